@@ -57,10 +57,12 @@
 #include <pthread.h>
 
 #include "io_lib/bam.h"
+#include "io_lib/bam_index.h"
 #include "io_lib/os.h"
 #include "io_lib/thread_pool.h"
 #include "io_lib/crc32.h"
 #include "io_lib/bgzip.h"
+#include "io_lib/codec_cache.h"
 
 // On later gcc releases the ALLOW_UAC code causes the vectorizor to
 // use aligned SIMD instructions on unaligned memory access.  This is due
@@ -129,6 +131,11 @@ typedef uint32_t uint32_u;
 
 static int bam_more_input(bam_file_t *b);
 static int bam_uncompress_input(bam_file_t *b);
+static uint64_t bam_tell(bam_file_t *b);
+static void sam_parse_destroy(bam_file_t *b);
+static void seq_run_setup(void);
+static int sam_format_flush(bam_file_t *fp);
+static void sam_format_destroy(bam_file_t *b);
 static int reg2bin(int start, int end);
 static int bgzf_block_write(bam_file_t *bf, int level, const void *buf, size_t count);
 static int bgzf_write(bam_file_t *bf, int level, const void *buf, size_t count);
@@ -139,6 +146,16 @@ static int bgzf_flush_mt(bam_file_t *bf);
 static int bgzf_flush(bam_file_t *bf);
 #endif
 
+/*
+ * All output goes through here, so it can be diverted to the writer
+ * thread when one is in use.
+ */
+static size_t bam_fwrite(bam_file_t *b, const void *buf, size_t len) {
+    return b->writer
+	? write_thread_write(b->writer, buf, len)
+	: fwrite(buf, 1, len, b->fp);
+}
+
 /*
  * Reads len bytes from fp into data.
  *
@@ -302,6 +319,15 @@ static int bam_get_line(bam_file_t *b, unsigned char **str, size_t *len) {
 	return -1;
     
     b->eof_block = 1; // expected eof
+
+    // A final line with no trailing newline
+    if (used_l > 0) {
+	if (buf[used_l-1] == '\r')
+	    used_l--;
+	buf[used_l] = 0;
+	return used_l;
+    }
+
     return 0;
 }
 
@@ -449,6 +475,35 @@ static void bam_file_init(bam_file_t *b) {
     b->bgbuf_p = b->bgbuf;
     b->bgbuf_sz = 0;
     b->idx_fn = NULL;
+    b->in_off = 0;
+    b->block_addr = 0;
+    b->block_csize = 0;
+    b->block_usize = 0;
+    b->index = NULL;
+    b->ranges = NULL;
+    b->chunks = NULL;
+    b->range_hits = NULL;
+    b->index_out = NULL;
+    b->index_out_fn = NULL;
+    b->uoff = 0;
+    b->pqueue = NULL;
+    b->sam_job = NULL;
+    b->sam_pending = NULL;
+    b->sam_free = NULL;
+    b->sam_carry = NULL;
+    b->sam_carry_sz = 0;
+    b->sam_carry_alloc = 0;
+    b->sam_eof = 0;
+    b->sam_njobs = 0;
+    b->fqueue = NULL;
+    b->sam_fjob = NULL;
+    b->sam_ffree = NULL;
+    b->sam_fheader = NULL;
+    b->sam_bgzf = 0;
+    b->view_buf = NULL;
+    b->view_alloc = 0;
+
+    seq_run_setup();
 }
 
 /*! Opens a SAM or BAM file.
@@ -458,7 +513,8 @@ static void bam_file_init(bam_file_t *b) {
  * writing. Use "rb" or "wb" for reading or writing BAM and "r" or
  * "w" or reading or writing SAM. When writing BAM, the mode may end
  * with a digit from 0 to 9 to indicate the compression to use with 0
- * indicating uncompressed data.
+ * indicating uncompressed data.  "wz" writes BGZF compressed SAM, also
+ * accepting a compression level.
  *
  * @param fn The filename to open or create.
  * @param mode The input/output mode, similar to fopen().
@@ -481,6 +537,9 @@ bam_file_t *bam_open(const char *fn, const char *mode) {
 	if (mode[1] == 'b') {
 	    b->mode |= O_BINARY;
 	    b->binary = 1;
+	} else if (mode[1] == 'z') {
+	    b->mode |= O_BINARY;
+	    b->sam_bgzf = 1;
 	}
 	if (mode[2] >= '0' && mode[2] <= '9')
 	    b->level = mode[2] - '0';
@@ -548,6 +607,7 @@ bam_file_t *bam_open(const char *fn, const char *mode) {
 	if (-1 == load_bam_header(b))
 	    goto error;
 	b->bam = 1;
+	b->first_voff = bam_tell(b);
     } else {
 	if (-1 == load_sam_header(b))
 	    goto error;
@@ -595,7 +655,12 @@ int bam_close(bam_file_t *b) {
 	return 0;
 
     if (b->mode & O_WRONLY) {
-	if (b->binary) {
+	if (!b->binary && sam_format_flush(b) != 0) {
+	    fprintf(stderr, "Write failed in bam_close()\n");
+	    r = -1;
+	}
+
+	if (b->binary || b->sam_bgzf) {
 	    if (bgzf_block_write(b, b->level, b->uncomp,
 				 b->uncomp_p - b->uncomp)) {
 		fprintf(stderr, "Write failed in bam_close()\n");
@@ -604,14 +669,18 @@ int bam_close(bam_file_t *b) {
 	    BGZF_FLUSH(b);
 
 	    /* Output a blank BGZF block too to mark EOF */
-	    if (28 != fwrite(EOF_BLOCK, 1, 28, b->fp)) {
+	    if (28 != bam_fwrite(b, EOF_BLOCK, 28)) {
 		fprintf(stderr, "Write failed in bam_close()\n");
 	    }
+
+	    if (b->index_out &&
+		bam_index_build_write(b->index_out, b->index_out_fn) != 0)
+		r = -1;
 	} else {
 	    BGZF_FLUSH(b);
 
 	    if (b->uncomp_p - b->uncomp !=
-		fwrite(b->uncomp, 1, b->uncomp_p - b->uncomp, b->fp)) {
+		bam_fwrite(b, b->uncomp, b->uncomp_p - b->uncomp)) {
 		fprintf(stderr, "Write failed in bam_close()\n");
 	    }
 	}
@@ -629,8 +698,21 @@ int bam_close(bam_file_t *b) {
     if (b->sam_str)
 	free(b->sam_str);
 
-    if (b->fp)
-	r = fclose(b->fp);
+    bam_index_free(b->index);
+    bam_index_build_free(b->index_out);
+    free(b->index_out_fn);
+    free(b->ranges);
+    free(b->chunks);
+    free(b->range_hits);
+    free(b->view_buf);
+
+    if (b->writer && write_thread_close(b->writer) != 0) {
+	fprintf(stderr, "Write failed in bam_close()\n");
+	r = -1;
+    }
+
+    if (b->fp && fclose(b->fp) != 0)
+	r = -1;
 
     if (b->idx) {
 	if ((b->mode == O_RDONLY) && b->idx_fn) {
@@ -652,6 +734,9 @@ int bam_close(bam_file_t *b) {
 	t_pool_flush(b->pool);
     }
 
+    sam_parse_destroy(b);
+    sam_format_destroy(b);
+
     //fprintf(stderr, "BAM: destroying equeue %p, dqueue %p\n",
     //	    b->equeue, b->dqueue);
 
@@ -662,6 +747,9 @@ int bam_close(bam_file_t *b) {
 
     free(b);
 
+    /* Worker threads free theirs on exit, but the caller's thread won't */
+    codec_cache_free();
+
     return r;
 }
 
@@ -687,6 +775,7 @@ static int bam_more_input(bam_file_t *b) {
 	return -1;
     
     b->comp_sz += l;
+    b->in_off  += l;
     return 0;
 }
 
@@ -695,6 +784,7 @@ typedef struct {
     unsigned char uncomp[Z_BUFF_SIZE];
     size_t comp_sz, uncomp_sz;
     int ignore_chksum;
+    uint64_t block_addr;
 } bgzf_decode_job;
 static bgzf_decode_job *last_job = NULL;
 
@@ -705,13 +795,12 @@ static bgzf_decode_job *last_job = NULL;
 #ifdef HAVE_LIBDEFLATE
 void *bgzf_decode_thread(void *arg) {
     bgzf_decode_job *j = (bgzf_decode_job *)arg;
-    struct libdeflate_decompressor *z = libdeflate_alloc_decompressor();
+    struct libdeflate_decompressor *z = codec_libdeflate_decompressor();
     if (!z) return NULL;
 
     int err = libdeflate_deflate_decompress(z, j->comp, j->comp_sz,
 					    j->uncomp, Z_BUFF_SIZE, &j->uncomp_sz);
 
-    libdeflate_free_decompressor(z);
     if (err != LIBDEFLATE_SUCCESS) {
 	fprintf(stderr, "Libdeflate returned error code %d\n", err);
 	return NULL;
@@ -735,20 +824,15 @@ void *bgzf_decode_thread(void *arg) {
 void *bgzf_decode_thread(void *arg) {
     bgzf_decode_job *j = (bgzf_decode_job *)arg;
     int err;
-    z_stream s;
+    z_stream *s = codec_zlib_inflater(-15);
+    if (!s) return NULL;
 
-    s.avail_in  = j->comp_sz;
-    s.next_in   = j->comp; 
-    s.avail_out = Z_BUFF_SIZE;
-    s.next_out  = j->uncomp;
-    s.total_out = 0;
-    s.zalloc    = NULL;
-    s.zfree     = NULL;
-    s.opaque    = NULL;
+    s->avail_in  = j->comp_sz;
+    s->next_in   = j->comp;
+    s->avail_out = Z_BUFF_SIZE;
+    s->next_out  = j->uncomp;
 
-    inflateInit2(&s, -15);
-    err = inflate(&s, Z_FINISH);
-    inflateEnd(&s);
+    err = inflate(s, Z_FINISH);
 
     if (err != Z_STREAM_END) {
 	fprintf(stderr, "Inflate returned error code %d\n", err);
@@ -756,7 +840,7 @@ void *bgzf_decode_thread(void *arg) {
     }
 
     if (!j->ignore_chksum) {
-	uint32_t crc1=iolib_crc32(0L, (unsigned char *)j->uncomp, s.total_out);
+	uint32_t crc1=iolib_crc32(0L, (unsigned char *)j->uncomp, s->total_out);
 	uint32_t crc2;
 	memcpy(&crc2, j->comp + j->comp_sz, 4);
 	crc2 = le_int4(crc2);
@@ -767,7 +851,7 @@ void *bgzf_decode_thread(void *arg) {
 	}
     }
 
-    j->uncomp_sz  = s.total_out;
+    j->uncomp_sz  = s->total_out;
 
     return j;
 }
@@ -841,6 +925,7 @@ static int bam_uncompress_input(bam_file_t *b) {
 		    }
 		}
 
+		j->block_addr = b->in_off - b->comp_sz;
 		bgzf = b->comp_p;
 		b->comp_p += 10; b->comp_sz -= 10;
 
@@ -943,6 +1028,9 @@ static int bam_uncompress_input(bam_file_t *b) {
 	b->uncomp_p = j->uncomp;
 #endif
 	b->uncomp_sz = j->uncomp_sz;
+	b->block_addr  = j->block_addr;
+	b->block_csize = j->comp_sz + 26;
+	b->block_usize = j->uncomp_sz;
 	t_pool_delete_result(res, 0);
 	if (b->idx){
 	    if (gzi_index_add_block(b->idx, j->comp_sz + 26, b->uncomp_sz))
@@ -973,6 +1061,7 @@ static int bam_uncompress_input(bam_file_t *b) {
 	    /*
 	     * BGZF header is gzip + extra fields.
 	     */
+	    b->block_addr = b->in_off - b->comp_sz;
 	    bgzf = b->comp_p;
 	    b->comp_p += 10; b->comp_sz -= 10;
 
@@ -1013,13 +1102,12 @@ static int bam_uncompress_input(bam_file_t *b) {
 	    }
 
 #ifdef HAVE_LIBDEFLATE
-	    struct libdeflate_decompressor *z = libdeflate_alloc_decompressor();
+	    struct libdeflate_decompressor *z = codec_libdeflate_decompressor();
 	    if (!z) return -1;
 
 	    err = libdeflate_deflate_decompress(z, b->comp_p, bsize,
 						b->uncomp, Z_BUFF_SIZE, &b->uncomp_sz);
 
-	    libdeflate_free_decompressor(z);
 	    if (err != LIBDEFLATE_SUCCESS) {
 		fprintf(stderr, "Libdeflate returned error code %d\n", err);
 		return -1;
@@ -1050,6 +1138,9 @@ static int bam_uncompress_input(bam_file_t *b) {
 	    b->uncomp_p   = b->uncomp;
 #endif
 
+	    b->block_csize = bsize + 26;
+	    b->block_usize = b->uncomp_sz;
+
 	    if (b->idx){
 		if (gzi_index_add_block(b->idx, bsize + 26, b->uncomp_sz))
 		    return -1;
@@ -1129,6 +1220,274 @@ static int bam_uncompress_input(bam_file_t *b) {
 
 }
 
+/*
+ * Returns the BGZF virtual file offset of the next byte to be read.
+ * Once a block is consumed this is the start of the following block,
+ * matching the offsets recorded by the index.
+ */
+static uint64_t bam_tell(bam_file_t *b) {
+    if (b->uncomp_sz == 0)
+	return (b->block_addr + b->block_csize) << 16;
+
+    return (b->block_addr << 16) | (b->block_usize - b->uncomp_sz);
+}
+
+/*
+ * Seeks to a BGZF virtual file offset, discarding any decode jobs
+ * already in flight.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int bam_seek(bam_file_t *b, uint64_t voff) {
+    uint32_t skip = voff & 0xffff;
+    t_pool_result *res;
+
+    if (b->pool && b->dqueue) {
+	free(b->job_pending);
+	b->job_pending = NULL;
+	t_pool_flush_queue(b->pool, b->dqueue);
+	while ((res = t_pool_next_result(b->dqueue)))
+	    t_pool_delete_result(res, 1);
+	b->nd_jobs = 0;
+    }
+
+    if (fseeko(b->fp, voff >> 16, SEEK_SET) != 0)
+	return -1;
+
+    b->in_off      = voff >> 16;
+    b->comp_p      = b->comp;
+    b->comp_sz     = 0;
+    b->uncomp_sz   = 0;
+    b->z_finish    = 1;
+    b->eof         = 0;
+    b->next_len    = 0;
+    b->block_addr  = voff >> 16;
+    b->block_csize = 0;
+    b->block_usize = 0;
+
+    if (skip) {
+	if (bam_uncompress_input(b) < (int)skip)
+	    return -1;
+	b->uncomp_p  += skip;
+	b->uncomp_sz -= skip;
+    }
+
+    return 0;
+}
+
+/*
+ * Vectorised conversion of sequence and quality strings.  Each *_run
+ * function converts the longest prefix of its input that fills whole
+ * vectors and returns its length, leaving the remainder to the caller's
+ * scalar code.  The implementation is chosen by CPU at run time, with
+ * the default converting nothing.
+ *
+ * seq_pack_run:   ASCII bases to BAM 4-bit codes, two to a byte.
+ *                 Stops before any vector holding a byte <= '\t', so it
+ *                 can be run over SAM fields.  Returns an even count.
+ * seq_unpack_run: BAM 4-bit codes to ASCII bases; n counts bases.
+ * qual_run:       Adds delta to each byte, stopping as for seq_pack_run
+ *                 if tab_stop is set.
+ */
+static int seq_run_none(const uint8_t *in, int n, uint8_t *out) {
+    return 0;
+}
+
+static int qual_run_none(const uint8_t *in, int n, uint8_t *out,
+			 int delta, int tab_stop) {
+    return 0;
+}
+
+#if defined(__x86_64__) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define SEQ_SIMD
+#include <immintrin.h>
+
+/* "=ACMGRSVTWYHKDBN" codes for 0x3?, 0x4? and 0x6?, 0x5? and 0x7? */
+#define SEQ_CODE_3 15,15,15,15,15,15,15,15, 15,15,15,15,15, 0,15,15
+#define SEQ_CODE_4 15, 1,14, 2,13,15,15, 4, 11,15,15,12,15, 3,15,15
+#define SEQ_CODE_5 15,15, 5, 6, 8,15, 7, 9, 15,10,15,15,15,15,15,15
+#define SEQ_BASES  '=','A','C','M','G','R','S','V', \
+		   'T','W','Y','H','K','D','B','N'
+
+__attribute__((target("ssse3")))
+static int seq_pack_ssse3(const uint8_t *in, int n, uint8_t *out) {
+    const __m128i t3 = _mm_setr_epi8(SEQ_CODE_3);
+    const __m128i t4 = _mm_setr_epi8(SEQ_CODE_4);
+    const __m128i t5 = _mm_setr_epi8(SEQ_CODE_5);
+    const __m128i nib = _mm_set1_epi8(15), tab = _mm_set1_epi8('\t');
+    const __m128i mul = _mm_set1_epi16(0x0110);
+    int i = 0;
+
+    while (n - i >= 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *)(in+i));
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, tab), v)))
+	    break;
+
+	// Upper case and lower case share a code, so drop the 0x20 bit
+	__m128i lo = _mm_and_si128(v, nib);
+	__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nib);
+	__m128i hc = _mm_and_si128(hi, _mm_set1_epi8(0x0d));
+	__m128i m3 = _mm_cmpeq_epi8(hi, _mm_set1_epi8(3));
+	__m128i m4 = _mm_cmpeq_epi8(hc, _mm_set1_epi8(4));
+	__m128i m5 = _mm_cmpeq_epi8(hc, _mm_set1_epi8(5));
+	__m128i c  = _mm_andnot_si128(_mm_or_si128(_mm_or_si128(m3, m4), m5),
+				      nib);
+	c = _mm_or_si128(c, _mm_and_si128(m3, _mm_shuffle_epi8(t3, lo)));
+	c = _mm_or_si128(c, _mm_and_si128(m4, _mm_shuffle_epi8(t4, lo)));
+	c = _mm_or_si128(c, _mm_and_si128(m5, _mm_shuffle_epi8(t5, lo)));
+
+	// c[0]*16 + c[1] per 16-bit word, then down to bytes
+	c = _mm_maddubs_epi16(c, mul);
+	_mm_storel_epi64((__m128i *)(out+i/2), _mm_packus_epi16(c, c));
+	i += 16;
+    }
+
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static int seq_unpack_ssse3(const uint8_t *in, int n, uint8_t *out) {
+    const __m128i bases = _mm_setr_epi8(SEQ_BASES);
+    const __m128i nib = _mm_set1_epi8(15);
+    int i = 0;
+
+    while (n - i >= 16) {
+	__m128i v  = _mm_loadl_epi64((const __m128i *)(in+i/2));
+	__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nib);
+	__m128i lo = _mm_and_si128(v, nib);
+	_mm_storeu_si128((__m128i *)(out+i),
+			 _mm_shuffle_epi8(bases, _mm_unpacklo_epi8(hi, lo)));
+	i += 16;
+    }
+
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static int qual_run_ssse3(const uint8_t *in, int n, uint8_t *out,
+			  int delta, int tab_stop) {
+    const __m128i d = _mm_set1_epi8(delta), tab = _mm_set1_epi8('\t');
+    int i = 0;
+
+    while (n - i >= 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *)(in+i));
+	if (tab_stop &&
+	    _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, tab), v)))
+	    break;
+	_mm_storeu_si128((__m128i *)(out+i), _mm_add_epi8(v, d));
+	i += 16;
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int seq_pack_avx2(const uint8_t *in, int n, uint8_t *out) {
+    const __m256i t3 = _mm256_setr_epi8(SEQ_CODE_3, SEQ_CODE_3);
+    const __m256i t4 = _mm256_setr_epi8(SEQ_CODE_4, SEQ_CODE_4);
+    const __m256i t5 = _mm256_setr_epi8(SEQ_CODE_5, SEQ_CODE_5);
+    const __m256i nib = _mm256_set1_epi8(15), tab = _mm256_set1_epi8('\t');
+    const __m256i mul = _mm256_set1_epi16(0x0110);
+    int i = 0;
+
+    while (n - i >= 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i *)(in+i));
+	if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(v, tab),
+						   v)))
+	    break;
+
+	__m256i lo = _mm256_and_si256(v, nib);
+	__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nib);
+	__m256i hc = _mm256_and_si256(hi, _mm256_set1_epi8(0x0d));
+	__m256i m3 = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(3));
+	__m256i m4 = _mm256_cmpeq_epi8(hc, _mm256_set1_epi8(4));
+	__m256i m5 = _mm256_cmpeq_epi8(hc, _mm256_set1_epi8(5));
+	__m256i c  = _mm256_andnot_si256(_mm256_or_si256(_mm256_or_si256(m3,
+									 m4),
+							 m5), nib);
+	c = _mm256_or_si256(c, _mm256_and_si256(m3, _mm256_shuffle_epi8(t3,lo)));
+	c = _mm256_or_si256(c, _mm256_and_si256(m4, _mm256_shuffle_epi8(t4,lo)));
+	c = _mm256_or_si256(c, _mm256_and_si256(m5, _mm256_shuffle_epi8(t5,lo)));
+
+	// Packing works within 128-bit lanes, so gather the two halves
+	c = _mm256_maddubs_epi16(c, mul);
+	c = _mm256_permute4x64_epi64(_mm256_packus_epi16(c, c), 0x08);
+	_mm_storeu_si128((__m128i *)(out+i/2), _mm256_castsi256_si128(c));
+	i += 32;
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int seq_unpack_avx2(const uint8_t *in, int n, uint8_t *out) {
+    const __m256i bases = _mm256_setr_epi8(SEQ_BASES, SEQ_BASES);
+    const __m128i nib = _mm_set1_epi8(15);
+    int i = 0;
+
+    while (n - i >= 32) {
+	__m128i v  = _mm_loadu_si128((const __m128i *)(in+i/2));
+	__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nib);
+	__m128i lo = _mm_and_si128(v, nib);
+	__m256i c  = _mm256_inserti128_si256(
+			 _mm256_castsi128_si256(_mm_unpacklo_epi8(hi, lo)),
+			 _mm_unpackhi_epi8(hi, lo), 1);
+	_mm256_storeu_si256((__m256i *)(out+i), _mm256_shuffle_epi8(bases, c));
+	i += 32;
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int qual_run_avx2(const uint8_t *in, int n, uint8_t *out,
+			 int delta, int tab_stop) {
+    const __m256i d = _mm256_set1_epi8(delta), tab = _mm256_set1_epi8('\t');
+    int i = 0;
+
+    while (n - i >= 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i *)(in+i));
+	if (tab_stop &&
+	    _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(v, tab),
+						   v)))
+	    break;
+	_mm256_storeu_si256((__m256i *)(out+i), _mm256_add_epi8(v, d));
+	i += 32;
+    }
+
+    return i;
+}
+#endif
+
+static int (*seq_pack_run)(const uint8_t *in, int n, uint8_t *out)
+    = seq_run_none;
+static int (*seq_unpack_run)(const uint8_t *in, int n, uint8_t *out)
+    = seq_run_none;
+static int (*qual_run)(const uint8_t *in, int n, uint8_t *out,
+		       int delta, int tab_stop) = qual_run_none;
+static pthread_once_t seq_run_once = PTHREAD_ONCE_INIT;
+
+static void seq_run_init(void) {
+#ifdef SEQ_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+	seq_pack_run   = seq_pack_avx2;
+	seq_unpack_run = seq_unpack_avx2;
+	qual_run       = qual_run_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+	seq_pack_run   = seq_pack_ssse3;
+	seq_unpack_run = seq_unpack_ssse3;
+	qual_run       = qual_run_ssse3;
+    }
+#endif
+}
+
+static void seq_run_setup(void) {
+    pthread_once(&seq_run_once, seq_run_init);
+}
+
 #ifdef ALLOW_UAC
 #if SIZEOF_LONG == 8 && ULONG_MAX != 0xffffffff
 #define COPY_CPF_TO_CPTM(n)				\
@@ -1223,21 +1582,27 @@ static int64_t inline STRTOL64(const char *v, const char **rv, int b) {
 }
 
 /*
- * Decodes the next line of SAM into a bam_seq_t struct.
+ * Decodes a nul terminated line of SAM, of length used_l, into a
+ * bam_seq_t struct.  The line must be followed by at least 8 bytes of
+ * addressable memory for the word at a time copying.
+ *
+ * References missing from the header are added to sh when add_refs is
+ * set, otherwise -2 is returned so the caller can retry once it is
+ * safe to modify the header.
  *
  * Returns 1 on success
- *         0 on eof
  *        -1 on error
+ *        -2 on unknown reference when add_refs is 0
  */
-static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
-    int used_l, sign;
+static int sam_parse_line(SAM_hdr *sh, int no_aux, unsigned char *line,
+			  int used_l, bam_seq_t **bsp, int add_refs) {
+    int sign, k;
     int64_t n;
-    unsigned char *cpf, *cpt, *cp;
+    unsigned char *cpf, *cpt, *cp, *line_end = line + used_l;
     int cigar_len;
     bam_seq_t *bs;
     HashItem *hi;
     int64_t start, end;
-    SAM_hdr *sh = b->header;
 
     static const char lookup[256] = {
 	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 00 */
@@ -1257,11 +1622,6 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
 	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* e0 */
 	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15};/* f0 */
 
-    /* Fetch a single line */
-    if ((used_l = bam_get_line(b, &b->sam_str, &b->alloc_l)) <= 0) {
-	return used_l;
-    }
-
     used_l *= 4; // FIXME, what is the correct max size?
 
     /* Over sized memory, for worst case? FIXME: cigar can break this! */
@@ -1277,7 +1637,7 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
     bs->bin_packed = 0;
     
     /* Decode line */
-    cpf = b->sam_str;
+    cpf = line;
     cpt = (unsigned char *)&bs->data;
     
     /* Name */
@@ -1309,11 +1669,13 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
 	/* Unmapped */
 	bs->ref = -1;
     } else {
-	hi = HashTableSearch(b->header->ref_hash, (char *)cp, cpf-cp);
+	hi = HashTableSearch(sh->ref_hash, (char *)cp, cpf-cp);
 	if (!hi) {
-	    SAM_hdr *sh = b->header;
 	    HashData hd;
 
+	    if (!add_refs)
+		return -2;
+
 	    fprintf(stderr, "Reference seq %.*s unknown\n", (int)(cpf-cp), cp);
 
 	    /* Fabricate it instead */
@@ -1415,6 +1777,9 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
 	if (!hi) {
 	    HashData hd;
 
+	    if (!add_refs)
+		return -2;
+
 	    fprintf(stderr, "Mate ref seq \"%.*s\" unknown\n", (int)(cpf-cp), cp);
 
 	    /* Fabricate it instead */
@@ -1466,6 +1831,9 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
 	cpf++;
 	bs->len = 0;
     } else {
+	k = seq_pack_run(cpf, line_end - cpf, cpt);
+	cpf += k;
+	cpt += k/2;
 	while (cpf[0] > '\t' && cpf[1] > '\t') {
 	    /* 9% of cpu time is here */
 	    *cpt++ = (lookup[cpf[0]]<<4) | lookup[cpf[1]];
@@ -1497,6 +1865,9 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
 	cpt += bs->len;
 	cpf++;
     } else {
+	k = qual_run(cpf, line_end - cpf, cpt, -'!', 1);
+	cpf += k;
+	cpt += k;
 	COPY_CPF_TO_CPTM('!');
 //	while (*cpf > '\t')
 //	    *cpt++ = *cpf++ - '!';
@@ -1504,7 +1875,7 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
 
     if ((char *)cpt != (char *)(bam_aux(bs))) return -1;
 
-    if (!*cpf++ || b->no_aux) goto skip_aux;
+    if (!*cpf++ || no_aux) goto skip_aux;
 
     /* aux */
     while (*cpf) {
@@ -1648,6 +2019,293 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
     return 1;
 }
 
+/*
+ * Decodes the next line of SAM into a bam_seq_t struct.
+ *
+ * Returns 1 on success
+ *         0 on eof
+ *        -1 on error
+ */
+static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
+    int used_l;
+
+    /* Fetch a single line */
+    if ((used_l = bam_get_line(b, &b->sam_str, &b->alloc_l)) <= 0) {
+	return used_l;
+    }
+
+    return sam_parse_line(b->header, b->no_aux, b->sam_str, used_l, bsp, 1);
+}
+
+/*
+ * Multi-threaded SAM parsing.  The main thread reads the input in
+ * batches of whole lines, leaving any partial line at the end for the
+ * next batch, and the pool parses each batch into bam_seq_t structs.
+ * Batches are returned in order, so this works equally well on
+ * streamed input.
+ */
+#define SAM_PARSE_BATCH (512*1024) // bytes of text per job
+
+typedef struct {
+    bam_seq_t *bs;
+    size_t off;         // line start in text, for reparsing
+    int len;
+    int status;         // as per sam_parse_line, or 0 for a blank line
+} sam_parse_rec;
+
+typedef struct sam_parse_job {
+    struct sam_parse_job *next; // free list
+    SAM_hdr *header;
+    int no_aux;
+    unsigned char *text;
+    size_t text_sz, text_alloc;
+    sam_parse_rec *rec;
+    int nrec, rec_alloc, curr;
+    int err;
+} sam_parse_job;
+
+static void sam_parse_job_free(sam_parse_job *j) {
+    int i;
+
+    if (!j)
+	return;
+
+    for (i = 0; i < j->rec_alloc; i++)
+	free(j->rec[i].bs);
+    free(j->rec);
+    free(j->text);
+    free(j);
+}
+
+/*
+ * Frees the parsing queue and batches.  The pool must have been
+ * flushed first.
+ */
+static void sam_parse_destroy(bam_file_t *b) {
+    if (b->pqueue) {
+	t_pool_result *res;
+	while ((res = t_pool_next_result(b->pqueue))) {
+	    sam_parse_job_free((sam_parse_job *)res->data);
+	    t_pool_delete_result(res, 0);
+	}
+	t_results_queue_destroy(b->pqueue);
+    }
+    sam_parse_job_free(b->sam_job);
+    sam_parse_job_free(b->sam_pending);
+    while (b->sam_free) {
+	sam_parse_job *j = b->sam_free;
+	b->sam_free = j->next;
+	sam_parse_job_free(j);
+    }
+    free(b->sam_carry);
+}
+
+static void *sam_parse_thread(void *arg) {
+    sam_parse_job *j = (sam_parse_job *)arg;
+    unsigned char *cp = j->text, *end = j->text + j->text_sz;
+
+    j->nrec = j->curr = 0;
+    j->err = 0;
+
+    // Batches always end in a newline
+    while (cp < end) {
+	unsigned char *nl = memchr(cp, '\n', end-cp), *next = nl+1;
+	sam_parse_rec *r;
+
+	if (j->nrec >= j->rec_alloc) {
+	    int n = j->rec_alloc ? j->rec_alloc*2 : 1024;
+	    if (!(r = realloc(j->rec, n * sizeof(*r)))) {
+		j->err = 1;
+		break;
+	    }
+	    memset(&r[j->rec_alloc], 0, (n - j->rec_alloc) * sizeof(*r));
+	    j->rec = r;
+	    j->rec_alloc = n;
+	}
+
+	*nl = 0;
+	if (nl > cp && nl[-1] == '\r')
+	    *--nl = 0;
+
+	r = &j->rec[j->nrec++];
+	r->off = cp - j->text;
+	r->len = nl - cp;
+	r->status = r->len
+	    ? sam_parse_line(j->header, j->no_aux, cp, r->len, &r->bs, 0)
+	    : 0;
+	if (r->status == -1)
+	    break;
+
+	cp = next;
+    }
+
+    return j;
+}
+
+/*
+ * Reads the next batch of whole lines into a job.
+ *
+ * Returns the job on success
+ *         NULL on eof or failure, setting b->sam_eof to 1 or -1.
+ */
+static sam_parse_job *sam_read_batch(bam_file_t *b) {
+    sam_parse_job *j;
+    size_t nl;
+    int r;
+
+    if (b->sam_free) {
+	j = b->sam_free;
+	b->sam_free = j->next;
+    } else if (!(j = calloc(1, sizeof(*j)))) {
+	b->sam_eof = -1;
+	return NULL;
+    }
+    j->header = b->header;
+    j->no_aux = b->no_aux;
+    j->text_sz = 0;
+
+    for (;;) {
+	size_t need = b->sam_carry_sz + b->uncomp_sz + 8;
+
+	// Move carried over data and the decoded input into the batch
+	if (j->text_sz + need > j->text_alloc) {
+	    size_t n = j->text_alloc ? j->text_alloc : SAM_PARSE_BATCH;
+	    unsigned char *t;
+	    while (n < j->text_sz + need)
+		n *= 2;
+	    if (!(t = realloc(j->text, n)))
+		goto err;
+	    j->text = t;
+	    j->text_alloc = n;
+	}
+	if (b->sam_carry_sz) {
+	    memcpy(j->text + j->text_sz, b->sam_carry, b->sam_carry_sz);
+	    j->text_sz += b->sam_carry_sz;
+	    b->sam_carry_sz = 0;
+	}
+	memcpy(j->text + j->text_sz, b->uncomp_p, b->uncomp_sz);
+	j->text_sz += b->uncomp_sz;
+	b->uncomp_sz = 0;
+
+	if (j->text_sz >= SAM_PARSE_BATCH || b->sam_eof) {
+	    // Break at the last newline, keeping the remainder for later
+	    for (nl = j->text_sz; nl > 0 && j->text[nl-1] != '\n'; nl--)
+		;
+	    if (b->sam_eof) {
+		if (nl != j->text_sz)
+		    j->text[j->text_sz++] = '\n';
+		break;
+	    }
+	    if (nl > 0) {
+		size_t rem = j->text_sz - nl;
+		if (rem > b->sam_carry_alloc) {
+		    unsigned char *t = realloc(b->sam_carry, rem);
+		    if (!t)
+			goto err;
+		    b->sam_carry = t;
+		    b->sam_carry_alloc = rem;
+		}
+		memcpy(b->sam_carry, j->text + nl, rem);
+		b->sam_carry_sz = rem;
+		j->text_sz = nl;
+		break;
+	    }
+	    // A single line longer than the batch, so keep reading
+	}
+
+	if ((r = bam_uncompress_input(b)) < 0)
+	    goto err;
+	if (r == 0) {
+	    b->sam_eof = 1;
+	    b->eof_block = 1; // expected eof
+	}
+    }
+
+    if (j->text_sz == 0) {
+	j->next = b->sam_free;
+	b->sam_free = j;
+	return NULL;
+    }
+
+    // The parser may read a word beyond the end of the last line
+    memset(j->text + j->text_sz, 0, 8);
+
+    return j;
+
+ err:
+    b->sam_eof = -1;
+    j->next = b->sam_free;
+    b->sam_free = j;
+    return NULL;
+}
+
+/*
+ * As sam_next_seq, but parsing in the thread pool.  The caller's
+ * bam_seq_t is exchanged for the parsed one, keeping the memory in
+ * circulation between the batches.
+ *
+ * Returns 1 on success
+ *         0 on eof
+ *        -1 on error
+ */
+static int sam_next_seq_mt(bam_file_t *b, bam_seq_t **bsp) {
+    int max_jobs = MIN(b->pool->qsize, b->pool->tsize*2);
+    sam_parse_job *j;
+    t_pool_result *res;
+
+    for (;;) {
+	if ((j = b->sam_job) && j->curr < j->nrec) {
+	    sam_parse_rec *r = &j->rec[j->curr++];
+	    bam_seq_t *tmp;
+
+	    if (r->status == -2) {
+		// Adding to the header, so wait for other batches first
+		if (t_pool_flush_queue(b->pool, b->pqueue) < 0)
+		    return -1;
+		r->status = sam_parse_line(b->header, b->no_aux,
+					   j->text + r->off, r->len,
+					   &r->bs, 1);
+	    }
+	    if (r->status <= 0)
+		return r->status < 0 ? -1 : 0;
+
+	    tmp = *bsp;
+	    *bsp = r->bs;
+	    r->bs = tmp;
+	    return 1;
+	}
+
+	if (j) {
+	    b->sam_job = NULL;
+	    j->next = b->sam_free;
+	    b->sam_free = j;
+	    if (j->err)
+		return -1;
+	}
+
+	// Keep the pool supplied with batches
+	while (b->sam_njobs < max_jobs && (b->sam_pending || !b->sam_eof)) {
+	    if (!b->sam_pending && !(b->sam_pending = sam_read_batch(b)))
+		break;
+
+	    if (-1 == t_pool_dispatch2(b->pool, b->pqueue, sam_parse_thread,
+				       b->sam_pending, b->sam_njobs ? 1 : 0))
+		break; // would block
+	    b->sam_pending = NULL;
+	    b->sam_njobs++;
+	}
+
+	if (!b->sam_njobs)
+	    return b->sam_eof < 0 ? -1 : 0;
+
+	if (!(res = t_pool_next_result_wait(b->pqueue)))
+	    return -1;
+	b->sam_job = (sam_parse_job *)res->data;
+	t_pool_delete_result(res, 0);
+	b->sam_njobs--;
+    }
+}
+
 /*
  * Based on htslib's copy from htslib/sam.c
  *
@@ -1838,16 +2496,19 @@ static bam_seq_t *bam_cigar2tag(bam_seq_t *b) {
  *        -1 on error
  */
 #ifdef ALLOW_UAC
-int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
+static int bam_read_seq(bam_file_t *b, bam_seq_t **bsp) {
     int32_t blk_size, blk_ret;
     bam_seq_t *bs;
     uint32_t u32;
     int32_t i32;
+    int ahead = b->ranges ? 0 : 4; // also read the next record length
 
     b->line++;
 
     if (!b->bam)
-	return sam_next_seq(b, bsp);
+	return b->pool && b->pqueue
+	    ? sam_next_seq_mt(b, bsp)
+	    : sam_next_seq(b, bsp);
 
     if (b->next_len > 0) {
 	blk_size = b->next_len;
@@ -1869,10 +2530,10 @@ int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
     }
     bs = *bsp;
     
-    if ((blk_ret = bam_read(b, &bs->ref, blk_size+4)) == 0)
+    if ((blk_ret = bam_read(b, &bs->ref, blk_size+ahead)) == 0)
 	return 0;
 
-    if (blk_size+4 != blk_ret) {
+    if (!ahead || blk_size+4 != blk_ret) {
 	if (blk_size != blk_ret) {
 	    return -1;
 	} else {
@@ -1920,16 +2581,19 @@ int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
 
 #else
 
-int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
+static int bam_read_seq(bam_file_t *b, bam_seq_t **bsp) {
     int32_t blk_size, blk_ret;
     bam_seq_t *bs;
     uint32_t u32;
     int32_t i32;
+    int ahead = b->ranges ? 0 : 4; // also read the next record length
 
     b->line++;
 
     if (!b->bam)
-	return sam_next_seq(b, bsp);
+	return b->pool && b->pqueue
+	    ? sam_next_seq_mt(b, bsp)
+	    : sam_next_seq(b, bsp);
 
     if (b->next_len > 0) {
 	blk_size = b->next_len;
@@ -1988,10 +2652,10 @@ int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
 
     /* The remainder, word aligned */
     blk_size = blk_ret;
-    if ((blk_ret = bam_read(b, (char *)bam_cigar(bs), blk_size+4)) == 0 &&
+    if ((blk_ret = bam_read(b, (char *)bam_cigar(bs), blk_size+ahead)) == 0 &&
 	blk_size != 0)
 	return 0;
-    if (blk_size+4 != blk_ret) {
+    if (!ahead || blk_size+4 != blk_ret) {
 	if (blk_size != blk_ret) {
 	    return -1;
 	} else {
@@ -2019,37 +2683,170 @@ int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
 }
 #endif
 
+/*
+ * As bam_read_seq, but when ranges have been set by bam_set_ranges we
+ * walk the index chunks and return only records overlapping a range.
+ *
+ * Returns 1 on success
+ *         0 on eof
+ *        -1 on error
+ */
+int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
+    bam_seq_t *bs;
+    int r, i;
+
+    if (!b->ranges)
+	return bam_read_seq(b, bsp);
+
+    for (;;) {
+	uint64_t voff;
+	int64_t end;
+
+	if (b->curr_chunk < 0) {
+	    if (b->nchunks && bam_seek(b, b->chunks[0].beg) < 0)
+		return -1;
+	    b->curr_chunk = 0;
+	}
+	if (b->curr_chunk >= b->nchunks)
+	    return 0;
+
+	voff = bam_tell(b);
+	if (voff >= b->chunks[b->curr_chunk].end) {
+	    b->curr_chunk++;
+	    continue;
+	}
+	if (voff < b->chunks[b->curr_chunk].beg) {
+	    if (bam_seek(b, b->chunks[b->curr_chunk].beg) < 0)
+		return -1;
+	    continue;
+	}
+
+	if ((r = bam_read_seq(b, bsp)) <= 0)
+	    return r;
+
+	bs = *bsp;
+	end = bs->pos + (bam_flag(bs) & BAM_FUNMAP ? 0 : ref_len(bs));
+	if (end <= bs->pos)
+	    end = bs->pos+1;
+
+	b->nrange_hits = 0;
+	for (i = 0; i < b->nranges; i++) {
+	    bam_range *rg = &b->ranges[i];
+	    if (rg->refid == bs->ref &&
+		(rg->refid == -1 || (bs->pos < rg->end && end >= rg->start)))
+		b->range_hits[b->nrange_hits++] = i;
+	}
+	if (b->nrange_hits)
+	    return 1;
+    }
+}
+
 /* Old name */
 int bam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
     return bam_get_seq(b, bsp);
 }
 
-static int8_t aux_type_size[256] = {
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 1, 0, 1, 0, 0, 0, 0, 0, 4, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 1, 8, 0, 4, 0, 0, 4, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-};
-
 /*
- * Skips to the next tag start.
- * Returns next tag pointer (or end of buffer) on success,
- *         NULL on failure
+ * Reads the next record without copying it out of the decompressed
+ * block, unless it spans blocks.  See bam.h.
+ *
+ * Returns 1 on success
+ *         0 on eof
+ *        -1 on error
  */
-char *bam_aux_skip(const char *s_) {
-    const uint8_t *s = (const uint8_t *)s_;
+int bam_next_view(bam_file_t *b, bam_view_t *v) {
+    const unsigned char *rec;
+    int32_t blk_size, i32;
+    uint32_t u32;
+    int r;
+
+    if (!b->bam || b->ranges) {
+	fprintf(stderr, "bam_next_view() requires BAM input without "
+		"ranges\n");
+	return -1;
+    }
+
+    b->line++;
+
+    if (b->next_len > 0) {
+	blk_size = b->next_len;
+	b->next_len = 0;
+    } else {
+	if ((r = bam_read(b, &blk_size, 4)) != 4)
+	    return r == 0 ? 0 : -1;
+	blk_size = le_int4(blk_size);
+    }
+    if (blk_size < 36) /* Minimum valid BAM record size */
+	return -1;
+
+    if (b->uncomp_sz >= blk_size) {
+	rec = b->uncomp_p;
+	b->uncomp_p  += blk_size;
+	b->uncomp_sz -= blk_size;
+    } else {
+	if (blk_size > b->view_alloc) {
+	    unsigned char *buf = realloc(b->view_buf, blk_size);
+	    if (!buf)
+		return -1;
+	    b->view_buf = buf;
+	    b->view_alloc = blk_size;
+	}
+	if (bam_read(b, b->view_buf, blk_size) != blk_size)
+	    return -1;
+	rec = b->view_buf;
+    }
+
+    memcpy(&i32, rec+ 0, 4); v->ref      = le_int4(i32);
+    memcpy(&i32, rec+ 4, 4); v->pos      = le_int4(i32);
+    memcpy(&u32, rec+ 8, 4); u32         = le_int4(u32);
+    v->bin      = u32 >> 16;
+    v->map_qual = (u32 >> 8) & 0xff;
+    v->name_len = u32 & 0xff;
+    memcpy(&u32, rec+12, 4); u32         = le_int4(u32);
+    v->flag      = u32 >> 16;
+    v->cigar_len = u32 & 0xffff;
+    memcpy(&i32, rec+16, 4); v->len      = le_int4(i32);
+    memcpy(&i32, rec+20, 4); v->mate_ref = le_int4(i32);
+    memcpy(&i32, rec+24, 4); v->mate_pos = le_int4(i32);
+    memcpy(&i32, rec+28, 4); v->ins_size = le_int4(i32);
+
+    v->data     = rec + 32;
+    v->data_len = blk_size - 32;
+
+    if (v->len < 0 ||
+	(int64_t)v->name_len + 4*v->cigar_len + (v->len+1)/2 + v->len
+	> v->data_len)
+	return -1;
+
+    return 1;
+}
+
+static int8_t aux_type_size[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 1, 0, 0, 0, 0, 0, 4, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 1, 8, 0, 4, 0, 0, 4, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/*
+ * Skips to the next tag start.
+ * Returns next tag pointer (or end of buffer) on success,
+ *         NULL on failure
+ */
+char *bam_aux_skip(const char *s_) {
+    const uint8_t *s = (const uint8_t *)s_;
     int sz;
     if ((sz = aux_type_size[s[2]])) {
 	s += sz + 3;
@@ -2468,7 +3265,10 @@ int bam_construct_seq(bam_seq_t **b, size_t extra_len,
     }
 
     /* Seq */
-    for (i = 0; i < len-1; i += 2) {
+    seq_run_setup();
+    i = seq_pack_run((const uint8_t *)seq, len, (uint8_t *)cp);
+    cp += i/2;
+    for (; i < len-1; i += 2) {
 	*cp++ = (L[(uc)seq[i]]<<4) + L[(uc)seq[i+1]];
     }
     if (i < len)
@@ -3171,9 +3971,9 @@ unsigned char *append_int64(unsigned char *cp, int64_t i) {
  *        -1 on error
  */
 #ifdef HAVE_LIBDEFLATE
-static int bgzf_encode(int level,
-		       const void *buf, uint32_t in_sz,
-		       void *out, uint32_t *out_sz) {
+int bgzf_encode(int level,
+		const void *buf, uint32_t in_sz,
+		void *out, uint32_t *out_sz) {
     size_t clen;
     unsigned char *blk = out;
     level = level >= 0 ? level : 6; // libdeflate doesn't honour -1 as default
@@ -3191,12 +3991,11 @@ static int bgzf_encode(int level,
 	memcpy(blk+18+5, buf, in_sz);
 	clen = in_sz+5;
     } else  {
-	struct libdeflate_compressor *z = libdeflate_alloc_compressor(level);
+	struct libdeflate_compressor *z = codec_libdeflate_compressor(level);
 	if (!z)
 	    return -1;
 
 	clen = libdeflate_deflate_compress(z, buf, in_sz, blk + 18, Z_BUFF_SIZE);
-	libdeflate_free_compressor(z);
 	if (clen <= 0) {
 	    fprintf(stderr, "Libdeflate failed to compress\n");
 	    return -1;
@@ -3239,63 +4038,50 @@ static int bgzf_encode(int level,
     return 0;
 }
 #else
-static int bgzf_encode(int level,
-		       const void *buf, uint32_t in_sz,
-		       void *out, uint32_t *out_sz) {
+int bgzf_encode(int level,
+		const void *buf, uint32_t in_sz,
+		void *out, uint32_t *out_sz) {
     unsigned char *blk = out;
-    z_stream s;
+    z_stream *s;
     int cdata_pos;
     int cdata_size;
     int cdata_alloc;
     int err;
     uint32_t crc;
 
-    /* Initialise zlib stream */
+    /* Fetch this thread's zlib stream, reset for a new block */
+    s = codec_zlib_deflater(level, -15, 8, Z_DEFAULT_STRATEGY);
+    //s = codec_zlib_deflater(level, -15, 8, Z_FILTERED);
+    if (!s)
+	return -1;
+
     cdata_pos = 18;
     cdata_alloc = Z_BUFF_SIZE;
-    s.zalloc = Z_NULL; /* use default allocation functions */
-    s.zfree  = Z_NULL;
-    s.opaque = Z_NULL;
-    s.next_in  = (unsigned char *)buf;
-    s.avail_in = in_sz;
-    s.total_in = 0;
-    s.next_out  = blk + cdata_pos;
-    s.avail_out = cdata_alloc;
-    s.total_out = 0;
-    s.data_type = Z_BINARY;
-
-    /* Compress it */
-    err = deflateInit2(&s, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
-    //err = deflateInit2(&s, level, Z_DEFLATED, -15, 8, Z_FILTERED);
-
-    if (err != Z_OK) {
-	fprintf(stderr, "zlib deflateInit2 error: %s\n", s.msg);
-	return -1;
-    }
+    s->next_in  = (unsigned char *)buf;
+    s->avail_in = in_sz;
+    s->next_out  = blk + cdata_pos;
+    s->avail_out = cdata_alloc;
+    s->data_type = Z_BINARY;
 
     /* Encode to 'cdata' array */
-    for (;s.avail_in;) {
-	s.next_out = blk + cdata_pos;
-	s.avail_out = cdata_alloc - cdata_pos;
+    for (;s->avail_in;) {
+	s->next_out = blk + cdata_pos;
+	s->avail_out = cdata_alloc - cdata_pos;
 	if (cdata_alloc - cdata_pos <= 0) {
 	    fprintf(stderr, "Deflate produced larger output than expected. Abort\n"); 
 	    return -1;
 	}
-	err = deflate(&s, Z_NO_FLUSH); // or Z_FINISH?
-	cdata_pos = cdata_alloc - s.avail_out;
+	err = deflate(s, Z_NO_FLUSH); // or Z_FINISH?
+	cdata_pos = cdata_alloc - s->avail_out;
 	if (err != Z_OK) {
-	    fprintf(stderr, "zlib deflate error: %s\n", s.msg);
+	    fprintf(stderr, "zlib deflate error: %s\n", s->msg);
 	    break;
 	}
     }
-    if (deflate(&s, Z_FINISH) != Z_STREAM_END) {
-	fprintf(stderr, "zlib deflate error: %s\n", s.msg);
-    }
-    cdata_size = s.total_out;
-
-    if (deflateEnd(&s) != Z_OK) {
-	fprintf(stderr, "zlib deflate error: %s\n", s.msg);
+    if (deflate(s, Z_FINISH) != Z_STREAM_END) {
+	fprintf(stderr, "zlib deflate error: %s\n", s->msg);
     }
+    cdata_size = s->total_out;
 
     assert(cdata_size <= 65536);
 
@@ -3337,6 +4123,8 @@ static int bgzf_encode(int level,
 
 static int bgzf_block_write(bam_file_t *bf, int level,
 			    const void *buf, size_t count) {
+    bf->uoff += count;
+
     if (!bf->idx)
 	return BGZF_WRITE(bf, level, buf, count);
 
@@ -3380,7 +4168,10 @@ static int bgzf_write(bam_file_t *bf, int level, const void *buf, size_t count)
     if (0 != bgzf_encode(level, buf, count, blk, &len)) 
 	return -1;
 
-    if (len != fwrite(blk, 1, len, bf->fp))
+    if (len != bam_fwrite(bf, blk, len))
+	return -1;
+
+    if (bf->index_out && bam_index_build_block(bf->index_out, count, len))
 	return -1;
 
     return 0;
@@ -3416,7 +4207,10 @@ static int bgzf_write_mt(bam_file_t *bf, int level, const void *buf,
 
     while ((r = t_pool_next_result(bf->equeue))) {
 	j = (bgzf_encode_job *)r->data;
-	if (j->out_sz != fwrite(j->out, 1, j->out_sz, bf->fp))
+	if (j->out_sz != bam_fwrite(bf, j->out, j->out_sz))
+	    return -1;
+	if (bf->index_out &&
+	    bam_index_build_block(bf->index_out, j->in_sz, j->out_sz))
 	    return -1;
 	t_pool_delete_result(r, 1);
     }
@@ -3436,7 +4230,10 @@ static int bgzf_flush_mt(bam_file_t *bf) {
 
     while ((r = t_pool_next_result(bf->equeue))) {
 	j = (bgzf_encode_job *)r->data;
-	if (j->out_sz != fwrite(j->out, 1, j->out_sz, bf->fp))
+	if (j->out_sz != bam_fwrite(bf, j->out, j->out_sz))
+	    return -1;
+	if (bf->index_out &&
+	    bam_index_build_block(bf->index_out, j->in_sz, j->out_sz))
 	    return -1;
 	t_pool_delete_result(r, 1);
     }
@@ -3450,14 +4247,89 @@ static int bgzf_flush(bam_file_t *bf) {
 }
 #endif
 
+#define SAM_FORMAT_BATCH (256*1024) // bytes of records per job
+
 /*
- * Writes a single bam sequence object.
+ * An output buffer for sam_format_seq.  When full it is written to fp,
+ * or grown if fp is NULL.
+ */
+typedef struct {
+    unsigned char *buf, *p, *end;
+    bam_file_t *fp;
+} sam_out_buf;
+
+/*
+ * Makes room for at least BGZF_BUFF_SIZE more bytes in o.
+ *
  * Returns 0 on success
  *        -1 on failure
  */
-int bam_put_seq(bam_file_t *fp, bam_seq_t *b) {
+static int sam_out_flush(sam_out_buf *o) {
+    if (o->fp) {
+	bam_file_t *fp = o->fp;
+	size_t len = o->p - o->buf;
+
+	if (fp->sam_bgzf
+	    ? bgzf_block_write(fp, fp->level, o->buf, len) != 0
+	    : bam_fwrite(fp, o->buf, len) != len)
+	    return -1;
+	o->p = o->buf;
+    } else {
+	size_t used = o->p - o->buf, n = o->end - o->buf;
+	unsigned char *buf;
+
+	n = n ? n*2 : SAM_FORMAT_BATCH*2;
+	while (n - used < BGZF_BUFF_SIZE)
+	    n *= 2;
+	if (!(buf = realloc(o->buf, n)))
+	    return -1;
+	o->buf = buf;
+	o->p   = buf + used;
+	o->end = buf + n;
+    }
+
+    return 0;
+}
+
+/*
+ * Fetches the RNAME and RNEXT text for a SAM line.
+ *
+ * Returns 0 on success
+ *        -1 if the references are out of range
+ */
+static int sam_ref_names(SAM_hdr *h, bam_seq_t *b,
+			 const char **rname, const char **mname) {
+    if (b->ref < -1 || b->ref >= h->nref ||
+	b->mate_ref < -1 || b->mate_ref >= h->nref)
+	return -1;
+
+    *rname = b->ref != -1 ? h->ref[b->ref].name : "*";
+    if (b->mate_ref == -1)
+	*mname = "*";
+    else if (b->mate_ref == b->ref)
+	*mname = "=";
+    else
+	*mname = h->ref[b->mate_ref].name;
+
+    return 0;
+}
+
+/*
+ * Formats a single bam sequence object as a line of SAM, using rname
+ * and mname from sam_ref_names.  This touches nothing but its arguments
+ * so may be called from multiple threads.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int sam_format_seq(sam_out_buf *o, const char *rname,
+			  const char *mname, enum quality_binning binning,
+			  bam_seq_t *b) {
     char *auxh, aux_key[3], type;
     bam_aux_t val;
+    unsigned char *dat;
+    int sz, i, n;
+
 
     /*
      * Thread safe version of:
@@ -3517,388 +4389,650 @@ int bam_put_seq(bam_file_t *fp, bam_seq_t *b) {
     };
 #endif
 
-    if (!fp->binary) {
-	/* SAM */
-	unsigned char *end = fp->uncomp + BGZF_BUFF_SIZE, *dat;
-	int sz, i, n;
-
-#define BF_FLUSH()							\
-	do {								\
-	    if (fp->uncomp_p - fp->uncomp !=				\
-		fwrite(fp->uncomp, 1, fp->uncomp_p - fp->uncomp, fp->fp)) \
-		return -1;						\
-	    fp->uncomp_p=fp->uncomp;					\
-	} while(0)
-
-	/* QNAME */
-	if (end - fp->uncomp_p < (sz = bam_name_len(b))) BF_FLUSH();
-	if (bam_name(b) - (char *)b + sz-1 >
-	    b->blk_size + offsetof(bam_seq_t, ref)) {
-	    fprintf(stderr, "Name length too large for bam block\n");
-	    return -1;
-	}
-	memcpy(fp->uncomp_p, bam_name(b), sz-1); fp->uncomp_p += sz-1;
-	*fp->uncomp_p++ = '\t';
+#define BF_FLUSH() do { if (sam_out_flush(o)) return -1; } while(0)
 
-	/* FLAG */
-	if (end-fp->uncomp_p < 5) BF_FLUSH();
-	fp->uncomp_p = append_int(fp->uncomp_p, bam_flag(b) & ~BAM_CIGAR32);
-	*fp->uncomp_p++ = '\t';
-
-	/* RNAME */
-	if (b->ref < -1 || b->ref >= fp->header->nref)
-	    return -1;
+    /* QNAME */
+    if (o->end - o->p < (sz = bam_name_len(b))) BF_FLUSH();
+    if (bam_name(b) - (char *)b + sz-1 >
+	b->blk_size + offsetof(bam_seq_t, ref)) {
+	fprintf(stderr, "Name length too large for bam block\n");
+	return -1;
+    }
+    memcpy(o->p, bam_name(b), sz-1); o->p += sz-1;
+    *o->p++ = '\t';
+
+    /* FLAG */
+    if (o->end-o->p < 5) BF_FLUSH();
+    o->p = append_int(o->p, bam_flag(b) & ~BAM_CIGAR32);
+    *o->p++ = '\t';
+
+    /* RNAME */
+    sz = strlen(rname);
+    if (o->end-o->p < sz+1) BF_FLUSH();
+    memcpy(o->p, rname, sz);
+    o->p += sz;
+    *o->p++ = '\t';
+
+    /* POS */
+    if (b->pos < -1) return -1;
+    if (o->end-o->p < 12) BF_FLUSH();
+    o->p = append_int64(o->p, b->pos+1); *o->p++ = '\t';
+
+    /* MAPQ */
+    if (o->end-o->p < 5) BF_FLUSH();
+    o->p = append_int(o->p, bam_map_qual(b)); *o->p++ = '\t';
+
+    /* CIGAR */
+    n = bam_cigar_len(b);dat = (uc *)bam_cigar(b);
+    if (n < 0 ||
+	dat - (uc *)b + n*4 > b->blk_size + offsetof(bam_seq_t, ref))
+	return -1;
+    for (i = 0; i < n; i++, dat+=4) {
+	uint32_t c = *(uint32_t *)dat;
+	if (o->end-o->p < 13) BF_FLUSH();
+	o->p = append_int(o->p, c>>4);
+	*o->p++="MIDNSHP=X???????"[c&15];
+    }
+    if (n==0) {
+	if (o->end-o->p < 2) BF_FLUSH();
+	*o->p++='*';
+    }
+    *o->p++='\t';
 
-	if (b->ref != -1) {
-	    size_t l = strlen(fp->header->ref[b->ref].name);
-	    if (end-fp->uncomp_p < l+1) BF_FLUSH();
-	    memcpy(fp->uncomp_p, fp->header->ref[b->ref].name, l);
-	    fp->uncomp_p += l;
-	} else {
-	    if (end-fp->uncomp_p < 2) BF_FLUSH();
-	    *fp->uncomp_p++ = '*';
-	}
-	*fp->uncomp_p++ = '\t';
+    /* NRNM */
+    sz = strlen(mname);
+    if (o->end-o->p < sz+1) BF_FLUSH();
+    memcpy(o->p, mname, sz);
+    o->p += sz;
+    *o->p++ = '\t';
 
-	/* POS */
-	if (b->pos < -1) return -1;
-	if (end-fp->uncomp_p < 12) BF_FLUSH();
-	fp->uncomp_p = append_int64(fp->uncomp_p, b->pos+1); *fp->uncomp_p++ = '\t';
+    /* MPOS */
+    if (o->end-o->p < 12) BF_FLUSH();
+    o->p = append_int64(o->p, b->mate_pos+1); *o->p++ = '\t';
 
-	/* MAPQ */
-	if (end-fp->uncomp_p < 5) BF_FLUSH();
-	fp->uncomp_p = append_int(fp->uncomp_p, bam_map_qual(b)); *fp->uncomp_p++ = '\t';
+    /* ISIZE */
+    if (o->end-o->p < 12) BF_FLUSH();
+    o->p = append_int64(o->p, b->ins_size); *o->p++ = '\t';
 
-	/* CIGAR */
-	n = bam_cigar_len(b);dat = (uc *)bam_cigar(b);
-	if (n < 0 ||
-	    dat - (uc *)b + n*4 > b->blk_size + offsetof(bam_seq_t, ref))
-	    return -1;
-	for (i = 0; i < n; i++, dat+=4) {
-	    uint32_t c = *(uint32_t *)dat;
-	    if (end-fp->uncomp_p < 13) BF_FLUSH();
-	    fp->uncomp_p = append_int(fp->uncomp_p, c>>4);
-	    *fp->uncomp_p++="MIDNSHP=X???????"[c&15];
-	}
-	if (n==0) {
-	    if (end-fp->uncomp_p < 2) BF_FLUSH();
-	    *fp->uncomp_p++='*';
-	}
-	*fp->uncomp_p++='\t';
+    /* SEQ */
+    n = (b->len+1)/2;
+    dat = (uc *)bam_seq(b);
 
-	/* NRNM */
-	if (b->mate_ref < -1 || b->mate_ref >= fp->header->nref)
-	    return -1;
+    if (dat - (uc *)b + b->len > b->blk_size + offsetof(bam_seq_t, ref)) {
+	fprintf(stderr, "Sequence length too large for bam block\n");
+	return -1;
+    }
 
-	if (b->mate_ref != -1) {
-	    if (b->mate_ref == b->ref) {
-		if (end-fp->uncomp_p < 2) BF_FLUSH();
-		*fp->uncomp_p++ = '=';
-	    } else {
-		size_t l = strlen(fp->header->ref[b->mate_ref].name);
-		if (end-fp->uncomp_p < l+1) BF_FLUSH();
-		memcpy(fp->uncomp_p, fp->header->ref[b->mate_ref].name, l);
-		fp->uncomp_p += l;
+    /* BAM encoding */
+    //	while (n) {
+    //	    int l = o->end-o->p < n ? o->end-o->p : n;
+    //	    memcpy(o->p, dat, l); o->p += l;
+    //	    n -= l; dat += l;
+    //	    if (o->end == o->p) BF_FLUSH();
+    //	}
+    if (b->len != 0) {
+	if (o->end - o->p < b->len + 3) BF_FLUSH();
+	if (o->end - o->p < b->len + 3) {
+	    /* Extra long seqs need more regular checks */
+	    for (i = 0; i < b->len-1; i+=2) {
+		if (o->end - o->p < 3) BF_FLUSH();
+		*o->p++ = "=ACMGRSVTWYHKDBN"[*dat >> 4];
+		*o->p++ = "=ACMGRSVTWYHKDBN"[*dat++ & 15];
+	    }
+	    if (i < b->len) {
+		if (o->end - o->p < 3) BF_FLUSH();
+		*o->p++ = "=ACMGRSVTWYHKDBN"[*dat >> 4];
 	    }
 	} else {
-	    if (end-fp->uncomp_p < 2) BF_FLUSH();
-	    *fp->uncomp_p++ = '*';
-	}
-	*fp->uncomp_p++ = '\t';
-
-	/* MPOS */
-	if (end-fp->uncomp_p < 12) BF_FLUSH();
-	fp->uncomp_p = append_int64(fp->uncomp_p, b->mate_pos+1); *fp->uncomp_p++ = '\t';
-
-	/* ISIZE */
-	if (end-fp->uncomp_p < 12) BF_FLUSH();
-	fp->uncomp_p = append_int64(fp->uncomp_p, b->ins_size); *fp->uncomp_p++ = '\t';
-
-	/* SEQ */
-	n = (b->len+1)/2;
-	dat = (uc *)bam_seq(b);
-
-	if (dat - (uc *)b + b->len > b->blk_size + offsetof(bam_seq_t, ref)) {
-	    fprintf(stderr, "Sequence length too large for bam block\n");
-	    return -1;
-	}
-
-	/* BAM encoding */
-	//	while (n) {
-	//	    int l = end-fp->uncomp_p < n ? end-fp->uncomp_p : n;
-	//	    memcpy(fp->uncomp_p, dat, l); fp->uncomp_p += l;
-	//	    n -= l; dat += l;
-	//	    if (end == fp->uncomp_p) BF_FLUSH();
-	//	}
-	if (b->len != 0) {
-	    if (end - fp->uncomp_p < b->len + 3) BF_FLUSH();
-	    if (end - fp->uncomp_p < b->len + 3) {
-		/* Extra long seqs need more regular checks */
-		for (i = 0; i < b->len-1; i+=2) {
-		    if (end - fp->uncomp_p < 3) BF_FLUSH();
-		    *fp->uncomp_p++ = "=ACMGRSVTWYHKDBN"[*dat >> 4];
-		    *fp->uncomp_p++ = "=ACMGRSVTWYHKDBN"[*dat++ & 15];
-		}
-		if (i < b->len) {
-		    if (end - fp->uncomp_p < 3) BF_FLUSH();
-		    *fp->uncomp_p++ = "=ACMGRSVTWYHKDBN"[*dat >> 4];
-		}
-	    } else {
-		unsigned char *cp = fp->uncomp_p;
-		int n = b->len & ~1;
-		for (i = 0; i < n; i+=2) {
+	    unsigned char *cp = o->p;
+	    int n = b->len & ~1;
+	    i = seq_unpack_run(dat, n, cp);
+	    dat += i/2;
+	    cp  += i;
+	    for (; i < n; i+=2) {
 #ifdef ALLOW_UAC
-		    *(int16_u *)cp = le_int2(code2base[*dat++]);
-		    cp += 2;
+		*(int16_u *)cp = le_int2(code2base[*dat++]);
+		cp += 2;
 #else
-		    cp[0] = "=ACMGRSVTWYHKDBN"[*dat >> 4];
-		    cp[1] = "=ACMGRSVTWYHKDBN"[*dat++ & 15];
-		    cp += 2;
+		cp[0] = "=ACMGRSVTWYHKDBN"[*dat >> 4];
+		cp[1] = "=ACMGRSVTWYHKDBN"[*dat++ & 15];
+		cp += 2;
 #endif
-		}
-		if (i < b->len) {
-		    *cp++ = "=ACMGRSVTWYHKDBN"[*dat >> 4];
-		}
-		fp->uncomp_p = cp;
 	    }
-	} else {
-	    if (end - fp->uncomp_p < 2) BF_FLUSH();
-	    *fp->uncomp_p++ = '*';
+	    if (i < b->len) {
+		*cp++ = "=ACMGRSVTWYHKDBN"[*dat >> 4];
+	    }
+	    o->p = cp;
 	}
-	*fp->uncomp_p++ = '\t';
+    } else {
+	if (o->end - o->p < 2) BF_FLUSH();
+	*o->p++ = '*';
+    }
+    *o->p++ = '\t';
 
-	/* QUAL */
-	n = b->len;
-	if (b->len < 0) return -1;
-	dat = (uc *)bam_qual(b);
-	if (dat - (uc *)b + b->len > b->blk_size + offsetof(bam_seq_t, ref))
-	    return -1;
-	/* BAM encoding */
-	//	while (n) {
-	//	    int l = end-fp->uncomp_p < n ? end-fp->uncomp_p : n;
-	//	    memcpy(fp->uncomp_p, dat, l); fp->uncomp_p += l;
-	//	    n -= l; dat += l;
-	//	    if (end == fp->uncomp_p) BF_FLUSH();
-	//	}
-	if (b->len != 0) {
-	    if (*dat == 0xff) {
-		if (end - fp->uncomp_p < 2) BF_FLUSH();
-		*fp->uncomp_p++ = '*';
-		dat += b->len;
-	    } else {
-		if (end - fp->uncomp_p < b->len + 3) BF_FLUSH();
-		if (end - fp->uncomp_p < b->len + 3 ||
-		    fp->binning == BINNING_ILLUMINA) {
-
-		    /* Long seqs */
-		    if (fp->binning == BINNING_ILLUMINA) {
-			for (i = 0; i < b->len; i++) {
-			    if (end - fp->uncomp_p < 3) BF_FLUSH();
-			    *fp->uncomp_p++ = illumina_bin_33[(uc)*dat++];
-			}
-		    } else {
-			for (i = 0; i < b->len; i++) {
-			    if (end - fp->uncomp_p < 3) BF_FLUSH();
-			    *fp->uncomp_p++ = *dat++ + '!';
-			}
+    /* QUAL */
+    n = b->len;
+    if (b->len < 0) return -1;
+    dat = (uc *)bam_qual(b);
+    if (dat - (uc *)b + b->len > b->blk_size + offsetof(bam_seq_t, ref))
+	return -1;
+    /* BAM encoding */
+    //	while (n) {
+    //	    int l = o->end-o->p < n ? o->end-o->p : n;
+    //	    memcpy(o->p, dat, l); o->p += l;
+    //	    n -= l; dat += l;
+    //	    if (o->end == o->p) BF_FLUSH();
+    //	}
+    if (b->len != 0) {
+	if (*dat == 0xff) {
+	    if (o->end - o->p < 2) BF_FLUSH();
+	    *o->p++ = '*';
+	    dat += b->len;
+	} else {
+	    if (o->end - o->p < b->len + 3) BF_FLUSH();
+	    if (o->end - o->p < b->len + 3 ||
+		binning == BINNING_ILLUMINA) {
+
+		/* Long seqs */
+		if (binning == BINNING_ILLUMINA) {
+		    for (i = 0; i < b->len; i++) {
+			if (o->end - o->p < 3) BF_FLUSH();
+			*o->p++ = illumina_bin_33[(uc)*dat++];
 		    }
 		} else {
-		    unsigned char *cp = fp->uncomp_p;
-		    i = 0;
-#ifdef ALLOW_UAC
-		    int n = b->len & ~3;
-		    for (; i < n; i+=4) {
-			//*cp++ = *dat++ + '!';
-			*(uint32_u *)cp = *(uint32_u *)dat + 0x21212121;
-			cp  += 4;
-			dat += 4;
+		    for (i = 0; i < b->len; i++) {
+			if (o->end - o->p < 3) BF_FLUSH();
+			*o->p++ = *dat++ + '!';
 		    }
+		}
+	    } else {
+		unsigned char *cp = o->p;
+		i = qual_run(dat, b->len, cp, '!', 0);
+		dat += i;
+		cp  += i;
+#ifdef ALLOW_UAC
+		int n = b->len & ~3;
+		for (; i < n; i+=4) {
+		    //*cp++ = *dat++ + '!';
+		    *(uint32_u *)cp = *(uint32_u *)dat + 0x21212121;
+		    cp  += 4;
+		    dat += 4;
+		}
 #endif
-		    for (; i < b->len; i++) {
-			*cp++ = *dat++ + '!';
-		    }
-		    fp->uncomp_p = cp;
+		for (; i < b->len; i++) {
+		    *cp++ = *dat++ + '!';
 		}
+		o->p = cp;
 	    }
-	} else {
-	    if (end - fp->uncomp_p < 2) BF_FLUSH();
-	    *fp->uncomp_p++ = '*';
 	}
+    } else {
+	if (o->end - o->p < 2) BF_FLUSH();
+	*o->p++ = '*';
+    }
 
-	/* Auxiliary tags */
-	auxh = NULL;
-	while (0 == bam_aux_iter_full(b, &auxh, aux_key, &type, &val)) {
-	    if (end - fp->uncomp_p < 20) BF_FLUSH();
-	    *fp->uncomp_p++ = '\t';
-	    *fp->uncomp_p++ = aux_key[0];
-	    *fp->uncomp_p++ = aux_key[1];
-	    *fp->uncomp_p++ = ':';
-	    *fp->uncomp_p++ = type;
-	    *fp->uncomp_p++ = ':';
-	    switch(aux_key[2]) {
-	    case 'A':
-		*fp->uncomp_p++ = val.i;
-		break;
+    /* Auxiliary tags */
+    auxh = NULL;
+    while (0 == bam_aux_iter_full(b, &auxh, aux_key, &type, &val)) {
+	if (o->end - o->p < 20) BF_FLUSH();
+	*o->p++ = '\t';
+	*o->p++ = aux_key[0];
+	*o->p++ = aux_key[1];
+	*o->p++ = ':';
+	*o->p++ = type;
+	*o->p++ = ':';
+	switch(aux_key[2]) {
+	case 'A':
+	    *o->p++ = val.i;
+	    break;
 
-	    case 'C':
-		fp->uncomp_p = append_uint(fp->uncomp_p, (uint8_t)val.i);
-		break;
+	case 'C':
+	    o->p = append_uint(o->p, (uint8_t)val.i);
+	    break;
 
-	    case 'c':
-		fp->uncomp_p = append_int(fp->uncomp_p, (int8_t)val.i);
-		break;
+	case 'c':
+	    o->p = append_int(o->p, (int8_t)val.i);
+	    break;
 
-	    case 'S':
-		fp->uncomp_p = append_uint(fp->uncomp_p, (uint16_t)val.i);
-		break;
+	case 'S':
+	    o->p = append_uint(o->p, (uint16_t)val.i);
+	    break;
 
-	    case 's':
-		fp->uncomp_p = append_int(fp->uncomp_p, (int16_t)val.i);
-		break;
+	case 's':
+	    o->p = append_int(o->p, (int16_t)val.i);
+	    break;
 
-	    case 'I':
-		fp->uncomp_p = append_uint(fp->uncomp_p, (uint32_t)val.i);
-		break;
+	case 'I':
+	    o->p = append_uint(o->p, (uint32_t)val.i);
+	    break;
 
-	    case 'i':
-		fp->uncomp_p = append_int(fp->uncomp_p, (int32_t)val.i);
-		break;
+	case 'i':
+	    o->p = append_int(o->p, (int32_t)val.i);
+	    break;
 
-	    case 'f':
-		fp->uncomp_p += sprintf((char *)fp->uncomp_p, "%g", val.f);
-		break;
+	case 'f':
+	    o->p += sprintf((char *)o->p, "%g", val.f);
+	    break;
 
-	    case 'd':
-		fp->uncomp_p += sprintf((char *)fp->uncomp_p, "%g", val.d);
-		break;
+	case 'd':
+	    o->p += sprintf((char *)o->p, "%g", val.d);
+	    break;
 
-	    case 'Z':
-	    case 'H': {
-		size_t l = strlen(val.s), l2;
-		char *dat = val.s;
-		do {
-		    if (end - fp->uncomp_p < l+2) BF_FLUSH();
-		    l2 = MIN(l, end-fp->uncomp_p);
-		    memcpy(fp->uncomp_p, dat, l2);
-		    fp->uncomp_p += l2;
-		    l   -= l2;
-		    dat += l2;
-		} while (l);
-		break;
+	case 'Z':
+	case 'H': {
+	    size_t l = strlen(val.s), l2;
+	    char *dat = val.s;
+	    do {
+		if (o->end - o->p < l+2) BF_FLUSH();
+		l2 = MIN(l, o->end-o->p);
+		memcpy(o->p, dat, l2);
+		o->p += l2;
+		l   -= l2;
+		dat += l2;
+	    } while (l);
+	    break;
+	}
+
+	case 'B': {
+	    uint32_t count = val.B.n, sz, j;
+	    unsigned char *s = val.B.s;
+	    *o->p++ = val.B.t;
+
+	    /*
+	     * Chew through count items 4000 at a time.
+	     * This is because 4000*14 (biggest %g output plus comma?)
+	     * is just shy of 64k, so we avoid buffer overflows.
+	     */
+	    switch (val.B.t) {
+	    case 'C': case 'c': sz = 4; break;
+	    case 'S': case 's': sz = 6; break;
+	    default:            sz = 14; break;
 	    }
 
-	    case 'B': {
-		uint32_t count = val.B.n, sz, j;
-		unsigned char *s = val.B.s;
-		*fp->uncomp_p++ = val.B.t;
+	    for (j = 0; j < count; j += 4000) {
+		int i_start = j;
+		int i_end = j + 4000 < count ? j + 4000 : count;
+
+		if (o->end - o->p < 5+(i_end-i_start)*sz) BF_FLUSH();
 
-		/*
-		 * Chew through count items 4000 at a time.
-		 * This is because 4000*14 (biggest %g output plus comma?)
-		 * is just shy of 64k, so we avoid buffer overflows.
-		 */
 		switch (val.B.t) {
-		case 'C': case 'c': sz = 4; break;
-		case 'S': case 's': sz = 6; break;
-		default:            sz = 14; break;
-		}
+		    int i;
+		case 'C':
+		    for (i = i_start; i < i_end; i++, s++) {
+			*o->p++ = ',';
+			o->p = append_int(o->p, (uint8_t)s[0]);
+		    }
+		    break;
 
-		for (j = 0; j < count; j += 4000) {
-		    int i_start = j;
-		    int i_end = j + 4000 < count ? j + 4000 : count;
+		case 'c':
+		    for (i = i_start; i < i_end; i++, s++) {
+			*o->p++ = ',';
+			o->p = append_int(o->p, (int8_t)s[0]);
+		    }
+		    break;
 
-		    if (end - fp->uncomp_p < 5+(i_end-i_start)*sz) BF_FLUSH();
+		case 'S':
+		    for (i = i_start; i < i_end; i++, s+=2) {
+			*o->p++ = ',';
+			o->p = append_int(o->p,
+						  (uint16_t)((s[0] << 0) +
+							     (s[1] << 8)));
+		    }
+		    break;
 
-		    switch (val.B.t) {
-			int i;
-		    case 'C':
-			for (i = i_start; i < i_end; i++, s++) {
-			    *fp->uncomp_p++ = ',';
-			    fp->uncomp_p = append_int(fp->uncomp_p, (uint8_t)s[0]);
-			}
-			break;
+		case 's':
+		    for (i = i_start; i < i_end; i++, s+=2) {
+			*o->p++ = ',';
+			o->p = append_int(o->p,
+						  (int16_t)((s[0] << 0) +
+							    (s[1] << 8)));
+		    }
+		    break;
 
-		    case 'c':
-			for (i = i_start; i < i_end; i++, s++) {
-			    *fp->uncomp_p++ = ',';
-			    fp->uncomp_p = append_int(fp->uncomp_p, (int8_t)s[0]);
-			}
-			break;
-
-		    case 'S':
-			for (i = i_start; i < i_end; i++, s+=2) {
-			    *fp->uncomp_p++ = ',';
-			    fp->uncomp_p = append_int(fp->uncomp_p,
-						      (uint16_t)((s[0] << 0) +
-								 (s[1] << 8)));
-			}
-			break;
-
-		    case 's':
-			for (i = i_start; i < i_end; i++, s+=2) {
-			    *fp->uncomp_p++ = ',';
-			    fp->uncomp_p = append_int(fp->uncomp_p,
-						      (int16_t)((s[0] << 0) +
-								(s[1] << 8)));
-			}
-			break;
-
-		    case 'I':
-			for (i = i_start; i < i_end; i++, s+=4) {
-			    *fp->uncomp_p++ = ',';
-			    fp->uncomp_p = append_uint(fp->uncomp_p,
-						       (uint32_t)((s[0] << 0) +
-								  (s[1] << 8) +
-								  (s[2] <<16) +
-								  (s[3] <<24)));
-			}
-			break;
-
-		    case 'i':
-			for (i = i_start; i < i_end; i++, s+=4) {
-			    *fp->uncomp_p++ = ',';
-			    fp->uncomp_p = append_int(fp->uncomp_p,
-						      (int32_t)((s[0] << 0) +
-								(s[1] << 8) +
-								(s[2] <<16) +
-								(s[3] <<24)));
-			}
-			break;
-
-		    case 'f': {
-			union {
-			    float f;
-			    unsigned char c[4];
-			} u;
-			for (i = i_start; i < i_end; i++, s+=4) {
-			    *fp->uncomp_p++ = ',';
-			    u.c[0] = s[0];
-			    u.c[1] = s[1];
-			    u.c[2] = s[2];
-			    u.c[3] = s[3];
-			    fp->uncomp_p += sprintf((char *)fp->uncomp_p, "%g", u.f);
-			}
-			break;
+		case 'I':
+		    for (i = i_start; i < i_end; i++, s+=4) {
+			*o->p++ = ',';
+			o->p = append_uint(o->p,
+						   (uint32_t)((s[0] << 0) +
+							      (s[1] << 8) +
+							      (s[2] <<16) +
+							      (s[3] <<24)));
+		    }
+		    break;
+
+		case 'i':
+		    for (i = i_start; i < i_end; i++, s+=4) {
+			*o->p++ = ',';
+			o->p = append_int(o->p,
+						  (int32_t)((s[0] << 0) +
+							    (s[1] << 8) +
+							    (s[2] <<16) +
+							    (s[3] <<24)));
 		    }
+		    break;
 
-		    default:
-			fprintf(stderr, "Unhandled sub-type of aux type B\n");
+		case 'f': {
+		    union {
+			float f;
+			unsigned char c[4];
+		    } u;
+		    for (i = i_start; i < i_end; i++, s+=4) {
+			*o->p++ = ',';
+			u.c[0] = s[0];
+			u.c[1] = s[1];
+			u.c[2] = s[2];
+			u.c[3] = s[3];
+			o->p += sprintf((char *)o->p, "%g", u.f);
 		    }
+		    break;
 		}
-		break;
-	    }
 
-	    default:
-		fprintf(stderr, "Unhandled auxiliary type '%c' in "
-			"bam_put_seq()\n", type);
+		default:
+		    fprintf(stderr, "Unhandled sub-type of aux type B\n");
+		}
 	    }
+	    break;
+	}
+
+	default:
+	    fprintf(stderr, "Unhandled auxiliary type '%c' in "
+		    "sam_format_seq()\n", type);
+	}
+    }
+
+    *o->p++ = '\n';
+
+#undef BF_FLUSH
+    return 0;
+}
+
+/*
+ * Multi-threaded SAM formatting.  bam_put_seq copies records into a
+ * batch and the pool turns each batch into text, compressing it too for
+ * BGZF output.  Batches are written back in order.
+ *
+ * The reference names are looked up by the main thread, so the jobs
+ * never touch the header while the input may still be adding to it.
+ */
+typedef struct sam_format_job {
+    struct sam_format_job *next; // free list
+    enum quality_binning binning;
+    int level;                  // BGZF level, or -2 for plain text
+    unsigned char *rec;         // records, each padded to its b->alloc
+    size_t rec_sz, rec_alloc;
+    const char **names;         // RNAME and RNEXT per record
+    int nrec, names_alloc;
+    sam_out_buf text;
+    unsigned char *out;         // BGZF blocks of text
+    size_t out_sz, out_alloc;
+    int err;
+} sam_format_job;
+
+static void sam_format_job_free(sam_format_job *j) {
+    if (!j)
+	return;
+
+    free(j->rec);
+    free(j->names);
+    free(j->text.buf);
+    free(j->out);
+    free(j);
+}
+
+static void *sam_format_thread(void *arg) {
+    sam_format_job *j = (sam_format_job *)arg;
+    unsigned char *cp = j->rec;
+    size_t len, off;
+    int i;
+
+    j->text.p = j->text.buf;
+    j->out_sz = 0;
+    j->err = 0;
+
+    for (i = 0; i < j->nrec; i++) {
+	bam_seq_t *b = (bam_seq_t *)cp;
+	if (sam_format_seq(&j->text, j->names[i*2], j->names[i*2+1],
+			   j->binning, b)) {
+	    j->err = 1;
+	    return j;
+	}
+	cp += b->alloc;
+    }
+
+    if (j->level == -2)
+	return j;
+
+    // Each block can be at most Z_BUFF_SIZE plus its header and footer
+    len = j->text.p - j->text.buf;
+    off = (len + BGZF_BUFF_SIZE-1) / BGZF_BUFF_SIZE * (Z_BUFF_SIZE+26);
+    if (off > j->out_alloc) {
+	unsigned char *out = realloc(j->out, off);
+	if (!out) {
+	    j->err = 1;
+	    return j;
+	}
+	j->out = out;
+	j->out_alloc = off;
+    }
+
+    for (off = 0; off < len; off += BGZF_BUFF_SIZE) {
+	uint32_t in_sz = MIN(BGZF_BUFF_SIZE, len - off), out_sz;
+	if (bgzf_encode(j->level, j->text.buf + off, in_sz,
+			j->out + j->out_sz, &out_sz) != 0) {
+	    j->err = 1;
+	    break;
+	}
+	j->out_sz += out_sz;
+    }
+
+    return j;
+}
+
+/*
+ * Writes a formatted batch and puts the job back on the free list.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int sam_format_write(bam_file_t *fp, sam_format_job *j) {
+    int err = j->err;
+
+    if (!err) {
+	if (j->level == -2) {
+	    size_t len = j->text.p - j->text.buf;
+	    err = bam_fwrite(fp, j->text.buf, len) != len;
+	} else {
+	    err = bam_fwrite(fp, j->out, j->out_sz) != j->out_sz;
+	}
+    }
+
+    j->next = fp->sam_ffree;
+    fp->sam_ffree = j;
+
+    return err ? -1 : 0;
+}
+
+/*
+ * Hands the current batch to the pool and writes any completed ones.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int sam_format_dispatch(bam_file_t *fp) {
+    sam_format_job *j = fp->sam_fjob;
+    t_pool_result *r;
+    int err = 0;
+
+    if (!j)
+	return 0;
+    fp->sam_fjob = NULL;
+
+    // Anything written before the pool was in use must go first
+    if (fp->uncomp_p != fp->uncomp) {
+	sam_out_buf o;
+	o.buf = fp->uncomp;
+	o.p   = fp->uncomp_p;
+	o.end = fp->uncomp + BGZF_BUFF_SIZE;
+	o.fp  = fp;
+	if (sam_out_flush(&o))
+	    err = -1;
+	fp->uncomp_p = fp->uncomp;
+    }
+    if (fp->sam_bgzf && !t_pool_results_queue_empty(fp->equeue))
+	BGZF_FLUSH(fp);
+
+    t_pool_dispatch(fp->pool, fp->fqueue, sam_format_thread, j);
+
+    while ((r = t_pool_next_result(fp->fqueue))) {
+	if (sam_format_write(fp, (sam_format_job *)r->data))
+	    err = -1;
+	t_pool_delete_result(r, 0);
+    }
+
+    return err;
+}
+
+/*
+ * Adds a record to the current batch, dispatching it once full.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int sam_put_seq_mt(bam_file_t *fp, bam_seq_t *b,
+			  const char *rname, const char *mname) {
+    sam_format_job *j = fp->sam_fjob;
+    // Including the nul byte terminating the aux list
+    size_t len = offsetof(bam_seq_t, ref) + b->blk_size + 1;
+    size_t sz = (len + 7) & ~7;
+
+    if (!j) {
+	if (fp->sam_ffree) {
+	    j = fp->sam_ffree;
+	    fp->sam_ffree = j->next;
+	} else if (!(j = calloc(1, sizeof(*j)))) {
+	    return -1;
 	}
+	j->binning = fp->binning;
+	j->level = fp->sam_bgzf ? fp->level : -2;
+	j->rec_sz = 0;
+	j->nrec = 0;
+	fp->sam_fjob = j;
+
+	// Keep the reference names alive until the jobs are written
+	if (!fp->sam_fheader) {
+	    fp->sam_fheader = fp->header;
+	    sam_hdr_incr_ref(fp->header);
+	}
+    }
+
+    if (j->rec_sz + sz > j->rec_alloc) {
+	size_t n = j->rec_alloc ? j->rec_alloc : SAM_FORMAT_BATCH;
+	unsigned char *rec;
+	while (n < j->rec_sz + sz)
+	    n *= 2;
+	if (!(rec = realloc(j->rec, n)))
+	    return -1;
+	j->rec = rec;
+	j->rec_alloc = n;
+    }
+    if (j->nrec >= j->names_alloc) {
+	int n = j->names_alloc ? j->names_alloc*2 : 1024;
+	const char **names = realloc(j->names, n * 2 * sizeof(*names));
+	if (!names)
+	    return -1;
+	j->names = names;
+	j->names_alloc = n;
+    }
+
+    memcpy(j->rec + j->rec_sz, b, len);
+    ((bam_seq_t *)(j->rec + j->rec_sz))->alloc = sz;
+    j->rec_sz += sz;
+    j->names[j->nrec*2]   = rname;
+    j->names[j->nrec*2+1] = mname;
+    j->nrec++;
+
+    return j->rec_sz >= SAM_FORMAT_BATCH ? sam_format_dispatch(fp) : 0;
+}
+
+/*
+ * Formats and writes all outstanding batches.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int sam_format_flush(bam_file_t *fp) {
+    t_pool_result *r;
+    int err = 0;
 
-	*fp->uncomp_p++ = '\n';
+    if (!fp->fqueue)
+	return 0;
+
+    if (sam_format_dispatch(fp))
+	err = -1;
+
+    if (t_pool_flush_queue(fp->pool, fp->fqueue) < 0)
+	err = -1;
 
+    while ((r = t_pool_next_result(fp->fqueue))) {
+	if (sam_format_write(fp, (sam_format_job *)r->data))
+	    err = -1;
+	t_pool_delete_result(r, 0);
+    }
+
+    return err;
+}
+
+/*
+ * Frees the formatting queue and batches.  The pool must have been
+ * flushed first.
+ */
+static void sam_format_destroy(bam_file_t *b) {
+    if (b->fqueue) {
+	t_pool_result *res;
+	while ((res = t_pool_next_result(b->fqueue))) {
+	    sam_format_job_free((sam_format_job *)res->data);
+	    t_pool_delete_result(res, 0);
+	}
+	t_results_queue_destroy(b->fqueue);
+    }
+    sam_format_job_free(b->sam_fjob);
+    while (b->sam_ffree) {
+	sam_format_job *j = b->sam_ffree;
+	b->sam_ffree = j->next;
+	sam_format_job_free(j);
+    }
+    sam_hdr_free(b->sam_fheader);
+}
+
+/*
+ * Writes a single bam sequence object.
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int bam_put_seq(bam_file_t *fp, bam_seq_t *b) {
+    if (!fp->binary) {
+	/* SAM */
+	const char *rname, *mname;
+	sam_out_buf o;
+	int r;
+
+	if (sam_ref_names(fp->header, b, &rname, &mname))
+	    return -1;
+
+	if (fp->pool && fp->fqueue)
+	    return sam_put_seq_mt(fp, b, rname, mname);
+
+	o.buf = fp->uncomp;
+	o.p   = fp->uncomp_p;
+	o.end = fp->uncomp + BGZF_BUFF_SIZE;
+	o.fp  = fp;
+	r = sam_format_seq(&o, rname, mname, fp->binning, b);
+	fp->uncomp_p = o.p;
+	if (r)
+	    return -1;
     } else {
 	/* BAM */
 	bam_seq_t *b_orig = b;
+	uint64_t ubeg = fp->uoff + (fp->uncomp_p - fp->uncomp);
 
 	if (b->flag & BAM_CIGAR32) {
 	    b = bam_cigar2tag(b);
@@ -4023,6 +5157,15 @@ int bam_put_seq(bam_file_t *fp, bam_seq_t *b) {
 
 	if (b_orig != b)
 	    free(b);
+
+	/* Failures here abandon the index and are reported by bam_close */
+	if (fp->index_out) {
+	    int unmapped = (bam_flag(b_orig) & BAM_FUNMAP) != 0;
+	    bam_index_build_add(fp->index_out, fp->header, bam_ref(b_orig),
+				bam_pos(b_orig), bam_pos(b_orig) +
+				(unmapped ? 0 : ref_len(b_orig)), unmapped,
+				ubeg, fp->uoff + (fp->uncomp_p - fp->uncomp));
+	}
     }
 
     return 0;
@@ -4075,7 +5218,7 @@ int bam_write_header(bam_file_t *out) {
 	}
     }
 
-    if (out->binary) {
+    if (out->binary || out->sam_bgzf) {
 	int len = hp-header;
 	char *cp = header;
 
@@ -4087,7 +5230,7 @@ int bam_write_header(bam_file_t *out) {
 	    len -= sz;
 	}
     } else {
-	if (hp-header != fwrite(header, 1, hp-header, out->fp))
+	if (hp-header != bam_fwrite(out, header, hp-header))
 	    return -1;
     }
 
@@ -4097,6 +5240,41 @@ int bam_write_header(bam_file_t *out) {
 }
 
 
+/*
+ * Starts, restarts or stops the background writer according to
+ * write_bufsize and write_direct.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int bam_set_writer(bam_file_t *fd) {
+    if (!(fd->mode & O_WRONLY) || !fd->fp)
+	return 0;
+
+    if (fd->writer) {
+	int r = write_thread_close(fd->writer);
+	fd->writer = NULL;
+	if (r)
+	    return -1;
+    }
+
+    if (fd->write_bufsize <= 0 && !fd->write_direct)
+	return 0;
+
+    if (fflush(fd->fp) != 0)
+	return -1;
+
+    fd->writer = write_thread_init(fileno(fd->fp),
+				   fd->write_bufsize > 0 ? fd->write_bufsize : 0,
+				   fd->write_direct);
+    if (!fd->writer) {
+	fprintf(stderr, "Failed to start writer thread\n");
+	return -1;
+    }
+
+    return 0;
+}
+
 /* 
  * Sets options on the bam_file_t. See BAM_OPT_* definitions in bam.h.
  * Use this immediately after opening.
@@ -4128,6 +5306,8 @@ int bam_set_voption(bam_file_t *fd, enum bam_option opt, va_list args) {
 	fd->pool = va_arg(args, t_pool *);
 	fd->equeue = t_results_queue_init();
 	fd->dqueue = t_results_queue_init();
+	fd->pqueue = t_results_queue_init();
+	fd->fqueue = t_results_queue_init();
 	break;
 
     case BAM_OPT_BINNING:
@@ -4143,6 +5323,37 @@ int bam_set_voption(bam_file_t *fd, enum bam_option opt, va_list args) {
     case BAM_OPT_OUTPUT_BGZIP_IDX:
         fd->idx_fn =  va_arg(args, char *);
 	break;
+
+    case BAM_OPT_WRITE_THREAD:
+	fd->write_bufsize = va_arg(args, int);
+	return bam_set_writer(fd);
+
+    case BAM_OPT_DIRECT_IO:
+	fd->write_direct = va_arg(args, int);
+	return bam_set_writer(fd);
+
+    case BAM_OPT_OUTPUT_INDEX: {
+	// A .csi suffix gives a CSI index, otherwise BAI
+	char *fn = va_arg(args, char *);
+	size_t l = fn ? strlen(fn) : 0;
+
+	bam_index_build_free(fd->index_out);
+	free(fd->index_out_fn);
+	fd->index_out = NULL;
+	fd->index_out_fn = NULL;
+	if (!fn)
+	    break;
+
+	if (!(fd->mode & O_WRONLY) || !fd->binary) {
+	    fprintf(stderr, "Indices can only be built when writing BAM\n");
+	    return -1;
+	}
+	if (!(fd->index_out_fn = strdup(fn)) ||
+	    !(fd->index_out = bam_index_build_init(l > 4 &&
+						    !strcmp(fn+l-4, ".csi"))))
+	    return -1;
+	break;
+    }
     }
 
     return 0;
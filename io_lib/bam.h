@@ -58,6 +58,7 @@ extern "C" {
 #include "io_lib/thread_pool.h"
 #include "io_lib/binning.h"
 #include "io_lib/bgzip.h"
+#include "io_lib/write_thread.h"
 
 /* BAM header structs */
 typedef struct tag_list {
@@ -135,6 +136,24 @@ typedef struct {
     } value;
 } bam_aux_tag_t;
 
+/* A region for BAM index queries, 1-based inclusive as per cram_range */
+typedef struct {
+    int refid;
+    int64_t start;
+    int64_t end;
+} bam_range;
+
+/* A run of BGZF virtual file offsets, [beg,end) */
+typedef struct {
+    uint64_t beg;
+    uint64_t end;
+} bam_chunk;
+
+struct bam_index;
+struct bam_index_build;
+struct sam_parse_job;
+struct sam_format_job;
+
 /*
  * Our bam stream consists of a zlib gzFile stream and a buffer for it to
  * output to. This allows us to call small bam_read requests while
@@ -212,6 +231,52 @@ typedef struct {
     unsigned char bgbuf[Z_BUFF_SIZE];
     unsigned char *bgbuf_p;
     size_t bgbuf_sz;
+
+    /* Background writer; see BAM_OPT_WRITE_THREAD */
+    write_thread *writer;
+    int write_bufsize;
+    int write_direct;
+
+    /* The BGZF block being decoded, for virtual file offsets */
+    uint64_t in_off;            // bytes read so far from fp
+    uint64_t block_addr;
+    uint32_t block_csize, block_usize;
+    uint64_t first_voff;        // of the first record
+
+    /* Region queries; see bam_index.h */
+    struct bam_index *index;
+    bam_range *ranges;
+    int nranges;
+    bam_chunk *chunks;
+    int nchunks, curr_chunk;
+    int *range_hits, nrange_hits;
+
+    /* Index built while writing; see BAM_OPT_OUTPUT_INDEX */
+    struct bam_index_build *index_out;
+    char *index_out_fn;
+    uint64_t uoff;              // uncompressed bytes passed to BGZF
+
+    /* SAM parsing in the thread pool, a batch of lines per job */
+    t_results_queue *pqueue;
+    struct sam_parse_job *sam_job;      // batch being returned
+    struct sam_parse_job *sam_pending;  // waiting for room in the pool
+    struct sam_parse_job *sam_free;     // for reuse
+    unsigned char *sam_carry;           // partial line left from a batch
+    size_t sam_carry_sz, sam_carry_alloc;
+    int sam_eof, sam_njobs;
+
+    /* SAM formatting in the thread pool, a batch of records per job */
+    t_results_queue *fqueue;
+    struct sam_format_job *sam_fjob;    // batch being filled
+    struct sam_format_job *sam_ffree;   // for reuse
+    SAM_hdr *sam_fheader;               // held until the jobs are written
+
+    /* SAM output is BGZF compressed ("wz" mode) */
+    int sam_bgzf;
+
+    /* Records spanning BGZF blocks, for bam_next_view */
+    unsigned char *view_buf;
+    size_t view_alloc;
 } bam_file_t;
 
 /* BAM flags */
@@ -274,6 +339,34 @@ static inline void bam_set_bin(bam_seq_t *b, uint32_t v) {
 #define bam_qual(b)      (bam_seq(b) + (int)(((b)->len+1)/2))
 #define bam_aux(b)       (bam_qual(b) + (b)->len)
 
+/*
+ * A read-only view of a BAM record, filled out by bam_next_view().
+ * The fixed fields are decoded, while data points at the rest of the
+ * record (read name onwards) in its on-disk form, usually within the
+ * decompressed BGZF block.  CIGAR operations are therefore little endian
+ * and may be unaligned, and the aux fields are not nul terminated.
+ */
+typedef struct {
+    int32_t  ref;
+    int64_t  pos;
+    int32_t  mate_ref;
+    int64_t  mate_pos;
+    int64_t  ins_size;
+    uint16_t flag, bin;
+    uint8_t  map_qual, name_len;
+    uint16_t cigar_len;
+    int32_t  len;
+    const unsigned char *data;
+    uint32_t data_len;
+} bam_view_t;
+
+#define bam_view_name(v)    ((const char *)(v)->data)
+#define bam_view_cigar(v)   ((v)->data + (v)->name_len)
+#define bam_view_seq(v)     (bam_view_cigar(v) + 4*(v)->cigar_len)
+#define bam_view_qual(v)    (bam_view_seq(v) + ((v)->len+1)/2)
+#define bam_view_aux(v)     (bam_view_qual(v) + (v)->len)
+#define bam_view_aux_end(v) ((v)->data + (v)->data_len)
+
 /* Rounds up to the next multiple of 4 or 8 */
 #define round4(v) (((v-1)&~3)+4)
 #define round8(v) (((v-1)&~7)+8)
@@ -326,7 +419,8 @@ enum cigar_op {
  * writing. Use "rb" or "wb" for reading or writing BAM and "r" or
  * "w" or reading or writing SAM. When writing BAM, the mode may end
  * with a digit from 0 to 9 to indicate the compression to use with 0
- * indicating uncompressed data.
+ * indicating uncompressed data.  "wz" writes BGZF compressed SAM, also
+ * accepting a compression level.
  *
  * @param fn The filename to open or create.
  * @param mode The input/output mode, similar to fopen().
@@ -369,6 +463,24 @@ int bam_next_seq(bam_file_t *b, bam_seq_t **bsp);
  */
 int bam_get_seq(bam_file_t *b, bam_seq_t **bsp);
 
+/*! Reads the next BAM record as a read-only view.
+ *
+ * Unlike bam_get_seq() the record is normally not copied, with v
+ * pointing into the decompressed BGZF block.  Only records spanning
+ * two blocks are assembled into a buffer held by b.  Either way the
+ * view is valid only until the next read from b.  This suits scans
+ * that just inspect records, such as counting or filtering.
+ *
+ * BAM input only, and ranges set by bam_set_ranges() are not honoured.
+ * Long CIGARs held in a CG tag are not expanded.
+ *
+ * @return
+ * Returns 1 on success;
+ *         0 on eof;
+ *        -1 on error.
+ */
+int bam_next_view(bam_file_t *b, bam_view_t *v);
+
 /*!Looks for aux field 'key' and returns the value.
  * The type is the first char and the value is the 2nd character onwards.
  *
@@ -757,7 +869,10 @@ enum bam_option {
     BAM_OPT_BINNING,
     BAM_OPT_IGNORE_CHKSUM,
     BAM_OPT_WITH_BGZIP_IDX,
-    BAM_OPT_OUTPUT_BGZIP_IDX
+    BAM_OPT_OUTPUT_BGZIP_IDX,
+    BAM_OPT_WRITE_THREAD,
+    BAM_OPT_DIRECT_IO,
+    BAM_OPT_OUTPUT_INDEX
 };
 
 /*! Sets options on the bam_file_t.
@@ -790,6 +905,13 @@ int bam_set_voption(bam_file_t *fd, enum bam_option opt, va_list args);
 unsigned char *append_int(unsigned char *cp, int32_t i);
 unsigned char *append_uint(unsigned char *cp, uint32_t i);
 
+/*
+ * Compresses in_sz bytes, at most BGZF_BUFF_SIZE, into a single BGZF
+ * block in out (of at least Z_BUFF_SIZE bytes).
+ */
+int bgzf_encode(int level, const void *buf, uint32_t in_sz,
+		void *out, uint32_t *out_sz);
+
 #ifdef __cplusplus
 }
 #endif
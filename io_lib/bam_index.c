@@ -0,0 +1,1050 @@
+/*
+ * Copyright (c) 2024 Genome Research Ltd.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ * 
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * BAI and CSI coordinate indices for BAM files.
+ *
+ * Both formats hold, per reference, a set of bins from the UCSC
+ * binning scheme with each bin listing chunks of virtual file offsets
+ * (compressed block address << 16 | offset within the uncompressed
+ * block) holding records assigned to that bin.  BAI also holds a
+ * linear index of the smallest offset of records overlapping each
+ * 16kb window while CSI instead gives every bin such a minimum offset
+ * and permits a configurable bin size and depth.  See the SAM
+ * specification for the details.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "io_lib_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <zlib.h>
+
+#include "io_lib/bam_index.h"
+#include "io_lib/os.h"
+
+#ifndef MIN
+#  define MIN(a,b) ((a)<(b)?(a):(b))
+#endif
+
+#define BAI_MIN_SHIFT 14
+#define BAI_DEPTH     5
+
+/* First bin number at level l */
+#define bin_first(l) (((1<<(((l)<<1) + (l))) - 1) / 7)
+
+/* Pseudo-bin holding the per-reference metadata */
+#define bin_meta(n_lvls) (bin_first((n_lvls)+1) + 1)
+
+/* Smallest bin containing [beg,end) */
+static int idx_reg2bin(int64_t beg, int64_t end, int min_shift, int n_lvls) {
+    int l, s = min_shift, t = bin_first(n_lvls);
+
+    for (--end, l = n_lvls; l > 0; --l, s += 3, t -= 1 << ((l<<1) + l))
+	if (beg>>s == end>>s)
+	    return t + (beg>>s);
+
+    return 0;
+}
+
+/*
+ * Lists all bins overlapping [beg,end) in *bins, growing it as needed.
+ *
+ * Returns the number of bins on success
+ *        -1 on failure
+ */
+static int idx_reg2bins(int64_t beg, int64_t end, int min_shift, int n_lvls,
+			uint32_t **bins, int *nalloc) {
+    int l, t, s = min_shift + n_lvls*3, n = 0;
+
+    for (--end, l = 0, t = 0; l <= n_lvls; s -= 3, t += 1 << ((l<<1) + l), l++) {
+	int64_t b = t + (beg>>s), e = t + (end>>s), i;
+
+	if (n + e - b + 1 > *nalloc) {
+	    int a = n + e - b + 1 + 64;
+	    uint32_t *tmp = realloc(*bins, a * sizeof(*tmp));
+	    if (!tmp)
+		return -1;
+	    *bins = tmp, *nalloc = a;
+	}
+	for (i = b; i <= e; i++)
+	    (*bins)[n++] = i;
+    }
+
+    return n;
+}
+
+/* Level of a bin, 0 being the root */
+static int bin_level(uint32_t bin) {
+    int l;
+
+    for (l = 0; bin; l++)
+	bin = (bin-1) >> 3;
+
+    return l;
+}
+
+
+/* ----------------------------------------------------------------------
+ * Loading and querying.
+ */
+
+typedef struct {
+    uint32_t bin;
+    uint64_t loff;              // CSI only
+    int nchunk;
+    bam_chunk *chunk;
+} bam_index_bin;
+
+typedef struct {
+    int nbin;
+    bam_index_bin *bin;         // sorted by bin number
+    int nlin;                   // BAI only
+    uint64_t *lin;
+} bam_index_ref;
+
+struct bam_index {
+    int csi;
+    int min_shift, n_lvls;
+    int nref;
+    bam_index_ref *ref;
+    uint64_t max_off;           // end of the placed records
+    uint64_t n_no_coor;
+};
+
+void bam_index_free(struct bam_index *idx) {
+    int i, j;
+
+    if (!idx)
+	return;
+
+    for (i = 0; i < idx->nref; i++) {
+	for (j = 0; j < idx->ref[i].nbin; j++)
+	    free(idx->ref[i].bin[j].chunk);
+	free(idx->ref[i].bin);
+	free(idx->ref[i].lin);
+    }
+    free(idx->ref);
+    free(idx);
+}
+
+/*
+ * Reads a whole file, uncompressing it if it is gzip or BGZF.
+ * Returns the malloced contents on success, setting *len
+ *         NULL on failure
+ */
+static unsigned char *idx_read_file(const char *fn, size_t *len) {
+    gzFile gz;
+    unsigned char *buf = NULL, *tmp;
+    size_t alloc = 0, used = 0;
+    int l;
+
+    if (!(gz = gzopen(fn, "rb")))
+	return NULL;
+
+    do {
+	if (alloc - used < 65536) {
+	    alloc = alloc ? alloc*2 : 1<<20;
+	    if (!(tmp = realloc(buf, alloc)))
+		goto err;
+	    buf = tmp;
+	}
+	if ((l = gzread(gz, buf+used, alloc-used)) < 0)
+	    goto err;
+	used += l;
+    } while (l > 0);
+
+    gzclose(gz);
+    *len = used;
+    return buf;
+
+ err:
+    gzclose(gz);
+    free(buf);
+    return NULL;
+}
+
+/* Bounds checked little-endian reads from an in-memory index */
+typedef struct {
+    const unsigned char *cp, *end;
+} idx_buf;
+
+static int idx_get32(idx_buf *b, uint32_t *v) {
+    if (b->end - b->cp < 4)
+	return -1;
+    *v = b->cp[0] | (b->cp[1]<<8) | (b->cp[2]<<16) | ((uint32_t)b->cp[3]<<24);
+    b->cp += 4;
+    return 0;
+}
+
+static int idx_get64(idx_buf *b, uint64_t *v) {
+    uint32_t lo, hi;
+
+    if (idx_get32(b, &lo) || idx_get32(b, &hi))
+	return -1;
+    *v = ((uint64_t)hi << 32) | lo;
+    return 0;
+}
+
+static int bam_index_bin_cmp(const void *v1, const void *v2) {
+    const bam_index_bin *b1 = v1, *b2 = v2;
+    return (b1->bin > b2->bin) - (b1->bin < b2->bin);
+}
+
+/*
+ * Parses an in-memory BAI or CSI index.
+ * Returns the index on success
+ *         NULL on failure
+ */
+static struct bam_index *bam_index_parse(const unsigned char *data,
+					  size_t len) {
+    struct bam_index *idx;
+    idx_buf b = {data, data+len};
+    uint32_t u32, nref;
+    int i, j, k;
+
+    if (!(idx = calloc(1, sizeof(*idx))))
+	return NULL;
+
+    if (len >= 4 && memcmp(data, "BAI\1", 4) == 0) {
+	idx->csi = 0;
+	idx->min_shift = BAI_MIN_SHIFT;
+	idx->n_lvls = BAI_DEPTH;
+	b.cp += 4;
+    } else if (len >= 4 && memcmp(data, "CSI\1", 4) == 0) {
+	uint32_t min_shift, depth, l_aux;
+	idx->csi = 1;
+	b.cp += 4;
+	if (idx_get32(&b, &min_shift) || idx_get32(&b, &depth) ||
+	    idx_get32(&b, &l_aux))
+	    goto trunc;
+	if (min_shift > 32 || depth > 10 || min_shift + 3*depth > 62) {
+	    fprintf(stderr, "Unsupported CSI min_shift %u / depth %u\n",
+		    min_shift, depth);
+	    goto err;
+	}
+	idx->min_shift = min_shift;
+	idx->n_lvls = depth;
+	if (b.end - b.cp < l_aux)
+	    goto trunc;
+	b.cp += l_aux;
+    } else {
+	fprintf(stderr, "Index is neither BAI nor CSI format\n");
+	goto err;
+    }
+
+    if (idx_get32(&b, &nref))
+	goto trunc;
+    if (nref > INT_MAX / sizeof(*idx->ref))
+	goto trunc;
+    if (!(idx->ref = calloc(nref ? nref : 1, sizeof(*idx->ref))))
+	goto err;
+    idx->nref = nref;
+
+    for (i = 0; i < idx->nref; i++) {
+	bam_index_ref *r = &idx->ref[i];
+	uint32_t nbin;
+
+	if (idx_get32(&b, &nbin))
+	    goto trunc;
+	// Each bin occupies at least 8 bytes, which limits a corrupt count
+	if (nbin > (b.end - b.cp) / 8)
+	    goto trunc;
+	if (nbin && !(r->bin = calloc(nbin, sizeof(*r->bin))))
+	    goto err;
+
+	for (j = 0; j < nbin; j++) {
+	    bam_index_bin *bn = &r->bin[r->nbin];
+	    uint32_t nchunk;
+
+	    if (idx_get32(&b, &bn->bin))
+		goto trunc;
+	    if (idx->csi && idx_get64(&b, &bn->loff))
+		goto trunc;
+	    if (idx_get32(&b, &nchunk))
+		goto trunc;
+	    if (nchunk > (b.end - b.cp) / 16)
+		goto trunc;
+
+	    if (bn->bin == bin_meta(idx->n_lvls)) {
+		// Reference start/end offsets and mapped/unmapped counts
+		uint64_t beg, end;
+		if (nchunk >= 1) {
+		    if (idx_get64(&b, &beg) || idx_get64(&b, &end))
+			goto trunc;
+		    if (idx->max_off < end)
+			idx->max_off = end;
+		}
+		b.cp += 16 * (nchunk ? nchunk-1 : 0);
+		continue;
+	    }
+
+	    if (!(bn->chunk = malloc((nchunk ? nchunk : 1) * sizeof(*bn->chunk))))
+		goto err;
+	    bn->nchunk = nchunk;
+	    for (k = 0; k < nchunk; k++) {
+		if (idx_get64(&b, &bn->chunk[k].beg) ||
+		    idx_get64(&b, &bn->chunk[k].end))
+		    goto trunc;
+		if (idx->max_off < bn->chunk[k].end)
+		    idx->max_off = bn->chunk[k].end;
+	    }
+	    r->nbin++;
+	}
+	qsort(r->bin, r->nbin, sizeof(*r->bin), bam_index_bin_cmp);
+
+	if (!idx->csi) {
+	    if (idx_get32(&b, &u32))
+		goto trunc;
+	    if (u32 > (b.end - b.cp) / 8)
+		goto trunc;
+	    if (u32 && !(r->lin = malloc(u32 * sizeof(*r->lin))))
+		goto err;
+	    r->nlin = u32;
+	    for (k = 0; k < r->nlin; k++)
+		if (idx_get64(&b, &r->lin[k]))
+		    goto trunc;
+	}
+    }
+
+    // Optional count of unplaced reads
+    if (idx_get64(&b, &idx->n_no_coor))
+	idx->n_no_coor = 0;
+
+    return idx;
+
+ trunc:
+    fprintf(stderr, "Truncated or corrupt BAM index\n");
+ err:
+    bam_index_free(idx);
+    return NULL;
+}
+
+static int idx_has_suffix(const char *fn, const char *suffix) {
+    size_t l1 = strlen(fn), l2 = strlen(suffix);
+    return l1 >= l2 && strcmp(fn + l1 - l2, suffix) == 0;
+}
+
+/*
+ * Loads a BAI or CSI index for a BAM file.
+ *
+ * fn is the BAM filename.  We look for fn.bai, fn.csi and then fn
+ * with any .bam suffix replaced by .bai.  If fn itself ends in .bai or
+ * .csi it is loaded directly.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int bam_index_load(bam_file_t *b, const char *fn) {
+    static const char *suffix[] = {".bai", ".csi"};
+    unsigned char *data = NULL;
+    size_t len, l = strlen(fn);
+    char *fn2;
+    int i;
+
+    if (!(fn2 = malloc(l + 5)))
+	return -1;
+
+    if (idx_has_suffix(fn, ".bai") || idx_has_suffix(fn, ".csi")) {
+	data = idx_read_file(fn, &len);
+    } else {
+	for (i = 0; !data && i < 2; i++) {
+	    sprintf(fn2, "%s%s", fn, suffix[i]);
+	    data = idx_read_file(fn2, &len);
+	}
+	if (!data && idx_has_suffix(fn, ".bam")) {
+	    sprintf(fn2, "%.*s.bai", (int)l-4, fn);
+	    data = idx_read_file(fn2, &len);
+	}
+    }
+    free(fn2);
+
+    if (!data) {
+	fprintf(stderr, "Unable to open index for %s\n", fn);
+	return -1;
+    }
+
+    bam_index_free(b->index);
+    b->index = bam_index_parse(data, len);
+    free(data);
+
+    return b->index ? 0 : -1;
+}
+
+static bam_index_bin *bam_index_find_bin(bam_index_ref *r, uint32_t bin) {
+    bam_index_bin key;
+    key.bin = bin;
+    return bsearch(&key, r->bin, r->nbin, sizeof(*r->bin), bam_index_bin_cmp);
+}
+
+/*
+ * The smallest virtual offset of records that may overlap position
+ * beg, from the linear index for BAI or otherwise the closest bin in
+ * the CSI index.
+ */
+static uint64_t bam_index_min_off(struct bam_index *idx, bam_index_ref *r,
+				  int64_t beg) {
+    bam_index_bin *bn = NULL;
+    uint32_t bin;
+
+    if (!idx->csi) {
+	if (!r->nlin)
+	    return 0;
+	return r->lin[MIN(beg >> idx->min_shift, r->nlin-1)];
+    }
+
+    // Step left along the bottom level and then up until a bin is found
+    bin = bin_first(idx->n_lvls) + (beg >> idx->min_shift);
+    for (;;) {
+	uint32_t first;
+	if ((bn = bam_index_find_bin(r, bin)) || bin == 0)
+	    break;
+	first = (((bin-1) >> 3) << 3) + 1;
+	bin = bin > first ? bin-1 : (bin-1) >> 3;
+    }
+
+    return bn ? bn->loff : 0;
+}
+
+static int bam_chunk_cmp(const void *v1, const void *v2) {
+    const bam_chunk *c1 = v1, *c2 = v2;
+
+    if (c1->beg != c2->beg)
+	return c1->beg < c2->beg ? -1 : 1;
+    return (c1->end > c2->end) - (c1->end < c2->end);
+}
+
+/*
+ * Computes the virtual file offset chunks in the index covering the
+ * ranges, sorted and with overlaps merged.
+ *
+ * Returns the number of chunks on success, filling out *chunks
+ *        -1 on failure
+ */
+int bam_index_chunks(bam_file_t *b, bam_range *r, int n, bam_chunk **chunks) {
+    struct bam_index *idx = b->index;
+    bam_chunk *c = NULL, *tmp;
+    uint32_t *bins = NULL;
+    int nbins_alloc = 0, nc = 0, ac = 0, i, j, k, l;
+    int64_t max_len;
+
+    *chunks = NULL;
+    if (!idx) {
+	fprintf(stderr, "No BAM index loaded\n");
+	return -1;
+    }
+    max_len = (int64_t)1 << (idx->min_shift + 3*idx->n_lvls);
+
+    for (i = 0; i < n; i++) {
+	bam_index_ref *ref;
+	int64_t beg, end;
+	uint64_t min_off;
+	int nbins;
+
+	if (r[i].refid == -1) {
+	    // Unplaced reads follow everything else
+	    if (nc >= ac) {
+		ac = ac ? ac*2 : 256;
+		if (!(tmp = realloc(c, ac * sizeof(*c))))
+		    goto err;
+		c = tmp;
+	    }
+	    c[nc].beg = idx->max_off ? idx->max_off : b->first_voff;
+	    c[nc++].end = UINT64_MAX;
+	    continue;
+	}
+
+	if (r[i].refid < 0 || r[i].refid >= idx->nref)
+	    continue;
+	ref = &idx->ref[r[i].refid];
+
+	beg = r[i].start > 1 ? r[i].start-1 : 0;
+	end = r[i].end < max_len ? r[i].end : max_len;
+	if (end <= beg)
+	    continue;
+
+	min_off = bam_index_min_off(idx, ref, beg);
+	if ((nbins = idx_reg2bins(beg, end, idx->min_shift, idx->n_lvls,
+				  &bins, &nbins_alloc)) < 0)
+	    goto err;
+
+	for (j = 0; j < nbins; j++) {
+	    bam_index_bin *bn = bam_index_find_bin(ref, bins[j]);
+	    if (!bn)
+		continue;
+	    for (k = 0; k < bn->nchunk; k++) {
+		if (bn->chunk[k].end <= min_off)
+		    continue;
+		if (nc >= ac) {
+		    ac = ac ? ac*2 : 256;
+		    if (!(tmp = realloc(c, ac * sizeof(*c))))
+			goto err;
+		    c = tmp;
+		}
+		c[nc++] = bn->chunk[k];
+	    }
+	}
+    }
+    free(bins);
+
+    // Sort and merge overlapping chunks so records are visited once
+    if (nc) {
+	qsort(c, nc, sizeof(*c), bam_chunk_cmp);
+	for (k = 0, l = 1; l < nc; l++) {
+	    if (c[l].beg <= c[k].end) {
+		if (c[k].end < c[l].end)
+		    c[k].end = c[l].end;
+	    } else {
+		c[++k] = c[l];
+	    }
+	}
+	nc = k+1;
+    }
+
+    *chunks = c;
+    return nc;
+
+ err:
+    free(bins);
+    free(c);
+    return -1;
+}
+
+/*
+ * Restricts bam_get_seq to records overlapping any of n ranges.  The
+ * next read seeks to the first chunk.  n == 0 clears the ranges.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int bam_set_ranges(bam_file_t *b, bam_range *r, int n) {
+    bam_chunk *chunks;
+    int nchunks;
+
+    free(b->ranges);
+    free(b->chunks);
+    free(b->range_hits);
+    b->ranges = NULL;
+    b->chunks = NULL;
+    b->range_hits = NULL;
+    b->nranges = b->nchunks = b->nrange_hits = 0;
+
+    if (n == 0)
+	return 0;
+
+    if (!b->bam || !b->gzip || !b->fp) {
+	fprintf(stderr, "Region queries need a BGZF compressed BAM file\n");
+	return -1;
+    }
+
+    if ((nchunks = bam_index_chunks(b, r, n, &chunks)) < 0)
+	return -1;
+
+    if (!(b->ranges = malloc(n * sizeof(*r))) ||
+	!(b->range_hits = malloc(n * sizeof(int)))) {
+	free(chunks);
+	return -1;
+    }
+    memcpy(b->ranges, r, n * sizeof(*r));
+    b->nranges = n;
+    b->chunks = chunks;
+    b->nchunks = nchunks;
+    b->curr_chunk = -1;
+
+    return 0;
+}
+
+/*
+ * Reports the ranges overlapped by the last record read.
+ *
+ * Returns the number of ranges the last record overlapped.
+ */
+int bam_range_hits(bam_file_t *b, int **hits) {
+    *hits = b->range_hits;
+    return b->ranges ? b->nrange_hits : 0;
+}
+
+
+/* ----------------------------------------------------------------------
+ * Building while writing.
+ */
+
+/* Records in one bin at consecutive file offsets */
+typedef struct {
+    uint32_t bin;
+    uint64_t beg, end;          // uncompressed offsets, later virtual
+} bam_index_run;
+
+typedef struct {
+    bam_index_run *run;
+    size_t nrun, arun;
+    uint64_t *lin;              // smallest offset per window
+    int64_t nlin;
+    uint64_t beg, end;
+    uint64_t n_mapped, n_unmapped;
+    int used;
+} bam_index_build_ref;
+
+struct bam_index_build {
+    int csi;
+    int min_shift, n_lvls;
+    int nref;
+    bam_index_build_ref *ref;
+    int last_ref;
+    int64_t last_pos;
+    uint64_t n_no_coor;
+    int failed;
+
+    // Uncompressed and compressed start of each BGZF block written
+    uint64_t *blk_u, *blk_c;
+    size_t nblk, ablk;
+    uint64_t u_total, c_total;
+};
+
+struct bam_index_build *bam_index_build_init(int csi) {
+    struct bam_index_build *ib = calloc(1, sizeof(*ib));
+
+    if (!ib)
+	return NULL;
+
+    ib->csi = csi;
+    ib->min_shift = BAI_MIN_SHIFT;
+    ib->n_lvls = BAI_DEPTH;
+
+    return ib;
+}
+
+void bam_index_build_free(struct bam_index_build *ib) {
+    int i;
+
+    if (!ib)
+	return;
+
+    for (i = 0; i < ib->nref; i++) {
+	free(ib->ref[i].run);
+	free(ib->ref[i].lin);
+    }
+    free(ib->ref);
+    free(ib->blk_u);
+    free(ib->blk_c);
+    free(ib);
+}
+
+/*
+ * Adds a BGZF block of usize bytes, compressed to csize bytes, to the
+ * file layout.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int bam_index_build_block(struct bam_index_build *ib,
+			  uint32_t usize, uint32_t csize) {
+    if (ib->nblk >= ib->ablk) {
+	size_t a = ib->ablk ? ib->ablk*2 : 1024;
+	uint64_t *u, *c;
+	if (!(u = realloc(ib->blk_u, a * sizeof(*u))))
+	    return -1;
+	ib->blk_u = u;
+	if (!(c = realloc(ib->blk_c, a * sizeof(*c))))
+	    return -1;
+	ib->blk_c = c;
+	ib->ablk = a;
+    }
+
+    ib->blk_u[ib->nblk] = ib->u_total;
+    ib->blk_c[ib->nblk] = ib->c_total;
+    ib->nblk++;
+    ib->u_total += usize;
+    ib->c_total += csize;
+
+    return 0;
+}
+
+/*
+ * Sets up the per-reference arrays and, for CSI, a depth covering the
+ * longest reference.
+ */
+static int bam_index_build_start(struct bam_index_build *ib, SAM_hdr *h) {
+    int64_t max_len = 0, s;
+    int i;
+
+    if (!(ib->ref = calloc(h->nref ? h->nref : 1, sizeof(*ib->ref))))
+	return -1;
+    ib->nref = h->nref;
+    ib->last_ref = -1;
+    ib->last_pos = -1;
+
+    for (i = 0; i < h->nref; i++)
+	if (max_len < h->ref[i].len)
+	    max_len = h->ref[i].len;
+
+    if (ib->csi) {
+	max_len += 256;
+	for (ib->n_lvls = 0, s = 1 << ib->min_shift; max_len > s; s <<= 3)
+	    ib->n_lvls++;
+    } else if (max_len > (int64_t)1 << (BAI_MIN_SHIFT + 3*BAI_DEPTH)) {
+	fprintf(stderr, "Reference too long for a BAI index; use CSI\n");
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Adds a record spanning [pos,end) on refid to the index, held at
+ * uncompressed offsets [ubeg,uend) in the file.  The data must be
+ * sorted by coordinate.
+ *
+ * Returns 0 on success
+ *        -1 on failure, after which no index will be written
+ */
+int bam_index_build_add(struct bam_index_build *ib, SAM_hdr *h,
+			int refid, int64_t pos, int64_t end, int unmapped,
+			uint64_t ubeg, uint64_t uend) {
+    bam_index_build_ref *r;
+    bam_index_run *run;
+    int64_t w, wend;
+    int key;
+
+    if (ib->failed)
+	return -1;
+
+    if (!ib->ref && bam_index_build_start(ib, h) < 0)
+	goto err;
+
+    // Unplaced reads sort after every reference
+    key = refid < 0 ? ib->nref : refid;
+    if (key < ib->last_ref ||
+	(refid >= 0 && key == ib->last_ref && pos < ib->last_pos)) {
+	fprintf(stderr, "BAM output is not sorted by coordinate; "
+		"not writing an index\n");
+	goto err;
+    }
+    ib->last_ref = key;
+    ib->last_pos = pos;
+
+    if (refid < 0) {
+	ib->n_no_coor++;
+	return 0;
+    }
+
+    if (refid >= ib->nref) {
+	fprintf(stderr, "Reference id %d not in the header; "
+		"not writing an index\n", refid);
+	goto err;
+    }
+
+    if (pos < 0)
+	pos = 0;
+    if (end <= pos)
+	end = pos+1;
+    if (end > (int64_t)1 << (ib->min_shift + 3*ib->n_lvls)) {
+	fprintf(stderr, "Position %"PRId64" too large for the index\n", end);
+	goto err;
+    }
+
+    r = &ib->ref[refid];
+    if (!r->used) {
+	r->beg = ubeg;
+	r->used = 1;
+    }
+    r->end = uend;
+    if (unmapped)
+	r->n_unmapped++;
+    else
+	r->n_mapped++;
+
+    // Bin, extending the last run if contiguous
+    run = r->nrun ? &r->run[r->nrun-1] : NULL;
+    if (run && run->end == ubeg &&
+	run->bin == idx_reg2bin(pos, end, ib->min_shift, ib->n_lvls)) {
+	run->end = uend;
+    } else {
+	if (r->nrun >= r->arun) {
+	    size_t a = r->arun ? r->arun*2 : 256;
+	    if (!(run = realloc(r->run, a * sizeof(*run))))
+		goto err;
+	    r->run = run;
+	    r->arun = a;
+	}
+	run = &r->run[r->nrun++];
+	run->bin = idx_reg2bin(pos, end, ib->min_shift, ib->n_lvls);
+	run->beg = ubeg;
+	run->end = uend;
+    }
+
+    // Linear index
+    w = pos >> ib->min_shift;
+    wend = (end-1) >> ib->min_shift;
+    if (wend >= r->nlin) {
+	int64_t i, n = wend+1 > r->nlin*2 ? wend+1 : r->nlin*2;
+	uint64_t *lin = realloc(r->lin, n * sizeof(*lin));
+	if (!lin)
+	    goto err;
+	for (i = r->nlin; i < n; i++)
+	    lin[i] = UINT64_MAX;
+	r->lin = lin;
+	r->nlin = n;
+    }
+    for (; w <= wend; w++)
+	if (r->lin[w] == UINT64_MAX)
+	    r->lin[w] = ubeg;
+
+    return 0;
+
+ err:
+    ib->failed = 1;
+    return -1;
+}
+
+/* Converts an uncompressed file offset to a virtual file offset */
+static uint64_t bam_index_voff(struct bam_index_build *ib, uint64_t u) {
+    size_t lo = 0, hi = ib->nblk;
+
+    if (u >= ib->u_total || !ib->nblk)
+	return ib->c_total << 16;
+
+    // Last block starting at or before u
+    while (hi - lo > 1) {
+	size_t mid = lo + (hi-lo)/2;
+	if (ib->blk_u[mid] <= u)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+
+    return (ib->blk_c[lo] << 16) | (u - ib->blk_u[lo]);
+}
+
+static int bam_index_run_cmp(const void *v1, const void *v2) {
+    const bam_index_run *r1 = v1, *r2 = v2;
+
+    if (r1->bin != r2->bin)
+	return r1->bin < r2->bin ? -1 : 1;
+    return (r1->beg > r2->beg) - (r1->beg < r2->beg);
+}
+
+/* A growable little-endian output buffer */
+typedef struct {
+    unsigned char *data;
+    size_t len, alloc;
+    int err;
+} idx_out;
+
+static void idx_put(idx_out *o, const void *data, size_t len) {
+    if (o->len + len > o->alloc) {
+	size_t a = o->alloc ? o->alloc*2 : 65536;
+	unsigned char *tmp;
+	while (a < o->len + len)
+	    a *= 2;
+	if (!(tmp = realloc(o->data, a))) {
+	    o->err = 1;
+	    return;
+	}
+	o->data = tmp;
+	o->alloc = a;
+    }
+    memcpy(o->data + o->len, data, len);
+    o->len += len;
+}
+
+static void idx_put32(idx_out *o, uint32_t v) {
+    unsigned char c[4] = {v, v>>8, v>>16, v>>24};
+    idx_put(o, c, 4);
+}
+
+static void idx_put64(idx_out *o, uint64_t v) {
+    idx_put32(o, v);
+    idx_put32(o, v>>32);
+}
+
+/*
+ * Serialises one reference.  Runs are merged into per-bin chunks,
+ * joining those which are contiguous or share a BGZF block.
+ */
+static void bam_index_build_ref_out(struct bam_index_build *ib,
+				    bam_index_build_ref *r, idx_out *o) {
+    size_t i, j, k, nbin;
+    int64_t l;
+
+    if (!r->used) {
+	idx_put32(o, 0);
+	if (!ib->csi)
+	    idx_put32(o, 0);
+	return;
+    }
+
+    qsort(r->run, r->nrun, sizeof(*r->run), bam_index_run_cmp);
+    for (k = 0, i = 1; i < r->nrun; i++) {
+	if (r->run[i].bin == r->run[k].bin && r->run[i].beg == r->run[k].end)
+	    r->run[k].end = r->run[i].end;
+	else
+	    r->run[++k] = r->run[i];
+    }
+    r->nrun = k+1;
+
+    for (i = 0; i < r->nrun; i++) {
+	r->run[i].beg = bam_index_voff(ib, r->run[i].beg);
+	r->run[i].end = bam_index_voff(ib, r->run[i].end);
+    }
+    for (k = 0, i = 1; i < r->nrun; i++) {
+	if (r->run[i].bin == r->run[k].bin &&
+	    r->run[i].beg >> 16 <= r->run[k].end >> 16) {
+	    if (r->run[k].end < r->run[i].end)
+		r->run[k].end = r->run[i].end;
+	} else {
+	    r->run[++k] = r->run[i];
+	}
+    }
+    r->nrun = k+1;
+
+    // Fill gaps in the linear index, converting to virtual offsets
+    for (l = 0; l < r->nlin; l++) {
+	if (r->lin[l] == UINT64_MAX)
+	    r->lin[l] = l ? r->lin[l-1] : 0;
+	else
+	    r->lin[l] = bam_index_voff(ib, r->lin[l]);
+    }
+
+    for (nbin = 0, i = 0; i < r->nrun; i = j, nbin++)
+	for (j = i+1; j < r->nrun && r->run[j].bin == r->run[i].bin; j++)
+	    ;
+    idx_put32(o, nbin + 1);
+
+    for (i = 0; i < r->nrun; i = j) {
+	uint32_t bin = r->run[i].bin;
+	for (j = i+1; j < r->nrun && r->run[j].bin == bin; j++)
+	    ;
+	idx_put32(o, bin);
+	if (ib->csi) {
+	    // Smallest offset of records overlapping the bin start
+	    int lvl = bin_level(bin);
+	    int64_t bot = (int64_t)(bin - bin_first(lvl))
+		<< 3*(ib->n_lvls - lvl);
+	    idx_put64(o, bot < r->nlin ? r->lin[bot] : 0);
+	}
+	idx_put32(o, j-i);
+	for (k = i; k < j; k++) {
+	    idx_put64(o, r->run[k].beg);
+	    idx_put64(o, r->run[k].end);
+	}
+    }
+
+    idx_put32(o, bin_meta(ib->n_lvls));
+    if (ib->csi)
+	idx_put64(o, 0);
+    idx_put32(o, 2);
+    idx_put64(o, bam_index_voff(ib, r->beg));
+    idx_put64(o, bam_index_voff(ib, r->end));
+    idx_put64(o, r->n_mapped);
+    idx_put64(o, r->n_unmapped);
+
+    if (!ib->csi) {
+	idx_put32(o, r->nlin);
+	for (l = 0; l < r->nlin; l++)
+	    idx_put64(o, r->lin[l]);
+    }
+}
+
+/*
+ * Writes the index to fn, as BGZF compressed CSI or plain BAI.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int bam_index_build_write(struct bam_index_build *ib, const char *fn) {
+    idx_out o = {NULL, 0, 0, 0};
+    FILE *fp = NULL;
+    int i, ret = -1;
+
+    if (ib->failed)
+	return -1;
+
+    if (ib->csi) {
+	idx_put(&o, "CSI\1", 4);
+	idx_put32(&o, ib->min_shift);
+	idx_put32(&o, ib->n_lvls);
+	idx_put32(&o, 0);
+    } else {
+	idx_put(&o, "BAI\1", 4);
+    }
+    idx_put32(&o, ib->nref);
+    for (i = 0; i < ib->nref; i++)
+	bam_index_build_ref_out(ib, &ib->ref[i], &o);
+    idx_put64(&o, ib->n_no_coor);
+
+    if (o.err)
+	goto err;
+
+    if (!(fp = fopen(fn, "wb"))) {
+	perror(fn);
+	goto err;
+    }
+
+    if (ib->csi) {
+	unsigned char blk[Z_BUFF_SIZE];
+	uint32_t blk_sz;
+	size_t pos = 0, sz;
+
+	do {
+	    sz = MIN(o.len - pos, BGZF_BUFF_SIZE);
+	    if (bgzf_encode(Z_DEFAULT_COMPRESSION, o.data + pos, sz,
+			    blk, &blk_sz) != 0)
+		goto err;
+	    if (fwrite(blk, 1, blk_sz, fp) != blk_sz)
+		goto err;
+	    pos += sz;
+	} while (sz); // finishing with an empty EOF block
+    } else {
+	if (fwrite(o.data, 1, o.len, fp) != o.len)
+	    goto err;
+    }
+
+    ret = 0;
+
+ err:
+    if (fp && fclose(fp) != 0)
+	ret = -1;
+    if (ret != 0) {
+	fprintf(stderr, "Failed to write index %s\n", fn);
+	if (fp)
+	    remove(fn);
+    }
+    free(o.data);
+
+    return ret;
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2024 Genome Research Ltd.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ * 
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * BAI and CSI coordinate indices for BAM files.
+ *
+ * Indices may be built while writing, by setting BAM_OPT_OUTPUT_INDEX
+ * on a file opened for writing BAM, and are used for region queries
+ * via bam_index_load() and bam_set_ranges().
+ */
+
+#ifndef _BAM_INDEX_H_
+#define _BAM_INDEX_H_
+
+#include "io_lib/bam.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! Loads a BAI or CSI index for a BAM file.
+ *
+ * fn is the BAM filename.  We look for fn.bai, fn.csi and then fn
+ * with any .bam suffix replaced by .bai.  If fn itself ends in .bai or
+ * .csi it is loaded directly.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int bam_index_load(bam_file_t *b, const char *fn);
+
+/*! Frees an index loaded by bam_index_load */
+void bam_index_free(struct bam_index *idx);
+
+/*! Restricts bam_get_seq to records overlapping any of n ranges.
+ *
+ * Requires an index to have been loaded with bam_index_load.
+ * Records are returned once each, in file order, even when they
+ * overlap several ranges.  A refid of -1 selects the unplaced
+ * unmapped reads at the end of the file.  Use n == 0 to clear the
+ * ranges, after which reading continues from the current position.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int bam_set_ranges(bam_file_t *b, bam_range *r, int n);
+
+/*! Reports the ranges overlapped by the last record read.
+ *
+ * *hits is set to an array of indices into the bam_set_ranges array,
+ * valid until the next record is read.
+ *
+ * @return
+ * Returns the number of ranges the last record overlapped.
+ */
+int bam_range_hits(bam_file_t *b, int **hits);
+
+/*
+ * Computes the virtual file offset chunks in the index covering the
+ * ranges, sorted and with overlaps merged.
+ *
+ * Returns the number of chunks on success, filling out *chunks
+ *        -1 on failure
+ */
+int bam_index_chunks(bam_file_t *b, bam_range *r, int n, bam_chunk **chunks);
+
+
+/*
+ * Index building, used by bam_put_seq and bam_close.
+ *
+ * Records are added with uncompressed file offsets and the BGZF blocks
+ * written are added as they are output, so the virtual file offsets
+ * can be computed once the last block is known.
+ */
+struct bam_index_build *bam_index_build_init(int csi);
+void bam_index_build_free(struct bam_index_build *ib);
+
+/*
+ * Adds a BGZF block of usize bytes, compressed to csize bytes, to the
+ * file layout.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int bam_index_build_block(struct bam_index_build *ib,
+			  uint32_t usize, uint32_t csize);
+
+/*
+ * Adds a record spanning [pos,end) on refid to the index, held at
+ * uncompressed offsets [ubeg,uend) in the file.
+ *
+ * Returns 0 on success
+ *        -1 on failure, after which no index will be written
+ */
+int bam_index_build_add(struct bam_index_build *ib, SAM_hdr *h,
+			int refid, int64_t pos, int64_t end, int unmapped,
+			uint64_t ubeg, uint64_t uend);
+
+/*
+ * Writes the index to fn.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int bam_index_build_write(struct bam_index_build *ib, const char *fn);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BAM_INDEX_H_ */
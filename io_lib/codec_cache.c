@@ -0,0 +1,471 @@
+/*
+ * Copyright (c) 2024 Genome Research Ltd.
+ * Author(s): James Bonfield
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ * 
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "io_lib_config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef HAVE_LIBBZ2
+#include <bzlib.h>
+#endif
+
+#include "io_lib/codec_cache.h"
+
+/*
+ * Number of distinct deflateInit2() configurations kept per thread.  CRAM
+ * trials gzip and gzip-rle at one level, and BGZF uses another.  Slots are
+ * only reused for identical parameters; deflateParams() is avoided as some
+ * zlib releases (1.2.9 to 1.2.11) mishandle it on a reset stream.
+ */
+#define ZLIB_DEFLATE_SLOTS 8
+
+/* libbzip2 work buffers kept per thread; compression uses 4, decode 3 */
+#define BZ2_STASH_SIZE 8
+
+/* Bytes before each bzip2 allocation used to record its size */
+#define BZ2_HDR 16
+
+typedef struct {
+    z_stream s;
+    int used;
+    int window_bits, mem_level;
+    int level, strategy;
+    unsigned int last_use;
+} zlib_deflate_slot;
+
+typedef struct {
+    zlib_deflate_slot zdef[ZLIB_DEFLATE_SLOTS];
+    unsigned int zdef_clock;
+    z_stream zinf;
+    int zinf_used;
+
+#ifdef HAVE_LIBDEFLATE
+    struct libdeflate_compressor *ldef[13];
+    struct libdeflate_decompressor *linf;
+#endif
+
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstd_c;
+    ZSTD_DCtx *zstd_d;
+#endif
+
+#ifdef HAVE_LIBLZMA
+    lzma_stream lzma_enc;
+    lzma_stream lzma_dec;
+#endif
+
+#ifdef HAVE_LIBBZ2
+    void *bz2_stash[BZ2_STASH_SIZE];
+#endif
+} codec_cache;
+
+static pthread_key_t codec_key;
+static pthread_once_t codec_once = PTHREAD_ONCE_INIT;
+static int codec_key_ok = 0;
+
+static void codec_cache_destroy(void *arg) {
+    codec_cache *c = (codec_cache *)arg;
+    int i;
+
+    if (!c)
+	return;
+
+    for (i = 0; i < ZLIB_DEFLATE_SLOTS; i++)
+	if (c->zdef[i].used)
+	    deflateEnd(&c->zdef[i].s);
+    if (c->zinf_used)
+	inflateEnd(&c->zinf);
+
+#ifdef HAVE_LIBDEFLATE
+    for (i = 0; i < 13; i++)
+	if (c->ldef[i])
+	    libdeflate_free_compressor(c->ldef[i]);
+    if (c->linf)
+	libdeflate_free_decompressor(c->linf);
+#endif
+
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(c->zstd_c);
+    ZSTD_freeDCtx(c->zstd_d);
+#endif
+
+#ifdef HAVE_LIBLZMA
+    lzma_end(&c->lzma_enc);
+    lzma_end(&c->lzma_dec);
+#endif
+
+#ifdef HAVE_LIBBZ2
+    for (i = 0; i < BZ2_STASH_SIZE; i++)
+	free(c->bz2_stash[i]);
+#endif
+
+    free(c);
+}
+
+static void codec_key_init(void) {
+    codec_key_ok = (pthread_key_create(&codec_key, codec_cache_destroy) == 0);
+}
+
+/*
+ * Returns the calling thread's cache, creating it if needed.
+ *
+ * Returns codec_cache pointer on success;
+ *         NULL on failure
+ */
+static codec_cache *codec_cache_get(void) {
+    codec_cache *c;
+
+    pthread_once(&codec_once, codec_key_init);
+    if (!codec_key_ok)
+	return NULL;
+
+    if ((c = pthread_getspecific(codec_key)))
+	return c;
+
+    if (!(c = calloc(1, sizeof(*c))))
+	return NULL;
+
+#ifdef HAVE_LIBLZMA
+    {
+	lzma_stream init = LZMA_STREAM_INIT;
+	c->lzma_enc = init;
+	c->lzma_dec = init;
+    }
+#endif
+
+    if (pthread_setspecific(codec_key, c) != 0) {
+	free(c);
+	return NULL;
+    }
+
+    return c;
+}
+
+void codec_cache_free(void) {
+    codec_cache *c;
+
+    pthread_once(&codec_once, codec_key_init);
+    if (!codec_key_ok || !(c = pthread_getspecific(codec_key)))
+	return;
+
+    pthread_setspecific(codec_key, NULL);
+    codec_cache_destroy(c);
+}
+
+/* ------------------------------------------------------------------------
+ * zlib
+ */
+z_stream *codec_zlib_deflater(int level, int window_bits, int mem_level,
+			      int strategy) {
+    codec_cache *c = codec_cache_get();
+    zlib_deflate_slot *z = NULL;
+    int i, err;
+
+    if (!c)
+	return NULL;
+
+    for (i = 0; i < ZLIB_DEFLATE_SLOTS; i++) {
+	if (c->zdef[i].used &&
+	    c->zdef[i].window_bits == window_bits &&
+	    c->zdef[i].mem_level   == mem_level &&
+	    c->zdef[i].level       == level &&
+	    c->zdef[i].strategy    == strategy) {
+	    z = &c->zdef[i];
+	    break;
+	}
+    }
+
+    if (z) {
+	z->last_use = ++c->zdef_clock;
+	if (deflateReset(&z->s) != Z_OK)
+	    goto reinit;
+	return &z->s;
+    }
+
+    // Not found, so use a free slot or evict the least recently used
+    z = &c->zdef[0];
+    for (i = 0; i < ZLIB_DEFLATE_SLOTS; i++) {
+	if (!c->zdef[i].used) {
+	    z = &c->zdef[i];
+	    break;
+	}
+	if (c->zdef[i].last_use < z->last_use)
+	    z = &c->zdef[i];
+    }
+    z->last_use = ++c->zdef_clock;
+
+ reinit:
+    if (z->used)
+	deflateEnd(&z->s);
+    z->used = 0;
+
+    memset(&z->s, 0, sizeof(z->s));
+    z->s.zalloc = Z_NULL;
+    z->s.zfree  = Z_NULL;
+    z->s.opaque = Z_NULL;
+    err = deflateInit2(&z->s, level, Z_DEFLATED, window_bits, mem_level,
+		       strategy);
+    if (err != Z_OK) {
+	fprintf(stderr, "zlib deflateInit2 error: %s\n",
+		z->s.msg ? z->s.msg : "?");
+	return NULL;
+    }
+
+    z->used        = 1;
+    z->window_bits = window_bits;
+    z->mem_level   = mem_level;
+    z->level       = level;
+    z->strategy    = strategy;
+
+    return &z->s;
+}
+
+z_stream *codec_zlib_inflater(int window_bits) {
+    codec_cache *c = codec_cache_get();
+    int err;
+
+    if (!c)
+	return NULL;
+
+    if (c->zinf_used) {
+	if (inflateReset2(&c->zinf, window_bits) == Z_OK)
+	    return &c->zinf;
+	inflateEnd(&c->zinf);
+	c->zinf_used = 0;
+    }
+
+    memset(&c->zinf, 0, sizeof(c->zinf));
+    c->zinf.zalloc   = Z_NULL;
+    c->zinf.zfree    = Z_NULL;
+    c->zinf.opaque   = Z_NULL;
+    c->zinf.next_in  = Z_NULL;
+    c->zinf.avail_in = 0;
+    err = inflateInit2(&c->zinf, window_bits);
+    if (err != Z_OK) {
+	fprintf(stderr, "zlib inflateInit2 error: %s\n",
+		c->zinf.msg ? c->zinf.msg : "?");
+	return NULL;
+    }
+    c->zinf_used = 1;
+
+    return &c->zinf;
+}
+
+/* ------------------------------------------------------------------------
+ * libdeflate
+ */
+#ifdef HAVE_LIBDEFLATE
+struct libdeflate_compressor *codec_libdeflate_compressor(int level) {
+    codec_cache *c = codec_cache_get();
+
+    if (!c || level < 0 || level > 12)
+	return NULL;
+
+    if (!c->ldef[level])
+	c->ldef[level] = libdeflate_alloc_compressor(level);
+
+    return c->ldef[level];
+}
+
+struct libdeflate_decompressor *codec_libdeflate_decompressor(void) {
+    codec_cache *c = codec_cache_get();
+
+    if (!c)
+	return NULL;
+
+    if (!c->linf)
+	c->linf = libdeflate_alloc_decompressor();
+
+    return c->linf;
+}
+#endif
+
+/* ------------------------------------------------------------------------
+ * zstd
+ */
+#ifdef HAVE_ZSTD
+ZSTD_CCtx *codec_zstd_cctx(void) {
+    codec_cache *c = codec_cache_get();
+
+    if (!c)
+	return NULL;
+
+    if (!c->zstd_c)
+	c->zstd_c = ZSTD_createCCtx();
+
+    return c->zstd_c;
+}
+
+ZSTD_DCtx *codec_zstd_dctx(void) {
+    codec_cache *c = codec_cache_get();
+
+    if (!c)
+	return NULL;
+
+    if (!c->zstd_d)
+	c->zstd_d = ZSTD_createDCtx();
+
+    return c->zstd_d;
+}
+#endif
+
+/* ------------------------------------------------------------------------
+ * lzma
+ */
+#ifdef HAVE_LIBLZMA
+lzma_stream *codec_lzma_encoder(void) {
+    codec_cache *c = codec_cache_get();
+    return c ? &c->lzma_enc : NULL;
+}
+
+lzma_stream *codec_lzma_decoder(void) {
+    codec_cache *c = codec_cache_get();
+    return c ? &c->lzma_dec : NULL;
+}
+#endif
+
+/* ------------------------------------------------------------------------
+ * bzip2
+ *
+ * Allocations are prefixed by their size so bzfree can return them to
+ * the per-thread stash, where bzalloc looks for an exact size match.
+ */
+#ifdef HAVE_LIBBZ2
+static void *codec_bz2_alloc(void *opaque, int n, int m) {
+    codec_cache *c = (codec_cache *)opaque;
+    size_t sz = (size_t)n * m;
+    char *p;
+    int i;
+
+    for (i = 0; i < BZ2_STASH_SIZE; i++) {
+	if (c->bz2_stash[i] && *(size_t *)c->bz2_stash[i] == sz) {
+	    p = c->bz2_stash[i];
+	    c->bz2_stash[i] = NULL;
+	    return p + BZ2_HDR;
+	}
+    }
+
+    if (!(p = malloc(sz + BZ2_HDR)))
+	return NULL;
+    *(size_t *)p = sz;
+
+    return p + BZ2_HDR;
+}
+
+static void codec_bz2_free(void *opaque, void *ptr) {
+    codec_cache *c = (codec_cache *)opaque;
+    int i;
+
+    if (!ptr)
+	return;
+
+    for (i = 0; i < BZ2_STASH_SIZE; i++) {
+	if (!c->bz2_stash[i]) {
+	    c->bz2_stash[i] = (char *)ptr - BZ2_HDR;
+	    return;
+	}
+    }
+
+    free((char *)ptr - BZ2_HDR);
+}
+
+static void codec_bz2_stream(bz_stream *s) {
+    codec_cache *c = codec_cache_get();
+
+    memset(s, 0, sizeof(*s));
+    if (c) {
+	s->bzalloc = codec_bz2_alloc;
+	s->bzfree  = codec_bz2_free;
+	s->opaque  = c;
+    }
+}
+
+int codec_bz2_compress(char *dest, unsigned int *dest_len,
+		       char *source, unsigned int source_len,
+		       int block_size_100k, int work_factor) {
+    bz_stream s;
+    int ret;
+
+    codec_bz2_stream(&s);
+    if ((ret = BZ2_bzCompressInit(&s, block_size_100k, 0, work_factor))
+	!= BZ_OK)
+	return ret;
+
+    s.next_in   = source;
+    s.avail_in  = source_len;
+    s.next_out  = dest;
+    s.avail_out = *dest_len;
+
+    ret = BZ2_bzCompress(&s, BZ_FINISH);
+    BZ2_bzCompressEnd(&s);
+
+    if (ret == BZ_FINISH_OK)
+	return BZ_OUTBUFF_FULL;
+    if (ret != BZ_STREAM_END)
+	return ret;
+
+    *dest_len -= s.avail_out;
+    return BZ_OK;
+}
+
+int codec_bz2_decompress(char *dest, unsigned int *dest_len,
+			 char *source, unsigned int source_len) {
+    bz_stream s;
+    int ret;
+
+    codec_bz2_stream(&s);
+    if ((ret = BZ2_bzDecompressInit(&s, 0, 0)) != BZ_OK)
+	return ret;
+
+    s.next_in   = source;
+    s.avail_in  = source_len;
+    s.next_out  = dest;
+    s.avail_out = *dest_len;
+
+    ret = BZ2_bzDecompress(&s);
+    BZ2_bzDecompressEnd(&s);
+
+    if (ret == BZ_OK)
+	return s.avail_out > 0 ? BZ_UNEXPECTED_EOF : BZ_OUTBUFF_FULL;
+    if (ret != BZ_STREAM_END)
+	return ret;
+
+    *dest_len -= s.avail_out;
+    return BZ_OK;
+}
+#endif
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2024 Genome Research Ltd.
+ * Author(s): James Bonfield
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ * 
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Per-thread caches of compression and decompression contexts.
+ *
+ * Allocating a codec context is often more expensive than using it on a
+ * small block, eg a libdeflate compressor or a zstd CCtx costs more to
+ * set up than compressing a single 64KB BGZF block.  Instead each thread
+ * keeps its own set of contexts, created on first use and freed when the
+ * thread exits, so every thread pool worker ends up with exactly one of
+ * each codec it has needed.
+ *
+ * The contexts returned belong to the calling thread and must not be
+ * freed or handed to another thread.
+ *
+ * This header is internal to io_lib and depends on the optional codec
+ * libraries being enabled in io_lib_config.h.
+ */
+
+#ifndef _CODEC_CACHE_H_
+#define _CODEC_CACHE_H_
+
+#include <zlib.h>
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LIBLZMA
+#include <lzma.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Returns a zlib deflate stream, reset and ready for a new stream with
+ * the given deflateInit2() parameters.  The caller should not call
+ * deflateEnd() on it.
+ *
+ * Returns z_stream pointer on success;
+ *         NULL on failure
+ */
+z_stream *codec_zlib_deflater(int level, int window_bits, int mem_level,
+			      int strategy);
+
+/*
+ * Returns a zlib inflate stream, reset for inflateInit2() window_bits.
+ * The caller should not call inflateEnd() on it.
+ *
+ * Returns z_stream pointer on success;
+ *         NULL on failure
+ */
+z_stream *codec_zlib_inflater(int window_bits);
+
+#ifdef HAVE_LIBDEFLATE
+/*
+ * Returns a libdeflate compressor for level (1 to 12) or decompressor.
+ *
+ * Returns context on success;
+ *         NULL on failure
+ */
+struct libdeflate_compressor *codec_libdeflate_compressor(int level);
+struct libdeflate_decompressor *codec_libdeflate_decompressor(void);
+#endif
+
+#ifdef HAVE_ZSTD
+/*
+ * Returns a zstd compression or decompression context.
+ *
+ * Returns context on success;
+ *         NULL on failure
+ */
+ZSTD_CCtx *codec_zstd_cctx(void);
+ZSTD_DCtx *codec_zstd_dctx(void);
+#endif
+
+#ifdef HAVE_LIBLZMA
+/*
+ * Returns an lzma stream for encoding or decoding.  Initialising a new
+ * coder on these with lzma_easy_encoder() or lzma_stream_decoder() reuses
+ * the memory from the previous coder where possible.  The caller should
+ * not call lzma_end() on it.
+ *
+ * Returns lzma_stream pointer on success;
+ *         NULL on failure
+ */
+lzma_stream *codec_lzma_encoder(void);
+lzma_stream *codec_lzma_decoder(void);
+#endif
+
+#ifdef HAVE_LIBBZ2
+/*
+ * Equivalents of BZ2_bzBuffToBuffCompress and BZ2_bzBuffToBuffDecompress.
+ * libbzip2 has no way to reset a stream, so instead the large work
+ * buffers it allocates are kept per thread and handed back to the next
+ * stream needing the same sizes.
+ *
+ * Returns BZ_OK on success;
+ *         a BZ_* error code on failure
+ */
+int codec_bz2_compress(char *dest, unsigned int *dest_len,
+		       char *source, unsigned int source_len,
+		       int block_size_100k, int work_factor);
+int codec_bz2_decompress(char *dest, unsigned int *dest_len,
+			 char *source, unsigned int source_len);
+#endif
+
+/*
+ * Frees all contexts held by the calling thread.  This happens
+ * automatically when a thread exits, but not for the main thread.  The
+ * cache is recreated as needed if any codec is used again afterwards.
+ */
+void codec_cache_free(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CODEC_CACHE_H_ */
@@ -345,8 +345,10 @@ static char *cram_extract_block(cram_block *b, int size) {
  */
 int cram_external_decode_int(cram_slice *slice, cram_codec *c,
 			     cram_block *in, char *out, int *out_size) {
-    char *cp;
+    int32_t *out_i = (int32_t *)out;
+    char *cp, *endp;
     cram_block *b;
+    int n = *out_size, err;
 
     /* Find the external block */
     b = cram_get_block_by_id(slice, c->external.content_id);
@@ -354,19 +356,19 @@ int cram_external_decode_int(cram_slice *slice, cram_codec *c,
         return *out_size?-1:0;
 
     cp = (char *)b->data + b->idx;
-    // E_INT and E_LONG are guaranteed single item queries
-    int err = 0;
-    *(int32_t *)out = c->vv->varint_get32(&cp, (char *)b->data + b->uncomp_size, &err);
+    endp = (char *)b->data + b->uncomp_size;
+    err = c->vv->varint_get32_array(&cp, endp, out_i, n);
     b->idx = cp - (char *)b->data;
-    *out_size = 1;
 
     return err ? -1 : 0;
 }
 
 int cram_external_decode_long(cram_slice *slice, cram_codec *c,
 			      cram_block *in, char *out, int *out_size) {
-    char *cp;
+    int64_t *out_i = (int64_t *)out;
+    char *cp, *endp;
     cram_block *b;
+    int n = *out_size, err;
 
     /* Find the external block */
     b = cram_get_block_by_id(slice, c->external.content_id);
@@ -374,11 +376,9 @@ int cram_external_decode_long(cram_slice *slice, cram_codec *c,
         return *out_size?-1:0;
 
     cp = (char *)b->data + b->idx;
-    // E_INT and E_LONG are guaranteed single item queries
-    int err = 0;
-    *(int64_t *)out = c->vv->varint_get64(&cp, (char *)b->data + b->uncomp_size, &err);
+    endp = (char *)b->data + b->uncomp_size;
+    err = c->vv->varint_get64_array(&cp, endp, out_i, n);
     b->idx = cp - (char *)b->data;
-    *out_size = 1;
 
     return err ? -1 : 0;
 }
@@ -620,8 +620,10 @@ cram_codec *cram_external_encode_init(cram_stats *st,
  */
 int cram_varint_decode_int(cram_slice *slice, cram_codec *c,
 			   cram_block *in, char *out, int *out_size) {
-    char *cp;
+    int32_t *out_i = (int32_t *)out;
+    char *cp, *endp;
     cram_block *b;
+    int i, n = *out_size, err;
 
     /* Find the data block */
     b = cram_get_block_by_id(slice, c->varint.content_id);
@@ -629,19 +631,22 @@ int cram_varint_decode_int(cram_slice *slice, cram_codec *c,
         return *out_size?-1:0;
 
     cp = (char *)b->data + b->idx;
-    // E_INT and E_LONG are guaranteed single item queries
-    int err = 0;
-    *(int32_t *)out = c->vv->varint_get32(&cp, (char *)b->data + b->uncomp_size, &err) + c->varint.offset;
+    endp = (char *)b->data + b->uncomp_size;
+    err = c->vv->varint_get32_array(&cp, endp, out_i, n);
     b->idx = cp - (char *)b->data;
-    *out_size = 1;
+    if (c->varint.offset)
+	for (i = 0; i < n; i++)
+	    out_i[i] += c->varint.offset;
 
     return err ? -1 : 0;
 }
 
 int cram_varint_decode_sint(cram_slice *slice, cram_codec *c,
 			      cram_block *in, char *out, int *out_size) {
-    char *cp;
+    int32_t *out_i = (int32_t *)out;
+    char *cp, *endp;
     cram_block *b;
+    int i, n = *out_size, err;
 
     /* Find the data block */
     b = cram_get_block_by_id(slice, c->varint.content_id);
@@ -649,19 +654,22 @@ int cram_varint_decode_sint(cram_slice *slice, cram_codec *c,
         return *out_size?-1:0;
 
     cp = (char *)b->data + b->idx;
-    // E_INT and E_LONG are guaranteed single item queries
-    int err = 0;
-    *(int32_t *)out = c->vv->varint_get32s(&cp, (char *)b->data + b->uncomp_size, &err) + c->varint.offset;
+    endp = (char *)b->data + b->uncomp_size;
+    err = c->vv->varint_get32s_array(&cp, endp, out_i, n);
     b->idx = cp - (char *)b->data;
-    *out_size = 1;
+    if (c->varint.offset)
+	for (i = 0; i < n; i++)
+	    out_i[i] += c->varint.offset;
 
     return err ? -1 : 0;
 }
 
 int cram_varint_decode_long(cram_slice *slice, cram_codec *c,
 			      cram_block *in, char *out, int *out_size) {
-    char *cp;
+    int64_t *out_i = (int64_t *)out;
+    char *cp, *endp;
     cram_block *b;
+    int i, n = *out_size, err;
 
     /* Find the data block */
     b = cram_get_block_by_id(slice, c->varint.content_id);
@@ -669,19 +677,22 @@ int cram_varint_decode_long(cram_slice *slice, cram_codec *c,
         return *out_size?-1:0;
 
     cp = (char *)b->data + b->idx;
-    // E_INT and E_LONG are guaranteed single item queries
-    int err = 0;
-    *(int64_t *)out = c->vv->varint_get64(&cp, (char *)b->data + b->uncomp_size, &err) + c->varint.offset;
+    endp = (char *)b->data + b->uncomp_size;
+    err = c->vv->varint_get64_array(&cp, endp, out_i, n);
     b->idx = cp - (char *)b->data;
-    *out_size = 1;
+    if (c->varint.offset)
+	for (i = 0; i < n; i++)
+	    out_i[i] += c->varint.offset;
 
     return err ? -1 : 0;
 }
 
 int cram_varint_decode_slong(cram_slice *slice, cram_codec *c,
 			       cram_block *in, char *out, int *out_size) {
-    char *cp;
+    int64_t *out_i = (int64_t *)out;
+    char *cp, *endp;
     cram_block *b;
+    int i, n = *out_size, err;
 
     /* Find the data block */
     b = cram_get_block_by_id(slice, c->varint.content_id);
@@ -689,11 +700,12 @@ int cram_varint_decode_slong(cram_slice *slice, cram_codec *c,
         return *out_size?-1:0;
 
     cp = (char *)b->data + b->idx;
-    // E_INT and E_LONG are guaranteed single item queries
-    int err = 0;
-    *(int64_t *)out = c->vv->varint_get64s(&cp, (char *)b->data + b->uncomp_size, &err) + c->varint.offset;
+    endp = (char *)b->data + b->uncomp_size;
+    err = c->vv->varint_get64s_array(&cp, endp, out_i, n);
     b->idx = cp - (char *)b->data;
-    *out_size = 1;
+    if (c->varint.offset)
+	for (i = 0; i < n; i++)
+	    out_i[i] += c->varint.offset;
 
     return err ? -1 : 0;
 }
@@ -1564,9 +1576,20 @@ int cram_xdelta_decode_long(cram_slice *slice, cram_codec *c, cram_block *in, ch
 }
 
 int cram_xdelta_decode_int(cram_slice *slice, cram_codec *c, cram_block *in, char *out, int *out_size) {
-    // Slow value-by-value method for now
     uint32_t *out32 = (uint32_t *)out;
     int i;
+
+    // Fetch all deltas in one go if the sub-codec permits it.
+    if (c->xdelta.sub_codec->decode_batch) {
+	if (c->xdelta.sub_codec->decode_batch(slice, c->xdelta.sub_codec, in,
+					      out, out_size) < 0)
+	    return -1;
+	for (i = 0; i < *out_size; i++)
+	    c->xdelta.last = out32[i] = unzigzag32(out32[i]) + c->xdelta.last;
+	return 0;
+    }
+
+    // Otherwise value-by-value
     for (i = 0; i < *out_size; i++) {
 	uint32_t v;
 	int one = 1;
@@ -2496,6 +2519,8 @@ void cram_huffman_decode_free(cram_codec *c) {
 
     if (c->huffman.codes)
 	free(c->huffman.codes);
+    if (c->huffman.lut)
+	free(c->huffman.lut);
     free(c);
 }
 
@@ -2518,37 +2543,65 @@ int cram_huffman_decode_char0(cram_slice *slice, cram_codec *c,
     return 0;
 }
 
-int cram_huffman_decode_char(cram_slice *slice, cram_codec *c,
-			     cram_block *in, char *out, int *out_size) {
-    int i, n, ncodes = c->huffman.ncodes;
-    const cram_huffman_code * const codes = c->huffman.codes;
+/*
+ * Decodes a single huffman symbol, returning its index into codes[].
+ *
+ * If enough input remains we peek at the next lut_bits bits and resolve
+ * the code in a single table lookup.  Otherwise, or for codes longer than
+ * lut_bits, we fall back to walking the canonical code table a bit at
+ * a time.
+ *
+ * Returns index on success;
+ *        -1 on failure
+ */
+static inline int cram_huffman_decode_idx(const cram_huffman_decoder *h,
+					  cram_block *in) {
+    const cram_huffman_code * const codes = h->codes;
+    int idx = 0, val = 0, len = 0, last_len = 0;
+
+    if (h->lut && in->byte + 2 < (size_t)in->uncomp_size) {
+	// 24-bit window; at most 7 bits used + HUFF_LUT_BITS fits.
+	const unsigned char *d = &in->data[in->byte];
+	uint32_t w = (d[0] << 16) | (d[1] << 8) | d[2];
+	int used = 7 - in->bit;
+	const cram_huffman_lut *l =
+	    &h->lut[(w >> (24 - used - h->lut_bits)) & ((1<<h->lut_bits)-1)];
+	if (l->len) {
+	    used += l->len;
+	    in->byte += used >> 3;
+	    in->bit = 7 - (used & 7);
+	    return l->idx;
+	}
+    }
 
-    for (i = 0, n = *out_size; i < n; i++) {
-	int idx = 0;
-	int val = 0, len = 0, last_len = 0;
+    for (;;) {
+	int dlen = codes[idx].len - last_len;
+	if (cram_not_enough_bits(in, dlen))
+	    return -1;
 
-	for (;;) {
-	    int dlen = codes[idx].len - last_len;
-	    if (cram_not_enough_bits(in, dlen))
-		return -1;
+	last_len = (len += dlen);
+	for (; dlen; dlen--) GET_BIT_MSB(in, val);
 
-	    //val <<= dlen;
-	    //val  |= get_bits_MSB(in, dlen);
-	    //last_len = (len += dlen);
+	idx = val - codes[idx].p;
+	if (idx >= h->ncodes || idx < 0)
+	    return -1;
 
-	    last_len = (len += dlen);
-	    for (; dlen; dlen--) GET_BIT_MSB(in, val);
+	if (codes[idx].code == val && codes[idx].len == len)
+	    return idx;
+    }
+}
 
-	    idx = val - codes[idx].p;
-	    if (idx >= ncodes || idx < 0)
-		return -1;
+int cram_huffman_decode_char(cram_slice *slice, cram_codec *c,
+			     cram_block *in, char *out, int *out_size) {
+    int i, n;
+    const cram_huffman_code * const codes = c->huffman.codes;
 
-	    if (codes[idx].code == val && codes[idx].len == len) {
-		if (out)
-		    out[i] = codes[idx].symbol;
-		break;
-	    }
-	}
+    for (i = 0, n = *out_size; i < n; i++) {
+	int idx = cram_huffman_decode_idx(&c->huffman, in);
+	if (idx < 0)
+	    return -1;
+	if (out)
+	    out[i] = codes[idx].symbol;
     }
 
     return 0;
@@ -2570,35 +2623,14 @@ int cram_huffman_decode_int0(cram_slice *slice, cram_codec *c,
 int cram_huffman_decode_int(cram_slice *slice, cram_codec *c,
 			    cram_block *in, char *out, int *out_size) {
     int32_t *out_i = (int32_t *)out;
-    int i, n, ncodes = c->huffman.ncodes;
+    int i, n;
     const cram_huffman_code * const codes = c->huffman.codes;
 
     for (i = 0, n = *out_size; i < n; i++) {
-	int idx = 0;
-	int val = 0, len = 0, last_len = 0;
-
-	// Now one bit at a time for remaining checks
-	for (;;) {
-	    int dlen = codes[idx].len - last_len;
-	    if (cram_not_enough_bits(in, dlen))
-		return -1;
-	    
-	    //val <<= dlen;
-	    //val  |= get_bits_MSB(in, dlen);
-	    //last_len = (len += dlen);
-
-	    last_len = (len += dlen);
-	    for (; dlen; dlen--) GET_BIT_MSB(in, val);
-
-	    idx = val - codes[idx].p;
-	    if (idx >= ncodes || idx < 0)
-		return -1;
-
-	    if (codes[idx].code == val && codes[idx].len == len) {
-		out_i[i] = codes[idx].symbol;
-		break;
-	    }
-	}
+	int idx = cram_huffman_decode_idx(&c->huffman, in);
+	if (idx < 0)
+	    return -1;
+	out_i[i] = codes[idx].symbol;
     }
 
     return 0;
@@ -2620,35 +2652,14 @@ int cram_huffman_decode_long0(cram_slice *slice, cram_codec *c,
 int cram_huffman_decode_long(cram_slice *slice, cram_codec *c,
 			     cram_block *in, char *out, int *out_size) {
     int64_t *out_i = (int64_t *)out;
-    int i, n, ncodes = c->huffman.ncodes;
+    int i, n;
     const cram_huffman_code * const codes = c->huffman.codes;
 
     for (i = 0, n = *out_size; i < n; i++) {
-	int idx = 0;
-	int val = 0, len = 0, last_len = 0;
-
-	// Now one bit at a time for remaining checks
-	for (;;) {
-	    int dlen = codes[idx].len - last_len;
-	    if (cram_not_enough_bits(in, dlen))
-		return -1;
-
-	    //val <<= dlen;
-	    //val  |= get_bits_MSB(in, dlen);
-	    //last_len = (len += dlen);
-
-	    last_len = (len += dlen);
-	    for (; dlen; dlen--) GET_BIT_MSB(in, val);
-
-	    idx = val - codes[idx].p;
-	    if (idx >= ncodes || idx < 0)
-		return -1;
-
-	    if (codes[idx].code == val && codes[idx].len == len) {
-		out_i[i] = codes[idx].symbol;
-		break;
-	    }
-	}
+	int idx = cram_huffman_decode_idx(&c->huffman, in);
+	if (idx < 0)
+	    return -1;
+	out_i[i] = codes[idx].symbol;
     }
 
     return 0;
@@ -2762,6 +2773,33 @@ cram_codec *cram_huffman_decode_init(cram_block_compression_hdr *hdr,
 	codes[i].p = j;
     }
 
+    /*
+     * Build the multi-bit lookup table.  Every lut_bits wide prefix of a
+     * code no longer than lut_bits maps directly to that code.  Codes are
+     * sorted by length, so we can stop at the first long one.  If we
+     * cannot allocate the table we just use the slow decoder instead.
+     */
+    h->huffman.lut_bits = MIN(max_len, HUFF_LUT_BITS);
+    if (h->huffman.lut_bits > 0 &&
+	(h->huffman.lut = calloc(1 << h->huffman.lut_bits,
+				 sizeof(*h->huffman.lut)))) {
+	int lut_bits = h->huffman.lut_bits;
+	for (i = 0; i < ncodes; i++) {
+	    int32_t k, shift = lut_bits - codes[i].len;
+	    if (codes[i].len <= 0)
+		continue;
+	    if (shift < 0)
+		break;
+	    if (codes[i].code < 0 || codes[i].code >= 1 << codes[i].len)
+		break; // malformed; leave for the slow path to reject
+	    for (k = codes[i].code << shift; k < (codes[i].code+1) << shift;
+		 k++) {
+		h->huffman.lut[k].idx = i;
+		h->huffman.lut[k].len = codes[i].len;
+	    }
+	}
+    }
+
 //    puts("==HUFF LEN==");
 //    for (i = 0; i <= last_len+1; i++) {
 //	printf("len %d=%d prefix %d\n", i, h->huffman.lengths[i], h->huffman.prefix[i]); 
@@ -3614,6 +3652,46 @@ static cram_codec *(*decode_init[])(cram_block_compression_hdr *hdr,
     cram_xdelta_decode_init,
 };
 
+/*
+ * Identifies which decode functions are able to return many values per
+ * call, permitting the caller to fetch an entire data series in one go.
+ * Integer EXTERNAL and VARINT, CONST, BETA and HUFFMAN all loop over
+ * *out_size.  XPACK and XRLE only expand whole blocks for byte data, and
+ * XDELTA is only a batch decoder when its own sub-codec is.
+ *
+ * Returns the batch decode function, or NULL if none.
+ */
+static int (*cram_decode_batch_func(cram_codec *c))
+    (cram_slice *, cram_codec *, cram_block *, char *, int *) {
+    if (c->decode == cram_external_decode_int  ||
+	c->decode == cram_external_decode_long ||
+	c->decode == cram_external_decode_char ||
+	c->decode == cram_varint_decode_int    ||
+	c->decode == cram_varint_decode_sint   ||
+	c->decode == cram_varint_decode_long   ||
+	c->decode == cram_varint_decode_slong  ||
+	c->decode == cram_const_decode_byte    ||
+	c->decode == cram_const_decode_int     ||
+	c->decode == cram_const_decode_long    ||
+	c->decode == cram_beta_decode_char     ||
+	c->decode == cram_beta_decode_int      ||
+	c->decode == cram_beta_decode_long     ||
+	c->decode == cram_huffman_decode_char0 ||
+	c->decode == cram_huffman_decode_char  ||
+	c->decode == cram_huffman_decode_int0  ||
+	c->decode == cram_huffman_decode_int   ||
+	c->decode == cram_huffman_decode_long0 ||
+	c->decode == cram_huffman_decode_long  ||
+	c->decode == cram_xpack_decode_char    ||
+	c->decode == cram_xrle_decode_char)
+	return c->decode;
+
+    if (c->decode == cram_xdelta_decode_int && c->xdelta.sub_codec->decode_batch)
+	return c->decode;
+
+    return NULL;
+}
+
 cram_codec *cram_decoder_init(cram_block_compression_hdr *hdr,
 			      enum cram_encoding codec,
 			      char *data, int size,
@@ -3624,6 +3702,7 @@ cram_codec *cram_decoder_init(cram_block_compression_hdr *hdr,
 	if (r) {
 	    r->vv = vv;
 	    r->codec_id = hdr->ncodecs++;
+	    r->decode_batch = cram_decode_batch_func(r);
 	}
 	return r;
     } else {
@@ -3690,8 +3769,10 @@ cram_codec *cram_encoder_init(enum cram_encoding codec,
 
     if (encode_init[codec]) {
 	cram_codec *r;
-	if ((r = encode_init[codec](st, codec, option, dat, version, vv)))
+	if ((r = encode_init[codec](st, codec, option, dat, version, vv))) {
 	    r->out = NULL;
+	    r->decode_batch = NULL;
+	}
 	if (!r) {
 	    fprintf(stderr, "Unable to initialise codec of type %s\n",
 		    cram_encoding2str(codec));
@@ -3717,6 +3798,7 @@ int cram_codec_to_id(cram_codec *c, int *id2) {
     case E_CONST_INT:
     case E_CONST_BYTE:
 	bnum1 = -2; // no blocks used
+	break;
 
     case E_HUFFMAN:
 	bnum1 = c->huffman.ncodes == 1 ? -2 : -1;
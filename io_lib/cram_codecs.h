@@ -62,10 +62,24 @@ typedef struct {
     int32_t len;
 } cram_huffman_code;
 
+/*
+ * Multi-bit lookup table for the huffman decoder.  We peek at the next
+ * lut_bits bits and index lut[] to get the code index and its length in
+ * one probe.  Entries with len 0 are prefixes of codes longer than
+ * lut_bits, which are handled by the bit-at-a-time code above.
+ */
+#define HUFF_LUT_BITS 10
+typedef struct {
+    int32_t idx;  // index into codes[]
+    int32_t len;  // code length, or 0 for "use slow path"
+} cram_huffman_lut;
+
 typedef struct {
     int ncodes;
     cram_huffman_code *codes;
     int option;
+    int lut_bits;
+    cram_huffman_lut *lut;
 } cram_huffman_decoder;
 
 #define MAX_HUFF 128
@@ -175,6 +189,12 @@ typedef struct cram_codec {
     void (*free)(struct cram_codec *codec);
     int (*decode)(cram_slice *slice, struct cram_codec *codec,
 		  cram_block *in, char *out, int *out_size);
+    /*
+     * As decode, but guaranteed to fill out all *out_size values in a
+     * single call.  NULL if the codec only supports one value at a time.
+     */
+    int (*decode_batch)(cram_slice *slice, struct cram_codec *codec,
+			cram_block *in, char *out, int *out_size);
     int (*encode)(cram_slice *slice, struct cram_codec *codec,
 		  char *in, int in_size);
     int (*store)(struct cram_codec *codec, cram_block *b, char *prefix,
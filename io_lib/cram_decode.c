@@ -133,12 +133,12 @@ int cram_decode_TD(cram_fd *fd, char *cp, const char *endp,
 }
 
 /*
- * Decodes a CRAM block compression header.
+ * Parses a CRAM block compression header, initialising all its codecs.
  * Returns header ptr on success
  *         NULL on failure
  */
-cram_block_compression_hdr *cram_decode_compression_header(cram_fd *fd,
-							   cram_block *b) {
+static cram_block_compression_hdr *cram_parse_compression_header(cram_fd *fd,
+								 cram_block *b) {
     char *cp, *endp, *cp_copy;
     cram_block_compression_hdr *hdr = calloc(1, sizeof(*hdr));
     int i, err = 0;
@@ -609,6 +609,185 @@ cram_block_compression_hdr *cram_decode_compression_header(cram_fd *fd,
     return hdr;
 }
 
+/*
+ * Returns whether codec c, or any codec nested within it, keeps decoder
+ * state in the codec itself between calls.  XRLE holds the current run
+ * and XDELTA the last value.  Such codecs cannot be shared between
+ * containers decoded concurrently, or even sequentially as the state
+ * carries over.
+ */
+static int cram_codec_has_state(cram_codec *c) {
+    if (!c)
+	return 0;
+
+    switch (c->codec) {
+    case E_XRLE:
+    case E_XDELTA:
+	return 1;
+
+    case E_XPACK:
+	return cram_codec_has_state(c->xpack.sub_codec);
+
+    case E_BYTE_ARRAY_LEN:
+	return cram_codec_has_state(c->byte_array_len.len_codec) ||
+	       cram_codec_has_state(c->byte_array_len.val_codec);
+
+    default:
+	return 0;
+    }
+}
+
+/*
+ * Returns whether any codec in hdr keeps decoder state; see
+ * cram_codec_has_state.
+ */
+static int cram_compression_header_has_state(cram_block_compression_hdr *hdr) {
+    cram_map *m;
+    int i;
+
+    for (i = 0; i < DS_END; i++)
+	if (cram_codec_has_state(hdr->codecs[i]))
+	    return 1;
+
+    for (i = 0; i < CRAM_MAP_HASH; i++)
+	for (m = hdr->tag_encoding_map[i]; m; m = m->next)
+	    if (cram_codec_has_state(m->codec))
+		return 1;
+
+    return 0;
+}
+
+/*
+ * Decodes a CRAM block compression header.
+ *
+ * Many files repeat the same compression header in every container, so
+ * the last few decoded headers are kept in fd->comp_hdr_cache, keyed
+ * on a hash of their raw bytes.  A repeat is returned with its
+ * reference count incremented rather than parsed and having its codecs
+ * initialised again.  The caller frees it with
+ * cram_free_compression_header as usual.
+ *
+ * CRAM 1.x stores container fields in this header, so it isn't cached.
+ * Nor are headers using codecs that hold decoder state, as those codecs
+ * would then be shared by concurrently decoded containers.
+ *
+ * Returns header ptr on success
+ *         NULL on failure
+ */
+cram_block_compression_hdr *cram_decode_compression_header(cram_fd *fd,
+							   cram_block *b) {
+    cram_block_compression_hdr *hdr;
+    cram_hdr_cache *hc;
+    uint64_t h;
+    int i;
+
+    if (IS_CRAM_1_VERS(fd))
+	return cram_parse_compression_header(fd, b);
+
+    if (b->method != RAW && cram_uncompress_block(b))
+	return NULL;
+
+    // Byte-wise, as JENKINS3 reads whole words past the end of the block
+    h = hash64(HASH_FUNC_JENKINS, b->data, b->uncomp_size);
+    for (i = 0; i < CRAM_HDR_CACHE_MAX; i++) {
+	hc = &fd->comp_hdr_cache[i];
+	if (hc->hdr && hc->hash == h && hc->size == b->uncomp_size &&
+	    memcmp(hc->data, b->data, hc->size) == 0) {
+	    cram_ref_compression_header(hc->hdr);
+	    return hc->hdr;
+	}
+    }
+
+    if (!(hdr = cram_parse_compression_header(fd, b)))
+	return NULL;
+
+    if (cram_compression_header_has_state(hdr))
+	return hdr; // uncached
+
+    // Replace the oldest entry
+    hc = &fd->comp_hdr_cache[fd->comp_hdr_next];
+    if (hc->hdr) {
+	cram_free_compression_header(hc->hdr);
+	hc->hdr = NULL;
+    }
+    if (hc->alloc < b->uncomp_size) {
+	char *d = realloc(hc->data, b->uncomp_size);
+	if (!d)
+	    return hdr; // uncached, but still usable
+	hc->data = d;
+	hc->alloc = b->uncomp_size;
+    }
+    memcpy(hc->data, b->data, b->uncomp_size);
+    hc->size = b->uncomp_size;
+    hc->hash = h;
+    hc->hdr = hdr;
+    fd->comp_hdr_next = (fd->comp_hdr_next + 1) % CRAM_HDR_CACHE_MAX;
+
+    // One reference held by the cache and one by the caller.
+    hdr->ref_count = 2;
+
+    return hdr;
+}
+
+
+static void *cram_uncompress_block_job(void *arg) {
+    // NULL on success, so a non-NULL result flags an error
+    return cram_uncompress_block((cram_block *)arg) ? arg : NULL;
+}
+
+/*
+ * Uncompresses the slice blocks marked in used[], or all blocks if
+ * used is NULL.
+ *
+ * The blocks are independent, so with a thread pool they are
+ * uncompressed in parallel as sub-jobs.  This is typically called from
+ * within a slice decoding job, so the calling thread participates too
+ * rather than blocking on the pool.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_uncompress_slice_blocks(cram_fd *fd, cram_slice *s,
+					int *used) {
+    t_results_queue *q;
+    t_pool_result *r;
+    int i, n = 0, err = 0;
+
+    for (i = 0; i < s->hdr->num_blocks; i++)
+	if (!used || used[i])
+	    n++;
+
+    if (!fd->pool || n < 2) {
+	for (i = 0; i < s->hdr->num_blocks; i++) {
+	    if ((!used || used[i]) && cram_uncompress_block(s->block[i]))
+		return -1;
+	}
+	return 0;
+    }
+
+    if (!(q = t_results_queue_init()))
+	return -1;
+
+    for (i = 0; i < s->hdr->num_blocks; i++) {
+	if (used && !used[i])
+	    continue;
+	if (t_pool_dispatch2(fd->pool, q, cram_uncompress_block_job,
+			     s->block[i], -1) < 0) {
+	    err = 1;
+	    break;
+	}
+    }
+
+    t_pool_flush_queue(fd->pool, q);
+    while ((r = t_pool_next_result(q))) {
+	if (r->data)
+	    err = 1;
+	t_pool_delete_result(r, 0);
+    }
+    t_results_queue_destroy(q);
+
+    return err ? -1 : 0;
+}
 
 /*
  * Note we also need to scan through the record encoding map to
@@ -688,24 +867,19 @@ int cram_dependent_data_series(cram_fd *fd,
 	if (fd->required_fields & SAM_RGAUX)
 	    s->data_series |= CRAM_RG | CRAM_BF;
 
-	// Always uncompress CORE block
-	if (cram_uncompress_block(s->block[0]))
-	    return -1;
     } else {
 	s->data_series = CRAM_ALL;
 
-	for (i = 0; i < s->hdr->num_blocks; i++) {
-	    if (cram_uncompress_block(s->block[i]))
-		return -1;
-	}
-
-	return 0;
+	return cram_uncompress_slice_blocks(fd, s, NULL);
     }
 
     block_used = calloc(s->hdr->num_blocks+1, sizeof(int));
     if (!block_used)
 	return -1;
 
+    // Always uncompress CORE block
+    block_used[0] = 1;
+
     do {
 	/*
 	 * Also set data_series based on code prerequisites. Eg if we need
@@ -772,10 +946,6 @@ int cram_dependent_data_series(cram_fd *fd,
 			if (s->block[j]->content_type == EXTERNAL &&
 			    s->block[j]->content_id == bnum1) {
 			    block_used[j] = 1;
-			    if (cram_uncompress_block(s->block[j])) {
-				free(block_used);
-				return -1;
-			    }
 			}
 		    }
 		    break;
@@ -818,10 +988,6 @@ int cram_dependent_data_series(cram_fd *fd,
 				if (s->block[j]->content_type == EXTERNAL &&
 				    s->block[j]->content_id == bnum1) {
 				    block_used[j] = 1;
-				    if (cram_uncompress_block(s->block[j])) {
-					free(block_used);
-					return -1;
-				    }
 				}
 			    }
 			    break;
@@ -930,8 +1096,9 @@ int cram_dependent_data_series(cram_fd *fd,
 	}
     } while (orig_ds != s->data_series);
 
+    i = cram_uncompress_slice_blocks(fd, s, block_used);
     free(block_used);
-    return 0;
+    return i;
 }
 
 /*
@@ -1005,6 +1172,55 @@ void cram_decode_estimate_sizes(cram_block_compression_hdr *hdr, cram_slice *s,
 }
 
 
+/*
+ * Returns whether codec c reads from either of blocks id1 or id2, as
+ * returned by cram_codec_to_id().
+ */
+static int cram_codec_uses_id(cram_codec *c, int id1, int id2) {
+    int bnum1, bnum2;
+
+    bnum1 = cram_codec_to_id(c, &bnum2);
+    return (bnum1 != -2 && (bnum1 == id1 || bnum1 == id2)) ||
+	   (bnum2 != -2 && (bnum2 == id1 || bnum2 == id2));
+}
+
+/*
+ * Checks whether data series ds can be decoded for all records in a slice
+ * with a single decode_batch call.  This requires a codec capable of it,
+ * and that the data it reads (external or CORE) is not interleaved with
+ * any other data series or tag.
+ *
+ * Returns 1 if so,
+ *         0 if not.
+ */
+static int cram_ds_batchable(cram_block_compression_hdr *hdr, int ds) {
+    cram_codec *cd = hdr->codecs[ds];
+    int i, id1, id2;
+
+    if (!cd || !cd->decode_batch)
+	return 0;
+
+    id1 = cram_codec_to_id(cd, &id2);
+    if (id1 == -2 && id2 == -2)
+	return 1;
+
+    for (i = 0; i < DS_END; i++) {
+	if (i != ds && hdr->codecs[i] &&
+	    cram_codec_uses_id(hdr->codecs[i], id1, id2))
+	    return 0;
+    }
+
+    for (i = 0; i < CRAM_MAP_HASH; i++) {
+	cram_map *m;
+	for (m = hdr->tag_encoding_map[i]; m; m = m->next) {
+	    if (m->codec && cram_codec_uses_id(m->codec, id1, id2))
+		return 0;
+	}
+    }
+
+    return 1;
+}
+
 /* ----------------------------------------------------------------------
  * CRAM slices
  */
@@ -1180,6 +1396,10 @@ cram_block_slice_hdr *cram_decode_slice_header(cram_fd *fd, cram_block *b) {
 	    } else {
 	        /* Add missing NUL termination */
 	        assert(cp == BLOCK_DATA(b) + b->uncomp_size);
+		if (cram_block_own_data(b) < 0) {
+		    cram_free_slice_header(hdr);
+		    return NULL;
+		}
 	        BLOCK_RESIZE(b, b->uncomp_size + 1);
 		cp = cp_end = BLOCK_DATA(b) + b->uncomp_size;
 		*cp = '\0';
@@ -2056,7 +2276,7 @@ static int cram_decode_aux_1_0(cram_container *c, cram_slice *s,
 // 1 for present and verbatim, and -pos for present as placeholder
 // (MD*, NM*) to be generated and filled out at offset +pos.
 static int cram_decode_aux(cram_fd *fd, cram_container *c, cram_slice *s,
-			   cram_block *blk, cram_record *cr,
+			   cram_block *blk, cram_record *cr, int32_t *TL_p,
 			   int *has_MD, int *has_NM) {
     int i, r = 0, out_sz = 1;
     int32_t TL = 0;
@@ -2069,9 +2289,13 @@ static int cram_decode_aux(cram_fd *fd, cram_container *c, cram_slice *s,
 	return 0;
     }
 
-    if (!c->comp_hdr->codecs[DS_TL]) return -1;
-    r |= c->comp_hdr->codecs[DS_TL]->decode(s, c->comp_hdr->codecs[DS_TL], blk,
-					    (char *)&TL, &out_sz);
+    if (TL_p) {
+	TL = *TL_p;
+    } else {
+	if (!c->comp_hdr->codecs[DS_TL]) return -1;
+	r |= c->comp_hdr->codecs[DS_TL]->decode(s, c->comp_hdr->codecs[DS_TL],
+						blk, (char *)&TL, &out_sz);
+    }
     if (r || TL < 0 || TL >= c->comp_hdr->nTL)
 	return -1;
 
@@ -2411,6 +2635,83 @@ static int cram_decode_tlen(cram_fd *fd, cram_container *c, cram_slice *s,
     return r;
 }
 
+/*
+ * Decodes up-front, for every record in the slice, those data series
+ * which hold exactly one value per record and which cram_ds_batchable()
+ * permits.  This avoids paying the codec dispatch and block lookup cost
+ * once per record.
+ *
+ * On return batch[DS_xx] points to an array of num_records values for
+ * each data series decoded here, or NULL if it should be decoded per
+ * record as usual.  The memory is owned by the slice.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+static int cram_decode_slice_batch(cram_fd *fd, cram_container *c,
+				   cram_slice *s, cram_block *blk,
+				   void **batch) {
+    static const int ds_id[] = {
+	DS_BF, DS_CF, DS_RI, DS_RL, DS_AP, DS_RG, DS_TL
+    };
+    const int nds = sizeof(ds_id)/sizeof(*ds_id);
+    uint32_t ds = s->data_series;
+    int i, nrec = s->hdr->num_records;
+    size_t sz[sizeof(ds_id)/sizeof(*ds_id)], total = 0;
+    char *cp;
+
+    for (i = 0; i < nds; i++) {
+	int want;
+
+	batch[ds_id[i]] = NULL;
+	sz[i] = 0;
+
+	// Must match the conditions used in cram_decode_slice.
+	switch (ds_id[i]) {
+	case DS_BF: want = ds & CRAM_BF; break;
+	case DS_CF: want = (ds & CRAM_CF) && !IS_CRAM_1_VERS(fd); break;
+	case DS_RI: want = (ds & CRAM_RI) && !IS_CRAM_1_VERS(fd)
+		        && s->hdr->ref_seq_id == -2; break;
+	case DS_RL: want = ds & CRAM_RL; break;
+	case DS_AP: want = ds & CRAM_AP; break;
+	case DS_RG: want = ds & CRAM_RG; break;
+	case DS_TL: want = (ds & (CRAM_TL|CRAM_aux)) && !IS_CRAM_1_VERS(fd);
+	    break;
+	default:    want = 0;
+	}
+
+	if (!want || !cram_ds_batchable(c->comp_hdr, ds_id[i]))
+	    continue;
+
+	sz[i] = (ds_id[i] == DS_AP && CRAM_MAJOR_VERS(fd->version) >= 4)
+	    ? sizeof(int64_t) : sizeof(int32_t);
+	total += sz[i] * nrec;
+    }
+
+    if (!total)
+	return 0;
+
+    if (!(cp = realloc(s->ds_batch, total)))
+	return -1;
+    s->ds_batch = cp;
+
+    for (i = 0; i < nds; i++) {
+	cram_codec *cd = c->comp_hdr->codecs[ds_id[i]];
+	int n = nrec;
+
+	if (!sz[i])
+	    continue;
+
+	if (cd->decode_batch(s, cd, blk, cp, &n) < 0 || n != nrec)
+	    return -1;
+
+	batch[ds_id[i]] = cp;
+	cp += sz[i] * nrec;
+    }
+
+    return 0;
+}
+
 /*
  * Decode an entire slice from container blocks. Fills out s->crecs[] array.
  * Returns 0 on success
@@ -2428,6 +2729,8 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
     int embed_ref;
     char **refs = NULL;
     uint32_t ds;
+    void *batch[DS_END];
+    int32_t *BF_b, *CF_b, *RI_b, *RL_b, *RG_b, *TL_b;
 
     if (cram_dependent_data_series(fd, c->comp_hdr, s) != 0)
 	return -1;
@@ -2611,6 +2914,18 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	    return -1;
     }
 
+    // Bulk decode the data series with one value per record.
+    if (cram_decode_slice_batch(fd, c, s, blk, batch) < 0) {
+	free(refs);
+	return -1;
+    }
+    BF_b = batch[DS_BF];
+    CF_b = batch[DS_CF];
+    RI_b = batch[DS_RI];
+    RL_b = batch[DS_RL];
+    RG_b = batch[DS_RG];
+    TL_b = batch[DS_TL];
+
 #define RETURN return printf("Fail to decode CRAM rec %d at %s:%d\n", rec, __FILE__, __LINE__),
     int last_ref_id = -9; // Arbitrary -ve marker for not-yet-set
     for (rec = 0; rec < s->hdr->num_records; rec++) {
@@ -2623,10 +2938,14 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 
 	out_sz = 1; /* decode 1 item */
 	if (ds & CRAM_BF) {
-	    if (!c->comp_hdr->codecs[DS_BF]) RETURN -1;
-	    r |= c->comp_hdr->codecs[DS_BF]
-		            ->decode(s, c->comp_hdr->codecs[DS_BF], blk,
-				     (char *)&bf, &out_sz);
+	    if (BF_b) {
+		bf = BF_b[rec];
+	    } else {
+		if (!c->comp_hdr->codecs[DS_BF]) RETURN -1;
+		r |= c->comp_hdr->codecs[DS_BF]
+		                ->decode(s, c->comp_hdr->codecs[DS_BF], blk,
+					 (char *)&bf, &out_sz);
+	    }
 	    if (r || bf < 0 ||
 		bf >= sizeof(fd->bam_flag_swap)/sizeof(*fd->bam_flag_swap))
 		RETURN -1;
@@ -2645,6 +2964,8 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 				 	 (char *)&cf, &out_sz);
 		if (r) RETURN -1;
 		cr->cram_flags = cf;
+	    } else if (CF_b) {
+		cf = cr->cram_flags = CF_b[rec];
 	    } else {
 		if (!c->comp_hdr->codecs[DS_CF]) RETURN -1;
 		r |= c->comp_hdr->codecs[DS_CF]
@@ -2659,11 +2980,15 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 
 	if (!IS_CRAM_1_VERS(fd) && ref_id == -2) {
 	    if (ds & CRAM_RI) {
-		if (!c->comp_hdr->codecs[DS_RI]) RETURN -1;
-		r |= c->comp_hdr->codecs[DS_RI]
-		                ->decode(s, c->comp_hdr->codecs[DS_RI], blk,
-					 (char *)&cr->ref_id, &out_sz);
-		if (r) RETURN -1;
+		if (RI_b) {
+		    cr->ref_id = RI_b[rec];
+		} else {
+		    if (!c->comp_hdr->codecs[DS_RI]) RETURN -1;
+		    r |= c->comp_hdr->codecs[DS_RI]
+			            ->decode(s, c->comp_hdr->codecs[DS_RI], blk,
+					     (char *)&cr->ref_id, &out_sz);
+		    if (r) RETURN -1;
+		}
 		if ((fd->required_fields & (SAM_SEQ|SAM_TLEN))
 		    && cr->ref_id >= 0
 		    && cr->ref_id != last_ref_id) {
@@ -2699,11 +3024,15 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	}
 
 	if (ds & CRAM_RL) {
-	    if (!c->comp_hdr->codecs[DS_RL]) RETURN -1;
-	    r |= c->comp_hdr->codecs[DS_RL]
-		            ->decode(s, c->comp_hdr->codecs[DS_RL], blk,
-				     (char *)&cr->len, &out_sz);
-	    if (r) RETURN r;
+	    if (RL_b) {
+		cr->len = RL_b[rec];
+	    } else {
+		if (!c->comp_hdr->codecs[DS_RL]) RETURN -1;
+		r |= c->comp_hdr->codecs[DS_RL]
+		                ->decode(s, c->comp_hdr->codecs[DS_RL], blk,
+					 (char *)&cr->len, &out_sz);
+		if (r) RETURN r;
+	    }
 	    if (cr->len < 0) {
 	        fprintf(stderr, "Read has negative length\n");
 		RETURN -1;
@@ -2711,8 +3040,13 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	}
 
 	if (ds & CRAM_AP) {
-	    if (!c->comp_hdr->codecs[DS_AP]) RETURN -1;
-	    if (CRAM_MAJOR_VERS(fd->version) < 4) {
+	    if (batch[DS_AP]) {
+		cr->apos = CRAM_MAJOR_VERS(fd->version) < 4
+		    ? ((int32_t *)batch[DS_AP])[rec]
+		    : ((int64_t *)batch[DS_AP])[rec];
+	    } else if (!c->comp_hdr->codecs[DS_AP]) {
+		RETURN -1;
+	    } else if (CRAM_MAJOR_VERS(fd->version) < 4) {
 		int32_t i32;
 		r |= c->comp_hdr->codecs[DS_AP]
 		                ->decode(s, c->comp_hdr->codecs[DS_AP], blk,
@@ -2732,11 +3066,15 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	}
 		    
 	if (ds & CRAM_RG) {
-	    if (!c->comp_hdr->codecs[DS_RG]) RETURN -1;
-	    r |= c->comp_hdr->codecs[DS_RG]
-		           ->decode(s, c->comp_hdr->codecs[DS_RG], blk,
-				    (char *)&cr->rg, &out_sz);
-	    if (r) RETURN r;
+	    if (RG_b) {
+		cr->rg = RG_b[rec];
+	    } else {
+		if (!c->comp_hdr->codecs[DS_RG]) RETURN -1;
+		r |= c->comp_hdr->codecs[DS_RG]
+		               ->decode(s, c->comp_hdr->codecs[DS_RG], blk,
+					(char *)&cr->rg, &out_sz);
+		if (r) RETURN r;
+	    }
 	    if (cr->rg == unknown_rg)
 		cr->rg = -1;
 	} else {
@@ -2901,7 +3239,9 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	if (IS_CRAM_1_VERS(fd))
 	    r |= cram_decode_aux_1_0(c, s, blk, cr);
 	else
-	    r |= cram_decode_aux(fd, c, s, blk, cr, &has_MD, &has_NM);
+	    r |= cram_decode_aux(fd, c, s, blk, cr,
+				 batch[DS_TL] ? &TL_b[rec] : NULL,
+				 &has_MD, &has_NM);
 	if (r) RETURN r;
 
 	/* Fake up dynamic string growth and appending */
@@ -3063,7 +3403,7 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
     // Possible future optimisation - check range query and don't
     // convert all reads to BAM.
 
-    if (fd->pool)
+    if (fd->pool && !s->no_bam_seq)
 	r |= bulk_cram_to_bam(bfd, fd, s);
 
     return r;
@@ -3093,6 +3433,9 @@ int cram_decode_slice_mt(cram_fd *fd, cram_container *c, cram_slice *s,
     cram_decode_job *j;
     int nonblock;
 
+    // Captured now, as the worker may run after the caller changes it.
+    s->no_bam_seq = fd->no_bam_seq;
+
     if (!fd->pool)
 	return cram_decode_slice(fd, c, s, bfd);
 
@@ -3246,6 +3589,241 @@ static int cram_to_bam(SAM_hdr *bfd, cram_fd *fd, cram_slice *s,
     return bam_idx + (aux - aux_orig);
 }
 
+/* ----------------------------------------------------------------------
+ * Multi-range queries.
+ *
+ * The ranges are sorted and processed in passes, each covering a run
+ * of ranges on one reference.  fd->range is set to span the pass and
+ * the decoder seeks to its start using the index as for CRAM_OPT_RANGE.
+ * Within a pass containers and slices lying between ranges are skipped
+ * without decoding.  A new pass, with another seek, is only started
+ * when the next range's first indexed slice begins after the current
+ * pass ends, so no slice is decoded twice.
+ */
+
+static int cram_range_item_cmp(const void *v1, const void *v2) {
+    const cram_range_item *r1 = v1, *r2 = v2;
+
+    // Unmapped data (-1) is at the end of the file
+    if (r1->r.refid != r2->r.refid)
+	return (unsigned)r1->r.refid < (unsigned)r2->r.refid ? -1 : 1;
+    if (r1->r.start != r2->r.start)
+	return r1->r.start < r2->r.start ? -1 : 1;
+    if (r1->r.end != r2->r.end)
+	return r1->r.end < r2->r.end ? -1 : 1;
+    return r1->idx - r2->idx;
+}
+
+/*
+ * Finds the ranges in the current pass that overlap start..end,
+ * storing their indices in hits if non-NULL.
+ *
+ * Returns the number of ranges found (at most 1 if hits is NULL).
+ */
+static int cram_range_overlap(cram_fd *fd, int64_t start, int64_t end,
+			      int *hits) {
+    cram_range_item *r = fd->ranges;
+    int lo = fd->range_lo, hi = fd->range_hi, n = 0;
+
+    // max_end is non-decreasing, so find the first range that may overlap
+    while (lo < hi) {
+	int mid = lo + (hi-lo)/2;
+	if (r[mid].max_end < start)
+	    lo = mid+1;
+	else
+	    hi = mid;
+    }
+
+    for (; lo < fd->range_hi && r[lo].r.start <= end; lo++) {
+	if (r[lo].r.end < start)
+	    continue;
+	if (!hits)
+	    return 1;
+	hits[n++] = r[lo].idx;
+    }
+
+    return n;
+}
+
+/*
+ * Returns true if data covering start..end on fd->range.refid can be
+ * skipped, either being before fd->range or falling between the ranges
+ * of a multi-range query.
+ */
+static int cram_range_skip(cram_fd *fd, int64_t start, int64_t end) {
+    if (end < fd->range.start)
+	return 1;
+
+    if (!fd->ranges || fd->range.refid == -1)
+	return 0;
+
+    return !cram_range_overlap(fd, start, end, NULL);
+}
+
+/*
+ * Records in fd->range_hits the ranges overlapped by cr.
+ *
+ * Returns the number of ranges hit.
+ */
+static int cram_range_hit(cram_fd *fd, cram_record *cr) {
+    int i;
+
+    fd->nrange_hits = 0;
+    if (cr->ref_id != fd->range.refid)
+	return 0;
+
+    if (fd->range.refid == -1) {
+	for (i = fd->range_lo; i < fd->range_hi; i++)
+	    fd->range_hits[fd->nrange_hits++] = fd->ranges[i].idx;
+	return fd->nrange_hits;
+    }
+
+    return fd->nrange_hits = cram_range_overlap(fd, cr->apos, cr->aend,
+						fd->range_hits);
+}
+
+/*
+ * Starts the next pass of a multi-range query, seeking to the first of
+ * its ranges.  Ranges on references absent from the index are skipped
+ * as they cannot contain data.
+ *
+ * Returns 0 on success;
+ *         1 if no ranges remain;
+ *        -1 on failure
+ */
+static int cram_range_next_pass(cram_fd *fd) {
+    cram_range_item *r = fd->ranges;
+    cram_range pass;
+    cram_index *e;
+    int i = fd->range_hi;
+
+    while (i < fd->nranges &&
+	   !cram_index_query(fd, r[i].r.refid, (int)r[i].r.start, NULL))
+	i++;
+
+    fd->range_lo = i;
+    if (i >= fd->nranges) {
+	fd->range_hi = i;
+	fd->eof = 1;
+	return 1;
+    }
+
+    pass = r[i++].r;
+    if (pass.refid == -1) {
+	pass.start = INT_MIN;
+	pass.end   = INT_MAX;
+    }
+
+    // Extend the pass while the next range's data starts within it
+    while (i < fd->nranges && r[i].r.refid == pass.refid) {
+	if (pass.refid != -1) {
+	    e = cram_index_query(fd, pass.refid, (int)r[i].r.start, NULL);
+	    if (e && e->start > pass.end)
+		break;
+	    if (pass.end < r[i].r.end)
+		pass.end = r[i].r.end;
+	}
+	i++;
+    }
+    fd->range_hi = i;
+
+    if (fd->ctr_mt && fd->ctr_mt != fd->ctr)
+	cram_free_container(fd->ctr_mt);
+    fd->ctr_mt = NULL;
+
+    if (cram_seek_to_refpos(fd, &pass) != 0)
+	return -1;
+
+    fd->range = pass;
+    fd->ooc = 0;
+    fd->eof = 0;
+
+    return 0;
+}
+
+/*
+ * Sets a multi-range query, replacing any existing range.  Records from
+ * subsequent cram_get_seq() or cram_get_bam_seq() calls are those
+ * overlapping at least one of the n ranges in r, with each returned
+ * once and in file order.  cram_range_hits() reports which ranges the
+ * last record overlapped.
+ *
+ * An index must have been loaded.  The ranges are copied, so r need not
+ * be sorted or remain valid.  Setting n to 0 clears the query.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_set_ranges(cram_fd *fd, cram_range *r, int n) {
+    int i;
+
+    free(fd->ranges);
+    free(fd->range_hits);
+    fd->ranges = NULL;
+    fd->range_hits = NULL;
+    fd->nranges = fd->nrange_hits = 0;
+    fd->range_lo = fd->range_hi = 0;
+
+    if (n <= 0) {
+	fd->range.refid = -2;
+	return 0;
+    }
+
+    if (!fd->index && !fd->index_bin) {
+	fprintf(stderr, "Multi-range queries require an index\n");
+	return -1;
+    }
+
+    if (!(fd->ranges = malloc(n * sizeof(*fd->ranges))) ||
+	!(fd->range_hits = malloc(n * sizeof(*fd->range_hits)))) {
+	free(fd->ranges);
+	fd->ranges = NULL;
+	return -1;
+    }
+    fd->nranges = n;
+
+    for (i = 0; i < n; i++) {
+	fd->ranges[i].r = r[i];
+	fd->ranges[i].idx = i;
+    }
+    qsort(fd->ranges, n, sizeof(*fd->ranges), cram_range_item_cmp);
+
+    for (i = 0; i < n; i++) {
+	cram_range_item *ri = &fd->ranges[i];
+	ri->max_end = ri->r.end;
+	if (i && ri[-1].r.refid == ri->r.refid && ri->max_end < ri[-1].max_end)
+	    ri->max_end = ri[-1].max_end;
+    }
+
+    fd->required_fields |= SAM_POS;
+
+    return cram_range_next_pass(fd) < 0 ? -1 : 0;
+}
+
+/*
+ * Returns the number of ranges of a multi-range query overlapped by the
+ * last record returned, setting *hits to their indices in the array
+ * given to cram_set_ranges().  The array is valid until the next record
+ * is fetched.
+ */
+int cram_range_hits(cram_fd *fd, int **hits) {
+    *hits = fd->range_hits;
+    return fd->ranges ? fd->nrange_hits : 0;
+}
+
+/*
+ * As cram_read_container, but treating the end of a shard opened with
+ * cram_shard_open() as the end of file.
+ */
+static cram_container *cram_read_shard_container(cram_fd *fd) {
+    if (fd->shard_end > 0 && CRAM_IO_TELLO(fd) >= fd->shard_end) {
+	fd->eof = 1;
+	return NULL;
+    }
+
+    return cram_read_container(fd);
+}
+
 /*
  * Here be dragons! The multi-threading code in this is crufty beyond belief.
  */
@@ -3260,7 +3838,7 @@ static cram_container *cram_first_slice(cram_fd *fd) {
     cram_container *c;
 
     do {
-	if (!(c = fd->ctr = cram_read_container(fd)))
+	if (!(c = fd->ctr = cram_read_shard_container(fd)))
 	    return NULL;
 	c->curr_slice_mt = c->curr_slice;
     } while (c->length == 0);
@@ -3275,12 +3853,13 @@ static cram_container *cram_first_slice(cram_fd *fd) {
 	while (c->ref_seq_id != -2 &&
 	       (c->ref_seq_id < fd->range.refid ||
 		(fd->range.refid >= 0 && c->ref_seq_id == fd->range.refid
-		 && c->ref_seq_start + c->ref_seq_span-1 < fd->range.start))) {
+		 && cram_range_skip(fd, c->ref_seq_start,
+				    c->ref_seq_start + c->ref_seq_span-1)))) {
 	    if (0 != cram_seek(fd, c->length, SEEK_CUR))
 		return NULL;
 	    cram_free_container(fd->ctr);
 	    do {
-		if (!(c = fd->ctr = cram_read_container(fd)))
+		if (!(c = fd->ctr = cram_read_shard_container(fd)))
 		    return NULL;
 	    } while (c->length == 0);
 	}
@@ -3366,7 +3945,7 @@ static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
 	    if (!c_next || c_next->curr_slice_mt == c_next->max_slice) {
 		// new container
 		for(;;) {
-		    if (!(c_next = cram_read_container(fd))) {
+		    if (!(c_next = cram_read_shard_container(fd))) {
 			if (fd->pool) {
 			    fd->ooc = 1;
 			    break;
@@ -3402,9 +3981,11 @@ static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
 			break;
 		    }
 
-		    // before start of range; skip to next container
-		    if (c_next->ref_seq_start + c_next->ref_seq_span-1 <
-			fd->range.start) {
+		    // before start of range or between ranges; skip to
+		    // next container
+		    if (cram_range_skip(fd, c_next->ref_seq_start,
+					c_next->ref_seq_start +
+					c_next->ref_seq_span-1)) {
 			c_next->curr_slice_mt = c_next->max_slice;
 			cram_seek(fd, c_next->length, SEEK_CUR);
 			cram_free_container(c_next);
@@ -3471,9 +4052,10 @@ static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
 		    break;
 		}
 
-		// before start of range; skip to next slice
-		if (s_next->hdr->ref_seq_start + s_next->hdr->ref_seq_span-1 <
-		    fd->range.start) {
+		// before start of range or between ranges; skip to next slice
+		if (cram_range_skip(fd, s_next->hdr->ref_seq_start,
+				    s_next->hdr->ref_seq_start +
+				    s_next->hdr->ref_seq_span-1)) {
 		    cram_free_slice(s_next);
 		    c_next->slice = s_next = NULL;
 		    continue;
@@ -3564,6 +4146,23 @@ static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
     return s_curr;
 }
 
+/*
+ * As cram_next_slice, but moving on to the next pass of a multi-range
+ * query when the current one is exhausted.
+ */
+static cram_slice *cram_next_range_slice(cram_fd *fd, cram_container **cp) {
+    cram_slice *s;
+
+    while (!(s = cram_next_slice(fd, cp))) {
+	if (!fd->ranges || !fd->eof || fd->range_hi >= fd->nranges)
+	    return NULL;
+	if (cram_range_next_pass(fd) != 0)
+	    return NULL;
+    }
+
+    return s;
+}
+
 /*
  * Read the next cram record and return it.
  * Note that to decode cram_record the caller will need to look up some data
@@ -3582,12 +4181,19 @@ cram_record *cram_get_seq(cram_fd *fd) {
 	if (c && c->slice && c->slice->curr_rec < c->slice->max_rec) {
 	    s = c->slice;
 	} else {
-	    if (!(s = cram_next_slice(fd, &c)))
+	    if (!(s = cram_next_range_slice(fd, &c)))
 		return NULL;
 	    continue; /* In case slice contains no records */
 	}
 
-	if (fd->range.refid != -2) {
+	if (fd->ranges) {
+	    // Slices may extend past the ranges; skip, but keep draining
+	    // them so the next pass starts with an empty decode queue.
+	    if (!cram_range_hit(fd, &s->crecs[s->curr_rec])) {
+		s->curr_rec++;
+		continue;
+	    }
+	} else if (fd->range.refid != -2) {
 	    if (fd->range.refid == -1 && s->crecs[s->curr_rec].ref_id != -1) {
 		// Special case when looking for unmapped blocks at end.
 		// If these are mixed in with mapped data (c->ref_id == -2)
@@ -3680,3 +4286,140 @@ int cram_get_bam_seq(cram_fd *fd, bam_seq_t **bam) {
 
     return cram_to_bam(fd->header, fd, s, cr, s->curr_rec-1, bam) >= 0 ? 0 : -1;
 }
+
+/*
+ * Read the next slice and return it in columnar form, with one array per
+ * field.  The slice is detached from fd and owned by the returned struct.
+ *
+ * Returns columns on success (free with cram_free_slice_columns)
+ *         NULL on EOF or failure
+ */
+cram_slice_columns *cram_get_slice_columns(cram_fd *fd) {
+    cram_slice_columns *cols;
+    cram_container *c;
+    cram_slice *s;
+    unsigned int rf = fd->required_fields;
+    size_t n;
+    char *x;
+    int i, no_bam_seq = fd->no_bam_seq;
+
+    // Slices queued for decode by this call need no bam_seq_t
+    // conversion.  Restored afterwards so cram_get_bam_seq is unaffected.
+    fd->no_bam_seq = 1;
+
+    do {
+	s = cram_next_range_slice(fd, &c);
+    } while (s && s->max_rec == 0);
+
+    fd->no_bam_seq = no_bam_seq;
+    if (!s)
+	return NULL;
+
+    // Take ownership of the slice, so the next call does not free it.
+    c->slice = NULL;
+
+    n = s->max_rec;
+    cols = malloc(round8(sizeof(*cols)) + n * (4*sizeof(int64_t) +
+						 14*sizeof(int32_t)));
+    if (!cols) {
+	cram_free_slice(s);
+	return NULL;
+    }
+
+    cols->s = s;
+    cols->nrec = n;
+    cols->record_counter = s->hdr->record_counter;
+
+    x = (char *)cols + round8(sizeof(*cols));
+    cols->pos         = (int64_t *)x; x += n * sizeof(int64_t);
+    cols->end         = (int64_t *)x; x += n * sizeof(int64_t);
+    cols->mate_pos    = (int64_t *)x; x += n * sizeof(int64_t);
+    cols->tlen        = (int64_t *)x; x += n * sizeof(int64_t);
+    cols->ref_id      = (int32_t *)x; x += n * sizeof(int32_t);
+    cols->flag        = (int32_t *)x; x += n * sizeof(int32_t);
+    cols->mapq        = (int32_t *)x; x += n * sizeof(int32_t);
+    cols->mate_ref_id = (int32_t *)x; x += n * sizeof(int32_t);
+    cols->rg          = (int32_t *)x; x += n * sizeof(int32_t);
+    cols->name_off    = (uint32_t *)x; x += n * sizeof(uint32_t);
+    cols->name_len    = (uint32_t *)x; x += n * sizeof(uint32_t);
+    cols->cigar_off   = (uint32_t *)x; x += n * sizeof(uint32_t);
+    cols->ncigar      = (uint32_t *)x; x += n * sizeof(uint32_t);
+    cols->seq_off     = (uint32_t *)x; x += n * sizeof(uint32_t);
+    cols->qual_off    = (uint32_t *)x; x += n * sizeof(uint32_t);
+    cols->seq_len     = (uint32_t *)x; x += n * sizeof(uint32_t);
+    cols->aux_off     = (uint32_t *)x; x += n * sizeof(uint32_t);
+    cols->aux_len     = (uint32_t *)x; x += n * sizeof(uint32_t);
+
+    cols->names = (char *)BLOCK_DATA(s->name_blk);
+    cols->cigar = s->cigar;
+    cols->seq   = (char *)BLOCK_DATA(s->seqs_blk);
+    cols->qual  = (char *)BLOCK_DATA(s->qual_blk);
+    cols->aux   = (char *)BLOCK_DATA(s->aux_blk);
+
+    for (i = 0; i < n; i++) {
+	cram_record *cr = &s->crecs[i];
+
+	cols->ref_id[i]      = cr->ref_id;
+	cols->flag[i]        = cr->flags;
+	cols->pos[i]         = cr->apos;
+	cols->end[i]         = cr->aend;
+	cols->mapq[i]        = cr->mqual;
+	cols->mate_ref_id[i] = cr->mate_ref_id;
+	cols->mate_pos[i]    = cr->mate_pos;
+	cols->tlen[i]        = cr->tlen;
+	cols->rg[i]          = cr->rg;
+
+	// Unnamed reads take their name from their mate, as in cram_to_bam.
+	if (!cr->name_len && cr->mate_line >= 0 && cr->mate_line < n) {
+	    cols->name_off[i] = s->crecs[cr->mate_line].name;
+	    cols->name_len[i] = s->crecs[cr->mate_line].name_len;
+	} else {
+	    cols->name_off[i] = cr->name;
+	    cols->name_len[i] = cr->name_len;
+	}
+
+	cols->cigar_off[i]   = cr->cigar;
+	cols->ncigar[i]      = cr->ncigar;
+	cols->seq_off[i]     = cr->seq;
+	cols->qual_off[i]    = cr->qual;
+	cols->seq_len[i]     = cr->len;
+	cols->aux_off[i]     = cr->aux;
+	cols->aux_len[i]     = cr->aux_size;
+    }
+
+    // Fields not decoded hold undefined values, so hide them.
+    if (!(rf & SAM_RNAME)) cols->ref_id = NULL;
+    if (!(rf & SAM_FLAG))  cols->flag = NULL;
+    if (!(rf & SAM_POS))   cols->pos = cols->end = NULL;
+    if (!(rf & SAM_MAPQ))  cols->mapq = NULL;
+    if (!(rf & SAM_RNEXT)) cols->mate_ref_id = NULL;
+    if (!(rf & SAM_PNEXT)) cols->mate_pos = NULL;
+    if (!(rf & SAM_TLEN))  cols->tlen = NULL;
+    if (!(rf & SAM_RGAUX)) cols->rg = NULL;
+    if (!(rf & SAM_QNAME))
+	cols->names = NULL, cols->name_off = cols->name_len = NULL;
+    if (!(rf & SAM_CIGAR))
+	cols->cigar = NULL, cols->cigar_off = cols->ncigar = NULL;
+    if (!(rf & SAM_SEQ))
+	cols->seq = NULL, cols->seq_off = NULL;
+    if (!(rf & SAM_QUAL))
+	cols->qual = NULL, cols->qual_off = NULL;
+    if (!(rf & (SAM_SEQ | SAM_QUAL)))
+	cols->seq_len = NULL;
+    if (!(rf & SAM_AUX))
+	cols->aux = NULL, cols->aux_off = cols->aux_len = NULL;
+
+    return cols;
+}
+
+/*
+ * Frees a cram_slice_columns struct and the slice it holds.
+ */
+void cram_free_slice_columns(cram_slice_columns *cols) {
+    if (!cols)
+	return;
+
+    if (cols->s)
+	cram_free_slice(cols->s);
+    free(cols);
+}
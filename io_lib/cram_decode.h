@@ -72,6 +72,55 @@ cram_record *cram_get_seq(cram_fd *fd);
  */
 int cram_get_bam_seq(cram_fd *fd, bam_seq_t **bam);
 
+/*! Sets a multi-range query.
+ *
+ * Subsequent cram_get_seq() and cram_get_bam_seq() calls return only
+ * records overlapping at least one of the n ranges in r, each once and
+ * in file order, with cram_range_hits() reporting which ranges were
+ * hit.  Ranges are sorted internally and nearby ones are served by a
+ * single seek, with no container decoded twice.  An index must already
+ * be loaded.  Setting n to 0 clears the query.
+ *
+ * This is also available as cram_set_option(fd, CRAM_OPT_RANGES, r, n).
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int cram_set_ranges(cram_fd *fd, cram_range *r, int n);
+
+/*! Reports the ranges hit by the last record of a multi-range query.
+ *
+ * *hits is set to an array of indices into the ranges passed to
+ * cram_set_ranges(), valid until the next record is read.
+ *
+ * @return
+ * Returns the number of ranges the last record overlapped.
+ */
+int cram_range_hits(cram_fd *fd, int **hits);
+
+/*! Read the next slice and return it in columnar form.
+ *
+ * This avoids constructing a bam_seq_t per record, instead returning
+ * parallel arrays of fields for every record in the slice, honouring
+ * CRAM_OPT_REQUIRED_FIELDS.  The slice is detached from fd, so the
+ * result remains valid until freed with cram_free_slice_columns().
+ *
+ * Note that when a range has been set with CRAM_OPT_RANGE or
+ * CRAM_OPT_RANGES, the slices returned are those overlapping the
+ * range(s) and records within them are not filtered.
+ *
+ * @return
+ * Returns columns on success;
+ *         NULL on EOF or failure (check fd->err)
+ */
+cram_slice_columns *cram_get_slice_columns(cram_fd *fd);
+
+/*! Frees a cram_slice_columns returned by cram_get_slice_columns(),
+ * along with its slice.
+ */
+void cram_free_slice_columns(cram_slice_columns *cols);
+
 
 /* ----------------------------------------------------------------------
  * Internal functions
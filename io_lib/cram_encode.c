@@ -773,6 +773,107 @@ static void squash_qual(cram_block *b) {
 }
 #endif
 
+/*
+ * A single block compression, as queued up by cram_compress_slice.
+ */
+typedef struct {
+    cram_fd *fd;
+    cram_slice *s;
+    cram_block *b;
+    cram_metrics *m;
+    int64_t method;
+    int level;
+} cram_compress_job;
+
+/*
+ * Queues block b for compression.  As with cram_compress_block, a block
+ * reachable via multiple data series is only compressed the first time.
+ */
+static void cram_compress_job_add(cram_compress_job *jobs, int *njobs,
+				  cram_block *b, cram_metrics *m,
+				  int64_t method, int level) {
+    int i;
+
+    if (!b)
+	return;
+
+    for (i = 0; i < *njobs; i++)
+	if (jobs[i].b == b)
+	    return;
+
+    jobs[*njobs].b = b;
+    jobs[*njobs].m = m;
+    jobs[*njobs].method = method;
+    jobs[*njobs].level = level;
+    (*njobs)++;
+}
+
+static void *cram_compress_job_run(void *arg) {
+    cram_compress_job *j = (cram_compress_job *)arg;
+
+    // NULL on success, so a non-NULL result flags an error
+    return cram_compress_block(j->fd, j->s, j->b, j->m, j->method, j->level)
+	? arg : NULL;
+}
+
+// Largest first, as these are most likely to be on the critical path.
+static int cram_compress_job_cmp(const void *a, const void *b) {
+    const cram_compress_job *ja = a, *jb = b;
+    return (jb->b->uncomp_size > ja->b->uncomp_size)
+	-  (jb->b->uncomp_size < ja->b->uncomp_size);
+}
+
+/*
+ * Compresses the queued blocks.  With a thread pool each block, along
+ * with any trial compressions its metrics request, is a separate job.
+ * We are typically already running within a container encoding job, so
+ * wait using t_pool_flush_queue to avoid deadlocking a busy pool.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_compress_jobs_run(cram_fd *fd, cram_slice *s,
+				  cram_compress_job *jobs, int njobs) {
+    t_results_queue *q;
+    t_pool_result *r;
+    int i, err = 0;
+
+    for (i = 0; i < njobs; i++) {
+	jobs[i].fd = fd;
+	jobs[i].s  = s;
+    }
+
+    if (!fd->pool || njobs < 2) {
+	for (i = 0; i < njobs; i++)
+	    if (cram_compress_job_run(&jobs[i]))
+		return -1;
+	return 0;
+    }
+
+    qsort(jobs, njobs, sizeof(*jobs), cram_compress_job_cmp);
+
+    if (!(q = t_results_queue_init()))
+	return -1;
+
+    for (i = 0; i < njobs; i++) {
+	if (t_pool_dispatch2(fd->pool, q, cram_compress_job_run,
+			     &jobs[i], -1) < 0) {
+	    err = 1;
+	    break;
+	}
+    }
+
+    t_pool_flush_queue(fd->pool, q);
+    while ((r = t_pool_next_result(q))) {
+	if (r->data)
+	    err = 1;
+	t_pool_delete_result(r, 0);
+    }
+    t_results_queue_destroy(q);
+
+    return err ? -1 : 0;
+}
+
 /*
  * Applies various compression methods to specific blocks, depending on
  * known observations of how data series compress.
@@ -785,12 +886,21 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
     int64_t method = 1<<GZIP | 1<<GZIP_RLE, methodF = method, qmethod, qmethodF;
     int v31_or_above = (fd->version >= (3<<8)+1);
 
+    cram_compress_job *jobs;
+    int njobs = 0;
+
+    // Every block can appear at most once.
+    jobs = malloc((s->hdr->num_blocks + s->naux_block + DS_END)
+		  * sizeof(*jobs));
+    if (!jobs)
+	return -1;
+
     /* Compress the CORE Block too, with minimal zlib level */
     if (level > 5 && s->block[0]->uncomp_size > 500)
 #ifdef HAVE_ZSTD
-	cram_compress_block(fd, s, s->block[0], NULL, 1<<ZSTD, 3);
+	cram_compress_job_add(jobs, &njobs, s->block[0], NULL, 1<<ZSTD, 3);
 #else
-	cram_compress_block(fd, s, s->block[0], NULL, 1<<GZIP, 1);
+	cram_compress_job_add(jobs, &njobs, s->block[0], NULL, 1<<GZIP, 1);
 #endif
 
     if (fd->use_bz2)
@@ -894,55 +1004,44 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
 
 
     /* Specific compression methods for certain block types */
-    if (cram_compress_block(fd, s, s->block[DS_IN], fd->m[DS_IN], //IN (seq)
-			    method, level))
-	return -1;
+    cram_compress_job_add(jobs, &njobs, s->block[DS_IN], fd->m[DS_IN], // seq
+			  method, level);
 
     if (fd->level == 0) {
 	/* Do nothing */
     } else if (fd->level == 1) {
-	if (cram_compress_block(fd, s, s->block[DS_QS], fd->m[DS_QS],
-				qmethodF, 1))
-	    return -1;
+	cram_compress_job_add(jobs, &njobs, s->block[DS_QS], fd->m[DS_QS],
+			      qmethodF, 1);
 	for (i = DS_aux; i <= DS_aux_oz; i++) {
 	    if (s->block[i])
-		if (cram_compress_block(fd, s, s->block[i], fd->m[i],
-					method, 1))
-		    return -1;
+		cram_compress_job_add(jobs, &njobs, s->block[i], fd->m[i],
+				      method, 1);
 	}
     } else if (fd->level <= 3) {
-	if (cram_compress_block(fd, s, s->block[DS_QS], fd->m[DS_QS],
-				qmethod, 1))
-	    return -1;
-	if (cram_compress_block(fd, s, s->block[DS_BA], fd->m[DS_BA],
-				method, 1))
-	    return -1;
+	cram_compress_job_add(jobs, &njobs, s->block[DS_QS], fd->m[DS_QS],
+			      qmethod, 1);
+	cram_compress_job_add(jobs, &njobs, s->block[DS_BA], fd->m[DS_BA],
+			      method, 1);
 	if (s->block[DS_BB])
-	    if (cram_compress_block(fd, s, s->block[DS_BB], fd->m[DS_BB],
-				    method, 1))
-	    return -1;
+	    cram_compress_job_add(jobs, &njobs, s->block[DS_BB], fd->m[DS_BB],
+				  method, 1);
 	for (i = DS_aux; i <= DS_aux_oz; i++) {
 	    if (s->block[i])
-		if (cram_compress_block(fd, s, s->block[i], fd->m[i],
-					method, level))
-		    return -1;
+		cram_compress_job_add(jobs, &njobs, s->block[i], fd->m[i],
+				      method, level);
 	}
     } else {
-	if (cram_compress_block(fd, s, s->block[DS_QS], fd->m[DS_QS],
-				qmethod, level))
-	    return -1;
-	if (cram_compress_block(fd, s, s->block[DS_BA], fd->m[DS_BA],
-				method, level))
-	    return -1;
+	cram_compress_job_add(jobs, &njobs, s->block[DS_QS], fd->m[DS_QS],
+			      qmethod, level);
+	cram_compress_job_add(jobs, &njobs, s->block[DS_BA], fd->m[DS_BA],
+			      method, level);
 	if (s->block[DS_BB])
-	    if (cram_compress_block(fd, s, s->block[DS_BB], fd->m[DS_BB],
-				    method, level))
-	    return -1;
+	    cram_compress_job_add(jobs, &njobs, s->block[DS_BB], fd->m[DS_BB],
+				  method, level);
 	for (i = DS_aux; i <= DS_aux_oz; i++) {
 	    if (s->block[i])
-		if (cram_compress_block(fd, s, s->block[i], fd->m[i],
-					method, level))
-		    return -1;
+		cram_compress_job_add(jobs, &njobs, s->block[i], fd->m[i],
+				      method, level);
 	}
     }
 
@@ -951,15 +1050,13 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
     int method_rn = method & ~(method_rans | method_ranspr | 1<<GZIP_RLE);
     if (fd->version >= (3<<8)+1 && fd->use_tok && level > 1)
 	method_rn |= fd->use_arith ? (1<<NAME_TOKA) : (1<<NAME_TOK3);
-    if (cram_compress_block(fd, s, s->block[DS_RN], fd->m[DS_RN],
-			    method_rn, level))
-	return -1;
+    cram_compress_job_add(jobs, &njobs, s->block[DS_RN], fd->m[DS_RN],
+			  method_rn, level);
 
     // NS shows strong local correlation as rearrangements are localised
     if (s->block[DS_NS] && s->block[DS_NS] != s->block[0])
-	if (cram_compress_block(fd, s, s->block[DS_NS], fd->m[DS_NS],
-				method, level))
-	    return -1;
+	cram_compress_job_add(jobs, &njobs, s->block[DS_NS], fd->m[DS_NS],
+			      method, level);
 
     /*
      * Compress any auxiliary tags with their own per-tag metrics
@@ -981,9 +1078,8 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
 		// m2 |= (1<<BZIP2); // approx 30% slower and 6% smaller
 		if (m2 & (1<<BZIP2)) ml = 1;
 	    }
-	    if (cram_compress_block(fd, s, s->aux_block[i], s->aux_block[i]->m,
-				    m2, ml))
-		return -1;
+	    cram_compress_job_add(jobs, &njobs, s->aux_block[i],
+				  s->aux_block[i]->m, m2, ml);
 	}
     }
 
@@ -999,13 +1095,15 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
 	    if (s->block[i]->method != RAW)
 		continue;
 
-	    if (cram_compress_block(fd, s, s->block[i], fd->m[i],
-				    methodF, level))
-		return -1;
+	    cram_compress_job_add(jobs, &njobs, s->block[i], fd->m[i],
+				  methodF, level);
 	}
     }
 
-    return 0;
+    i = cram_compress_jobs_run(fd, s, jobs, njobs);
+    free(jobs);
+
+    return i;
 }
 
 /*
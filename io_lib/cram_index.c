@@ -55,6 +55,11 @@
  * earlier as it is sorted) range will be held within it. This ensures that
  * the outer list will never have containments and we can safely do a
  * binary search to find the first range which overlaps any given coordinate.
+ *
+ * Large indices are slow to parse, so the same data may also be stored
+ * in a binary sidecar (foo.cram.crbi, see cram_index_write_bin).  When
+ * present and not older than the .crai and .cram files this is memory
+ * mapped instead and searched directly.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -71,10 +76,16 @@
 #include <sys/stat.h>
 #include <math.h>
 #include <ctype.h>
+#include <limits.h>
+#if defined(HAVE_MMAP) && defined(HAVE_FILENO) && defined(HAVE_FSTAT)
+#include <sys/mman.h>
+#define CRAM_INDEX_MMAP
+#endif
 
 #include "io_lib/cram.h"
 #include "io_lib/os.h"
 #include "io_lib/zfio.h"
+#include "io_lib/dstring.h"
 
 #if 0
 static void dump_index_(cram_index *e, int level) {
@@ -246,21 +257,118 @@ int cram_index_load_via_callbacks(
 }
 #endif
 
+/*
+ * Loads fn.crbi, if present, valid and up to date.
+ *
+ * Returns 0 for success
+ *        -1 for failure (leaving fd->index_bin as NULL)
+ */
+static int cram_index_load_bin(cram_fd *fd, char const *fn) {
+    char fn2[PATH_MAX];
+    struct stat sb, sb2;
+    cram_index_bin *b;
+    const cram_index_bin_hdr *h;
+    FILE *fp;
+    size_t sz;
+    uint32_t i;
+
+    if (strlen(fn) > PATH_MAX-6)
+	return -1;
+
+    sprintf(fn2, "%s.crbi", fn);
+    if (stat(fn2, &sb) != 0)
+	return -1;
+
+    /* Ignore if older than the file or text index it describes */
+    if (stat(fn, &sb2) == 0 && sb2.st_mtime > sb.st_mtime)
+	return -1;
+    sprintf(fn2, "%s.crai", fn);
+    if (stat(fn2, &sb2) == 0 && sb2.st_mtime > sb.st_mtime)
+	return -1;
+
+    sprintf(fn2, "%s.crbi", fn);
+    if (!(fp = fopen(fn2, "rb")))
+	return -1;
+
+    if (!(b = calloc(1, sizeof(*b)))) {
+	fclose(fp);
+	return -1;
+    }
+
+#ifdef CRAM_INDEX_MMAP
+    if (fstat(fileno(fp), &sb) == 0 && sb.st_size > 0) {
+	b->size = sb.st_size;
+	b->data = mmap(NULL, b->size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	if (b->data == MAP_FAILED)
+	    b->data = NULL;
+	else
+	    b->mapped = 1;
+    }
+#endif
+
+    if (!b->data) {
+	b->size = sb.st_size;
+	if (!(b->data = malloc(b->size + 1)) ||
+	    b->size != fread(b->data, 1, b->size, fp))
+	    goto err;
+    }
+    fclose(fp);
+    fp = NULL;
+
+    /* Validate the layout before trusting any of it */
+    h = (const cram_index_bin_hdr *)b->data;
+    if (b->size < sizeof(*h) ||
+	memcmp(h->magic, CRAM_INDEX_BIN_MAGIC, 4) != 0 ||
+	h->byte_order != CRAM_INDEX_BIN_ORDER ||
+	h->version != CRAM_INDEX_BIN_VERSION)
+	goto err;
+
+    sz = b->size - sizeof(*h);
+    if (h->nref > sz / sizeof(cram_index_bin_ref))
+	goto err;
+    sz -= h->nref * sizeof(cram_index_bin_ref);
+    if (h->nentry != sz / sizeof(cram_index_bin_entry) ||
+	sz % sizeof(cram_index_bin_entry) != 0)
+	goto err;
+
+    b->hdr   = h;
+    b->ref   = (const cram_index_bin_ref *)(h+1);
+    b->entry = (const cram_index_bin_entry *)(b->ref + h->nref);
+
+    for (i = 0; i < h->nref; i++) {
+	if (b->ref[i].first > h->nentry ||
+	    b->ref[i].count > h->nentry - b->ref[i].first)
+	    goto err;
+    }
+
+    fd->index_bin = b;
+    return 0;
+
+ err:
+    fprintf(stderr, "Ignoring malformed binary index %s\n", fn2);
+    if (fp)
+	fclose(fp);
+#ifdef CRAM_INDEX_MMAP
+    if (b->mapped)
+	munmap(b->data, b->size);
+    else
+#endif
+	free(b->data);
+    free(b);
+    return -1;
+}
+
 /*
  * Loads a CRAM .crai index into memory.
  *
  * Returns 0 for success
  *        -1 for failure
  */
-int cram_index_load(cram_fd *fd, char const *fn) {
+static int cram_index_load_crai(cram_fd *fd, char const *fn) {
     zfp *fp = NULL;
     char fn2[PATH_MAX];
     int r = -1;
     
-    /* Check if already loaded */
-    if (fd->index)
-	return 0;
-
     /* copy filename */
     sprintf(fn2, "%s.crai", fn);
     
@@ -277,6 +385,156 @@ int cram_index_load(cram_fd *fd, char const *fn) {
     return r;
 }
 
+/*
+ * Loads a CRAM index into memory, preferring an up to date binary
+ * fn.crbi over the text fn.crai.
+ *
+ * Returns 0 for success
+ *        -1 for failure
+ */
+int cram_index_load(cram_fd *fd, char const *fn) {
+    /* Check if already loaded */
+    if (fd->index || fd->index_bin)
+	return 0;
+
+    if (cram_index_load_bin(fd, fn) == 0)
+	return 0;
+
+    return cram_index_load_crai(fd, fn);
+}
+
+/* Counts slices held in a containment list, recursively */
+static uint64_t cram_index_count(cram_index *e) {
+    uint64_t n = e->nslice;
+    int i;
+
+    for (i = 0; i < e->nslice; i++)
+	n += cram_index_count(&e->e[i]);
+
+    return n;
+}
+
+/* Flattens a containment list into an array of binary entries */
+static void cram_index_flatten(cram_index *e, cram_index_bin_entry **ep) {
+    int i;
+
+    for (i = 0; i < e->nslice; i++) {
+	cram_index_bin_entry *b = (*ep)++;
+	b->offset  = e->e[i].offset;
+	b->start   = e->e[i].start;
+	b->end     = e->e[i].end;
+	b->max_end = 0;
+	b->slice   = e->e[i].slice;
+	b->len     = e->e[i].len;
+	b->unused  = 0;
+	cram_index_flatten(&e->e[i], ep);
+    }
+}
+
+static int cram_index_bin_entry_cmp(const void *v1, const void *v2) {
+    const cram_index_bin_entry *e1 = v1, *e2 = v2;
+
+    if (e1->start != e2->start)
+	return e1->start < e2->start ? -1 : 1;
+    if (e1->offset != e2->offset)
+	return e1->offset < e2->offset ? -1 : 1;
+    return e1->slice - e2->slice;
+}
+
+/*
+ * Writes a binary index, fn.crbi, for use by subsequent
+ * cram_index_load calls.  This is built from the index already loaded
+ * in fd, or otherwise from fn.crai.  A trailing ".crai" on fn is
+ * ignored.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_index_write_bin(cram_fd *fd, const char *fn) {
+    char base[PATH_MAX], fn2[PATH_MAX];
+    cram_index_bin_hdr h;
+    cram_index_bin_ref *ref = NULL;
+    cram_index_bin_entry *entry = NULL, *ep;
+    FILE *fp = NULL;
+    size_t len;
+    int i, ret = -1;
+
+    if ((len = strlen(fn)) > PATH_MAX-6)
+	return -1;
+    strcpy(base, fn);
+    if (len >= 5 && strcmp(&base[len-5], ".crai") == 0)
+	base[len-5] = 0;
+    sprintf(fn2, "%s.crbi", base);
+
+    if (!fd->index && !fd->index_bin && cram_index_load_crai(fd, base) != 0)
+	return -1;
+
+    if (!(fp = fopen(fn2, "wb"))) {
+	perror(fn2);
+	return -1;
+    }
+
+    /* Already binary, so just copy it */
+    if (!fd->index) {
+	if (fd->index_bin->size != fwrite(fd->index_bin->data, 1,
+					  fd->index_bin->size, fp))
+	    goto err;
+	goto done;
+    }
+
+    memcpy(h.magic, CRAM_INDEX_BIN_MAGIC, 4);
+    h.byte_order = CRAM_INDEX_BIN_ORDER;
+    h.version    = CRAM_INDEX_BIN_VERSION;
+    h.nref       = fd->index_sz;
+    h.nentry     = 0;
+
+    if (!(ref = calloc(fd->index_sz, sizeof(*ref))))
+	goto err;
+    for (i = 0; i < fd->index_sz; i++) {
+	ref[i].first = h.nentry;
+	ref[i].count = cram_index_count(&fd->index[i]);
+	h.nentry += ref[i].count;
+    }
+
+    if (!(entry = malloc((h.nentry ? h.nentry : 1) * sizeof(*entry))))
+	goto err;
+
+    for (ep = entry, i = 0; i < fd->index_sz; i++) {
+	cram_index_bin_entry *e = entry + ref[i].first;
+	uint64_t j;
+	int32_t max_end = INT_MIN;
+
+	cram_index_flatten(&fd->index[i], &ep);
+	qsort(e, ref[i].count, sizeof(*e), cram_index_bin_entry_cmp);
+
+	for (j = 0; j < ref[i].count; j++) {
+	    if (max_end < e[j].end)
+		max_end = e[j].end;
+	    e[j].max_end = max_end;
+	}
+    }
+
+    if (1 != fwrite(&h, sizeof(h), 1, fp) ||
+	fd->index_sz != fwrite(ref, sizeof(*ref), fd->index_sz, fp) ||
+	h.nentry != fwrite(entry, sizeof(*entry), h.nentry, fp))
+	goto err;
+
+ done:
+    ret = 0;
+
+ err:
+    if (fclose(fp) != 0)
+	ret = -1;
+    if (ret != 0) {
+	perror(fn2);
+	remove(fn2);
+    }
+    free(ref);
+    free(entry);
+
+    return ret;
+}
+
 static void cram_index_free_recurse(cram_index *e) {
     if (e->e) {
 	int i;
@@ -290,6 +548,22 @@ static void cram_index_free_recurse(cram_index *e) {
 void cram_index_free(cram_fd *fd) {
     int i;
 
+    if (fd->index_bin) {
+	if (fd->index_bin->node) {
+	    for (i = 0; i < fd->index_bin->hdr->nref; i++)
+		free(fd->index_bin->node[i].e);
+	    free(fd->index_bin->node);
+	}
+#ifdef CRAM_INDEX_MMAP
+	if (fd->index_bin->mapped)
+	    munmap(fd->index_bin->data, fd->index_bin->size);
+	else
+#endif
+	    free(fd->index_bin->data);
+	free(fd->index_bin);
+	fd->index_bin = NULL;
+    }
+
     if (!fd->index)
 	return;
     
@@ -301,6 +575,79 @@ void cram_index_free(cram_fd *fd) {
     fd->index = NULL;
 }
 
+/*
+ * Returns the cram_index node for refid in a binary index, holding the
+ * reference's slices as its children.  These are only built when the
+ * reference is first queried, so opening a large index stays cheap.
+ *
+ * Returns the cram_index pointer on success
+ *         NULL on failure
+ */
+static cram_index *cram_index_bin_node(cram_fd *fd, int refid) {
+    cram_index_bin *b = fd->index_bin;
+    const cram_index_bin_entry *e;
+    cram_index *n;
+    uint64_t i;
+
+    if (refid+1 < 0 || refid+1 >= b->hdr->nref)
+	return NULL;
+
+    if (!b->node && !(b->node = calloc(b->hdr->nref, sizeof(*b->node))))
+	return NULL;
+
+    n = &b->node[refid+1];
+    if (n->e || !b->ref[refid+1].count)
+	return n;
+
+    if (!(n->e = calloc(b->ref[refid+1].count, sizeof(*n->e))))
+	return NULL;
+    n->nslice = n->nalloc = b->ref[refid+1].count;
+    n->refid  = refid;
+
+    e = b->entry + b->ref[refid+1].first;
+    for (i = 0; i < b->ref[refid+1].count; i++) {
+	n->e[i].refid  = refid;
+	n->e[i].start  = e[i].start;
+	n->e[i].end    = e[i].end;
+	n->e[i].slice  = e[i].slice;
+	n->e[i].len    = e[i].len;
+	n->e[i].offset = e[i].offset;
+    }
+
+    return n;
+}
+
+/*
+ * cram_index_query for a binary index.  Entries are sorted by start
+ * with a non-decreasing max_end, so the first slice whose max_end
+ * reaches pos is the first to overlap it.
+ */
+static cram_index *cram_index_query_bin(cram_fd *fd, int refid, int pos) {
+    cram_index_bin *b = fd->index_bin;
+    const cram_index_bin_entry *e;
+    cram_index *n;
+    uint64_t lo, hi;
+
+    if (!(n = cram_index_bin_node(fd, refid)) || !n->e)
+	return NULL;
+
+    e = b->entry + b->ref[refid+1].first;
+    lo = 0, hi = n->nslice;
+    while (lo < hi) {
+	uint64_t mid = lo + (hi-lo)/2;
+	if (e[mid].max_end < pos)
+	    lo = mid+1;
+	else
+	    hi = mid;
+    }
+
+    // Nothing overlaps, so return the last slice as the text index does
+    if (lo == n->nslice)
+	lo--;
+
+    return &n->e[lo];
+}
+
 /*
  * Searches the index for the first slice overlapping a reference ID
  * and position, or one immediately preceding it if none is found in
@@ -320,11 +667,14 @@ cram_index *cram_index_query(cram_fd *fd, int refid, int pos,
     int i, j, k;
     cram_index *e;
 
-    if (refid+1 < 0 || refid+1 >= fd->index_sz)
-	return NULL;
+    if (fd->index_bin && !from)
+	return cram_index_query_bin(fd, refid, pos);
 
-    if (!from)
+    if (!from) {
+	if (refid+1 < 0 || refid+1 >= fd->index_sz)
+	    return NULL;
 	from = &fd->index[refid+1];
+    }
 
     // Ref with nothing aligned against it.
     if (!from->e)
@@ -332,7 +682,7 @@ cram_index *cram_index_query(cram_fd *fd, int refid, int pos,
 
     // This sequence is covered by the index, so binary search to find
     // the optimal starting block.
-    i = 0, j = fd->index[refid+1].nslice-1;
+    i = 0, j = from->nslice-1;
     for (k = j/2; k != i; k = (j-i)/2 + i) {
 	if (from->e[k].refid > refid) {
 	    j = k;
@@ -439,6 +789,477 @@ int cram_seek_to_refpos(cram_fd *fd, cram_range *r) {
     return 0;
 }
 
+/*
+ * A container as seen by the index, used when sharding.  extent is
+ * the furthest slice end from the container start.
+ */
+typedef struct {
+    int64_t offset;
+    int64_t extent;
+    int refid;
+    int64_t pos;
+    int32_t slice;
+} cram_index_ctr;
+
+static int cram_index_ctr_add(cram_index_ctr **ctr, int *nctr, int *actr,
+			      int refid, int64_t pos, int64_t offset,
+			      int32_t slice, int32_t len) {
+    cram_index_ctr *c;
+
+    if (*nctr >= *actr) {
+	int n = *actr ? *actr*2 : 1024;
+	if (!(c = realloc(*ctr, n * sizeof(*c))))
+	    return -1;
+	*ctr = c, *actr = n;
+    }
+
+    c = &(*ctr)[(*nctr)++];
+    c->offset = offset;
+    c->extent = (int64_t)slice + len;
+    c->refid  = refid;
+    c->pos    = pos;
+    c->slice  = slice;
+
+    return 0;
+}
+
+static int cram_index_ctr_collect(cram_index *e, cram_index_ctr **ctr,
+				  int *nctr, int *actr) {
+    int i;
+
+    for (i = 0; i < e->nslice; i++) {
+	cram_index *s = &e->e[i];
+	if (cram_index_ctr_add(ctr, nctr, actr, s->refid, s->start,
+			       s->offset, s->slice, s->len) < 0)
+	    return -1;
+	if (cram_index_ctr_collect(s, ctr, nctr, actr) < 0)
+	    return -1;
+    }
+
+    return 0;
+}
+
+static int cram_index_ctr_cmp(const void *v1, const void *v2) {
+    const cram_index_ctr *c1 = v1, *c2 = v2;
+
+    if (c1->offset != c2->offset)
+	return c1->offset < c2->offset ? -1 : 1;
+    return c1->slice - c2->slice;
+}
+
+/*
+ * Splits the file into at most n shards of roughly equal compressed
+ * size, using the container offsets held in the index.  Shards cover
+ * whole containers and together span every container in the file,
+ * so iterating over each (see cram_shard_open) visits every record
+ * exactly once.
+ *
+ * Returns the number of shards on success, filling out *shards which
+ *         the caller should free
+ *        -1 on failure
+ */
+int cram_index_shards(cram_fd *fd, int n, cram_shard **shards) {
+    cram_index_ctr *ctr = NULL;
+    cram_shard *sh = NULL;
+    int nctr = 0, actr = 0, i, j, nsh;
+    int64_t total, sum;
+
+    *shards = NULL;
+    if (n < 1)
+	n = 1;
+
+    if (fd->index_bin) {
+	cram_index_bin *b = fd->index_bin;
+	for (i = 0; i < b->hdr->nref; i++) {
+	    const cram_index_bin_entry *e = b->entry + b->ref[i].first;
+	    uint64_t k;
+	    for (k = 0; k < b->ref[i].count; k++)
+		if (cram_index_ctr_add(&ctr, &nctr, &actr, i-1, e[k].start,
+				       e[k].offset, e[k].slice, e[k].len) < 0)
+		    goto err;
+	}
+    } else if (fd->index) {
+	for (i = 0; i < fd->index_sz; i++)
+	    if (cram_index_ctr_collect(&fd->index[i], &ctr, &nctr, &actr) < 0)
+		goto err;
+    } else {
+	fprintf(stderr, "Sharding requires an index\n");
+	return -1;
+    }
+
+    if (nctr == 0) {
+	fprintf(stderr, "Index has no entries\n");
+	goto err;
+    }
+
+    /*
+     * One entry per container, keeping the first slice (and so the
+     * first reference position) along with the furthest slice end.
+     */
+    qsort(ctr, nctr, sizeof(*ctr), cram_index_ctr_cmp);
+    for (i = 1, j = 0; i < nctr; i++) {
+	if (ctr[i].offset == ctr[j].offset) {
+	    if (ctr[j].extent < ctr[i].extent)
+		ctr[j].extent = ctr[i].extent;
+	} else {
+	    ctr[++j] = ctr[i];
+	}
+    }
+    nctr = j+1;
+
+    // Extent now becomes the container size, bar the last which is a guess
+    for (i = 0; i < nctr-1; i++)
+	ctr[i].extent = ctr[i+1].offset - ctr[i].offset;
+    for (total = 0, i = 0; i < nctr; i++)
+	total += ctr[i].extent;
+
+    if (n > nctr)
+	n = nctr;
+    if (!(sh = calloc(n, sizeof(*sh))))
+	goto err;
+
+    // Greedily fill each shard up to its share of the total
+    for (nsh = 0, sum = 0, i = 0; i < nctr; nsh++) {
+	sh[nsh].start = ctr[i].offset;
+	sh[nsh].refid = ctr[i].refid;
+	sh[nsh].pos   = ctr[i].pos;
+	do {
+	    sh[nsh].size += ctr[i].extent;
+	    sum += ctr[i++].extent;
+	} while (i < nctr && (nsh == n-1 || sum < total * (nsh+1) / n));
+	sh[nsh].end = i < nctr ? ctr[i].offset : -1;
+    }
+
+    // Containers missing from the start of the index belong to shard 0
+    if (fd->first_container > 0 && fd->first_container < sh[0].start)
+	sh[0].start = fd->first_container;
+
+    free(ctr);
+    *shards = sh;
+    return nsh;
+
+ err:
+    free(ctr);
+    free(sh);
+    return -1;
+}
+
+/*
+ * Opens a new file handle on fn, which must be the file already open
+ * in fd, positioned to iterate over a single shard from
+ * cram_index_shards.  The header, references and thread pool (if any)
+ * along with the decoding options are shared with fd, so shards may
+ * be decoded in separate threads.  fd must outlive the returned
+ * handle, which should be closed with cram_close as normal.
+ *
+ * Returns a cram_fd on success
+ *         NULL on failure
+ */
+cram_fd *cram_shard_open(cram_fd *fd, const char *fn, cram_shard *sh) {
+    cram_fd *s;
+
+    if (!(s = cram_open(fn, "rb")))
+	return NULL;
+
+    if (s->header != fd->header) {
+	if (s->header)
+	    sam_hdr_free(s->header);
+	s->header = fd->header;
+	sam_hdr_incr_ref(s->header);
+    }
+
+    /*
+     * The shard loads whole references into fd->refs, which are reference
+     * counted under refs->lock, so fd can't free those in use.  fd itself
+     * is left unchanged.
+     */
+    if (fd->refs) {
+	if (cram_set_option(s, CRAM_OPT_SHARED_REF, fd->refs) < 0)
+	    goto err;
+    }
+
+    if (fd->pool && cram_set_option(s, CRAM_OPT_THREAD_POOL, fd->pool) < 0)
+	goto err;
+
+    s->required_fields = fd->required_fields;
+    s->decode_md       = fd->decode_md;
+    s->ignore_md5      = fd->ignore_md5;
+    s->ignore_chksum   = fd->ignore_chksum;
+
+    if (cram_seek(s, sh->start, SEEK_SET) < 0) {
+	fprintf(stderr, "Failed to seek to shard at %"PRId64"\n", sh->start);
+	goto err;
+    }
+    s->shard_end = sh->end > 0 ? sh->end : 0;
+    s->shard = 1;
+
+    return s;
+
+ err:
+    cram_close(s);
+    return NULL;
+}
+
+/*
+ * A slice listed in the index as overlapping the range being counted.
+ */
+typedef struct {
+    int64_t offset;
+    int32_t slice;
+    int inside;         // lies wholly within the range
+} cram_index_span;
+
+static int cram_index_span_add(cram_index_span **sp, int *nsp, int *asp,
+			       cram_range *r, int64_t start, int64_t end,
+			       int64_t offset, int32_t slice) {
+    cram_index_span *s;
+
+    if (r->refid != -1 && (end < r->start || start > r->end))
+	return 0;
+
+    if (*nsp >= *asp) {
+	int n = *asp ? *asp*2 : 64;
+	if (!(s = realloc(*sp, n * sizeof(*s))))
+	    return -1;
+	*sp = s, *asp = n;
+    }
+
+    s = &(*sp)[(*nsp)++];
+    s->offset = offset;
+    s->slice  = slice;
+    s->inside = r->refid == -1 || (start >= r->start && end <= r->end);
+
+    return 0;
+}
+
+static int cram_index_span_collect(cram_index *e, cram_range *r,
+				   cram_index_span **sp, int *nsp, int *asp) {
+    int i;
+
+    for (i = 0; i < e->nslice; i++) {
+	cram_index *s = &e->e[i];
+
+	// Nested slices lie within their parent, so can be pruned with it
+	if (r->refid != -1 && (s->end < r->start || s->start > r->end))
+	    continue;
+	if (cram_index_span_add(sp, nsp, asp, r, s->start, s->end,
+				s->offset, s->slice) < 0)
+	    return -1;
+	if (cram_index_span_collect(s, r, sp, nsp, asp) < 0)
+	    return -1;
+    }
+
+    return 0;
+}
+
+static int cram_index_span_cmp(const void *v1, const void *v2) {
+    const cram_index_span *s1 = v1, *s2 = v2;
+
+    if (s1->offset != s2->offset)
+	return s1->offset < s2->offset ? -1 : 1;
+    return s1->slice - s2->slice;
+}
+
+/*
+ * Reads the compression header of container c, which starts at file
+ * offset cpos, if not already loaded.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_index_load_comp_hdr(cram_fd *fd, cram_container *c,
+				    int64_t cpos) {
+    if (c->comp_hdr)
+	return 0;
+
+    if (cram_seek(fd, cpos + c->offset, SEEK_SET) < 0 ||
+	!(c->comp_hdr_block = cram_read_block(fd)))
+	return -1;
+
+    return (c->comp_hdr = cram_decode_compression_header(fd,
+							 c->comp_hdr_block))
+	? 0 : -1;
+}
+
+/*
+ * Counts the records overlapping range r, which follows the same rules
+ * as CRAM_OPT_RANGE: records on r->refid whose alignment overlaps
+ * r->start..r->end, or all unmapped records if r->refid is -1.
+ *
+ * The index gives the slices that may hold such records.  Those lying
+ * wholly within the range have all their records counted, taking the
+ * number from the slice header without reading any of its data
+ * blocks.  Only the few slices crossing the range edges (or those
+ * holding multiple references) are decoded, and then just for the
+ * fields needed to find each record's extent.
+ *
+ * The file position is left at an arbitrary slice, so any subsequent
+ * reading should start with cram_seek_to_refpos, CRAM_OPT_RANGE or
+ * similar.
+ *
+ * Returns 0 on success, filling out *rc
+ *        -1 on failure
+ */
+int cram_index_count_range(cram_fd *fd, cram_range *r, cram_range_count *rc) {
+    cram_index_span *sp = NULL;
+    cram_container *c = NULL;
+    unsigned int required_fields = fd->required_fields;
+    int nsp = 0, asp = 0, i, j, ret = -1;
+
+    memset(rc, 0, sizeof(*rc));
+
+    if (fd->index_bin) {
+	cram_index_bin *b = fd->index_bin;
+
+	if (r->refid+1 >= 0 && r->refid+1 < b->hdr->nref) {
+	    const cram_index_bin_entry *e = b->entry + b->ref[r->refid+1].first;
+	    uint64_t k, n = b->ref[r->refid+1].count;
+
+	    // Sorted by start with non-decreasing max_end, as per query_bin
+	    for (k = 0; k < n && (r->refid == -1 || e[k].start <= r->end); k++)
+		if (cram_index_span_add(&sp, &nsp, &asp, r,
+					e[k].start, e[k].end,
+					e[k].offset, e[k].slice) < 0)
+		    goto err;
+	}
+    } else if (fd->index) {
+	if (r->refid+1 >= 0 && r->refid+1 < fd->index_sz &&
+	    cram_index_span_collect(&fd->index[r->refid+1], r,
+				    &sp, &nsp, &asp) < 0)
+	    goto err;
+    } else {
+	fprintf(stderr, "Counting records requires an index\n");
+	return -1;
+    }
+
+    /*
+     * Multi-reference slices are listed once per reference, so remove
+     * duplicates.  Visiting slices in file order also means each
+     * container header is read just once.
+     */
+    qsort(sp, nsp, sizeof(*sp), cram_index_span_cmp);
+    for (i = 1, j = 0; i < nsp; i++) {
+	if (sp[i].offset == sp[j].offset && sp[i].slice == sp[j].slice)
+	    sp[j].inside &= sp[i].inside;
+	else
+	    sp[++j] = sp[i];
+    }
+    if (nsp)
+	nsp = j+1;
+
+    // Slices crossing the range edges only need each record's extent
+    fd->required_fields = SAM_RNAME | SAM_POS | SAM_FLAG | SAM_CIGAR;
+
+    for (i = 0; i < nsp; i++) {
+	cram_block_slice_hdr *hdr;
+	cram_block *b;
+	cram_slice *s;
+	int64_t spos;
+
+	if (!c || sp[i].offset != sp[i-1].offset) {
+	    if (c)
+		cram_free_container(c);
+	    if (cram_seek(fd, sp[i].offset, SEEK_SET) < 0 ||
+		!(c = cram_read_container(fd))) {
+		fprintf(stderr, "Failed to read container at %"PRId64"\n",
+			sp[i].offset);
+		goto err;
+	    }
+	}
+	spos = sp[i].offset + c->offset + sp[i].slice;
+
+	if (cram_seek(fd, spos, SEEK_SET) < 0 || !(b = cram_read_block(fd)))
+	    goto err;
+	if (!(hdr = cram_decode_slice_header(fd, b))) {
+	    cram_free_block(b);
+	    goto err;
+	}
+
+	if (sp[i].inside && hdr->ref_seq_id != -2) {
+	    rc->nrec += hdr->num_records;
+	    rc->nslice++;
+	    cram_free_slice_header(hdr);
+	    cram_free_block(b);
+	    continue;
+	}
+	cram_free_slice_header(hdr);
+
+	// Decode, reading the compression header first if not yet done
+	if (!c->comp_hdr) {
+	    cram_free_block(b);
+	    if (cram_index_load_comp_hdr(fd, c, sp[i].offset) < 0 ||
+		cram_seek(fd, spos, SEEK_SET) < 0 ||
+		!(b = cram_read_block(fd)))
+		goto err;
+	}
+
+	if (!(s = cram_read_slice_blocks(fd, b)))
+	    goto err;
+	if (cram_decode_slice(fd, c, s, fd->header) != 0) {
+	    cram_free_slice(s);
+	    goto err;
+	}
+
+	for (j = 0; j < s->hdr->num_records; j++) {
+	    cram_record *cr = &s->crecs[j];
+	    if (cr->ref_id != r->refid)
+		continue;
+	    if (r->refid == -1 || (cr->apos <= r->end && cr->aend >= r->start))
+		rc->nrec++;
+	}
+	rc->ndecoded++;
+	cram_free_slice(s);
+    }
+
+    ret = 0;
+
+ err:
+    if (c)
+	cram_free_container(c);
+    free(sp);
+    fd->required_fields = required_fields;
+
+    return ret;
+}
+
+/*
+ * A multi-reference slice (ref_id -2), which needs decoding, possibly
+ * in another thread, to find the range covered by each reference.
+ */
+typedef struct {
+    cram_fd *fd;
+    cram_container *c;
+    cram_slice *s;
+    dstring_t *ds;       // index lines produced
+    off_t cpos;
+    int32_t landmark;
+    int sz;
+} cram_index_multiref;
+
+/* Index lines for a single slice */
+typedef struct {
+    int refid;
+    int64_t start, span;
+    off_t cpos;
+    int32_t landmark;
+    int sz;
+    cram_index_multiref *m; // non-NULL if lines come from decoding
+} cram_index_slice;
+
+/* Slices and containers read but not yet written to the index */
+typedef struct {
+    cram_index_slice *slice;
+    int nslice, slice_alloc;
+    cram_container **ctr;
+    int nctr, ctr_alloc;
+    int njobs;
+    t_results_queue *q;
+} cram_index_batch;
+
+// Limits on the work held in memory before writing out the index lines
+#define CRAM_INDEX_BATCH_SLICES 4096
+#define CRAM_INDEX_BATCH_JOBS   64
+
 /*
  * A specialised form of cram_index_build (below) that deals with slices
  * having multiple references in this (ref_id -2). In this scenario we
@@ -447,17 +1268,12 @@ int cram_seek_to_refpos(cram_fd *fd, cram_range *r) {
  * Returns 0 on success
  *        -1 on failure
  */
-static int cram_index_build_multiref(cram_fd *fd,
-				     cram_container *c,
-				     cram_slice *s,
-				     zfp *fp,
-				     off_t cpos,
-				     int32_t landmark,
-				     int sz) {
+static int cram_index_build_multiref(cram_index_multiref *is) {
+    cram_fd *fd = is->fd;
+    cram_slice *s = is->s;
     int i, ref = -2, ref_start = 0, ref_end;
-    char buf[1024];
 
-    if (0 != cram_decode_slice(fd, c, s, fd->header))
+    if (0 != cram_decode_slice(fd, is->c, s, fd->header))
 	return -1;
 
     ref_end = INT_MIN;
@@ -469,10 +1285,10 @@ static int cram_index_build_multiref(cram_fd *fd,
 	}
 
 	if (ref != -2) {
-	    sprintf(buf, "%d\t%d\t%d\t%"PRId64"\t%d\t%d\n",
-		    ref, ref_start, ref_end - ref_start + 1,
-		    (int64_t)cpos, landmark, sz);
-	    zfputs(buf, fp);
+	    if (dstring_appendf(is->ds, "%d\t%d\t%d\t%"PRId64"\t%d\t%d\n",
+				ref, ref_start, ref_end - ref_start + 1,
+				(int64_t)is->cpos, is->landmark, is->sz) < 0)
+		return -1;
 	}
 
 	ref = s->crecs[i].ref_id;
@@ -481,15 +1297,70 @@ static int cram_index_build_multiref(cram_fd *fd,
     }
 
     if (ref != -2) {
-	sprintf(buf, "%d\t%d\t%d\t%"PRId64"\t%d\t%d\n",
-		ref, ref_start, ref_end - ref_start + 1,
-		(int64_t)cpos, landmark, sz);
-	zfputs(buf, fp);
+	if (dstring_appendf(is->ds, "%d\t%d\t%d\t%"PRId64"\t%d\t%d\n",
+			    ref, ref_start, ref_end - ref_start + 1,
+			    (int64_t)is->cpos, is->landmark, is->sz) < 0)
+	    return -1;
     }
 
     return 0;
 }
 
+static void *cram_index_build_multiref_job(void *arg) {
+    // NULL on success, so a non-NULL result flags an error
+    return cram_index_build_multiref((cram_index_multiref *)arg) ? arg : NULL;
+}
+
+/*
+ * Waits for any outstanding multi-ref slice decodes and then writes the
+ * batch's index lines, in file order, to fp (if non-NULL).  The batch is
+ * emptied, even on failure.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_index_flush_batch(cram_fd *fd, cram_index_batch *bt, zfp *fp) {
+    t_pool_result *r;
+    int i, err = 0;
+
+    if (bt->q && bt->njobs) {
+	t_pool_flush_queue(fd->pool, bt->q);
+	while ((r = t_pool_next_result(bt->q))) {
+	    if (r->data)
+		err = 1;
+	    t_pool_delete_result(r, 0);
+	}
+    }
+    bt->njobs = 0;
+
+    for (i = 0; i < bt->nslice; i++) {
+	cram_index_slice *is = &bt->slice[i];
+	char buf[1024];
+
+	if (is->m) {
+	    if (fp && !err && dstring_str(is->m->ds))
+		zfputs(dstring_str(is->m->ds), fp);
+	    if (is->m->s)
+		cram_free_slice(is->m->s);
+	    if (is->m->ds)
+		dstring_destroy(is->m->ds);
+	    free(is->m);
+	} else if (fp && !err) {
+	    sprintf(buf, "%d\t%"PRId64"\t%"PRId64"\t%"PRId64"\t%d\t%d\n",
+		    is->refid, is->start, is->span, (int64_t)is->cpos,
+		    is->landmark, is->sz);
+	    zfputs(buf, fp);
+	}
+    }
+    bt->nslice = 0;
+
+    for (i = 0; i < bt->nctr; i++)
+	cram_free_container(bt->ctr[i]);
+    bt->nctr = 0;
+
+    return err ? -1 : 0;
+}
+
 /*
  * Builds an index file.
  *
@@ -497,16 +1368,29 @@ static int cram_index_build_multiref(cram_fd *fd,
  * fn_base is the filename of the associated CRAM file. Internally we
  * add ".crai" to this to get the index filename.
  *
+ * Only the container and slice headers are read, with the data blocks
+ * skipped over by seeking (or reading, if not seekable).  The exception
+ * is slices covering multiple references, which are decoded for just
+ * the fields needed to find each reference's range.  If fd has a thread
+ * pool these decodes are run in parallel.
+ *
+ * Container and slice headers are parsed here rather than in the pool.
+ * Each is only a few bytes, and parsing them is what tells us how far
+ * to skip and whether the slice is multi-ref and must be read in full,
+ * so the next read cannot start until the last header has been parsed.
+ *
  * Returns 0 on success
  *        -1 on failure
  */
 int cram_index_build(cram_fd *fd, const char *fn_base) {
     cram_container *c;
-    off_t cpos, spos, hpos;
+    cram_index_batch bt;
+    off_t cpos, hpos, pos;
     zfp *fp;
     char fn_idx[PATH_MAX];
-    int seekable;
+    unsigned int required_fields = fd->required_fields;
     size_t len;
+    int ret = -1;
 
     if ((len=strlen(fn_base)) > PATH_MAX-6)
 	return -1;
@@ -520,90 +1404,150 @@ int cram_index_build(cram_fd *fd, const char *fn_base) {
         return -1;
     }
 
+    memset(&bt, 0, sizeof(bt));
+    if (fd->pool && !(bt.q = t_results_queue_init()))
+	goto err;
+
+    // Multi-ref slices only need decoding for their reference ranges
+    fd->required_fields = SAM_RNAME | SAM_POS | SAM_CIGAR;
+
     cpos = CRAM_IO_TELLO(fd);
-    if (cpos >= 0) {
-	seekable = 1;
-    } else {
-	seekable = 0;
+    if (cpos < 0)
 	cpos = fd->first_container;
-    }
+
     while ((c = cram_read_container(fd))) {
         int j;
 
         if (fd->err) {
             perror("Cram container read");
-            return -1;
+	    cram_free_container(c);
+	    goto err;
         }
 
-	if (seekable) {
-	    hpos = CRAM_IO_TELLO(fd);
-	    assert(hpos == cpos + c->offset);
-	} else {
-	    hpos = cpos + c->offset;
+	if (bt.nctr >= bt.ctr_alloc) {
+	    cram_container **ctr;
+	    bt.ctr_alloc = bt.ctr_alloc ? bt.ctr_alloc*2 : 64;
+	    if (!(ctr = realloc(bt.ctr, bt.ctr_alloc * sizeof(*ctr)))) {
+		cram_free_container(c);
+		goto err;
+	    }
+	    bt.ctr = ctr;
 	}
+	bt.ctr[bt.nctr++] = c;
+
+	hpos = cpos + c->offset;
 
         if (!(c->comp_hdr_block = cram_read_block(fd)))
-            return -1;
+            goto err;
         assert(c->comp_hdr_block->content_type == COMPRESSION_HEADER);
-
-        c->comp_hdr = cram_decode_compression_header(fd, c->comp_hdr_block);
-        if (!c->comp_hdr)
-            return -1;
+	pos = hpos + cram_block_size(fd, c->comp_hdr_block);
 
         // 2.0 format
         for (j = 0; j < c->num_landmarks; j++) {
-            char buf[1024];
-            cram_slice *s;
-            int sz;
-
-	    if (seekable) {
-		spos = CRAM_IO_TELLO(fd);
-		assert(spos - cpos - c->offset == c->landmark[j]);
-	    } else {
-		spos = cpos + c->offset + c->landmark[j];
+	    cram_index_slice *is;
+	    cram_block_slice_hdr *hdr;
+	    cram_block *b;
+	    off_t spos = hpos + c->landmark[j];
+
+	    // Skip any data blocks left between us and the slice header
+	    if (spos < pos ||
+		(spos > pos && 0 != cram_seek(fd, spos - pos, SEEK_CUR)))
+		goto err;
+
+	    if (!(b = cram_read_block(fd)))
+		goto err;
+	    pos = spos + cram_block_size(fd, b);
+
+	    if (!(hdr = cram_decode_slice_header(fd, b))) {
+		cram_free_block(b);
+		goto err;
 	    }
 
-            if (!(s = cram_read_slice(fd))) {
-		zfclose(fp);
-		return -1;
+	    if (bt.nslice >= bt.slice_alloc) {
+		cram_index_slice *sl;
+		bt.slice_alloc = bt.slice_alloc ? bt.slice_alloc*2 : 256;
+		if (!(sl = realloc(bt.slice, bt.slice_alloc * sizeof(*sl)))) {
+		    cram_free_slice_header(hdr);
+		    cram_free_block(b);
+		    goto err;
+		}
+		bt.slice = sl;
 	    }
-
-	    if (seekable) {
-		sz = (int)(CRAM_IO_TELLO(fd) - spos);
-	    } else {
-		sz = j+1 < c->num_landmarks
-		    ? c->landmark[j+1] - c->landmark[j]
-		    : c->length - c->landmark[c->num_landmarks-1];
+	    is = &bt.slice[bt.nslice++];
+	    is->m        = NULL;
+	    is->refid    = hdr->ref_seq_id;
+	    is->start    = hdr->ref_seq_start;
+	    is->span     = hdr->ref_seq_span;
+	    is->cpos     = cpos;
+	    is->landmark = c->landmark[j];
+	    is->sz       = j+1 < c->num_landmarks
+		? c->landmark[j+1] - c->landmark[j]
+		: c->length - c->landmark[j];
+	    cram_free_slice_header(hdr);
+
+	    if (is->refid != -2) {
+		cram_free_block(b);
+		continue;
 	    }
 
-	    if (s->hdr->ref_seq_id == -2) {
-		cram_index_build_multiref(fd, c, s, fp,
-					  cpos, c->landmark[j], sz);
-	    } else {
-		sprintf(buf, "%d\t%"PRId64"\t%"PRId64"\t%"PRId64"\t%d\t%d\n",
-			s->hdr->ref_seq_id, s->hdr->ref_seq_start,
-			s->hdr->ref_seq_span, (int64_t)cpos,
-			c->landmark[j], sz);
-		zfputs(buf, fp);
+	    // Multi-ref, so we need the whole slice and compression header
+	    if (!(is->m = calloc(1, sizeof(*is->m))) ||
+		(!c->comp_hdr &&
+		 !(c->comp_hdr = cram_decode_compression_header(fd,
+							c->comp_hdr_block)))) {
+		cram_free_block(b);
+		goto err;
+	    }
+	    is->m->fd       = fd;
+	    is->m->c        = c;
+	    is->m->cpos     = is->cpos;
+	    is->m->landmark = is->landmark;
+	    is->m->sz       = is->sz;
+	    if (!(is->m->s = cram_read_slice_blocks(fd, b)))
+		goto err;
+	    pos = spos + is->sz;
+
+	    if (!(is->m->ds = dstring_create(NULL)))
+		goto err;
+
+	    if (bt.q) {
+		if (t_pool_dispatch(fd->pool, bt.q,
+				    cram_index_build_multiref_job, is->m) < 0)
+		    goto err;
+		bt.njobs++;
+	    } else if (0 != cram_index_build_multiref(is->m)) {
+		goto err;
 	    }
-
-            cram_free_slice(s);
         }
-	
-	if (seekable) {
-	    cpos = CRAM_IO_TELLO(fd);
-	    assert(cpos == hpos + c->length);
-	} else {
-	    cpos = hpos + c->length;
-	}
 
-        cram_free_container(c);
-    }
-    if (fd->err) {
-	zfclose(fp);
-	return -1;
+	// Skip the rest of the container
+	cpos = hpos + c->length;
+	if (cpos < pos ||
+	    (cpos > pos && 0 != cram_seek(fd, cpos - pos, SEEK_CUR)))
+	    goto err;
+
+	if (bt.nslice >= CRAM_INDEX_BATCH_SLICES ||
+	    bt.njobs  >= CRAM_INDEX_BATCH_JOBS) {
+	    if (0 != cram_index_flush_batch(fd, &bt, fp))
+		goto err;
+	}
     }
-	
 
-    return (zfclose(fp) >= 0) ? 0 : -1;
+    if (!fd->err)
+	ret = 0;
+
+ err:
+    // Also frees the batch on failure, having waited for running jobs
+    if (0 != cram_index_flush_batch(fd, &bt, ret == 0 ? fp : NULL))
+	ret = -1;
+    if (bt.q)
+	t_results_queue_destroy(bt.q);
+    free(bt.slice);
+    free(bt.ctr);
+    fd->required_fields = required_fields;
+
+    if (zfclose(fp) < 0)
+	ret = -1;
+
+    return ret;
 }
@@ -62,9 +62,21 @@ extern int cram_index_load_via_callbacks(
 
 void cram_index_free(cram_fd *fd);
 
+/*
+ * Writes a binary index, fn.crbi, from the index loaded in fd or
+ * otherwise from fn.crai.  cram_index_load uses this in preference to
+ * the text index when it is at least as new as fn and fn.crai.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_index_write_bin(cram_fd *fd, const char *fn);
+
 /*
  * Searches the index for the first slice overlapping a reference ID
- * and position.
+ * and position.  frm is NULL to search the whole reference, or a
+ * node from an earlier query to search only its children.  The
+ * returned entry remains valid until the index is freed.
  *
  * Returns the cram_index pointer on sucess
  *         NULL on failure
@@ -88,6 +100,36 @@ int cram_seek_to_refpos(cram_fd *fd, cram_range *r);
  */
 int cram_seek(cram_fd *fd, off_t offset, int whence);
 
+/*
+ * Splits the file into at most n shards of roughly equal compressed
+ * size using the index.  Shards never split a container, so each
+ * record belongs to exactly one.
+ *
+ * Returns the number of shards on success, filling out *shards which
+ *         the caller should free
+ *        -1 on failure
+ */
+int cram_index_shards(cram_fd *fd, int n, cram_shard **shards);
+
+/*
+ * Opens a new handle on fn (the file open in fd) to iterate over a
+ * single shard, sharing the header, references and thread pool of fd.
+ *
+ * Returns a cram_fd on success
+ *         NULL on failure
+ */
+cram_fd *cram_shard_open(cram_fd *fd, const char *fn, cram_shard *sh);
+
+/*
+ * Counts the records overlapping a range using the index and slice
+ * headers, only decoding slices that cross the range edges.  This
+ * moves the file position, so seek before reading records again.
+ *
+ * Returns 0 on success, filling out *rc
+ *        -1 on failure
+ */
+int cram_index_count_range(cram_fd *fd, cram_range *r, cram_range_count *rc);
+
 /*
  * Builds an index file.
  *
@@ -68,6 +68,8 @@ func ptr v4.0		10614 (10540-10653)  all zigzag (w INT7 #define)
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/time.h>
+#include <time.h>
 #include <zlib.h>
 #ifdef HAVE_LIBBZ2
 #include <bzlib.h>
@@ -83,6 +85,18 @@ func ptr v4.0		10614 (10540-10653)  all zigzag (w INT7 #define)
 #endif
 #include <sys/types.h>
 #include <sys/stat.h>
+#if defined(HAVE_MMAP) && defined(HAVE_FILENO) && defined(HAVE_FSTAT)
+#include <sys/mman.h>
+#define CRAM_IO_MMAP
+#endif
+#if defined(HAVE_WRITEV) && defined(HAVE_FILENO)
+#include <sys/uio.h>
+#include <limits.h>
+#define CRAM_IO_WRITEV
+#ifndef IOV_MAX
+#define IOV_MAX 1024 // POSIX only guarantees 16, but Linux & BSDs use 1024
+#endif
+#endif
 #include <math.h>
 #include <ctype.h>
 
@@ -111,6 +125,7 @@ func ptr v4.0		10614 (10540-10653)  all zigzag (w INT7 #define)
 #include "io_lib/md5.h"
 #include "io_lib/crc32.h"
 #include "io_lib/open_trace_file.h"
+#include "io_lib/codec_cache.h"
 #include <htscodecs/rANS_static.h>
 #include <htscodecs/rANS_static4x16.h>
 #include <htscodecs/arith_dynamic.h>
@@ -134,6 +149,7 @@ func ptr v4.0		10614 (10540-10653)  all zigzag (w INT7 #define)
 
 #define TRIAL_SPAN 50
 #define NTRIALS 3
+#define TRIAL_CHUNK 65536
 
 /* ----------------------------------------------------------------------
  * custom buffering helper routines
@@ -166,6 +182,10 @@ static off_t cram_io_C_FILE_ftell(void * fd)
 /* fill empty buffer */
 static void cram_io_fill_input_buffer(cram_fd * fd)
 {
+    /* a mapped buffer already holds the whole file */
+    if ( fd->fp_in_buffer->fp_in_mmap )
+        return;
+
     /* buffer need to be empty */
     assert ( fd->fp_in_buffer->fp_in_buf_pc == fd->fp_in_buffer->fp_in_buf_pe ); 
     
@@ -222,6 +242,10 @@ size_t cram_io_input_buffer_read(void *vptr, size_t size, size_t nmemb, cram_fd
     r += tocopy;
     ptr += tocopy;
     fd->fp_in_buffer->fp_in_buf_pc += tocopy;
+
+    /* a mapped buffer already holds the whole file */
+    if ( fd->fp_in_buffer->fp_in_mmap )
+        return size ? (r / size) : r;
     
     /* read whole blocks without copying to buffer first, C-IO fread */
     while ( (toread >= fd->fp_in_buffer->fp_in_buf_size) &&
@@ -265,6 +289,25 @@ int cram_io_input_buffer_seek(cram_fd * fd, off_t offset, int whence)
 {
     int r = -1;
 
+    /* a mapped buffer is seeked within the window */
+    if ( fd->fp_in_buffer->fp_in_mmap ) {
+        cram_fd_input_buffer * b = fd->fp_in_buffer;
+        int64_t target;
+
+        switch ( whence ) {
+        case SEEK_SET: target = offset; break;
+        case SEEK_CUR: target = (b->fp_in_buf_pc - b->fp_in_buf_pa) + offset; break;
+        case SEEK_END: target = b->fp_in_buf_size + offset; break;
+        default: return -1;
+        }
+
+        if ( target < 0 || target > (int64_t)b->fp_in_buf_size )
+            return -1;
+
+        b->fp_in_buf_pc = b->fp_in_buf_pa + target;
+        return 0;
+    }
+
     if ( whence == SEEK_CUR )
     {
         /* current absolute input position in buffer */
@@ -331,6 +374,508 @@ int cram_io_input_buffer_seek(cram_fd * fd, off_t offset, int whence)
     return r;
 }
 
+/*
+ * Returns a pointer to the next len bytes of a mapped input, advancing
+ * past them, so the data can be used without copying.
+ *
+ * Returns NULL if the input is not mapped or too short.
+ */
+unsigned char * cram_io_input_buffer_map(cram_fd * fd, size_t len)
+{
+    cram_fd_input_buffer * b = fd->fp_in_buffer;
+    unsigned char * p;
+
+    if ( !b || !b->fp_in_mmap ||
+	 (size_t)(b->fp_in_buf_pe - b->fp_in_buf_pc) < len )
+        return NULL;
+
+    p = (unsigned char *)b->fp_in_buf_pc;
+    b->fp_in_buf_pc += len;
+    return p;
+}
+
+/*
+ * Hints that the next len bytes of a mapped input will be needed soon,
+ * so the kernel can start reading them in.
+ */
+void cram_io_input_buffer_willneed(cram_fd * fd, size_t len)
+{
+#if defined(CRAM_IO_MMAP) && defined(MADV_WILLNEED)
+    cram_fd_input_buffer * b = fd->fp_in_buffer;
+    size_t pg, start, end;
+
+    if ( !b || !b->fp_in_mmap )
+        return;
+
+    pg = sysconf(_SC_PAGESIZE);
+    start = (b->fp_in_buf_pc - b->fp_in_buf_pa) & ~(pg-1);
+    end = imin((b->fp_in_buf_pc - b->fp_in_buf_pa) + len, b->fp_in_buf_size);
+    if ( end > start )
+        madvise(b->fp_in_buf_pa + start, end - start, MADV_WILLNEED);
+#endif
+}
+
+/* ----------------------------------------------------------------------
+ * Container read-ahead
+ */
+
+/* largest piece queued in one go */
+#define READAHEAD_PIECE (4<<20)
+/* container headers longer than this are assumed to be garbage */
+#define READAHEAD_HDR_MAX 65536
+
+/*
+ * Works out the size of the container whose header starts at buf.
+ *
+ * Returns the header length, with the whole container size in *ctr_len;
+ *         0 if more bytes are needed;
+ *        -1 if this does not look like a container header.
+ */
+static int cram_io_readahead_ctr_size(cram_fd * fd, char * buf, size_t len,
+				      int64_t * ctr_len)
+{
+    char * cp = buf, * endp = buf + len;
+    int err = 0, i, nlm;
+    int64_t length;
+
+    if ( IS_CRAM_1_VERS(fd) || CRAM_MAJOR_VERS(fd->version) >= 4 ) {
+        length = fd->vv.varint_get32(&cp, endp, &err);
+    } else {
+        if ( len < 4 )
+            return 0;
+        length = (int32_t)(((unsigned char)cp[0]      ) |
+			   ((unsigned char)cp[1] <<  8) |
+			   ((unsigned char)cp[2] << 16) |
+			   ((uint32_t)(unsigned char)cp[3] << 24));
+        cp += 4;
+    }
+
+    fd->vv.varint_get32s(&cp, endp, &err);      /* ref_seq_id */
+    if ( CRAM_MAJOR_VERS(fd->version) >= 4 ) {
+        fd->vv.varint_get64(&cp, endp, &err);   /* ref_seq_start */
+        fd->vv.varint_get64(&cp, endp, &err);   /* ref_seq_span */
+    } else {
+        fd->vv.varint_get32(&cp, endp, &err);
+        fd->vv.varint_get32(&cp, endp, &err);
+    }
+    fd->vv.varint_get32(&cp, endp, &err);       /* num_records */
+    if ( !IS_CRAM_1_VERS(fd) ) {
+        if ( IS_CRAM_3_VERS(fd) )
+            fd->vv.varint_get64(&cp, endp, &err); /* record_counter */
+        else
+            fd->vv.varint_get32(&cp, endp, &err);
+        fd->vv.varint_get64(&cp, endp, &err);   /* num_bases */
+    }
+    fd->vv.varint_get32(&cp, endp, &err);       /* num_blocks */
+    nlm = fd->vv.varint_get32(&cp, endp, &err);
+    for ( i = 0; !err && i < nlm; i++ )
+        fd->vv.varint_get32(&cp, endp, &err);
+
+    if ( IS_CRAM_3_VERS(fd) && !err ) {
+        uint32_t crc;
+        if ( endp - cp < 4 )
+            return len < READAHEAD_HDR_MAX ? 0 : -1;
+        crc = ((unsigned char)cp[0]      ) | ((unsigned char)cp[1] <<  8) |
+	      ((unsigned char)cp[2] << 16) |
+	      ((uint32_t)(unsigned char)cp[3] << 24);
+        if ( crc != iolib_crc32(0L, (unsigned char *)buf, cp - buf) )
+            return -1;
+        cp += 4;
+    }
+
+    if ( err )
+        return len < READAHEAD_HDR_MAX ? 0 : -1;
+    if ( length < 0 || nlm < 0 )
+        return -1;
+
+    *ctr_len = (cp - buf) + length;
+    return cp - buf;
+}
+
+/* reads len bytes from the underlying input, or fewer at end of file */
+static size_t cram_io_readahead_fill(cram_readahead * ra, char * buf, size_t len)
+{
+    size_t r = 0, n;
+
+    while ( r < len &&
+	    (n = ra->src->fread_callback(buf + r, 1, len - r,
+					 ra->src->user_data)) > 0 )
+        r += n;
+
+    return r;
+}
+
+/*
+ * Reads the next piece of input, holding at most the remainder of the
+ * current container.  If the stream stops looking like containers we
+ * fall back to fixed size pieces, which are just as correct but make
+ * the container count depth approximate.
+ *
+ * Returns the piece on success;
+ *         NULL at end of file or on failure.
+ */
+static cram_readahead_piece * cram_io_readahead_piece(cram_readahead * ra)
+{
+    cram_readahead_piece * p;
+    size_t sz, n;
+
+    while ( ra->remaining == 0 ) {
+        int64_t clen;
+        int r = ra->raw
+	    ? -1
+	    : cram_io_readahead_ctr_size(ra->fd, ra->stage, ra->stage_len, &clen);
+
+        if ( r > 0 ) {
+            ra->remaining = clen;
+            break;
+        }
+
+        if ( r < 0 ) {
+            ra->raw = 1;
+            ra->remaining = READAHEAD_PIECE;
+            break;
+        }
+
+        /* need more of the header */
+        if ( ra->stage_len + 1024 > ra->stage_alloc ) {
+            size_t alloc = ra->stage_alloc ? ra->stage_alloc*2 : 1024;
+            char * stage = realloc(ra->stage, alloc);
+            if ( ! stage )
+                return NULL;
+            ra->stage = stage;
+            ra->stage_alloc = alloc;
+        }
+        n = ra->src->fread_callback(ra->stage + ra->stage_len, 1, 1024,
+				    ra->src->user_data);
+        if ( n == 0 ) {
+            if ( ra->stage_len == 0 )
+                return NULL;
+            /* trailing partial container; pass it on as it is */
+            ra->raw = 1;
+            ra->remaining = ra->stage_len;
+            break;
+        }
+        ra->stage_len += n;
+    }
+
+    sz = imin(ra->remaining, READAHEAD_PIECE);
+    if ( ! (p = malloc(sizeof(*p))) )
+        return NULL;
+    if ( ! (p->data = malloc(sz)) ) {
+        free(p);
+        return NULL;
+    }
+
+    n = imin(ra->stage_len, sz);
+    memcpy(p->data, ra->stage, n);
+    memmove(ra->stage, ra->stage + n, ra->stage_len - n);
+    ra->stage_len -= n;
+    if ( n < sz )
+        n += cram_io_readahead_fill(ra, p->data + n, sz - n);
+
+    if ( n == 0 ) {
+        free(p->data);
+        free(p);
+        return NULL;
+    }
+
+    ra->remaining = n < sz ? 0 : ra->remaining - sz;
+    if ( ra->raw )
+        ra->remaining = 0;
+    p->size = n;
+    p->last = (ra->remaining == 0);
+    p->next = NULL;
+
+    return p;
+}
+
+static void * cram_io_readahead_thread(void * arg)
+{
+    cram_readahead * ra = (cram_readahead *)arg;
+    cram_readahead_piece * p;
+
+    do {
+        pthread_mutex_lock(&ra->lock);
+        while ( ! ra->shutdown &&
+		((ra->max_ctr   && ra->nctr   >= ra->max_ctr) ||
+		 (ra->max_bytes && ra->nbytes >= ra->max_bytes)) )
+            pthread_cond_wait(&ra->drained, &ra->lock);
+        if ( ra->shutdown ) {
+            pthread_mutex_unlock(&ra->lock);
+            break;
+        }
+        pthread_mutex_unlock(&ra->lock);
+
+        p = cram_io_readahead_piece(ra);
+
+        pthread_mutex_lock(&ra->lock);
+        if ( p ) {
+            if ( ra->tail )
+                ra->tail->next = p;
+            else
+                ra->head = p;
+            ra->tail = p;
+            ra->nbytes += p->size;
+            ra->nctr += p->last;
+        } else {
+            ra->eof = 1;
+        }
+        pthread_cond_signal(&ra->filled);
+        pthread_mutex_unlock(&ra->lock);
+    } while ( p );
+
+    return NULL;
+}
+
+/*
+ * Moves on to the next queued piece, waiting for the reader if wait is
+ * set.  Returns 0 if a piece is available, -1 otherwise.
+ */
+static int cram_io_readahead_next(cram_readahead * ra, int wait)
+{
+    cram_readahead_piece * p;
+
+    if ( ra->curr && ra->curr_pos < ra->curr->size )
+        return 0;
+
+    if ( ra->curr ) {
+        free(ra->curr->data);
+        free(ra->curr);
+        ra->curr = NULL;
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    while ( wait && ! ra->head && ! ra->eof )
+        pthread_cond_wait(&ra->filled, &ra->lock);
+    if ( (p = ra->head) ) {
+        if ( ! (ra->head = p->next) )
+            ra->tail = NULL;
+        ra->nbytes -= p->size;
+        ra->nctr -= p->last;
+        pthread_cond_signal(&ra->drained);
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    ra->curr = p;
+    ra->curr_pos = 0;
+
+    return p ? 0 : -1;
+}
+
+static size_t cram_io_readahead_fread(void * ptr, size_t size, size_t nmemb,
+				      void * stream)
+{
+    cram_readahead * ra = (cram_readahead *)stream;
+    size_t len = size * nmemb, r = 0;
+
+    /* block only until there is something to return */
+    while ( r < len && cram_io_readahead_next(ra, r == 0) == 0 ) {
+        size_t n = imin(len - r, ra->curr->size - ra->curr_pos);
+        memcpy((char *)ptr + r, ra->curr->data + ra->curr_pos, n);
+        ra->curr_pos += n;
+        r += n;
+    }
+
+    ra->pos += r;
+    return size ? r / size : r;
+}
+
+static off_t cram_io_readahead_ftell(void * stream)
+{
+    return ((cram_readahead *)stream)->pos;
+}
+
+static int cram_io_readahead_launch(cram_readahead * ra)
+{
+    ra->shutdown = 0;
+    if ( pthread_create(&ra->thread, NULL, cram_io_readahead_thread, ra) != 0 )
+        return -1;
+    ra->running = 1;
+    return 0;
+}
+
+/* stops the reader thread and discards everything read ahead */
+static void cram_io_readahead_halt(cram_readahead * ra)
+{
+    cram_readahead_piece * p, * next;
+
+    if ( ra->running ) {
+        pthread_mutex_lock(&ra->lock);
+        ra->shutdown = 1;
+        pthread_cond_signal(&ra->drained);
+        pthread_mutex_unlock(&ra->lock);
+        pthread_join(ra->thread, NULL);
+        ra->running = 0;
+    }
+
+    if ( ra->curr ) {
+        free(ra->curr->data);
+        free(ra->curr);
+        ra->curr = NULL;
+    }
+    for ( p = ra->head; p; p = next ) {
+        next = p->next;
+        free(p->data);
+        free(p);
+    }
+    ra->head = ra->tail = NULL;
+    ra->nbytes = ra->nctr = 0;
+    ra->stage_len = 0;
+    ra->remaining = 0;
+    ra->raw = 0;
+    ra->eof = 0;
+}
+
+static int cram_io_readahead_fseek(void * stream, off_t offset, int whence)
+{
+    cram_readahead * ra = (cram_readahead *)stream;
+
+    /* skip forward through anything already read */
+    if ( whence == SEEK_CUR && offset >= 0 ) {
+        while ( offset > 0 && cram_io_readahead_next(ra, !ra->seekable) == 0 ) {
+            size_t n = imin(offset, ra->curr->size - ra->curr_pos);
+            ra->curr_pos += n;
+            ra->pos += n;
+            offset -= n;
+        }
+        if ( offset == 0 )
+            return 0;
+    }
+
+    if ( ! ra->seekable )
+        return -1;
+
+    if ( whence == SEEK_CUR ) {
+        offset += ra->pos;
+        whence = SEEK_SET;
+    }
+
+    cram_io_readahead_halt(ra);
+    if ( ra->src->fseek_callback(ra->src->user_data, offset, whence) != 0 ) {
+        /* put the underlying input back where we were */
+        if ( ra->src->fseek_callback(ra->src->user_data, ra->pos, SEEK_SET) != 0 )
+            return -1;
+        cram_io_readahead_launch(ra);
+        return -1;
+    }
+    ra->pos = ra->src->ftell_callback(ra->src->user_data);
+
+    return cram_io_readahead_launch(ra);
+}
+
+/* Stops read-ahead and hands the input back to the original callbacks */
+static int cram_io_stop_readahead(cram_fd * fd)
+{
+    cram_readahead * ra = fd->readahead;
+    int r = 0;
+
+    if ( ! ra )
+        return 0;
+
+    cram_io_readahead_halt(ra);
+    if ( ra->seekable )
+        r = ra->src->fseek_callback(ra->src->user_data, ra->pos, SEEK_SET);
+
+    fd->fp_in_callbacks = ra->src;
+    fd->readahead = NULL;
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->filled);
+    pthread_cond_destroy(&ra->drained);
+    free(ra->stage);
+    free(ra);
+
+    return r;
+}
+
+/*
+ * Starts, adjusts or stops container read-ahead on an input CRAM,
+ * according to fd->readahead_containers and fd->readahead_bytes.
+ * Containers are prefetched by a dedicated thread into a bounded queue
+ * so the decoder does not wait on I/O.  Mapped input has no need of
+ * this and is left alone.
+ *
+ * Returns 0 on success;
+ *        -1 on failure.
+ */
+int cram_io_set_readahead(cram_fd * fd)
+{
+    cram_readahead * ra = fd->readahead;
+    cram_fd_input_buffer * b = fd->fp_in_buffer;
+    int on = fd->readahead_containers > 0 || fd->readahead_bytes > 0;
+
+    if ( fd->mode != 'r' || ! fd->fp_in_callbacks || ! b || b->fp_in_mmap )
+        return 0;
+
+    if ( ra ) {
+        if ( ! on ) {
+            if ( ! ra->seekable ) {
+                fprintf(stderr, "Cannot stop read-ahead on a "
+			"non-seekable input\n");
+                return -1;
+            }
+            return cram_io_stop_readahead(fd);
+        }
+
+        pthread_mutex_lock(&ra->lock);
+        ra->max_ctr = fd->readahead_containers;
+        ra->max_bytes = fd->readahead_bytes;
+        pthread_cond_signal(&ra->drained);
+        pthread_mutex_unlock(&ra->lock);
+        return 0;
+    }
+
+    if ( ! on )
+        return 0;
+
+    if ( ! (ra = calloc(1, sizeof(*ra))) )
+        return -1;
+
+    ra->src = fd->fp_in_callbacks;
+    ra->fd = fd;
+    ra->max_ctr = fd->readahead_containers;
+    ra->max_bytes = fd->readahead_bytes;
+    ra->pos = CRAM_IO_TELLO(fd);
+    ra->seekable = ra->src->ftell_callback(ra->src->user_data) >= 0;
+
+    /*
+     * Unconsumed input buffer contents become the start of the
+     * read-ahead stream, so it begins on a container boundary.
+     */
+    ra->stage_len = b->fp_in_buf_pe - b->fp_in_buf_pc;
+    ra->stage_alloc = ra->stage_len + 1024;
+    if ( ! (ra->stage = malloc(ra->stage_alloc)) ) {
+        free(ra);
+        return -1;
+    }
+    memcpy(ra->stage, b->fp_in_buf_pc, ra->stage_len);
+    b->fp_in_buf_pe = b->fp_in_buf_pc;
+
+    ra->io.user_data = ra;
+    ra->io.fread_callback = cram_io_readahead_fread;
+    ra->io.fseek_callback = cram_io_readahead_fseek;
+    ra->io.ftell_callback = cram_io_readahead_ftell;
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->filled, NULL);
+    pthread_cond_init(&ra->drained, NULL);
+
+    if ( cram_io_readahead_launch(ra) != 0 ) {
+        fprintf(stderr, "Failed to start read-ahead thread\n");
+        b->fp_in_buf_pe = b->fp_in_buf_pc + ra->stage_len;
+        pthread_mutex_destroy(&ra->lock);
+        pthread_cond_destroy(&ra->filled);
+        pthread_cond_destroy(&ra->drained);
+        free(ra->stage);
+        free(ra);
+        return -1;
+    }
+
+    fd->readahead = ra;
+    fd->fp_in_callbacks = &ra->io;
+
+    return 0;
+}
+
 static cram_io_input_t *
 cram_IO_deallocate_cram_io_input(cram_io_input_t * obj)
 {
@@ -375,6 +920,11 @@ cram_io_deallocate_input_buffer(cram_fd_input_buffer * buffer)
 {
     if ( buffer ) {
         if ( buffer->fp_in_buffer ) {
+#if defined(CRAM_IO_MMAP)
+            if ( buffer->fp_in_mmap )
+                munmap(buffer->fp_in_buffer, buffer->fp_in_buf_size);
+            else
+#endif
             free(buffer->fp_in_buffer);
             buffer->fp_in_buffer = NULL;
         }
@@ -409,6 +959,50 @@ cram_io_allocate_input_buffer(size_t const bufsize)
     return buffer;
 }
 
+#if defined(CRAM_IO_MMAP)
+/*
+ * Maps an entire regular file as the input buffer.  The mapping is
+ * private and writable so decoders modifying block data in place only
+ * touch their own copy of the page.
+ *
+ * Returns the buffer on success;
+ *         NULL if the file cannot be mapped.
+ */
+static cram_fd_input_buffer *
+cram_io_allocate_input_mmap(FILE * fp)
+{
+    cram_fd_input_buffer * buffer;
+    struct stat sb;
+    void * map;
+
+    if ( fstat(fileno(fp), &sb) != 0 || !S_ISREG(sb.st_mode) ||
+	 sb.st_size <= 0 || (uint64_t)sb.st_size > SIZE_MAX )
+        return NULL;
+
+    map = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	       fileno(fp), 0);
+    if ( map == MAP_FAILED )
+        return NULL;
+#if defined(MADV_SEQUENTIAL)
+    madvise(map, sb.st_size, MADV_SEQUENTIAL);
+#endif
+
+    if ( ! (buffer = calloc(1, sizeof(cram_fd_input_buffer))) ) {
+        munmap(map, sb.st_size);
+        return NULL;
+    }
+
+    buffer->fp_in_mmap     = 1;
+    buffer->fp_in_buf_size = sb.st_size;
+    buffer->fp_in_buffer   = (char *)map;
+    buffer->fp_in_buf_pa   = buffer->fp_in_buffer;
+    buffer->fp_in_buf_pc   = buffer->fp_in_buffer;
+    buffer->fp_in_buf_pe   = buffer->fp_in_buffer + sb.st_size;
+
+    return buffer;
+}
+#endif
+
 char * cram_io_input_buffer_fgets(char * s, int size, cram_fd * fd)
 {
      int linelen = 0;
@@ -590,6 +1184,81 @@ cram_IO_allocate_cram_io_output_from_C_FILE(FILE * file)
     return obj;
 }
 
+/* ----------------------------------------------------------------------
+ * Output writer thread
+ */
+
+static size_t cram_io_writer_fwrite(void *ptr, size_t size, size_t nmemb,
+				    void *stream)
+{
+    size_t r = write_thread_write((write_thread *)stream, ptr, size * nmemb);
+    return size ? r / size : r;
+}
+
+static off_t cram_io_writer_ftell(void * stream)
+{
+    return write_thread_tell((write_thread *)stream);
+}
+
+/* Stops the writer thread and hands output back to the original callbacks */
+static int cram_io_stop_writer(cram_fd * fd)
+{
+    int r;
+
+    if ( ! fd->writer )
+        return 0;
+
+    r = write_thread_close(fd->writer);
+    fd->writer = NULL;
+    fd->fp_out_callbacks = fd->writer_src;
+
+    return r;
+}
+
+/*
+ * Starts, restarts or stops the output writer thread according to
+ * fd->write_bufsize and fd->write_direct.  Once running, the thread
+ * performs all writes to the output file so the caller is not held up
+ * by slow disks.  Outputs without a FILE (eg in-memory or callback
+ * based) are left alone.
+ *
+ * Returns 0 on success;
+ *        -1 on failure.
+ */
+int cram_io_set_writer(cram_fd * fd)
+{
+    if ( fd->mode != 'w' || ! fd->fp_out || ! fd->fp_out_callbacks )
+        return 0;
+
+    if ( cram_io_flush_output_buffer(fd) != 0 )
+        return -1;
+
+    if ( cram_io_stop_writer(fd) != 0 )
+        return -1;
+
+    if ( fd->write_bufsize <= 0 && ! fd->write_direct )
+        return 0;
+
+    if ( fflush(fd->fp_out) != 0 )
+        return -1;
+
+    fd->writer = write_thread_init(fileno(fd->fp_out),
+				   fd->write_bufsize > 0 ? fd->write_bufsize : 0,
+				   fd->write_direct);
+    if ( ! fd->writer ) {
+        fprintf(stderr, "Failed to start writer thread\n");
+        return -1;
+    }
+
+    fd->writer_src = fd->fp_out_callbacks;
+    fd->writer_io.user_data = fd->writer;
+    fd->writer_io.fwrite_callback = cram_io_writer_fwrite;
+    fd->writer_io.ftell_callback = cram_io_writer_ftell;
+    fd->fp_out_callbacks = &fd->writer_io;
+
+    return 0;
+}
+
 cram_fd_output_buffer *
 cram_io_deallocate_output_buffer(cram_fd_output_buffer * buffer)
 {
@@ -1388,6 +2057,222 @@ static int uint7_decode_crc64(cram_fd *fd, int64_t *val_p, uint32_t *crc) {
     return i;
 }
 
+//-----------------------------------------------------------------------------
+// Bulk decoding of arrays of variable sized integers.
+//
+// Both ITF8/LTF8 and uint7 store values 0 to 127 as a single byte with the
+// top bit clear, and such small values dominate most integer data series.
+// The kernels below expand a run of these single byte values directly into
+// a 32-bit or 64-bit array, using SSE4.1 or AVX2 when available.  The
+// array decoders alternate between this and the scalar decoder, which is
+// used for each multi-byte value encountered.
+
+/*
+ * Expands up to n leading bytes with the top bit clear from cp to out.
+ * Returns the number of values written.
+ */
+static int varint_run32_scalar(const uint8_t *cp, const uint8_t *endp,
+			       int32_t *out, int n) {
+    int i;
+    if (n > endp - cp)
+	n = endp - cp;
+    for (i = 0; i < n && cp[i] < 0x80; i++)
+	out[i] = cp[i];
+    return i;
+}
+
+static int varint_run64_scalar(const uint8_t *cp, const uint8_t *endp,
+			       int64_t *out, int n) {
+    int i;
+    if (n > endp - cp)
+	n = endp - cp;
+    for (i = 0; i < n && cp[i] < 0x80; i++)
+	out[i] = cp[i];
+    return i;
+}
+
+#if defined(__x86_64__) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define VARINT_SIMD
+#include <immintrin.h>
+
+__attribute__((target("sse4.1")))
+static int varint_run32_sse4(const uint8_t *cp, const uint8_t *endp,
+			     int32_t *out, int n) {
+    int i = 0;
+    while (n - i >= 16 && endp - cp >= 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *)cp);
+	int m = _mm_movemask_epi8(v);
+	if (m)
+	    break;
+	_mm_storeu_si128((__m128i *)(out+i+ 0), _mm_cvtepu8_epi32(v));
+	_mm_storeu_si128((__m128i *)(out+i+ 4),
+			 _mm_cvtepu8_epi32(_mm_srli_si128(v,  4)));
+	_mm_storeu_si128((__m128i *)(out+i+ 8),
+			 _mm_cvtepu8_epi32(_mm_srli_si128(v,  8)));
+	_mm_storeu_si128((__m128i *)(out+i+12),
+			 _mm_cvtepu8_epi32(_mm_srli_si128(v, 12)));
+	cp += 16;
+	i  += 16;
+    }
+    return i + varint_run32_scalar(cp, endp, out+i, n-i);
+}
+
+__attribute__((target("sse4.1")))
+static int varint_run64_sse4(const uint8_t *cp, const uint8_t *endp,
+			     int64_t *out, int n) {
+    int i = 0, j;
+    while (n - i >= 16 && endp - cp >= 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *)cp);
+	if (_mm_movemask_epi8(v))
+	    break;
+	for (j = 0; j < 16; j += 2) {
+	    _mm_storeu_si128((__m128i *)(out+i+j), _mm_cvtepu8_epi64(v));
+	    v = _mm_srli_si128(v, 2);
+	}
+	cp += 16;
+	i  += 16;
+    }
+    return i + varint_run64_scalar(cp, endp, out+i, n-i);
+}
+
+__attribute__((target("avx2")))
+static int varint_run32_avx2(const uint8_t *cp, const uint8_t *endp,
+			     int32_t *out, int n) {
+    int i = 0, j;
+    while (n - i >= 32 && endp - cp >= 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i *)cp);
+	if (_mm256_movemask_epi8(v))
+	    break;
+	for (j = 0; j < 32; j += 8)
+	    _mm256_storeu_si256((__m256i *)(out+i+j),
+		_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(cp+j))));
+	cp += 32;
+	i  += 32;
+    }
+    return i + varint_run32_scalar(cp, endp, out+i, n-i);
+}
+
+__attribute__((target("avx2")))
+static int varint_run64_avx2(const uint8_t *cp, const uint8_t *endp,
+			     int64_t *out, int n) {
+    int i = 0, j;
+    while (n - i >= 32 && endp - cp >= 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i *)cp);
+	if (_mm256_movemask_epi8(v))
+	    break;
+	for (j = 0; j < 32; j += 4) {
+	    uint32_t w;
+	    memcpy(&w, cp+j, 4);
+	    _mm256_storeu_si256((__m256i *)(out+i+j),
+		_mm256_cvtepu8_epi64(_mm_cvtsi32_si128(w)));
+	}
+	cp += 32;
+	i  += 32;
+    }
+    return i + varint_run64_scalar(cp, endp, out+i, n-i);
+}
+#endif
+
+static int (*varint_run32)(const uint8_t *cp, const uint8_t *endp,
+			   int32_t *out, int n) = varint_run32_scalar;
+static int (*varint_run64)(const uint8_t *cp, const uint8_t *endp,
+			   int64_t *out, int n) = varint_run64_scalar;
+static pthread_once_t varint_run_once = PTHREAD_ONCE_INIT;
+
+static void varint_run_init(void) {
+#ifdef VARINT_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+	varint_run32 = varint_run32_avx2;
+	varint_run64 = varint_run64_avx2;
+    } else if (__builtin_cpu_supports("sse4.1")) {
+	varint_run32 = varint_run32_sse4;
+	varint_run64 = varint_run64_sse4;
+    }
+#endif
+}
+
+/*
+ * Decodes n values from *cp into out, using get() for multi-byte values.
+ * If zigzag is set single byte values are converted from the zig-zag
+ * signed representation; get() must already do this itself.
+ *
+ * Returns 0 on success, updating *cp;
+ *        -1 on failure
+ */
+static inline int varint_get_array32(char **cp, const char *endp,
+				     int32_t *out, int n, int zigzag,
+				     int64_t (*get)(char **, const char *, int *)) {
+    int i = 0, j, err = 0;
+
+    while (i < n) {
+	j = varint_run32((uint8_t *)*cp, (const uint8_t *)endp, out+i, n-i);
+	*cp += j;
+	if (zigzag)
+	    for (; j > 0; j--, i++)
+		out[i] = (out[i] >> 1) ^ -(out[i] & 1);
+	else
+	    i += j;
+
+	if (i < n) {
+	    out[i++] = get(cp, endp, &err);
+	    if (err)
+		return -1;
+	}
+    }
+
+    return 0;
+}
+
+static inline int varint_get_array64(char **cp, const char *endp,
+				     int64_t *out, int n, int zigzag,
+				     int64_t (*get)(char **, const char *, int *)) {
+    int i = 0, j, err = 0;
+
+    while (i < n) {
+	j = varint_run64((uint8_t *)*cp, (const uint8_t *)endp, out+i, n-i);
+	*cp += j;
+	if (zigzag)
+	    for (; j > 0; j--, i++)
+		out[i] = (out[i] >> 1) ^ -(out[i] & 1);
+	else
+	    i += j;
+
+	if (i < n) {
+	    out[i++] = get(cp, endp, &err);
+	    if (err)
+		return -1;
+	}
+    }
+
+    return 0;
+}
+
+static int itf8_get_array32(char **cp, const char *endp, int32_t *out, int n) {
+    return varint_get_array32(cp, endp, out, n, 0, safe_itf8_get);
+}
+
+static int ltf8_get_array64(char **cp, const char *endp, int64_t *out, int n) {
+    return varint_get_array64(cp, endp, out, n, 0, safe_ltf8_get);
+}
+
+static int uint7_get_array32(char **cp, const char *endp, int32_t *out, int n) {
+    return varint_get_array32(cp, endp, out, n, 0, uint7_get_32);
+}
+
+static int sint7_get_array32(char **cp, const char *endp, int32_t *out, int n) {
+    return varint_get_array32(cp, endp, out, n, 1, sint7_get_32);
+}
+
+static int uint7_get_array64(char **cp, const char *endp, int64_t *out, int n) {
+    return varint_get_array64(cp, endp, out, n, 0, uint7_get_64);
+}
+
+static int sint7_get_array64(char **cp, const char *endp, int64_t *out, int n) {
+    return varint_get_array64(cp, endp, out, n, 1, sint7_get_64);
+}
+
 //-----------------------------------------------------------------------------
 
 /*
@@ -1454,7 +2339,7 @@ int int32_put(cram_block *b, int32_t val) {
 // Named the same as the version that uses zlib as we always use libdeflate for
 // decompression when available.
 char *zlib_mem_inflate(char *cdata, size_t csize, size_t *size) {
-    struct libdeflate_decompressor *z = libdeflate_alloc_decompressor();
+    struct libdeflate_decompressor *z = codec_libdeflate_decompressor();
     if (!z) {
         fprintf(stderr, "Call to libdeflate_alloc_decompressor failed\n");
         return NULL;
@@ -1488,11 +2373,9 @@ char *zlib_mem_inflate(char *cdata, size_t csize, size_t *size) {
         }
     }
 
-    libdeflate_free_decompressor(z);
     return (char *)data;
 
  fail:
-    libdeflate_free_decompressor(z);
     free(data);
     return NULL;
 }
@@ -1512,7 +2395,7 @@ static char *libdeflate_deflate(char *data, size_t size, size_t *cdata_size,
     if (strat == Z_RLE || strat == GZIP_1 || level < 3)
 	level = 3;
 
-    struct libdeflate_compressor *z = libdeflate_alloc_compressor(level);
+    struct libdeflate_compressor *z = codec_libdeflate_compressor(level);
     if (!z) {
         fprintf(stderr, "Call to libdeflate_alloc_compressor failed\n");
         return NULL;
@@ -1523,12 +2406,10 @@ static char *libdeflate_deflate(char *data, size_t size, size_t *cdata_size,
     cdata = malloc(cdata_alloc = size*1.05+100);
     if (!cdata) {
         fprintf(stderr, "Memory allocation failure\n");
-        libdeflate_free_compressor(z);
         return NULL;
     }
 
     *cdata_size = libdeflate_gzip_compress(z, data, size, cdata, cdata_alloc);
-    libdeflate_free_compressor(z);
 
     if (*cdata_size == 0) {
         fprintf(stderr, "Call to libdeflate_gzip_compress failed\n");
@@ -1547,7 +2428,7 @@ static char *libdeflate_deflate(char *data, size_t size, size_t *cdata_size,
  * and cram_uncompress_block functions, which are the external interface.
  */
 char *zlib_mem_inflate(char *cdata, size_t csize, size_t *size) {
-    z_stream s;
+    z_stream *s;
     unsigned char *data = NULL; /* Uncompressed output */
     int data_alloc = 0;
     int err;
@@ -1557,61 +2438,51 @@ char *zlib_mem_inflate(char *cdata, size_t csize, size_t *size) {
     if (!data)
 	return NULL;
 
-    /* Initialise zlib stream */
-    s.zalloc = Z_NULL; /* use default allocation functions */
-    s.zfree  = Z_NULL;
-    s.opaque = Z_NULL;
-    s.next_in  = (unsigned char *)cdata;
-    s.avail_in = csize;
-    s.total_in = 0;
-    s.next_out  = data;
-    s.avail_out = data_alloc;
-    s.total_out = 0;
-
-    //err = inflateInit(&s);
-    err = inflateInit2(&s, 15 + 32);
-    if (err != Z_OK) {
-	fprintf(stderr, "zlib inflateInit error: %s\n", s.msg);
+    /* Fetch this thread's zlib stream, reset for gzip or zlib input */
+    if (!(s = codec_zlib_inflater(15 + 32))) {
 	free(data);
 	return NULL;
     }
+    s->next_in  = (unsigned char *)cdata;
+    s->avail_in = csize;
+    s->next_out  = data;
+    s->avail_out = data_alloc;
 
     /* Decode to 'data' array */
-    for (;s.avail_in;) {
+    for (;s->avail_in;) {
 	unsigned char *data_tmp;
 	int alloc_inc;
 
-	s.next_out = &data[s.total_out];
-	err = inflate(&s, Z_NO_FLUSH);
+	s->next_out = &data[s->total_out];
+	err = inflate(s, Z_NO_FLUSH);
 	if (err == Z_STREAM_END)
 	    break;
 
 	if (err != Z_OK) {
-	    fprintf(stderr, "zlib inflate error: %s\n", s.msg);
+	    fprintf(stderr, "zlib inflate error: %s\n", s->msg);
 	    if (data)
 		free(data);
 	    return NULL;
 	}
 
 	/* More to come, so realloc based on growth so far */
-	alloc_inc = (double)s.avail_in/s.total_in * s.total_out + 100;
+	alloc_inc = (double)s->avail_in/s->total_in * s->total_out + 100;
 	data = realloc((data_tmp = data), data_alloc += alloc_inc);
 	if (!data) {
 	    free(data_tmp);
 	    return NULL;
 	}
-	s.avail_out += alloc_inc;
+	s->avail_out += alloc_inc;
     }
-    inflateEnd(&s);
 
-    *size = s.total_out;
+    *size = s->total_out;
     return (char *)data;
 }
 #endif
 
 static char *zlib_mem_deflate(char *data, size_t size, size_t *cdata_size,
 			      int level, int strat) {
-    z_stream s;
+    z_stream *s;
     unsigned char *cdata = NULL; /* Compressed output */
     int cdata_alloc = 0;
     int cdata_pos = 0;
@@ -1622,47 +2493,36 @@ static char *zlib_mem_deflate(char *data, size_t size, size_t *cdata_size,
 	return NULL;
     cdata_pos = 0;
 
-    /* Initialise zlib stream */
-    s.zalloc = Z_NULL; /* use default allocation functions */
-    s.zfree  = Z_NULL;
-    s.opaque = Z_NULL;
-    s.next_in  = (unsigned char *)data;
-    s.avail_in = size;
-    s.total_in = 0;
-    s.next_out  = cdata;
-    s.avail_out = cdata_alloc;
-    s.total_out = 0;
-    s.data_type = Z_BINARY;
-
-    err = deflateInit2(&s, level, Z_DEFLATED, 15|16, 9, strat);
-    if (err != Z_OK) {
-	fprintf(stderr, "zlib deflateInit2 error: %s\n", s.msg);
+    /* Fetch this thread's zlib stream, reset for a new gzip stream */
+    if (!(s = codec_zlib_deflater(level, 15|16, 9, strat))) {
+	free(cdata);
 	return NULL;
     }
+    s->next_in  = (unsigned char *)data;
+    s->avail_in = size;
+    s->next_out  = cdata;
+    s->avail_out = cdata_alloc;
+    s->data_type = Z_BINARY;
 
     /* Encode to 'cdata' array */
-    for (;s.avail_in;) {
-	s.next_out = &cdata[cdata_pos];
-	s.avail_out = cdata_alloc - cdata_pos;
+    for (;s->avail_in;) {
+	s->next_out = &cdata[cdata_pos];
+	s->avail_out = cdata_alloc - cdata_pos;
 	if (cdata_alloc - cdata_pos <= 0) {
 	    fprintf(stderr, "Deflate produced larger output than expected. Abort\n"); 
 	    return NULL;
 	}
-	err = deflate(&s, Z_NO_FLUSH);
-	cdata_pos = cdata_alloc - s.avail_out;
+	err = deflate(s, Z_NO_FLUSH);
+	cdata_pos = cdata_alloc - s->avail_out;
 	if (err != Z_OK) {
-	    fprintf(stderr, "zlib deflate error: %s\n", s.msg);
+	    fprintf(stderr, "zlib deflate error: %s\n", s->msg);
 	    break;
 	}
     }
-    if (deflate(&s, Z_FINISH) != Z_STREAM_END) {
-	fprintf(stderr, "zlib deflate error: %s\n", s.msg);
-    }
-    *cdata_size = s.total_out;
-
-    if (deflateEnd(&s) != Z_OK) {
-	fprintf(stderr, "zlib deflate error: %s\n", s.msg);
+    if (deflate(s, Z_FINISH) != Z_STREAM_END) {
+	fprintf(stderr, "zlib deflate error: %s\n", s->msg);
     }
+    *cdata_size = s->total_out;
     return (char *)cdata;
 }
 
@@ -1685,66 +2545,78 @@ static char *lzma_mem_deflate(char *data, size_t size, size_t *cdata_size,
 			      int level) {
     char *out;
     size_t out_size = lzma_stream_buffer_bound(size);
+    lzma_stream *strm = codec_lzma_encoder();
     *cdata_size = 0;
 
-    out = malloc(out_size);
+    /*
+     * Single call compression.  Reinitialising this thread's encoder
+     * reuses its match finder buffers rather than allocating new ones,
+     * as lzma_easy_buffer_encode would.
+     */
+    if (!strm || LZMA_OK != lzma_easy_encoder(strm, level, LZMA_CHECK_CRC32))
+	return NULL;
+
+    if (!(out = malloc(out_size)))
+	return NULL;
 
-    /* Single call compression */
-    if (LZMA_OK != lzma_easy_buffer_encode(level, LZMA_CHECK_CRC32, NULL,
-					   (uint8_t *)data, size,
-					   (uint8_t *)out, cdata_size,
-					   out_size))
-    	return NULL;
+    strm->next_in   = (uint8_t *)data;
+    strm->avail_in  = size;
+    strm->next_out  = (uint8_t *)out;
+    strm->avail_out = out_size;
+    if (LZMA_STREAM_END != lzma_code(strm, LZMA_FINISH)) {
+	free(out);
+	return NULL;
+    }
 
+    *cdata_size = strm->total_out;
     return out;
 }
 
 static char *lzma_mem_inflate(char *cdata, size_t csize, size_t *size) {
-    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_stream *strm = codec_lzma_decoder();
     size_t out_size = 0, out_pos = 0;
     char *out = NULL;
     int r;
 
     /* Initiate the decoder */
-    if (LZMA_OK != lzma_stream_decoder(&strm, lzma_easy_decoder_memusage(9), 0))
+    if (!strm ||
+	LZMA_OK != lzma_stream_decoder(strm, lzma_easy_decoder_memusage(9), 0))
 	return NULL;
 
     /* Decode loop */
-    strm.avail_in = csize;
-    strm.next_in = (uint8_t *)cdata;
+    strm->avail_in = csize;
+    strm->next_in = (uint8_t *)cdata;
 
-    for (;strm.avail_in;) {
-	if (strm.avail_in > out_size - out_pos) {
-	    out_size += strm.avail_in * 4 + 32768;
+    for (;strm->avail_in;) {
+	if (strm->avail_in > out_size - out_pos) {
+	    out_size += strm->avail_in * 4 + 32768;
 	    out = realloc(out, out_size);
 	}
-	strm.avail_out = out_size - out_pos;
-	strm.next_out = (uint8_t *)&out[out_pos];
+	strm->avail_out = out_size - out_pos;
+	strm->next_out = (uint8_t *)&out[out_pos];
 
-	r = lzma_code(&strm, LZMA_RUN);
+	r = lzma_code(strm, LZMA_RUN);
 	if (LZMA_OK != r && LZMA_STREAM_END != r) {
 	    fprintf(stderr, "r=%d\n", r);
-	    fprintf(stderr, "mem=%"PRId64"\n", (int64_t)lzma_memusage(&strm));
+	    fprintf(stderr, "mem=%"PRId64"\n", (int64_t)lzma_memusage(strm));
 	    return NULL;
 	}
 
-	out_pos = strm.total_out;
+	out_pos = strm->total_out;
 
 	if (r == LZMA_STREAM_END)
 	    break;
     }
 
     /* finish up any unflushed data; necessary? */
-    r = lzma_code(&strm, LZMA_FINISH);
+    r = lzma_code(strm, LZMA_FINISH);
     if (r != LZMA_OK && r != LZMA_STREAM_END) {
 	fprintf(stderr, "r=%d\n", r);
 	return NULL;
     }
 
-    out = realloc(out, strm.total_out);
-    *size = strm.total_out;
-
-    lzma_end(&strm);
+    out = realloc(out, strm->total_out);
+    *size = strm->total_out;
 
     return out;
 }
@@ -1782,6 +2654,7 @@ cram_block *cram_new_block(enum cram_content_type content_type,
     b->crc32 = 0;
     b->idx = 0;
     b->m = NULL;
+    b->mapped = 0;
 
     return b;
 }
@@ -1811,6 +2684,16 @@ cram_block *cram_read_block(cram_fd *fd) {
     //    fprintf(stderr, "  method %d, ctype %d, cid %d, csize %d, ucsize %d\n",
     //	    b->method, b->content_type, b->content_id, b->comp_size, b->uncomp_size);
 
+    b->mapped = 0;
+#if defined(CRAM_IO_CUSTOM_BUFFERING)
+    // With mmapped input point straight into the mapping.
+    if ((b->data = cram_io_input_buffer_map(fd, b->method == RAW
+					    ? b->uncomp_size
+					    : b->comp_size))) {
+	b->alloc = b->method == RAW ? b->uncomp_size : b->comp_size;
+	b->mapped = 1;
+    } else
+#endif
     if (b->method == RAW) {
 	b->alloc = b->uncomp_size;
 	if (!(b->data = malloc(b->uncomp_size))){ free(b); return NULL; }
@@ -1850,23 +2733,60 @@ cram_block *cram_read_block(cram_fd *fd) {
     return b;
 }
 
+/*
+ * Encodes the header of block b into hdr, which must hold at least
+ * CRAM_BLOCK_HDR_MAX bytes.  For CRAM 3 onwards this also computes
+ * b->crc32 if not yet known.
+ *
+ * Returns the header length.
+ */
+#define CRAM_BLOCK_HDR_MAX 32
+static int cram_block_header_encode(cram_fd *fd, cram_block *b, char *hdr) {
+    char *cp = hdr, *endp = hdr + CRAM_BLOCK_HDR_MAX;
+
+    assert(b->method != RAW || (b->comp_size == b->uncomp_size));
+
+    *cp++ = b->method;
+    *cp++ = b->content_type;
+    cp += fd->vv.varint_put32(cp, endp, b->content_id);
+    cp += fd->vv.varint_put32(cp, endp, b->comp_size);
+    cp += fd->vv.varint_put32(cp, endp, b->uncomp_size);
+
+    if (IS_CRAM_3_VERS(fd) && !b->crc32) {
+	uint32_t crc = iolib_crc32(0L, (unsigned char *)hdr, cp-hdr);
+	b->crc32 = iolib_crc32(crc, b->data ? b->data : (uc*)"",
+			       b->method == RAW ? b->uncomp_size : b->comp_size);
+    }
+
+    return cp-hdr;
+}
+
+/*
+ * Returns the number of bytes block b occupies in the file, including
+ * its header and CRC.
+ */
+int cram_block_size(cram_fd *fd, cram_block *b) {
+    char hdr[CRAM_BLOCK_HDR_MAX], *endp = hdr + CRAM_BLOCK_HDR_MAX;
+    int sz = 2;
+
+    sz += fd->vv.varint_put32(hdr, endp, b->content_id);
+    sz += fd->vv.varint_put32(hdr, endp, b->comp_size);
+    sz += fd->vv.varint_put32(hdr, endp, b->uncomp_size);
+    sz += b->method == RAW ? b->uncomp_size : b->comp_size;
+
+    return IS_CRAM_3_VERS(fd) ? sz + 4 : sz;
+}
+
 /*
  * Writes a CRAM block.
  * Returns 0 on success
  *        -1 on failure
  */
 int cram_write_block(cram_fd *fd, cram_block *b) {
-    char vardata[100];
-    int vardata_o = 0;
-
-    assert(b->method != RAW || (b->comp_size == b->uncomp_size));
+    char hdr[CRAM_BLOCK_HDR_MAX];
+    int hdr_len = cram_block_header_encode(fd, b, hdr);
 
-    if (CRAM_IO_PUTC(b->method,       fd)   == EOF) return -1;
-    if (CRAM_IO_PUTC(b->content_type, fd)   == EOF) return -1;
-    vardata_o += fd->vv.varint_put32(vardata          , vardata+100, b->content_id);
-    vardata_o += fd->vv.varint_put32(vardata+vardata_o, vardata+100, b->comp_size);
-    vardata_o += fd->vv.varint_put32(vardata+vardata_o, vardata+100, b->uncomp_size);
-    if (vardata_o != CRAM_IO_WRITE(vardata, 1, vardata_o, fd))
+    if (hdr_len != CRAM_IO_WRITE(hdr, 1, hdr_len, fd))
 	return -1;
 
     if (b->method == RAW) {
@@ -1878,24 +2798,6 @@ int cram_write_block(cram_fd *fd, cram_block *b) {
     }
 
     if (IS_CRAM_3_VERS(fd)) {
-	char dat[100], *cp = dat;;
-	uint32_t crc;
-
-	*cp++ = b->method;
-	*cp++ = b->content_type;
-	cp += fd->vv.varint_put32(cp, dat+100, b->content_id);
-	cp += fd->vv.varint_put32(cp, dat+100, b->comp_size);
-	cp += fd->vv.varint_put32(cp, dat+100, b->uncomp_size);
-	crc = iolib_crc32(0L, (unsigned char *)dat, cp-dat);
-
-	if (!b->crc32) {
-	    if (b->method == RAW) {
-		b->crc32 = iolib_crc32(crc, b->data ? b->data : (uc*)"", b->uncomp_size);
-	    } else {
-		b->crc32 = iolib_crc32(crc, b->data ? b->data : (uc*)"", b->comp_size);
-	    }
-	}
-
 	if (-1 == int32_encode(fd, b->crc32))
 	    return -1;
     }
@@ -1909,11 +2811,41 @@ int cram_write_block(cram_fd *fd, cram_block *b) {
 void cram_free_block(cram_block *b) {
     if (!b)
 	return;
-    if (b->data)
+    if (b->data && !b->mapped)
 	free(b->data);
     free(b);
 }
 
+/*
+ * Gives a block read from a mapped file its own copy of the data.
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_block_own_data(cram_block *b) {
+    unsigned char *data;
+
+    if (!b->mapped)
+	return 0;
+
+    if (!(data = malloc(b->alloc ? b->alloc : 1)))
+	return -1;
+    memcpy(data, b->data, b->alloc);
+    b->data = data;
+    b->mapped = 0;
+    return 0;
+}
+
+/*
+ * Replaces the data of a block being uncompressed, freeing the old
+ * data unless it belongs to an input mapping.
+ */
+static void cram_block_set_data(cram_block *b, char *data) {
+    if (!b->mapped)
+	free(b->data);
+    b->mapped = 0;
+    b->data = (unsigned char *)data;
+}
+
 #ifdef HAVE_LIBBSC
 #define BSC_FEATURES LIBBSC_FEATURE_FASTMODE
 pthread_once_t bsc_once = PTHREAD_ONCE_INIT;
@@ -1958,8 +2890,7 @@ int cram_uncompress_block(cram_block *b) {
 	    free(uncomp);
 	    return -1;
 	}
-	free(b->data);
-	b->data = (unsigned char *)uncomp;
+	cram_block_set_data(b, uncomp);
 	b->alloc = uncomp_size;
 	b->method = RAW;
 	break;
@@ -1969,14 +2900,12 @@ int cram_uncompress_block(cram_block *b) {
 	unsigned int usize = b->uncomp_size;
 	if (!(uncomp = malloc(usize)))
 	    return -1;
-	if (BZ_OK != BZ2_bzBuffToBuffDecompress(uncomp, &usize,
-						(char *)b->data, b->comp_size,
-						0, 0)) {
+	if (BZ_OK != codec_bz2_decompress(uncomp, &usize,
+					  (char *)b->data, b->comp_size)) {
 	    free(uncomp);
 	    return -1;
 	}
-	free(b->data);
-	b->data = (unsigned char *)uncomp;
+	cram_block_set_data(b, uncomp);
 	b->alloc = usize;
 	b->method = RAW;
 	b->uncomp_size = usize; // Just incase it differs
@@ -2012,8 +2941,7 @@ int cram_uncompress_block(cram_block *b) {
 	    return -1;
 	}
 	
-	free(b->data);
-	b->data = (unsigned char *)uncomp;
+	cram_block_set_data(b, uncomp);
 	b->alloc = data_size;
 	b->method = RAW;
 	b->uncomp_size = data_size; // Just incase it differs
@@ -2031,8 +2959,7 @@ int cram_uncompress_block(cram_block *b) {
 	uncomp = fqz_decompress((char *)b->data, b->comp_size, &uncomp_size, NULL, 0);
 	if (!uncomp)
 	    return -1;
-	free(b->data);
-	b->data = (unsigned char *)uncomp;
+	cram_block_set_data(b, uncomp);
 	b->alloc = uncomp_size;
 	b->method = RAW;
 	break;
@@ -2045,8 +2972,7 @@ int cram_uncompress_block(cram_block *b) {
 	    return -1;
 	if ((int)uncomp_size != b->uncomp_size)
 	    return -1;
-	free(b->data);
-	b->data = (unsigned char *)uncomp;
+	cram_block_set_data(b, uncomp);
 	b->alloc = uncomp_size;
 	b->method = RAW;
 	break;
@@ -2064,12 +2990,20 @@ int cram_uncompress_block(cram_block *b) {
 	if (!uncomp)
 	    return -1;
 
-	size_t usize = ZSTD_decompress(uncomp, b->uncomp_size, b->data, b->comp_size);
+	ZSTD_DCtx *dctx = codec_zstd_dctx();
+	if (!dctx) {
+	    free(uncomp);
+	    return -1;
+	}
+
+	size_t usize = ZSTD_decompressDCtx(dctx, uncomp, b->uncomp_size,
+					   b->data, b->comp_size);
 
-	if ((int)usize != b->uncomp_size)
+	if ((int)usize != b->uncomp_size) {
+	    free(uncomp);
 	    return -1;
-	free(b->data);
-	b->data = (unsigned char *)uncomp;
+	}
+	cram_block_set_data(b, uncomp);
 	b->alloc = uncomp_size;
 	b->method = RAW;
 	break;
@@ -2088,8 +3022,7 @@ int cram_uncompress_block(cram_block *b) {
 	if (!uncomp || usize != usize2)
 	    return -1;
 	b->orig_method = b->data[0]&1 ? RANS1 : RANS0;
-	free(b->data);
-	b->data = (unsigned char *)uncomp;
+	cram_block_set_data(b, uncomp);
 	b->alloc = usize2;
 	b->method = RAW;
 	b->uncomp_size = usize2; // Just incase it differs
@@ -2115,8 +3048,7 @@ int cram_uncompress_block(cram_block *b) {
 	if (b->data[0] & 0x20) b->orig_method = RANS_PR32; // cat
 	if (b->data[0] & 0x08) b->orig_method = (b->data[0]&1)?RANS_PR9:RANS_PR9;
 
-	free(b->data);
-	b->data = (unsigned char *)uncomp;
+	cram_block_set_data(b, uncomp);
 	b->alloc = usize2;
 	b->method = RAW;
 	b->uncomp_size = usize2; // Just incase it differs
@@ -2143,8 +3075,7 @@ int cram_uncompress_block(cram_block *b) {
 	if (b->data[0] & 0x20) b->orig_method = ARITH_PR32; // cat
 	if (b->data[0] & 0x08) b->orig_method = (b->data[0]&1)?ARITH_PR9:ARITH_PR9;
 
-	free(b->data);
-	b->data = (unsigned char *)uncomp;
+	cram_block_set_data(b, uncomp);
 	b->alloc = usize2;
 	b->method = RAW;
 	b->uncomp_size = usize2; // Just incase it differs
@@ -2157,8 +3088,7 @@ int cram_uncompress_block(cram_block *b) {
 	uint8_t *cp = tok3_decode_names(b->data, b->comp_size, &out_len);
 	b->orig_method = NAME_TOK3;
 	b->method = RAW;
-	free(b->data);
-	b->data = cp;
+	cram_block_set_data(b, (char *)cp);
 	b->alloc = out_len;
 	b->uncomp_size = out_len;
 	break;
@@ -2253,9 +3183,9 @@ static char *cram_compress_by_method(cram_slice *s, char *in, size_t in_size,
 	if (!comp)
 	    return NULL;
 
-	if (BZ_OK != BZ2_bzBuffToBuffCompress(comp, &comp_size,
-					      in, in_size,
-					      level, 0, 30)) {
+	if (BZ_OK != codec_bz2_compress(comp, &comp_size,
+					in, in_size,
+					level, 30)) {
 	    free(comp);
 	    return NULL;
 	}
@@ -2330,6 +3260,10 @@ static char *cram_compress_by_method(cram_slice *s, char *in, size_t in_size,
     case ZSTD_1:
     case ZSTD: {
 #ifdef HAVE_ZSTD
+	ZSTD_CCtx *cctx = codec_zstd_cctx();
+	if (!cctx)
+	    return NULL;
+
 	size_t comp_size = ZSTD_compressBound(in_size);
 	char *comp = malloc(comp_size);
 	if (!comp)
@@ -2340,7 +3274,8 @@ static char *cram_compress_by_method(cram_slice *s, char *in, size_t in_size,
 	//int m[9] = {1,5,6,7,8,9,13,16,19};
 	int m[9] = {1,5,6,7,7,9,13,16,19};
 	level = m[level];
-	size_t csize = ZSTD_compress(comp, comp_size, in, in_size, level);
+	size_t csize = ZSTD_compressCCtx(cctx, comp, comp_size,
+					 in, in_size, level);
 	if (ZSTD_isError(csize)) {
 	    free(comp);
 	    return NULL;
@@ -2394,35 +3329,176 @@ static char *cram_compress_by_method(cram_slice *s, char *in, size_t in_size,
 	unsigned int out_size_i;
 	unsigned char *cp;
 
-	// see enum cram_block. We map ARITH_* methods to order bit-fields
-	static int methmap[] = { 1, 64,9, 128,129, 192,193 };
+	// see enum cram_block. We map ARITH_* methods to order bit-fields
+	static int methmap[] = { 1, 64,9, 128,129, 192,193 };
+
+	cp = arith_compress_to((unsigned char *)in, in_size, NULL, &out_size_i,
+			       method == ARITH_PR0 ? 0 : methmap[method - ARITH_PR1]);
+	*out_size = out_size_i;
+	return (char *)cp;
+    }
+
+    case NAME_TOK3:
+    case NAME_TOKA: {
+	int out_len;
+	int lev = level;
+	if (method == NAME_TOK3 && lev > 3)
+	    lev = 3;
+	uint8_t *cp = tok3_encode_names(in, in_size, lev, strat, &out_len,
+					NULL);
+	*out_size = out_len;
+	return (char *)cp;
+    }
+
+    case RAW:
+	break;
+
+    default:
+        return NULL;
+    }
+
+    return NULL;
+}
+
+/*
+ * CPU time in seconds used by the calling thread, for timing compression
+ * trials.  Trials may run concurrently, so wall clock time would also
+ * count time spent waiting for a CPU.  Falls back to wall clock time
+ * where per-thread CPU clocks are unavailable.
+ */
+static double cram_clock(void) {
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Sets the level and strategy to use for internal method m.
+ */
+static void cram_method_params(cram_fd *fd, int m, int level,
+			       int *lvl, int *strat) {
+    *lvl = level;
+    switch (m) {
+    case GZIP:     *strat = Z_FILTERED; break;
+    case GZIP_1:   *strat = Z_DEFAULT_STRATEGY; *lvl = 1; break;
+    case GZIP_RLE: *strat = Z_RLE; break;
+    case FQZ:      *strat = CRAM_MAJOR_VERS(fd->version); break;
+    case FQZ_b:    *strat = CRAM_MAJOR_VERS(fd->version)+256; break;
+    case FQZ_c:    *strat = CRAM_MAJOR_VERS(fd->version)+2*256; break;
+    case FQZ_d:    *strat = CRAM_MAJOR_VERS(fd->version)+3*256; break;
+    case NAME_TOK3:*strat = 0; break;
+    case NAME_TOKA:*strat = 1; break;
+    case ZSTD_1:   *lvl = 1; break;
+    default:       *strat = 0;
+    }
+}
+
+/*
+ * Builds a sample of roughly sample_size bytes from evenly spaced
+ * chunks of b, for trialling compression methods on large blocks.
+ *
+ * Returns malloced sample on success, with its length in *len;
+ *         NULL on failure
+ */
+static char *cram_trial_sample(cram_block *b, int sample_size, size_t *len) {
+    size_t chunk = MIN(TRIAL_CHUNK, sample_size);
+    size_t n = (sample_size + chunk-1) / chunk, i;
+    size_t stride = b->uncomp_size / n;
+    char *sample;
+
+    if (!(sample = malloc(n * chunk)))
+	return NULL;
+
+    for (i = 0; i < n; i++)
+	memcpy(sample + i*chunk, b->data + i*stride, chunk);
+
+    *len = n * chunk;
+    return sample;
+}
+
+/*
+ * A single trial compression of a block by one method, as run by
+ * cram_compress_block when choosing the best method.
+ */
+typedef struct {
+    cram_slice *s;
+    cram_block *b;
+    char *in;        // whole block or a sample of it
+    size_t in_sz;
+    int m, lvl, strat;
+
+    char *out;       // results
+    size_t sz;
+    double t;
+} cram_trial_job;
+
+static void *cram_trial_job_run(void *arg) {
+    cram_trial_job *j = (cram_trial_job *)arg;
+
+    j->sz = 0;
+    j->t = cram_clock();
+    j->out = cram_compress_by_method(j->s, j->in, j->in_sz,
+				     j->b->content_id, &j->sz, j->m,
+				     j->lvl, j->strat);
+    j->t = cram_clock() - j->t;
+
+    return NULL;
+}
+
+/*
+ * Runs the trial compressions for a block.  With a thread pool each
+ * method is a separate job, so a block with many candidate methods is
+ * no longer compressed serially within one job.  As with the per-block
+ * jobs in cram_compress_slice we are normally inside another pool job,
+ * so wait with t_pool_flush_queue to avoid deadlocking a busy pool.
+ *
+ * A failed trial is reported as out == NULL, as with a failed method.
+ *
+ * Returns 0 on success
+ *        -1 on failure to queue the jobs
+ */
+static int cram_trial_jobs_run(cram_fd *fd, cram_trial_job *jobs, int njobs) {
+    t_results_queue *q;
+    t_pool_result *r;
+    int i, err = 0;
 
-	cp = arith_compress_to((unsigned char *)in, in_size, NULL, &out_size_i,
-			       method == ARITH_PR0 ? 0 : methmap[method - ARITH_PR1]);
-	*out_size = out_size_i;
-	return (char *)cp;
+    if (!fd->pool || njobs < 2) {
+	for (i = 0; i < njobs; i++)
+	    cram_trial_job_run(&jobs[i]);
+	return 0;
     }
 
-    case NAME_TOK3:
-    case NAME_TOKA: {
-	int out_len;
-	int lev = level;
-	if (method == NAME_TOK3 && lev > 3)
-	    lev = 3;
-	uint8_t *cp = tok3_encode_names(in, in_size, lev, strat, &out_len,
-					NULL);
-	*out_size = out_len;
-	return (char *)cp;
+    if (!(q = t_results_queue_init()))
+	return -1;
+
+    for (i = 0; i < njobs; i++)
+	jobs[i].out = NULL;
+
+    for (i = 0; i < njobs; i++) {
+	if (t_pool_dispatch2(fd->pool, q, cram_trial_job_run,
+			     &jobs[i], -1) < 0) {
+	    err = 1;
+	    break;
+	}
     }
 
-    case RAW:
-	break;
+    t_pool_flush_queue(fd->pool, q);
+    while ((r = t_pool_next_result(q)))
+	t_pool_delete_result(r, 0);
+    t_results_queue_destroy(q);
 
-    default:
-        return NULL;
+    if (err) {
+	for (i = 0; i < njobs; i++)
+	    free(jobs[i].out);
+	return -1;
     }
 
-    return NULL;
+    return 0;
 }
 
 /*
@@ -2497,8 +3573,13 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 	    int m;
 	    size_t sz_best = INT_MAX;
 	    size_t sz[CRAM_MAX_METHOD] = {0};
+	    double t[CRAM_MAX_METHOD] = {0};
 	    int64_t method_best = 0;
-	    char *c_best = NULL, *c = NULL;
+	    int64_t sampled = 0;
+	    char *c_best = NULL, *c = NULL, *sample = NULL;
+	    size_t sample_sz = 0;
+	    cram_trial_job trial[CRAM_MAX_METHOD];
+	    int ntrial = 0;
 
 	    if (metrics->revised_method)
 		method = metrics->revised_method;
@@ -2508,8 +3589,11 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 	    if (metrics->next_trial <= 0) {
 		metrics->next_trial = TRIAL_SPAN;
 		metrics->trial = NTRIALS;
-		for (m = 0; m < CRAM_MAX_METHOD; m++)
+		for (m = 0; m < CRAM_MAX_METHOD; m++) {
 		    metrics->sz[m] /= 2;
+		    metrics->time[m] /= 2;
+		}
+		metrics->usz /= 2;
 	    }
 
             // Compress this block using the best method
@@ -2535,28 +3619,61 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 	    }
 	    if (fd->metrics_lock) pthread_mutex_unlock(fd->metrics_lock);
 
-            for (m = 0; m < CRAM_MAX_METHOD; m++) {
+	    // For large blocks only trial a sample, extrapolating the
+	    // sizes and times, and then compress the whole block with
+	    // the best method.
+	    if (fd->trial_sample > 0 &&
+		b->uncomp_size >= 4*(int64_t)fd->trial_sample)
+		sample = cram_trial_sample(b, fd->trial_sample, &sample_sz);
+
+	    // Queue one trial per candidate method, then run them.
+	    for (m = 0; m < CRAM_MAX_METHOD; m++) {
+		cram_trial_job *j = &trial[ntrial];
+		int whole;
+
+		if (!(method & (1LL<<m)))
+		    continue;
+
+		// fqzcomp and the name tokeniser need whole records
+		whole = !sample ||
+		    m == FQZ || m == FQZ_b || m == FQZ_c || m == FQZ_d ||
+		    m == NAME_TOK3 || m == NAME_TOKA;
+
+		j->s = s;
+		j->b = b;
+		j->m = m;
+		j->in    = whole ? (char *)b->data : sample;
+		j->in_sz = whole ? b->uncomp_size  : sample_sz;
+		cram_method_params(fd, m, level, &j->lvl, &j->strat);
+		ntrial++;
+	    }
+
+	    if (cram_trial_jobs_run(fd, trial, ntrial) < 0) {
+		free(sample);
+		return -1;
+	    }
+
+            for (m = 0, ntrial = 0; m < CRAM_MAX_METHOD; m++) {
 		if (method & (1LL<<m)) {
-		    int lvl = level;
-		    switch (m) {
-		    case GZIP:     strat = Z_FILTERED; break;
-		    case GZIP_1:   strat = Z_DEFAULT_STRATEGY; lvl = 1; break;
-		    case GZIP_RLE: strat = Z_RLE; break;
-		    case FQZ:      strat = CRAM_MAJOR_VERS(fd->version); break;
-		    case FQZ_b:    strat = CRAM_MAJOR_VERS(fd->version)+256; break;
-		    case FQZ_c:    strat = CRAM_MAJOR_VERS(fd->version)+2*256; break;
-		    case FQZ_d:    strat = CRAM_MAJOR_VERS(fd->version)+3*256; break;
-		    case NAME_TOK3:strat = 0; break;
-		    case NAME_TOKA:strat = 1; break;
-		    case ZSTD_1:   lvl = 1; break;
-		    default:       strat = 0;
+		    cram_trial_job *j = &trial[ntrial++];
+		    int whole = j->in != sample;
+
+		    c = j->out;
+		    sz[m] = j->sz;
+		    t[m] = j->t;
+		    strat = j->strat;
+
+		    if (c && !whole) {
+			double scale = (double)b->uncomp_size / sample_sz;
+			sz[m] *= scale;
+			t[m]  *= scale;
+			sampled |= 1LL<<m;
 		    }
 
-		    c = cram_compress_by_method(s, (char *)b->data, b->uncomp_size,
-						b->content_id, &sz[m], m, lvl, strat);
                     if (fd->verbose > 1)
-                        fprintf(stderr, "Try compression of block ID %d from %d to %d by method %s, strat %d\n",
-                                b->content_id, b->uncomp_size, (int)sz[m], cram_block_method2str(m), strat);
+                        fprintf(stderr, "Try compression of block ID %d from %d to %d by method %s, strat %d%s\n",
+                                b->content_id, b->uncomp_size, (int)sz[m], cram_block_method2str(m), strat,
+				c && !whole ? " (sampled)" : "");
 
 		    if (c && sz_best > sz[m]) {
 			sz_best = sz[m];
@@ -2568,6 +3685,7 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 			free(c);
 		    } else {
 			sz[m] = b->uncomp_size*2+1000; // arbitrarily worse than raw
+			t[m] = 1e6; // and arbitrarily slow, for target_rate
 		    }
 		} else {
 		    sz[m] = b->uncomp_size*2+1000; // arbitrarily worse than raw
@@ -2576,6 +3694,20 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 
 	    //fprintf(stderr, "sz_best = %d\n", sz_best);
 
+	    free(sample);
+	    if (sampled & (1LL<<method_best)) {
+		int lvl;
+		free(c_best);
+		cram_method_params(fd, method_best, level, &lvl, &strat);
+		c_best = cram_compress_by_method(s, (char *)b->data,
+						 b->uncomp_size,
+						 b->content_id, &sz_best,
+						 method_best, lvl, strat);
+		if (!c_best)
+		    return -1;
+		sz[method_best] = sz_best;
+	    }
+
 	    free(b->data);
 	    b->data = (unsigned char *)c_best;
 	    //printf("method_best = %s\n", cram_block_method2str(method_best));
@@ -2586,8 +3718,11 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 
 	    // Accumulate stats for all methods tried
 	    if (fd->metrics_lock) pthread_mutex_lock(fd->metrics_lock);
-            for (m = 0; m < CRAM_MAX_METHOD; m++)
+            for (m = 0; m < CRAM_MAX_METHOD; m++) {
                 metrics->sz[m] += sz[m]+50; // don't be overly sure on small blocks
+		metrics->time[m] += t[m];
+	    }
+	    metrics->usz += b->uncomp_size;
 
 	    // When enough trials performed, find the best on average
 	    if (--metrics->trial == 0) {
@@ -2637,8 +3772,12 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 		    1.01, // ZSTD -1
 		};
 
-		// Scale methods by cost based on compression level
-		if (fd->level <= 1) {
+		// Scale methods by cost based on compression level.
+		// With a target rate the measured times replace these
+		// guesses, so sizes are compared unscaled.
+		if (fd->target_rate > 0) {
+		    ;
+		} else if (fd->level <= 1) {
 		    for (m = 0; m < CRAM_MAX_METHOD; m++)
 			metrics->sz[m] *= 1+(meth_cost[m]-1)*4;
 		} else if (fd->level <= 3) {
@@ -2660,6 +3799,38 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 			best_sz = metrics->sz[m], best_method = m;
 		}
 
+		if (fd->target_rate > 0) {
+		    // Pick the smallest method fast enough to sustain the
+		    // target rate on each thread, falling back to the
+		    // fastest method if none of them are.  If every block
+		    // meets the rate then so does the file as a whole.
+		    double rate = fd->target_rate;
+		    double best_t = 1e100;
+		    int fast_method = RAW;
+
+		    if (fd->pool && fd->pool->tsize > 1)
+			rate /= fd->pool->tsize;
+
+		    best_sz = INT_MAX;
+		    best_method = -1;
+		    for (m = 0; m < CRAM_MAX_METHOD; m++) {
+			if ((!metrics->sz[m]) || (!(method & (1LL<<m))))
+			    continue;
+
+			if (best_t > metrics->time[m])
+			    best_t = metrics->time[m], fast_method = m;
+
+			if (metrics->time[m] > 0 &&
+			    metrics->usz / metrics->time[m] < rate)
+			    continue;
+
+			if (best_sz > metrics->sz[m])
+			    best_sz = metrics->sz[m], best_method = m;
+		    }
+		    if (best_method < 0)
+			best_method = fast_method;
+		}
+
 		if (fd->verbose > 1)
 		    fprintf(stderr, "Choosing method %s (was %s), strat %d for block ID %d\n",
 			    cram_block_method2str(best_method),
@@ -2787,6 +3958,169 @@ cram_metrics *cram_new_metrics(void) {
     return m;
 }
 
+/*
+ * Metrics profiles.
+ *
+ * The methods chosen by the compression trials can be saved to a small
+ * text file on closing an output file and preloaded when writing the
+ * next one.  This avoids spending the first containers of every file
+ * trialling all methods.  The usual periodic re-trials still occur.
+ *
+ * Learnt methods are only valid for the same encoding parameters, so
+ * the profile holds a signature of these and is ignored if it differs.
+ */
+#define METRICS_PROFILE_MAGIC "##cram_metrics\t1\n"
+
+static void cram_metrics_signature(cram_fd *fd, char *sig, size_t len) {
+    snprintf(sig, len, "#sig\t%d\t%d\t%d\t%d%d%d%d%d%d%d%d\t%d\t%d\t%d\n",
+	     fd->version, fd->level, (int)(fd->target_rate/1000),
+	     fd->use_rans, fd->use_bz2, fd->use_lzma, fd->use_bsc,
+	     fd->use_zstd, fd->use_fqz, fd->use_tok, fd->use_arith,
+	     (int)fd->binning, CRAM_MAX_METHOD, DS_END);
+}
+
+/*
+ * Loads fd->metrics_profile, if it exists, into fd->m[] and
+ * fd->tags_used.  A missing or mismatching profile is not an error.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_load_metrics(cram_fd *fd) {
+    char line[1024], sig[256], type[16], key[16];
+    int64_t method, revised;
+    int strat, consistency;
+    FILE *fp;
+
+    if (!(fp = fopen(fd->metrics_profile, "r")))
+	return 0;
+
+    cram_metrics_signature(fd, sig, sizeof(sig));
+    if (!fgets(line, sizeof(line), fp) ||
+	strcmp(line, METRICS_PROFILE_MAGIC) != 0 ||
+	!fgets(line, sizeof(line), fp) ||
+	strcmp(line, sig) != 0) {
+	if (fd->verbose)
+	    fprintf(stderr, "Ignoring metrics profile %s: different "
+		    "parameters\n", fd->metrics_profile);
+	fclose(fp);
+	return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+	cram_metrics *m = NULL;
+
+	if (sscanf(line, "%15s %15s %"SCNd64" %d %"SCNd64" %d",
+		   type, key, &method, &strat, &revised, &consistency) != 6 ||
+	    method < 0 || method >= CRAM_MAX_METHOD ||
+	    !(revised & (1LL<<method))) {
+	    fprintf(stderr, "Malformed metrics profile %s\n",
+		    fd->metrics_profile);
+	    fclose(fp);
+	    return -1;
+	}
+
+	if (strcmp(type, "DS") == 0) {
+	    int ds = atoi(key);
+	    if (ds >= 0 && ds < DS_END)
+		m = fd->m[ds];
+	} else if (strcmp(type, "TAG") == 0 && strlen(key) == 3) {
+	    HashData hd;
+	    HashItem *hi;
+
+	    hd.p = NULL;
+	    if (!(hi = HashTableAdd(fd->tags_used, key, 3, hd, NULL))) {
+		fclose(fp);
+		return -1;
+	    }
+	    if (!hi->data.p)
+		hi->data.p = cram_new_metrics();
+	    m = (cram_metrics *)hi->data.p;
+	}
+	if (!m)
+	    continue;
+
+	// Skip the initial trials, but still recheck after a span.
+	m->method = method;
+	m->strat = strat;
+	m->revised_method = revised;
+	m->consistency = consistency;
+	m->trial = 0;
+	m->next_trial = TRIAL_SPAN;
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+static void cram_save_metric(FILE *fp, char *type, char *key,
+			     cram_metrics *m) {
+    // Only record metrics which have completed a round of trials.
+    if (!m || !m->revised_method || (m->method == RAW && !m->consistency))
+	return;
+
+    fprintf(fp, "%s\t%s\t%"PRId64"\t%d\t%"PRId64"\t%d\n",
+	    type, key, m->method, m->strat, m->revised_method,
+	    m->consistency);
+}
+
+/*
+ * Writes fd->m[] and fd->tags_used to fd->metrics_profile.  The file
+ * is written to a temporary name and renamed into place so concurrent
+ * jobs sharing a profile always see a complete one.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_save_metrics(cram_fd *fd) {
+    char sig[256], *tmp;
+    FILE *fp;
+    int i;
+
+    if (!(tmp = malloc(strlen(fd->metrics_profile) + 30)))
+	return -1;
+    sprintf(tmp, "%s.tmp%d", fd->metrics_profile, (int)getpid());
+    if (!(fp = fopen(tmp, "w"))) {
+	perror(tmp);
+	free(tmp);
+	return -1;
+    }
+
+    cram_metrics_signature(fd, sig, sizeof(sig));
+    fputs(METRICS_PROFILE_MAGIC, fp);
+    fputs(sig, fp);
+
+    for (i = 0; i < DS_END; i++) {
+	char key[16];
+	sprintf(key, "%d", i);
+	cram_save_metric(fp, "DS", key, fd->m[i]);
+    }
+
+    if (fd->tags_used) {
+	HashIter *iter = HashTableIterCreate();
+	HashItem *hi;
+	while (iter && (hi = HashTableIterNext(fd->tags_used, iter))) {
+	    char key[4];
+	    if (hi->key_len != 3)
+		continue;
+	    memcpy(key, hi->key, 3);
+	    key[3] = 0;
+	    cram_save_metric(fp, "TAG", key, (cram_metrics *)hi->data.p);
+	}
+	HashTableIterDestroy(iter);
+    }
+
+    if (fclose(fp) != 0 || rename(tmp, fd->metrics_profile) != 0) {
+	perror(fd->metrics_profile);
+	unlink(tmp);
+	free(tmp);
+	return -1;
+    }
+
+    free(tmp);
+    return 0;
+}
+
 char *cram_block_method2str(enum cram_block_method m) {
     switch(m) {
     case RAW:	      return "RAW";
@@ -4178,6 +5512,12 @@ cram_container *cram_read_container(cram_fd *fd) {
 	}
     }
 
+#if defined(CRAM_IO_CUSTOM_BUFFERING)
+    // Start paging in the rest of the container if mmapped
+    if (c->length > 0)
+	cram_io_input_buffer_willneed(fd, c->length);
+#endif
+
     c->offset = rd;
     c->slices = NULL;
     c->curr_slice = 0;
@@ -4200,20 +5540,18 @@ cram_container *cram_read_container(cram_fd *fd) {
 }
 
 /*
- * Writes a container structure.
+ * Encodes a container structure into buf, which must hold at least
+ * CRAM_CONTAINER_HDR_MAX(c) bytes.
  *
- * Returns 0 on success
- *        -1 on failure
+ * Returns the encoded length.
  */
-int cram_write_container(cram_fd *fd, cram_container *c) {
-    char buf_a[1024], *buf = buf_a, *cp;
+// worse case sizes given 32-bit & 64-bit quantities.
+#define CRAM_CONTAINER_HDR_MAX(c) (62 + (c)->num_landmarks * 10)
+static int cram_container_header_encode(cram_fd *fd, cram_container *c,
+					char *buf) {
+    char *cp = buf;
     int i;
 
-    // worse case sizes given 32-bit & 64-bit quantities.
-    if (62 + c->num_landmarks * 10 >= 1024)
-	buf = malloc(61 + c->num_landmarks * 10);
-    cp = buf;
-
     if (CRAM_MAJOR_VERS(fd->version) >= 4) {
 	cp += fd->vv.varint_put32(cp, NULL, c->length);
     } else {
@@ -4255,7 +5593,26 @@ int cram_write_container(cram_fd *fd, cram_container *c) {
 	cp += 4;
     }
 
-    if (cp-buf != CRAM_IO_WRITE(buf, 1, cp-buf, fd)) {
+    return cp-buf;
+}
+
+/*
+ * Writes a container structure.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_write_container(cram_fd *fd, cram_container *c) {
+    char buf_a[1024], *buf = buf_a;
+    int len;
+
+    if (CRAM_CONTAINER_HDR_MAX(c) >= 1024)
+	if (!(buf = malloc(CRAM_CONTAINER_HDR_MAX(c))))
+	    return -1;
+
+    len = cram_container_header_encode(fd, c, buf);
+
+    if (len != CRAM_IO_WRITE(buf, 1, len, fd)) {
 	if (buf != buf_a)
 	    free(buf);
 	return -1;
@@ -4267,6 +5624,123 @@ int cram_write_container(cram_fd *fd, cram_container *c) {
     return 0;
 }
 
+#ifdef CRAM_IO_WRITEV
+/*
+ * Appends len bytes at p to the iovec list, merging with the previous
+ * entry when contiguous.
+ */
+static void cram_iov_add(struct iovec *iov, int *niov, void *p, size_t len) {
+    if (!len)
+	return;
+    if (*niov && (char *)iov[*niov-1].iov_base + iov[*niov-1].iov_len == p) {
+	iov[*niov-1].iov_len += len;
+    } else {
+	iov[*niov].iov_base = p;
+	iov[*niov].iov_len = len;
+	(*niov)++;
+    }
+}
+
+/*
+ * Writes an entire container, its compression header and slice blocks
+ * with writev.  The encoded headers are gathered in one small buffer
+ * while block data is written straight from the blocks, avoiding a copy
+ * through the output buffer.
+ *
+ * This is only possible when writing to a FILE; with user supplied
+ * output callbacks (or the writer thread) it returns 1 having written
+ * nothing, so the caller can fall back to the buffered path.
+ *
+ * Returns 0 on success;
+ *         1 if not applicable;
+ *        -1 on failure
+ */
+static int cram_writev_container(cram_fd *fd, cram_container *c) {
+    struct iovec *iov;
+    char *hdr, *cp;
+    int i, j, nblk, niov = 0, ret = -1;
+    size_t total = 0;
+
+    if (!fd->fp_out)
+	return 1;
+#if defined(CRAM_IO_CUSTOM_BUFFERING)
+    if (fd->fp_out_callbacks->fwrite_callback != cram_io_C_FILE_fwrite)
+	return 1;
+    if (cram_io_flush_output_buffer(fd) != 0)
+	return -1;
+#endif
+    if (fflush(fd->fp_out) != 0)
+	return -1;
+
+    nblk = 1;
+    for (i = 0; i < c->curr_slice; i++)
+	nblk += 1 + c->slices[i]->hdr->num_blocks;
+
+    hdr = malloc(CRAM_CONTAINER_HDR_MAX(c) + nblk * (CRAM_BLOCK_HDR_MAX+4));
+    iov = malloc((1 + 3*nblk) * sizeof(*iov));
+    if (!hdr || !iov)
+	goto err;
+
+    cp = hdr + cram_container_header_encode(fd, c, hdr);
+    cram_iov_add(iov, &niov, hdr, cp-hdr);
+
+    for (i = -1; i < c->curr_slice; i++) {
+	cram_slice *s = i >= 0 ? c->slices[i] : NULL;
+	for (j = -1; j < (s ? s->hdr->num_blocks : 0); j++) {
+	    cram_block *b = !s ? c->comp_hdr_block
+		: j < 0 ? s->hdr_block : s->block[j];
+	    char *bh = cp;
+
+	    cp += cram_block_header_encode(fd, b, cp);
+	    cram_iov_add(iov, &niov, bh, cp-bh);
+	    cram_iov_add(iov, &niov, b->data,
+			 b->method == RAW ? b->uncomp_size : b->comp_size);
+
+	    if (IS_CRAM_3_VERS(fd)) {
+		bh = cp;
+		*cp++ =  b->crc32        & 0xff;
+		*cp++ = (b->crc32 >>  8) & 0xff;
+		*cp++ = (b->crc32 >> 16) & 0xff;
+		*cp++ = (b->crc32 >> 24) & 0xff;
+		cram_iov_add(iov, &niov, bh, 4);
+	    }
+	}
+    }
+
+    for (i = 0; i < niov; ) {
+	int n = niov - i;
+	ssize_t w;
+
+	if (n > IOV_MAX)
+	    n = IOV_MAX;
+	if ((w = writev(fileno(fd->fp_out), iov+i, n)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    goto err;
+	}
+	total += w;
+
+	// Skip fully written entries and trim a partially written one
+	while (i < niov && (size_t)w >= iov[i].iov_len)
+	    w -= iov[i++].iov_len;
+	if (w) {
+	    iov[i].iov_base = (char *)iov[i].iov_base + w;
+	    iov[i].iov_len -= w;
+	}
+    }
+
+#if defined(CRAM_IO_CUSTOM_BUFFERING)
+    fd->fp_out_buffer->fp_out_buf_start += total;
+#endif
+    ret = 0;
+
+ err:
+    free(hdr);
+    free(iov);
+    return ret;
+}
+#endif
+
 // common component shared by cram_flush_container{,_mt}
 static int cram_flush_container2(cram_fd *fd, cram_container *c) {
     int i, j;
@@ -4276,6 +5750,12 @@ static int cram_flush_container2(cram_fd *fd, cram_container *c) {
 
     //fprintf(stderr, "Writing container %d, sum %u\n", c->record_counter, sum);
 
+#ifdef CRAM_IO_WRITEV
+    /* Gather the whole container into one writev where possible */
+    if ((i = cram_writev_container(fd, c)) <= 0)
+	return i;
+#endif
+
     /* Write the container struct itself */
     if (0 != cram_write_container(fd, c))
 	return -1;
@@ -4430,14 +5910,25 @@ void reset_metrics(cram_fd *fd) {
 	m->next_trial = TRIAL_SPAN;
 	m->revised_method = 0;
 
-	for (j = 0; j < CRAM_MAX_METHOD; j++)
+	for (j = 0; j < CRAM_MAX_METHOD; j++) {
 	    m->sz[j] = 0;
+	    m->time[j] = 0;
+	}
+	m->usz = 0;
     }
 }
 
 int cram_flush_container_mt(cram_fd *fd, cram_container *c) {
     cram_job *j;
 
+    // All options are known by the first flush, so we can now check
+    // the metrics profile matches them.
+    if (fd->metrics_profile && !fd->metrics_loaded) {
+	fd->metrics_loaded = 1;
+	if (cram_load_metrics(fd) < 0)
+	    return -1;
+    }
+
     // At the junction of mapped to unmapped data the compression
     // methods may need to change due to very different statistical
     // properties; particularly BA if minhash sorted.
@@ -4498,9 +5989,49 @@ cram_block_compression_hdr *cram_new_compression_header(void) {
     return hdr;
 }
 
+/*
+ * Protects the reference counts of compression headers shared between
+ * containers.  These may be freed by different threads, and after
+ * their cram_fd has gone, so the lock cannot live in the cram_fd.
+ */
+static pthread_mutex_t comp_hdr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void cram_ref_compression_header(cram_block_compression_hdr *hdr) {
+    pthread_mutex_lock(&comp_hdr_lock);
+    hdr->ref_count++;
+    pthread_mutex_unlock(&comp_hdr_lock);
+}
+
+/*
+ * Releases the cache references to headers in fd->comp_hdr_cache and
+ * empties it.
+ */
+void cram_free_compression_header_cache(cram_fd *fd) {
+    int i;
+
+    for (i = 0; i < CRAM_HDR_CACHE_MAX; i++) {
+	cram_hdr_cache *hc = &fd->comp_hdr_cache[i];
+	if (hc->hdr)
+	    cram_free_compression_header(hc->hdr);
+	free(hc->data);
+	memset(hc, 0, sizeof(*hc));
+    }
+    fd->comp_hdr_next = 0;
+}
+
 void cram_free_compression_header(cram_block_compression_hdr *hdr) {
     int i;
 
+    // Cached headers are shared, so only free on the last reference.
+    // Uncached ones always have a zero ref_count.
+    if (hdr->ref_count) {
+	pthread_mutex_lock(&comp_hdr_lock);
+	i = --hdr->ref_count;
+	pthread_mutex_unlock(&comp_hdr_lock);
+	if (i > 0)
+	    return;
+    }
+
     if (hdr->landmark)
 	free(hdr->landmark);
 
@@ -4628,6 +6159,9 @@ void cram_free_slice(cram_slice *s) {
     if (s->crecs)
 	free(s->crecs);
 
+    if (s->ds_batch)
+	free(s->ds_batch);
+
     if (s->features)
 	free(s->features);
 
@@ -4728,7 +6262,18 @@ cram_slice *cram_new_slice(enum cram_content_type type, int nrecs) {
  *         NULL on failure
  */
 cram_slice *cram_read_slice(cram_fd *fd) {
-    cram_block *b = cram_read_block(fd);
+    return cram_read_slice_blocks(fd, cram_read_block(fd));
+}
+
+/*
+ * Loads the remainder of a slice whose header block, b, has already
+ * been read.  Ownership of b passes to the slice, or it is freed on
+ * failure.
+ *
+ * Returns cram_slice ptr on success
+ *         NULL on failure
+ */
+cram_slice *cram_read_slice_blocks(cram_fd *fd, cram_block *b) {
     cram_slice *s = calloc(1, sizeof(*s));
     int i, n, max_id, min_id;
 
@@ -5204,11 +6749,17 @@ int cram_write_SAM_hdr(cram_fd *fd, SAM_hdr *hdr) {
  * vv is the vector table (probably &cram_fd->vv)
  */
 void cram_init_varint(varint_vec *vv, int version) {
+    pthread_once(&varint_run_once, varint_run_init);
+
     if (version >= 4) {
 	vv->varint_get32 = uint7_get_32; // FIXME: varint.h API should be size agnostic
 	vv->varint_get32s = sint7_get_32;
 	vv->varint_get64 = uint7_get_64;
 	vv->varint_get64s = sint7_get_64;
+	vv->varint_get32_array = uint7_get_array32;
+	vv->varint_get32s_array = sint7_get_array32;
+	vv->varint_get64_array = uint7_get_array64;
+	vv->varint_get64s_array = sint7_get_array64;
 	vv->varint_put32 = uint7_put_32;
 	vv->varint_put32s = sint7_put_32;
 	vv->varint_put64 = uint7_put_64;
@@ -5226,6 +6777,10 @@ void cram_init_varint(varint_vec *vv, int version) {
 	vv->varint_get32s = safe_itf8_get;
 	vv->varint_get64 = safe_ltf8_get;
 	vv->varint_get64s = safe_ltf8_get;
+	vv->varint_get32_array = itf8_get_array32;
+	vv->varint_get32s_array = itf8_get_array32;
+	vv->varint_get64_array = ltf8_get_array64;
+	vv->varint_get64s_array = ltf8_get_array64;
 	vv->varint_put32 = safe_itf8_put;
 	vv->varint_put32s = safe_itf8_put;
 	vv->varint_put64 = safe_ltf8_put;
@@ -5338,6 +6893,11 @@ int cram_default_version(void) {
 cram_fd * cram_io_close(cram_fd * fd, int * fclose_result)
 {
     if ( fd ) {
+        int wr = 0;
+#if defined(CRAM_IO_CUSTOM_BUFFERING)
+        cram_io_stop_readahead(fd);
+        wr = cram_io_stop_writer(fd);
+#endif
         if ( fd->fp_in ) {
             fclose(fd->fp_in);
             fd->fp_in = NULL;
@@ -5345,7 +6905,7 @@ cram_fd * cram_io_close(cram_fd * fd, int * fclose_result)
         if ( fd->fp_out ) {
             int const r = paranoid_fclose(fd->fp_out);
             if ( fclose_result )
-                *fclose_result = r;
+                *fclose_result = wr ? wr : r;
             fd->fp_out = NULL;
         }
         
@@ -5512,7 +7072,13 @@ cram_fd * cram_io_open(
 	if ( !bufsize )
 	    bufsize = 32*1024;
 
-	do {
+#if defined(CRAM_IO_MMAP)
+	/* mode "m" requests mmap input, falling back to buffered reads */
+	if ( strchr(mode, 'm') && strcmp(filename, "-") != 0 )
+	    fd->fp_in_buffer = cram_io_allocate_input_mmap(fd->fp_in);
+#endif
+
+	if ( ! fd->fp_in_buffer ) do {
 	    fd->fp_in_buffer = cram_io_allocate_input_buffer(bufsize);
 	    if ( ! fd->fp_in_buffer ) {
                 return cram_io_close(fd,0);
@@ -5670,6 +7236,12 @@ cram_fd *cram_open(const char *filename, const char *mode) {
     fd->last_RI = 0;
 
     fd->index       = NULL;
+    fd->index_bin   = NULL;
+    fd->ranges      = NULL;
+    fd->range_hits  = NULL;
+    fd->nranges     = 0;
+    fd->shard_end   = 0;
+    fd->shard       = 0;
     fd->own_pool    = 0;
     fd->pool        = NULL;
     fd->rqueue      = NULL;
@@ -5781,6 +7353,12 @@ cram_fd *cram_open_by_callbacks(
     fd->shared_ref = 0;
 
     fd->index       = NULL;
+    fd->index_bin   = NULL;
+    fd->ranges      = NULL;
+    fd->range_hits  = NULL;
+    fd->nranges     = 0;
+    fd->shard_end   = 0;
+    fd->shard       = 0;
     fd->own_pool    = 0;
     fd->pool        = NULL;
     fd->rqueue      = NULL;
@@ -5909,6 +7487,12 @@ cram_fd *cram_openw_by_callbacks(
     fd->shared_ref = 0;
 
     fd->index       = NULL;
+    fd->index_bin   = NULL;
+    fd->ranges      = NULL;
+    fd->range_hits  = NULL;
+    fd->nranges     = 0;
+    fd->shard_end   = 0;
+    fd->shard       = 0;
     fd->own_pool    = 0;
     fd->pool        = NULL;
     fd->rqueue      = NULL;
@@ -6078,7 +7662,11 @@ int cram_close(cram_fd *fd) {
     }
 
     if (fd->pool && fd->eof >= 0) {
-	t_pool_flush(fd->pool);
+	// Sibling shards may still be dispatching into the same pool
+	if (fd->shard)
+	    t_pool_flush_queue(fd->pool, fd->rqueue);
+	else
+	    t_pool_flush(fd->pool);
 
 	if (0 != cram_flush_result(fd)) {
 	    fd = cram_io_close(fd,0);
@@ -6104,6 +7692,10 @@ int cram_close(cram_fd *fd) {
 	/* Write EOF block */
 	if (0 != cram_write_eof_block(fd))
 	    return -1;
+
+	// Not fatal as the CRAM itself is complete
+	if (fd->metrics_profile && fd->metrics_loaded)
+	    cram_save_metrics(fd);
     }
 
     for (bl = fd->bl; bl; bl = next) {
@@ -6144,15 +7736,25 @@ int cram_close(cram_fd *fd) {
     if (fd->tags_used)
 	HashTableDestroy(fd->tags_used, 1);
 
-    if (fd->index)
+    cram_free_compression_header_cache(fd);
+
+    free(fd->metrics_profile);
+
+    if (fd->index || fd->index_bin)
 	cram_index_free(fd);
 
+    free(fd->ranges);
+    free(fd->range_hits);
+
     if (fd->own_pool && fd->pool)
 	t_pool_destroy(fd->pool, 0);
 
     /* rclose == return value for flush and close in case of CRAM output */
     fd = cram_io_close(fd, &rclose);
 
+    /* Worker threads free theirs on exit, but the caller's thread won't */
+    codec_cache_free();
+
     return rclose;
 }
 
@@ -6292,13 +7894,22 @@ int cram_set_voption(cram_fd *fd, enum cram_option opt, va_list args) {
 
     case CRAM_OPT_RANGE: {
 	cram_range *cr = va_arg(args, cram_range *);
-	int r = cram_seek_to_refpos(fd, cr);
+	int r;
+	if (fd->ranges)
+	    cram_set_ranges(fd, NULL, 0);
+	r = cram_seek_to_refpos(fd, cr);
 	fd->range = *cr;
 	if (fd->range.refid != -2)
 	    fd->required_fields |= SAM_POS;
 	return r;
     }
 
+    case CRAM_OPT_RANGES: {
+	cram_range *cr = va_arg(args, cram_range *);
+	int n = va_arg(args, int);
+	return cram_set_ranges(fd, cr, n);
+    }
+
     case CRAM_OPT_REFERENCE:
 	return cram_load_reference(fd, va_arg(args, char *));
 
@@ -6425,6 +8036,53 @@ int cram_set_voption(cram_fd *fd, enum cram_option opt, va_list args) {
 	break;
     }
 
+    case CRAM_OPT_TARGET_RATE:
+	// Supplied in kilobytes per second, stored as bytes per second.
+	fd->target_rate = va_arg(args, int) * 1000.0;
+	break;
+
+    case CRAM_OPT_TRIAL_SAMPLE:
+	fd->trial_sample = va_arg(args, int);
+	break;
+
+    case CRAM_OPT_READAHEAD:
+	fd->readahead_containers = va_arg(args, int);
+#if defined(CRAM_IO_CUSTOM_BUFFERING)
+	return cram_io_set_readahead(fd);
+#else
+	break;
+#endif
+
+    case CRAM_OPT_READAHEAD_BYTES:
+	fd->readahead_bytes = va_arg(args, int);
+#if defined(CRAM_IO_CUSTOM_BUFFERING)
+	return cram_io_set_readahead(fd);
+#else
+	break;
+#endif
+
+    case CRAM_OPT_WRITE_THREAD:
+	fd->write_bufsize = va_arg(args, int);
+#if defined(CRAM_IO_CUSTOM_BUFFERING)
+	return cram_io_set_writer(fd);
+#else
+	break;
+#endif
+
+    case CRAM_OPT_DIRECT_IO:
+	fd->write_direct = va_arg(args, int);
+#if defined(CRAM_IO_CUSTOM_BUFFERING)
+	return cram_io_set_writer(fd);
+#else
+	break;
+#endif
+
+    case CRAM_OPT_METRICS_PROFILE:
+	free(fd->metrics_profile);
+	if (!(fd->metrics_profile = strdup(va_arg(args, char *))))
+	    return -1;
+	break;
+
     default:
 	fprintf(stderr, "Unknown CRAM option code %d\n", opt);
 	return -1;
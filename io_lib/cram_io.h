@@ -96,10 +96,26 @@ cram_block *cram_read_block(cram_fd *fd);
  */
 int cram_write_block(cram_fd *fd, cram_block *b);
 
+/*! Returns the number of bytes a block occupies in the file.
+ *
+ * This includes the block header and, for CRAM 3 onwards, the CRC.
+ */
+int cram_block_size(cram_fd *fd, cram_block *b);
+
 /*! Frees a CRAM block, deallocating internal data too.
  */
 void cram_free_block(cram_block *b);
 
+/*! Gives a block read from a mapped file its own copy of the data.
+ *
+ * This is needed before the data can be resized.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int cram_block_own_data(cram_block *b);
+
 /*! Uncompresses a CRAM block, if compressed.
  *
  * @return
@@ -380,9 +396,19 @@ int cram_flush_container_mt(cram_fd *fd, cram_container *c);
  */
 cram_block_compression_hdr *cram_new_compression_header(void);
 
-/*! Frees a cram_block_compression_hdr */
+/*! Frees a cram_block_compression_hdr
+ *
+ * Headers shared via the decoder's header cache are reference counted,
+ * and only freed when the last reference is released.
+ */
 void cram_free_compression_header(cram_block_compression_hdr *hdr);
 
+/*! Adds a reference to a shared cram_block_compression_hdr */
+void cram_ref_compression_header(cram_block_compression_hdr *hdr);
+
+/*! Empties the decoded compression header cache of a cram_fd */
+void cram_free_compression_header_cache(cram_fd *fd);
+
 
 /**@}*/
 /**@{ ----------------------------------------------------------------------
@@ -418,6 +444,18 @@ cram_slice *cram_new_slice(enum cram_content_type type, int nrecs);
  */
 cram_slice *cram_read_slice(cram_fd *fd);
 
+/*! Loads the rest of a slice after its header block.
+ *
+ * The slice header block b has already been read with cram_read_block.
+ * Ownership of b passes to the returned slice, or it is freed on
+ * failure.
+ *
+ * @return
+ * Returns cram_slice ptr on success;
+ *         NULL on failure
+ */
+cram_slice *cram_read_slice_blocks(cram_fd *fd, cram_block *b);
+
 
 
 /**@}*/
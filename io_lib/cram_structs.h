@@ -57,6 +57,7 @@ extern "C" {
 
 #include "io_lib/hash_table.h"       // From io_lib aka staden-read
 #include "io_lib/thread_pool.h"
+#include "io_lib/write_thread.h"
 #include "io_lib/mFILE.h"
 #include "io_lib/bgzip.h"
 
@@ -287,6 +288,12 @@ typedef struct {
     // aggregate sizes during trials
     int sz[CRAM_MAX_METHOD];
 
+    // aggregate input size and per-method CPU time (seconds, or wall
+    // clock time where no per-thread CPU clock exists) during trials,
+    // used when targeting a throughput rather than a level.
+    double usz;
+    double time[CRAM_MAX_METHOD];
+
     // resultant method from trials
     int64_t method;
     int strat;
@@ -321,6 +328,8 @@ typedef struct {
 
     int crc32_checked;
     uint32_t crc_part;
+
+    int mapped; // data points into an mmapped input file, so isn't owned
 } cram_block;
 
 struct cram_codec; /* defined in cram_codecs.h */
@@ -363,6 +372,9 @@ typedef struct {
 
     // Total codec count, used for index to block_by_id for transforms
     int ncodecs;
+
+    // Number of containers plus cache sharing this; 0 if not cached
+    int ref_count;
 } cram_block_compression_hdr;
 
 typedef struct cram_map {
@@ -666,8 +678,55 @@ typedef struct cram_slice {
 
     // Cache of converted BAM structs
     bam_seq_t **bl;
+    int no_bam_seq;              // fd->no_bam_seq when decode was queued
+
+    // Data series decoded up-front for all records; see cram_decode_slice
+    char *ds_batch;
 } cram_slice;
 
+/*
+ * A decoded slice in columnar (struct-of-arrays) form, as returned by
+ * cram_get_slice_columns().  Each array holds nrec entries, indexed by
+ * record number within the slice.  Arrays for fields not listed in
+ * CRAM_OPT_REQUIRED_FIELDS are NULL.
+ *
+ * Variable length fields are offsets into buffers shared by the whole
+ * slice; these point into the slice itself and are not copied.
+ * Positions are 1-based, as in SAM.
+ */
+typedef struct {
+    cram_slice *s;           // owned by this struct
+    int nrec;
+    int64_t record_counter;  // record number of first record in file
+
+    int32_t *ref_id;         // SAM_RNAME
+    int32_t *flag;           // SAM_FLAG, BAM flags
+    int64_t *pos;            // SAM_POS
+    int64_t *end;            // SAM_POS, inclusive alignment end
+    int32_t *mapq;           // SAM_MAPQ
+    int32_t *mate_ref_id;    // SAM_RNEXT
+    int64_t *mate_pos;       // SAM_PNEXT
+    int64_t *tlen;           // SAM_TLEN
+    int32_t *rg;             // SAM_RGAUX; index to SAM_hdr rg[], -1 if none
+
+    // SAM_QNAME.  name_len is 0 for names not stored in the file,
+    // which cram_get_bam_seq would auto-generate.
+    char     *names;
+    uint32_t *name_off, *name_len;
+
+    // SAM_CIGAR; BAM encoded operations.
+    uint32_t *cigar;
+    uint32_t *cigar_off, *ncigar;
+
+    // SAM_SEQ and/or SAM_QUAL; seq_len is shared by both.
+    char     *seq, *qual;
+    uint32_t *seq_off, *qual_off, *seq_len;
+
+    // SAM_AUX; BAM encoded aux fields, excluding RG.
+    char     *aux;
+    uint32_t *aux_off, *aux_len;
+} cram_slice_columns;
+
 /*-----------------------------------------------------------------------------
  * Consider moving reference handling to cram_refs.[ch]
  */
@@ -730,12 +789,88 @@ typedef struct cram_index {
     int64_t offset; // 1.0                 1.1
 } cram_index;
 
+/*
+ * A binary form of the index (foo.cram.crbi), held as per-reference
+ * arrays of slices sorted by start.  max_end is the largest end of
+ * this and all earlier entries for the reference, making it
+ * non-decreasing so the first overlapping slice can be found by a
+ * binary search.
+ *
+ * The file is a cram_index_bin_hdr, nref cram_index_bin_ref structs
+ * (indexed by refid+1) and then nentry cram_index_bin_entry structs.
+ * Values are in host byte order; a mismatching byte_order field causes
+ * the file to be ignored.  It is memory mapped where possible, so
+ * opening is cheap and only the pages searched get read.
+ */
+#define CRAM_INDEX_BIN_MAGIC   "CRBI"
+#define CRAM_INDEX_BIN_ORDER   0x01020304
+#define CRAM_INDEX_BIN_VERSION 1
+
+typedef struct {
+    char     magic[4];
+    uint32_t byte_order;
+    uint32_t version;
+    uint32_t nref;
+    uint64_t nentry;
+} cram_index_bin_hdr;
+
+typedef struct {
+    uint64_t first;     // index of first entry for this ref
+    uint64_t count;     // number of entries
+} cram_index_bin_ref;
+
+typedef struct {
+    int64_t offset;
+    int32_t start;
+    int32_t end;
+    int32_t max_end;
+    int32_t slice;
+    int32_t len;
+    int32_t unused;
+} cram_index_bin_entry;
+
+typedef struct {
+    void   *data;       // the whole file
+    size_t  size;
+    int     mapped;     // 1 if data is mmapped, 0 if malloced
+    const cram_index_bin_hdr   *hdr;
+    const cram_index_bin_ref   *ref;
+    const cram_index_bin_entry *entry;
+    cram_index *node;   // per ref, built on first cram_index_query
+} cram_index_bin;
+
 typedef struct {
     int refid;
     int64_t start;
     int64_t end;
 } cram_range;
 
+/* One range of a multi-range query, see cram_set_ranges() */
+typedef struct {
+    cram_range r;
+    int idx;            // index into the caller's array of ranges
+    int64_t max_end;    // largest r.end of this and earlier ranges on r.refid
+} cram_range_item;
+
+/*
+ * A contiguous run of containers, see cram_index_shards().  As shards
+ * never split a container no record belongs to more than one.
+ */
+typedef struct {
+    int64_t start;      // file offset of the first container
+    int64_t end;        // file offset after the last, or -1 for EOF
+    int64_t size;       // approximate compressed size in bytes
+    int refid;          // reference and position of the first slice
+    int64_t pos;
+} cram_shard;
+
+/* The result of cram_index_count_range() */
+typedef struct {
+    int64_t nrec;       // records overlapping the range
+    int nslice;         // slices counted from their headers alone
+    int ndecoded;       // slices decoded as they cross the range edges
+} cram_range_count;
+
 /*-----------------------------------------------------------------------------
  */
 /* CRAM File handle */
@@ -788,6 +923,8 @@ typedef struct {
     char          *fp_in_buf_pc;
     /* window end pointer;  same as fp_in_buffer + fp_in_buf_size (no seeks) */
     char          *fp_in_buf_pe;    
+    /* non-zero if fp_in_buffer is an mmap of the entire file */
+    int            fp_in_mmap;
 } cram_fd_input_buffer;
 
 typedef struct {
@@ -804,9 +941,63 @@ typedef struct {
     /* window end pointer */
     char          *fp_out_buf_pe;    
 } cram_fd_output_buffer;
+
+/*
+ * A piece of input fetched by the read-ahead thread.  Pieces never span
+ * containers; 'last' marks the piece ending a container.
+ */
+typedef struct cram_readahead_piece {
+    char          *data;
+    size_t         size;
+    int            last;
+    struct cram_readahead_piece *next;
+} cram_readahead_piece;
+
+/*
+ * Container read-ahead.  A reader thread fetches containers from the
+ * underlying input callbacks into a bounded queue, which is handed to
+ * the input buffer through a replacement set of callbacks.
+ */
+typedef struct cram_readahead {
+    cram_io_input_t       io;        /* callbacks installed in the cram_fd */
+    cram_io_input_t      *src;       /* the underlying input */
+    struct cram_fd       *fd;
+    int                   seekable;
+
+    pthread_t             thread;
+    pthread_mutex_t       lock;
+    pthread_cond_t        filled, drained;
+    int                   running, shutdown, eof;
+
+    /* queued pieces; curr is being consumed and is no longer queued */
+    cram_readahead_piece *head, *tail, *curr;
+    size_t                curr_pos;
+    int                   nctr, max_ctr;
+    size_t                nbytes, max_bytes;
+    off_t                 pos;       /* file offset of next byte consumed */
+
+    /* reader thread state */
+    char                 *stage;     /* bytes read but not yet queued */
+    size_t                stage_len, stage_alloc;
+    int64_t               remaining; /* bytes left in current container */
+    int                   raw;       /* container boundaries unknown */
+} cram_readahead;
 #endif
 
 struct cram_fd;
+
+/*
+ * A recently decoded compression header along with a copy of the raw
+ * block it came from, so repeats can be identified.
+ */
+#define CRAM_HDR_CACHE_MAX 16
+typedef struct {
+    uint64_t hash;
+    char *data;
+    size_t size, alloc;
+    cram_block_compression_hdr *hdr;
+} cram_hdr_cache;
+
 typedef struct varint_vec {
     // Returns number of bytes decoded from fd, 0 on error
     int (*varint_decode32_crc)(struct cram_fd *fd, int32_t *val_p, uint32_t *crc);
@@ -823,6 +1014,13 @@ typedef struct varint_vec {
     int64_t (*varint_get64) (char **cp, const char *endp, int *err);
     int64_t (*varint_get64s)(char **cp, const char *endp, int *err);
 
+    // Decodes n values into out[] and increments *cp.
+    // Returns 0 on success, -1 on error.
+    int (*varint_get32_array) (char **cp, const char *endp, int32_t *out, int n);
+    int (*varint_get32s_array)(char **cp, const char *endp, int32_t *out, int n);
+    int (*varint_get64_array) (char **cp, const char *endp, int64_t *out, int n);
+    int (*varint_get64s_array)(char **cp, const char *endp, int64_t *out, int n);
+
     // Returns the number of bytes written, <= 0 on error.
     int (*varint_put32) (char *cp, const char *endp, int32_t val_p);
     int (*varint_put32s)(char *cp, const char *endp, int32_t val_p);
@@ -846,11 +1044,14 @@ typedef struct cram_fd {
     cram_io_input_t                 *fp_in_callbacks;
     cram_io_allocate_read_input_t    fp_in_callback_allocate_function;
     cram_io_deallocate_read_input_t  fp_in_callback_deallocate_function;
+    cram_readahead                  *readahead;
 
     cram_fd_output_buffer            *fp_out_buffer;
     cram_io_output_t                 *fp_out_callbacks;
     cram_io_allocate_write_output_t   fp_out_callback_allocate_function;
     cram_io_deallocate_write_output_t fp_out_callback_deallocate_function;
+    write_thread                     *writer;
+    cram_io_output_t                  writer_io, *writer_src;
 #endif
     
     FILE          *fp_out;
@@ -886,8 +1087,22 @@ typedef struct cram_fd {
 
     // compression level and metrics
     int level;
+    double target_rate; // bytes/sec per block compression; 0 => use level
     cram_metrics *m[DS_END];
     HashTable *tags_used; // cram_metrics[], per tag types in use.
+    cram_hdr_cache comp_hdr_cache[CRAM_HDR_CACHE_MAX]; // recent headers
+    int comp_hdr_next;                  // next comp_hdr_cache slot to use
+    char *metrics_profile; // file to preload and save cram_metrics to
+    int metrics_loaded;
+    int trial_sample;      // bytes of large blocks to trial; 0 => all
+
+    // input read-ahead depth; both 0 => read synchronously
+    int readahead_containers;
+    int readahead_bytes;
+
+    // output writer thread; both 0 => write synchronously
+    int write_bufsize;
+    int write_direct;
 
     // options
     int decode_md; // Whether to export MD and NM tags
@@ -911,6 +1126,12 @@ typedef struct cram_fd {
     enum quality_binning binning;
     unsigned int required_fields;
     cram_range range;
+    cram_range_item *ranges;            // multi-range query, sorted
+    int nranges;
+    int range_lo, range_hi;             // ranges[] searched in this pass
+    int *range_hits, nrange_hits;       // ranges hit by the last record
+    off_t shard_end;                    // if > 0, stop at this container
+    int shard;                          // opened by cram_shard_open
 
     // lookup tables, stored here so we can be trivially multi-threaded
     unsigned int bam_flag_swap[0x1000]; // cram -> bam flags
@@ -921,6 +1142,7 @@ typedef struct cram_fd {
 
     int         index_sz;
     cram_index *index;                  // array, sizeof index_sz
+    cram_index_bin *index_bin;          // binary index, used in place of index
     off_t first_container;
     int eof;
     int last_slice;                     // number of recs encoded in last slice
@@ -945,6 +1167,7 @@ typedef struct cram_fd {
     int lossy_read_names;
     int preserve_aux_order;             // if set implies emitting RG, MD and NM
     int preserve_aux_size;              // does not replace 'i' with 'c' etc in aux.
+    int no_bam_seq;                     // set during cram_get_slice_columns
 
     // variable integer decoding callbacks.
     // This changed in CRAM4.0 to a data-size agnostic encoding.
@@ -958,6 +1181,10 @@ extern size_t cram_io_input_buffer_read(void *ptr, size_t size, size_t nmemb, cr
 extern int cram_io_input_buffer_seek(cram_fd * fd, off_t offset, int whence);
 extern int cram_io_input_buffer_underflow(cram_fd * fd);
 extern char * cram_io_input_buffer_fgets(char * s, int size, cram_fd * fd);
+extern unsigned char * cram_io_input_buffer_map(cram_fd * fd, size_t len);
+extern void cram_io_input_buffer_willneed(cram_fd * fd, size_t len);
+extern int cram_io_set_readahead(cram_fd * fd);
+extern int cram_io_set_writer(cram_fd * fd);
 extern int cram_io_flush_output_buffer(cram_fd *fd);
 #endif
 
@@ -1082,7 +1309,16 @@ enum cram_option {
     CRAM_OPT_USE_FQZ,
     CRAM_OPT_EMBED_CONS,
     CRAM_OPT_USE_TOK,
-    CRAM_OPT_PROFILE
+    CRAM_OPT_PROFILE,
+    CRAM_OPT_TARGET_RATE,
+    CRAM_OPT_METRICS_PROFILE,
+    CRAM_OPT_TRIAL_SAMPLE,
+    CRAM_OPT_READAHEAD,
+    CRAM_OPT_READAHEAD_BYTES,
+    CRAM_OPT_WRITE_THREAD,
+    CRAM_OPT_DIRECT_IO,
+    CRAM_OPT_RANGES,
+    CRAM_OPT_OUTPUT_INDEX
 };
 
 /* BF bitfields */
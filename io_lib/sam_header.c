@@ -39,7 +39,9 @@
 #include "io_lib_config.h"
 #endif
 
+#include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
 
 #include "io_lib/sam_header.h"
@@ -1107,6 +1109,50 @@ int sam_hdr_name2ref(SAM_hdr *hdr, char *ref) {
     return hi ? hi->data.i : -1;
 }
 
+/*
+ * Parses a refseq:start-end region string, as used by scramble -R.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int sam_hdr_parse_region(SAM_hdr *hdr, const char *str,
+			 int *refid, int64_t *start, int64_t *end) {
+    char ref_name[1024], *cp = strchr(str, ':');
+    int s, e;
+    size_t len = cp ? cp - str : strlen(str);
+
+    if (cp) {
+	switch (sscanf(cp+1, "%d-%d", &s, &e)) {
+	case 1:
+	    e = s;
+	    break;
+	case 2:
+	    break;
+	default:
+	    fprintf(stderr, "Malformed range format\n");
+	    return -1;
+	}
+    } else {
+	s = INT_MIN;
+	e = INT_MAX;
+    }
+
+    if (len > 1023)
+	len = 1023;
+    memcpy(ref_name, str, len);
+    ref_name[len] = 0;
+
+    *refid = sam_hdr_name2ref(hdr, ref_name);
+    if (*refid == -1 && *ref_name != '*') {
+	fprintf(stderr, "Unknown reference name '%s'\n", ref_name);
+	return -1;
+    }
+    *start = s;
+    *end = e;
+
+    return 0;
+}
+
 /*
  * Looks up a read-group by name and returns a pointer to the start of the
  * associated tag list.
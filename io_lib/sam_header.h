@@ -63,6 +63,7 @@ extern "C" {
 #endif
 
 #include <stdarg.h>
+#include <stdint.h>
 
 #include "io_lib/dstring.h"
 #include "io_lib/hash_table.h"
@@ -403,6 +404,18 @@ int sam_hdr_rebuild(SAM_hdr *hdr);
  */
 int sam_hdr_name2ref(SAM_hdr *hdr, char *ref);
 
+/*! Parses a refseq:start-end region string, as used by scramble -R.
+ *
+ * "refseq:pos" is the single base pos and a bare "refseq" is the whole
+ * reference.  The name "*" gives refid -1, for unmapped data.
+ *
+ * @return
+ * Returns 0 on success, filling out *refid, *start and *end;
+ *        -1 on failure
+ */
+int sam_hdr_parse_region(SAM_hdr *hdr, const char *str,
+			 int *refid, int64_t *start, int64_t *end);
+
 /*! Looks up a read-group by name and returns a pointer to the start of the
  * associated tag list.
  *
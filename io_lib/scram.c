@@ -75,6 +75,7 @@ before sending on to FILE *fp.
 #include <assert.h>
 
 #include "io_lib/scram.h"
+#include "io_lib/bam_index.h"
 
 #define SCRAM_BUF_SIZE (1024*1024)
 
@@ -349,9 +350,8 @@ int scram_get_seq(scram_fd *fd, bam_seq_t **bsp) {
 	    return 0;
 
 	case 0:
-	    // FIXME: if we ever implement range queries for BAM this will
-	    // need amendments to not claim a sub-range is invalid EOF.
-	    fd->eof = fd->b->eof_block ? 1 : 2;
+	    // The end of a range query isn't the end of the file
+	    fd->eof = fd->b->eof_block || fd->b->ranges ? 1 : 2;
 	    return -1;
 
 	default:
@@ -371,6 +371,27 @@ int scram_next_seq(scram_fd *fd, bam_seq_t **bsp) {
     return scram_get_seq(fd, bsp);
 }
 
+int scram_get_view(scram_fd *fd, bam_view_t *v) {
+    if (!fd->is_bam) {
+	fprintf(stderr, "scram_get_view() requires BAM input\n");
+	fd->eof = -1;
+	return -1;
+    }
+
+    switch (bam_next_view(fd->b, v)) {
+    case 1:
+	return 0;
+
+    case 0:
+	fd->eof = fd->b->eof_block ? 1 : 2;
+	return -1;
+
+    default:
+	fd->eof = -1; // err
+	return -1;
+    }
+}
+
 int scram_put_seq(scram_fd *fd, bam_seq_t *s) {
     return fd->is_bam
 	? bam_put_seq(fd->b, s)
@@ -415,6 +436,18 @@ int scram_set_option(scram_fd *fd, enum cram_option opt, ...) {
 	return fd->is_bam
 	    ? bam_set_option (fd->b,  BAM_OPT_IGNORE_CHKSUM, chk)
 	    : cram_set_option(fd->c, CRAM_OPT_IGNORE_CHKSUM, chk);
+    } else if (opt == CRAM_OPT_WRITE_THREAD) {
+	int sz = va_arg(args, int);
+
+	return fd->is_bam
+	    ? bam_set_option (fd->b,  BAM_OPT_WRITE_THREAD, sz)
+	    : cram_set_option(fd->c, CRAM_OPT_WRITE_THREAD, sz);
+    } else if (opt == CRAM_OPT_DIRECT_IO) {
+	int direct = va_arg(args, int);
+
+	return fd->is_bam
+	    ? bam_set_option (fd->b,  BAM_OPT_DIRECT_IO, direct)
+	    : cram_set_option(fd->c, CRAM_OPT_DIRECT_IO, direct);
     } else if (opt == CRAM_OPT_WITH_BGZIP_INDEX) {
         gzi *idx = va_arg(args, gzi *);
         if (fd->is_bam)
@@ -423,6 +456,32 @@ int scram_set_option(scram_fd *fd, enum cram_option opt, ...) {
         char *idx_fn = va_arg(args, char *);
         if (fd->is_bam)
 	    return bam_set_option (fd->b,  BAM_OPT_OUTPUT_BGZIP_IDX, idx_fn);
+    } else if (opt == CRAM_OPT_OUTPUT_INDEX) {
+	char *idx_fn = va_arg(args, char *);
+	if (fd->is_bam)
+	    return bam_set_option(fd->b, BAM_OPT_OUTPUT_INDEX, idx_fn);
+    } else if (fd->is_bam && (opt == CRAM_OPT_RANGE ||
+			      opt == CRAM_OPT_RANGES)) {
+	cram_range *cr = va_arg(args, cram_range *);
+	int i, n = opt == CRAM_OPT_RANGES ? va_arg(args, int) : 1;
+	bam_range *br;
+
+	// refid -2 is "no range", as per cram_seek_to_refpos
+	if (opt == CRAM_OPT_RANGE && cr->refid == -2)
+	    n = 0;
+
+	br = malloc((n ? n : 1) * sizeof(*br));
+
+	if (!br)
+	    return -1;
+	for (i = 0; i < n; i++) {
+	    br[i].refid = cr[i].refid;
+	    br[i].start = cr[i].start;
+	    br[i].end   = cr[i].end;
+	}
+	r = bam_set_ranges(fd->b, br, n);
+	free(br);
+	return r;
     }
 
     if (!fd->is_bam) {
@@ -434,6 +493,31 @@ int scram_set_option(scram_fd *fd, enum cram_option opt, ...) {
     return r;
 }
 
+/*! Reports the ranges hit by the last record of a multi-range query.
+ *
+ * @return
+ * Returns the number of ranges the last record overlapped.
+ */
+int scram_range_hits(scram_fd *fd, int **hits) {
+    return fd->is_bam
+	? bam_range_hits(fd->b, hits)
+	: cram_range_hits(fd->c, hits);
+}
+
+/*! Loads the index for fn, the file open in fd.
+ *
+ * This is a .crai (or .crbi) for CRAM and a .bai or .csi for BAM.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int scram_index_load(scram_fd *fd, const char *fn) {
+    return fd->is_bam
+	? bam_index_load(fd->b, fn)
+	: cram_index_load(fd->c, fn);
+}
+
 /*! Returns the line number when processing a SAM file
  *
  * @return
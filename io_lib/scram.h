@@ -226,6 +226,18 @@ int scram_get_seq(scram_fd *fd, bam_seq_t **bsp);
 /*! Deprecated: please use scram_get_seq() instead */
 int scram_next_seq(scram_fd *fd, bam_seq_t **bsp);
 
+/*! Fetches the next record of a BAM file as a read-only view.
+ *
+ * See bam_next_view().  This is only available for BAM input, so
+ * callers should check fd->is_bam and fd->b->bam first and otherwise
+ * use scram_get_seq().
+ *
+ * @return
+ * Returns 0 on success and fills out v;
+ *        -1 on eof or failure
+ */
+int scram_get_view(scram_fd *fd, bam_view_t *v);
+
 
 /*! Writes a BAM encoded bam_seq_t to fd.
  *
@@ -238,7 +250,9 @@ int scram_put_seq(scram_fd *fd, bam_seq_t *s);
 
 /*! Sets a CRAM option on fd.
  *
- * This is only supported for CRAM files currently.
+ * This is mostly supported for CRAM files only, but BAM also honours
+ * the threading, binning, checksum, writer, BGZIP index, output index
+ * and range options.
  *
  * @return
  * Returns 0 on success;
@@ -246,6 +260,29 @@ int scram_put_seq(scram_fd *fd, bam_seq_t *s);
  */
 int scram_set_option(scram_fd *fd, enum cram_option opt, ...);
 
+/*! Reports the ranges hit by the last record of a multi-range query.
+ *
+ * Set the ranges with scram_set_option(fd, CRAM_OPT_RANGES, ranges, n).
+ * *hits is set to an array of indices into ranges, valid until the next
+ * record is read.
+ *
+ * @return
+ * Returns the number of ranges the last record overlapped.
+ */
+int scram_range_hits(scram_fd *fd, int **hits);
+
+/*! Loads the index for fn, the file open in fd.
+ *
+ * This is a .crai (or .crbi) for CRAM and a .bai or .csi for BAM.
+ * An index is required before setting CRAM_OPT_RANGE or
+ * CRAM_OPT_RANGES.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int scram_index_load(scram_fd *fd, const char *fn);
+
 /*! Returns the line number when processing a SAM file
  *
  * @return
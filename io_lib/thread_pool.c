@@ -664,6 +664,64 @@ int t_pool_dispatch2(t_pool *p, t_results_queue *q,
     return 0;
 }
 
+/*
+ * Waits for all jobs dispatched to results queue q to complete.
+ *
+ * Rather than blocking, the calling thread removes any of q's jobs
+ * still waiting on the pool input queue and runs them itself.  This
+ * permits jobs to dispatch sub-jobs of their own and wait on them
+ * without risk of deadlock when every worker is busy.  Sub-jobs should
+ * be dispatched with t_pool_dispatch2(..., -1) for the same reason.
+ *
+ * Results are left on q for the caller to collect.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int t_pool_flush_queue(t_pool *p, t_results_queue *q) {
+    t_pool_job *j, *last;
+
+    for (;;) {
+	pthread_mutex_lock(&p->pool_m);
+	for (last = NULL, j = p->head; j; last = j, j = j->next) {
+	    if (j->q == q)
+		break;
+	}
+
+	if (!j) {
+	    pthread_mutex_unlock(&p->pool_m);
+	    break;
+	}
+
+	if (last)
+	    last->next = j->next;
+	else
+	    p->head = j->next;
+	if (p->tail == j)
+	    p->tail = last;
+
+	if (p->njobs-- >= p->qsize)
+	    pthread_cond_signal(&p->full_c);
+
+	if (p->njobs == 0)
+	    pthread_cond_signal(&p->empty_c);
+
+	pthread_mutex_unlock(&p->pool_m);
+
+	t_pool_add_result(j, j->func(j->arg));
+	memset(j, 0xbb, sizeof(*j));
+	free(j);
+    }
+
+    // Anything remaining is already running on another thread.
+    pthread_mutex_lock(&q->result_m);
+    while (q->pending > 0)
+	pthread_cond_wait(&q->result_avail_c, &q->result_m);
+    pthread_mutex_unlock(&q->result_m);
+
+    return 0;
+}
+
 /*
  * Flushes the pool, but doesn't exit. This simply drains the queue and
  * ensures all worker threads have finished their current task.
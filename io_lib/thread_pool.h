@@ -156,6 +156,16 @@ int t_pool_dispatch2(t_pool *p, t_results_queue *q,
  */
 int t_pool_flush(t_pool *p);
 
+/*
+ * Waits for all jobs dispatched to results queue q to complete, running
+ * any not yet started in the calling thread.  Safe to call from within
+ * a job to wait on sub-jobs.  Results are left on q.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int t_pool_flush_queue(t_pool *p, t_results_queue *q);
+
 /*
  * Destroys a thread pool. If 'kill' is true the threads are terminated now,
  * otherwise they are joined into the main thread so they will finish their
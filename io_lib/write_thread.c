@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2024 Genome Research Ltd.
+ * Author(s): James Bonfield
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ * 
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "io_lib_config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // O_DIRECT
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "io_lib/write_thread.h"
+
+/*
+ * Sets or clears O_DIRECT on the descriptor.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+static int write_thread_set_direct(write_thread *w, int on) {
+#ifdef O_DIRECT
+    int flags;
+
+    if (w->direct_on == on)
+	return 0;
+
+    if ((flags = fcntl(w->fd, F_GETFL)) == -1)
+	return -1;
+    flags = on ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+    if (fcntl(w->fd, F_SETFL, flags) == -1)
+	return -1;
+
+    w->direct_on = on;
+    return 0;
+#else
+    return on ? -1 : 0;
+#endif
+}
+
+/*
+ * Writes a buffer in full, using O_DIRECT when the offset and length
+ * permit.  Runs in the writer thread.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+static int write_thread_output(write_thread *w, char *buf, size_t len) {
+    int direct = w->direct
+	&& w->pos % WRITE_THREAD_ALIGN == 0
+	&& len    % WRITE_THREAD_ALIGN == 0;
+
+    if (write_thread_set_direct(w, direct) != 0)
+	w->direct = direct = 0;
+
+    while (len) {
+	ssize_t n = write(w->fd, buf, len);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    // Some file systems accept the flag but reject the writes
+	    if (errno == EINVAL && direct) {
+		write_thread_set_direct(w, 0);
+		w->direct = direct = 0;
+		continue;
+	    }
+	    return -1;
+	}
+	buf += n;
+	len -= n;
+	w->pos += n;
+    }
+
+    return 0;
+}
+
+static void *write_thread_main(void *arg) {
+    write_thread *w = (write_thread *)arg;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+	int b, err;
+
+	while (w->busy < 0 && !w->shutdown)
+	    pthread_cond_wait(&w->work_c, &w->lock);
+	if (w->busy < 0)
+	    break;
+
+	b = w->busy;
+	err = w->err;
+	pthread_mutex_unlock(&w->lock);
+
+	if (!err && write_thread_output(w, w->buf[b], w->used[b]) != 0)
+	    err = 1;
+	w->used[b] = 0;
+
+	pthread_mutex_lock(&w->lock);
+	w->err = err;
+	w->busy = -1;
+	pthread_cond_signal(&w->done_c);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+/*
+ * Passes the buffer being filled to the writer thread, waiting for it
+ * to finish the other one first, and switches to filling the other.
+ *
+ * Returns 0 on success;
+ *        -1 if an earlier write has failed
+ */
+static int write_thread_submit(write_thread *w) {
+    int err;
+
+    pthread_mutex_lock(&w->lock);
+    while (w->busy >= 0)
+	pthread_cond_wait(&w->done_c, &w->lock);
+    w->busy = w->fill;
+    err = w->err;
+    pthread_cond_signal(&w->work_c);
+    pthread_mutex_unlock(&w->lock);
+
+    w->fill ^= 1;
+    w->cap = w->bufsize;
+
+    return err ? -1 : 0;
+}
+
+/* Returns the writer thread's error state */
+static int write_thread_err(write_thread *w) {
+    int err;
+
+    pthread_mutex_lock(&w->lock);
+    err = w->err;
+    pthread_mutex_unlock(&w->lock);
+
+    return err;
+}
+
+write_thread *write_thread_init(int fd, size_t bufsize, int direct) {
+    write_thread *w;
+    int i;
+
+    if (!(w = calloc(1, sizeof(*w))))
+	return NULL;
+
+    if (!bufsize)
+	bufsize = WRITE_THREAD_BUFSIZE;
+    bufsize = (bufsize + WRITE_THREAD_ALIGN-1) & ~(size_t)(WRITE_THREAD_ALIGN-1);
+
+    w->fd = fd;
+    w->bufsize = w->cap = bufsize;
+    w->busy = -1;
+
+    for (i = 0; i < 2; i++) {
+#ifdef O_DIRECT
+	void *p;
+	if (posix_memalign(&p, WRITE_THREAD_ALIGN, bufsize) != 0)
+	    p = NULL;
+	w->buf[i] = p;
+#else
+	w->buf[i] = malloc(bufsize);
+#endif
+	if (!w->buf[i])
+	    goto err;
+    }
+
+    // Pipes and terminals have no offset and no use for O_DIRECT
+    if ((w->pos = w->offset = lseek(fd, 0, SEEK_CUR)) < 0) {
+	w->pos = w->offset = 0;
+	direct = 0;
+    }
+
+    if (direct && write_thread_set_direct(w, 1) == 0) {
+	w->direct = 1;
+	// Realign with the first buffer if we're part way into a page
+	w->cap -= w->offset % WRITE_THREAD_ALIGN;
+    }
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work_c, NULL);
+    pthread_cond_init(&w->done_c, NULL);
+
+    if (pthread_create(&w->tid, NULL, write_thread_main, w) != 0) {
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->work_c);
+	pthread_cond_destroy(&w->done_c);
+	goto err;
+    }
+
+    return w;
+
+ err:
+    write_thread_set_direct(w, 0);
+    free(w->buf[0]);
+    free(w->buf[1]);
+    free(w);
+    return NULL;
+}
+
+size_t write_thread_write(write_thread *w, const void *buf, size_t len) {
+    const char *cp = (const char *)buf;
+    size_t r = 0;
+
+    if (write_thread_err(w))
+	return 0;
+
+    while (r < len) {
+	size_t n = w->cap - w->used[w->fill];
+	if (n > len - r)
+	    n = len - r;
+	memcpy(w->buf[w->fill] + w->used[w->fill], cp + r, n);
+	w->used[w->fill] += n;
+	r += n;
+
+	if (w->used[w->fill] == w->cap && write_thread_submit(w) != 0)
+	    break;
+    }
+
+    w->offset += r;
+    return r;
+}
+
+int write_thread_flush(write_thread *w) {
+    int err;
+
+    if (w->used[w->fill])
+	write_thread_submit(w);
+
+    pthread_mutex_lock(&w->lock);
+    while (w->busy >= 0)
+	pthread_cond_wait(&w->done_c, &w->lock);
+    err = w->err;
+    pthread_mutex_unlock(&w->lock);
+
+    // A partial buffer leaves the file unaligned; realign as at the start
+    if (w->direct)
+	w->cap = w->bufsize - w->offset % WRITE_THREAD_ALIGN;
+
+    return err ? -1 : 0;
+}
+
+off_t write_thread_tell(write_thread *w) {
+    return w->offset;
+}
+
+int write_thread_close(write_thread *w) {
+    int r;
+
+    if (!w)
+	return 0;
+
+    r = write_thread_flush(w);
+
+    pthread_mutex_lock(&w->lock);
+    w->shutdown = 1;
+    pthread_cond_signal(&w->work_c);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->tid, NULL);
+
+    if (write_thread_set_direct(w, 0) != 0)
+	r = -1;
+
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->work_c);
+    pthread_cond_destroy(&w->done_c);
+    free(w->buf[0]);
+    free(w->buf[1]);
+    free(w);
+
+    return r;
+}
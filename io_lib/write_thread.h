@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2024 Genome Research Ltd.
+ * Author(s): James Bonfield
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ * 
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A background writer thread for output files.
+ *
+ * Data written is copied into one of two large, page aligned buffers.
+ * When a buffer fills it is handed to the writer thread and the caller
+ * continues filling the other, so the caller only blocks on write(2)
+ * when the disk cannot keep up with both buffers.
+ *
+ * Optionally the file descriptor may be switched to O_DIRECT, bypassing
+ * the page cache.  This avoids evicting useful cached data when writing
+ * large files.  Writes which cannot meet the O_DIRECT alignment rules
+ * (an unaligned start or a final partial buffer) are issued without it.
+ */
+
+#ifndef _WRITE_THREAD_H_
+#define _WRITE_THREAD_H_
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Alignment of buffer sizes, memory and O_DIRECT file offsets */
+#define WRITE_THREAD_ALIGN 4096
+
+/* Default size of each of the two buffers */
+#define WRITE_THREAD_BUFSIZE (8<<20)
+
+typedef struct write_thread {
+    int fd;
+    int direct;          // O_DIRECT requested and usable
+    int direct_on;       // O_DIRECT currently set on fd
+    size_t bufsize;
+    char *buf[2];
+    size_t used[2];      // bytes held in each buffer
+    size_t cap;          // capacity of the buffer being filled
+    int fill;            // buffer being filled by the caller
+    int busy;            // buffer being written by the thread, or -1
+    off_t offset;        // file offset of the next byte accepted
+    off_t pos;           // file offset of the next byte written
+
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t work_c;  // a buffer is ready to write
+    pthread_cond_t done_c;  // the thread finished writing a buffer
+    int shutdown;
+    int err;             // non-zero once any write has failed; under lock
+} write_thread;
+
+/*
+ * Starts a writer thread for the open file descriptor fd, using two
+ * buffers of bufsize bytes (0 for the default).  If direct is true the
+ * descriptor is switched to O_DIRECT where the system supports it.
+ *
+ * Any data already buffered elsewhere (eg in a FILE*) must be flushed
+ * before calling this.
+ *
+ * Returns write_thread pointer on success;
+ *         NULL on failure
+ */
+write_thread *write_thread_init(int fd, size_t bufsize, int direct);
+
+/*
+ * Queues len bytes from buf for writing.
+ *
+ * Returns the number of bytes accepted; less than len if a previous
+ * write has failed.
+ */
+size_t write_thread_write(write_thread *w, const void *buf, size_t len);
+
+/*
+ * Waits until all data queued so far has been written.
+ *
+ * Returns 0 on success;
+ *        -1 if any write has failed
+ */
+int write_thread_flush(write_thread *w);
+
+/*
+ * Returns the file offset following the last byte queued.
+ */
+off_t write_thread_tell(write_thread *w);
+
+/*
+ * Flushes and stops the writer thread and frees w.  The file descriptor
+ * is left open, with O_DIRECT cleared again.
+ *
+ * Returns 0 on success;
+ *        -1 if any write has failed
+ */
+int write_thread_close(write_thread *w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _WRITE_THREAD_H_ */
@@ -45,15 +45,38 @@
 #include <ctype.h>
 #include <string.h>
 #include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include <io_lib/cram.h>
 #include <io_lib/zfio.h>
 
 int main(int argc, char **argv) {
     cram_fd *fd;
+    int binary = 0, nthreads = 1, c;
+
+    while ((c = getopt(argc, argv, "bt:")) != -1) {
+	switch (c) {
+	case 'b':
+	    binary = 1;
+	    break;
+
+	case 't':
+	    nthreads = atoi(optarg);
+	    break;
+
+	default:
+	    argc = 0; // force usage
+	    break;
+	}
+    }
+    argc -= optind-1;
+    argv += optind-1;
 
     if (argc != 2 && argc != 3) {
-	fprintf(stderr, "Usage: cram_index filename.cram [filename.cram.crai]\n");
+	fprintf(stderr, "Usage: cram_index [-b] [-t threads] filename.cram [filename.cram.crai]\n");
+	fprintf(stderr, "    -b    Also write a binary filename.cram.crbi index\n");
+	fprintf(stderr, "    -t N  Decode multi-reference slices with N threads\n");
 	return 1;
     }
 
@@ -65,11 +88,21 @@ int main(int argc, char **argv) {
     cram_set_option(fd, CRAM_OPT_REQUIRED_FIELDS,
 		    SAM_RNAME | SAM_POS | SAM_CIGAR);
 
+    if (nthreads > 1 && cram_set_option(fd, CRAM_OPT_NTHREADS, nthreads)) {
+	cram_close(fd);
+	return 1;
+    }
+
     if (cram_index_build(fd, argv[argc-1]) == -1) {
 	cram_close(fd);
 	return 1;
     }
 
+    if (binary && cram_index_write_bin(fd, argv[argc-1]) == -1) {
+	cram_close(fd);
+	return 1;
+    }
+
     cram_close(fd);
 
     return 0;
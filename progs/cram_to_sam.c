@@ -40,6 +40,7 @@
 #include "io_lib_config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
@@ -48,14 +49,16 @@
 #include <io_lib/bam.h>
 
 void usage(FILE *fp) {
-    fprintf(fp, "Usage: cram_to_sam [-r ref.fa] [-m] [-b] [-0..9] [-u] "
+    fprintf(fp, "Usage: cram_to_sam [-r ref.fa] [-m] [-b] [-z] [-0..9] [-u] [-t N] "
 	    "filename.cram [output_filename]\n\n");
     fprintf(fp, "Options:\n");
     fprintf(fp, "    -r ref.fa      Specifies the reference file.\n");
     fprintf(fp, "    -m             Generate MD and NM tags:\n");
     fprintf(fp, "    -b             Output in BAM (defaults to SAM)\n");
+    fprintf(fp, "    -z             Output in BGZF compressed SAM\n");
     fprintf(fp, "    -1 to -9       Set zlib compression level for BAM\n");
     fprintf(fp, "    -0 or -u       Output uncompressed, if BAM.\n");
+    fprintf(fp, "    -t N           Use N threads for decoding and formatting.\n");
     fprintf(fp, "    -p str         Set the prefix for auto-generated seq. names\n");
     fprintf(fp, "    -R region	    Extract region 'ref:start-end', eg -R chr1:1000-2000\n");
     fprintf(fp, "    -X             Extract using the embedded reference (if present).\n");
@@ -72,13 +75,19 @@ int main(int argc, char **argv) {
     int start, end;
     char ref_name[1024] = {0}, *arg_list, *ref_fn = NULL;
     int embed_ref = 0;
+    int nthreads = 1;
+    t_pool *p = NULL;
 
-    while ((C = getopt(argc, argv, "bu0123456789mp:hr:R:X")) != -1) {
+    while ((C = getopt(argc, argv, "bzu0123456789mp:hr:R:Xt:")) != -1) {
 	switch (C) {
 	case 'b':
 	    mode[1] = 'b';
 	    break;
 
+	case 'z':
+	    mode[1] = 'z';
+	    break;
+
 	case 'u':
 	    mode[2] = '0';
 	    break;
@@ -108,6 +117,14 @@ int main(int argc, char **argv) {
 	    embed_ref = 1;
 	    break;
 
+	case 't':
+	    nthreads = atoi(optarg);
+	    if (nthreads < 1) {
+		fprintf(stderr, "Number of threads needs to be >= 1\n");
+		return 1;
+	    }
+	    break;
+
 	case 'R': {
 	    char *cp = strchr(optarg, ':');
 	    if (cp) {
@@ -182,6 +199,15 @@ int main(int argc, char **argv) {
 
     bfd->header = fd->header;
 
+    if (nthreads > 1) {
+	if (NULL == (p = t_pool_init(nthreads*2, nthreads))) {
+	    fprintf(stderr, "Failed to create thread pool\n");
+	    return 1;
+	}
+	cram_set_option(fd, CRAM_OPT_THREAD_POOL, p);
+	bam_set_option(bfd, BAM_OPT_THREAD_POOL, p);
+    }
+
     if (*ref_name != 0) {
 	cram_range r;
 	int refid = sam_hdr_name2ref(fd->header, ref_name);
@@ -218,7 +244,13 @@ int main(int argc, char **argv) {
     cram_close(fd);
 
     bfd->header = NULL;
-    bam_close(bfd);
+    if (bam_close(bfd) != 0) {
+	fprintf(stderr, "Error while writing file\n");
+	return 1;
+    }
+
+    if (p)
+	t_pool_destroy(p, 0);
 
     free(bam);
 
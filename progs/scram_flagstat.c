@@ -103,6 +103,43 @@ typedef struct {
     int64_t n_diffchr[2], n_diffhigh[2];
 } bam_flagstat_t;
 
+static void flagstat(bam_flagstat_t *st, int flag, int ref, int mate_ref,
+		     int map_qual) {
+    int w = flag & BAM_FQCFAIL ? 1 : 0;
+    ++st->n_reads[w];
+
+    if (flag & BAM_FPAIRED) {
+	++st->n_pair_all[w];
+	if (flag & BAM_FPROPER_PAIR)
+	    ++st->n_pair_good[w];
+
+	if (flag & BAM_FREAD1)
+	    ++st->n_read1[w];
+
+	if (flag & BAM_FREAD2)
+	    ++st->n_read2[w];
+
+	if ((flag & BAM_FMUNMAP) && !(flag & BAM_FUNMAP))
+	    ++st->n_sgltn[w]; 
+
+	if (!(flag & BAM_FUNMAP) && !(flag & BAM_FMUNMAP)) {
+	    ++st->n_pair_map[w];
+
+	    if (mate_ref != ref) {
+		++st->n_diffchr[w];
+		if (map_qual >= 5)
+		    ++st->n_diffhigh[w];
+	    }
+	}
+    }
+
+    if (!(flag & BAM_FUNMAP))
+	++st->n_mapped[w];
+
+    if (flag & BAM_FDUP)
+	++st->n_dup[w];
+}
+
 int main(int argc, char **argv) {
     scram_fd *in;
     bam_seq_t *s;
@@ -256,40 +293,14 @@ int main(int argc, char **argv) {
     }
 
     s = NULL;
-    while (scram_get_seq(in, &s) >= 0) {
-	int w = s->flag & BAM_FQCFAIL ? 1 : 0;
-	++st.n_reads[w];
-
-	if (s->flag & BAM_FPAIRED) {
-	    ++st.n_pair_all[w];
-	    if (s->flag & BAM_FPROPER_PAIR)
-		++st.n_pair_good[w];
-
-	    if (s->flag & BAM_FREAD1)
-		++st.n_read1[w];
-
-	    if (s->flag & BAM_FREAD2)
-		++st.n_read2[w];
-
-	    if ((s->flag & BAM_FMUNMAP) && !(s->flag & BAM_FUNMAP))
-		++st.n_sgltn[w]; 
-
-	    if (!(s->flag & BAM_FUNMAP) && !(s->flag & BAM_FMUNMAP)) {
-		++st.n_pair_map[w];
-
-		if (s->mate_ref != s->ref) {
-		    ++st.n_diffchr[w];
-		    if (s->map_qual >= 5)
-			++st.n_diffhigh[w];
-		}
-	    }
-	}
-
-	if (!(s->flag & BAM_FUNMAP))
-	    ++st.n_mapped[w];
-
-	if (s->flag & BAM_FDUP)
-	    ++st.n_dup[w];
+    if (in->is_bam && in->b->bam) {
+	// Flags only, so skip copying the records
+	bam_view_t v;
+	while (scram_get_view(in, &v) >= 0)
+	    flagstat(&st, v.flag, v.ref, v.mate_ref, v.map_qual);
+    } else {
+	while (scram_get_seq(in, &s) >= 0)
+	    flagstat(&st, s->flag, s->ref, s->mate_ref, s->map_qual);
     }
 
     if (s)
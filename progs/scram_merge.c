@@ -118,7 +118,7 @@ static void usage(FILE *fp) {
     fprintf(fp, "    -1 to -9       Set zlib compression level.\n");
     fprintf(fp, "    -0 or -u       No zlib compression.\n");
     //fprintf(fp, "    -v             Verbose output.\n");
-    fprintf(fp, "    -R range       [Cram] Specifies the refseq:start-end range\n");
+    fprintf(fp, "    -R range       Specifies the refseq:start-end range (indexed input)\n");
     fprintf(fp, "    -r ref.fa      [Cram] Specifies the reference file.\n");
     fprintf(fp, "    -s integer     [Cram] Sequences per slice, default %d.\n",
 	    SEQS_PER_SLICE);
@@ -263,19 +263,15 @@ int main(int argc, char **argv) {
 	if (refs && scram_set_option(in[i], CRAM_OPT_SHARED_REF, refs))
 	    return 1;
 
-	/* Support for sub-range queries, currently implemented for CRAM only */
+	/* Support for sub-range queries, for indexed CRAM and BAM */
 	if (*ref_name != 0) {
 	    cram_range r;
 	    int refid;
 
-	    if (in[i]->is_bam) {
-		fprintf(stderr, "Currently the -R option is only implemented for CRAM indices\n");
+	    if (scram_index_load(in[i], argv[optind]) && in[i]->is_bam)
 		return 1;
-	    }
-	    
-	    cram_index_load(in[i]->c, argv[optind]);
 
-	    refid = sam_hdr_name2ref(in[i]->c->header, ref_name);
+	    refid = sam_hdr_name2ref(scram_get_header(in[i]), ref_name);
 
 
 	    if (refid == -1 && *ref_name != '*') {
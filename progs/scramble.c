@@ -48,6 +48,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 
 #if defined(__MINGW32__) || defined(__FreeBSD__) || defined(__APPLE__)
@@ -62,6 +63,9 @@ static char *parse_format(char *str) {
     if (strcmp(str, "sam") == 0 || strcmp(str, "SAM") == 0)
 	return "s";
 
+    if (strcmp(str, "sam.gz") == 0 || strcmp(str, "SAM.GZ") == 0)
+	return "z";
+
     if (strcmp(str, "bam") == 0 || strcmp(str, "BAM") == 0)
 	return "b";
 
@@ -80,6 +84,9 @@ static char *detect_format(char *fn) {
 
     if (strcmp(cp, ".sam") == 0 || strcmp(cp, ".SAM") == 0)
 	return "s";
+    if (strcmp(cp, ".gz") == 0 && cp - fn >= 4 &&
+	(strncmp(cp-4, ".sam", 4) == 0 || strncmp(cp-4, ".SAM", 4) == 0))
+	return "z";
     if (strcmp(cp, ".bam") == 0 || strcmp(cp, ".BAM") == 0)
 	return "b";
     if (strcmp(cp, ".cram") == 0 || strcmp(cp, ".CRAM") == 0)
@@ -190,12 +197,13 @@ static void usage(FILE *fp) {
 
     fprintf(fp, "Options:\n");
     fprintf(fp, "    -I format      Set input format:  \"bam\", \"sam\" or \"cram\".\n");
-    fprintf(fp, "    -O format      Set output format: \"bam\", \"sam\" or \"cram\".\n");
+    fprintf(fp, "    -O format      Set output format: \"bam\", \"sam\", \"sam.gz\" or \"cram\".\n");
     fprintf(fp, "    -1 to -9       Set compression level.\n");
     fprintf(fp, "    -0 or -u       No compression.\n");
     //fprintf(fp, "    -v             Verbose output.\n");
     fprintf(fp, "    -H             [SAM] Do not print header\n");
-    fprintf(fp, "    -R range       [Cram] Specifies the refseq:start-end range\n");
+    fprintf(fp, "    -R range       Specifies the refseq:start-end range (indexed input).\n");
+    fprintf(fp, "                   May be repeated to select several ranges.\n");
     fprintf(fp, "    -r ref.fa      [Cram] Specifies the reference file.\n");
     fprintf(fp, "    -b integer     [Cram] Max. bases per slice, default %d.\n",
 	    BASES_PER_SLICE);
@@ -233,7 +241,15 @@ static void usage(FILE *fp) {
     fprintf(fp, "    -!             Disable all checking of checksums\n");
     fprintf(fp, "    -g FILE        Convert to Bam using index (file.gzi)\n");
     fprintf(fp, "    -G FILE        Output Bam index when bam input(file.gzi)\n");
+    fprintf(fp, "    -i FILE        [Bam] Write a BAI index (or CSI if FILE ends .csi)\n");
     fprintf(fp, "    -X mode        [Cram] Mode is fast, normal, small or archive.\n");
+    fprintf(fp, "    -L rate        [Cram] Pick codecs to compress at rate per thread (eg 200M)\n");
+    fprintf(fp, "    -Y file        [Cram] Load and save learnt codec choices in file\n");
+    fprintf(fp, "    -W size        [Cram] Trial codecs on a size byte sample of large blocks\n");
+    fprintf(fp, "    -A depth       [Cram] Read ahead depth containers (or bytes if suffixed k/M/G)\n");
+    fprintf(fp, "    -K             [Cram] Read input via mmap rather than buffered reads\n");
+    fprintf(fp, "    -w size        Write output from a separate thread using size byte buffers\n");
+    fprintf(fp, "    -o             Write output with O_DIRECT, bypassing the page cache\n");
     fprintf(fp, "    -d tag-list    Keep only specified aux tags (discard the others)\n");
     fprintf(fp, "    -D tag-list    Discard specified aux tags (keep the others)\n");
 }
@@ -242,13 +258,15 @@ int main(int argc, char **argv) {
     scram_fd *in, *out;
     bam_seq_t *s;
     char imode[10], *in_f = "", omode[10], *out_f = "", *index_fn = NULL, *index_out_fn = NULL;
+    char *bam_index_fn = NULL;
     int level = '\0'; // nul terminate string => auto level
     int c, verbose = 0;
     int s_opt = 0, S_opt = 0, embed_ref = 0, embed_cons = 0, ignore_md5 = 0, decode_md = 0;
     char *ref_fn = NULL;
-    int start, end, multi_seq = -1, no_ref = 0;
+    int multi_seq = -1, no_ref = 0;
     int use_bz2 = 0, use_bsc = 0, use_lzma = 0, use_fqz = 0, use_tok = 0, use_arith = 0, use_zstd = 0;
-    char ref_name[1024] = {0};
+    char **range_str = NULL;
+    int nrange_str = 0;
     refs_t *refs;
     int nthreads = 1;
     t_pool *p = NULL;
@@ -264,18 +282,109 @@ int main(int argc, char **argv) {
     int add_pg = 1;
     int archive = 0;
     char *profile = "normal";
+    int target_rate = 0;
+    char *metrics_profile = NULL;
+    int trial_sample = 0;
+    int readahead = 0, readahead_bytes = 0, use_mmap = 0;
+    int write_bufsize = 0, write_direct = 0;
     int aux_keep = -1;
     char aux_filter[65536] = {0};
 
     scram_init();
 
     /* Parse command line arguments */
-    while ((c = getopt(argc, argv, "u0123456789hvs:S:V:r:xeEI:O:R:!MmajJzZt:BN:F:Hb:nPpqg:G:fTX:d:D:")) != -1) {
+    while ((c = getopt(argc, argv, "u0123456789hvs:S:V:r:xeEI:O:R:!MmajJzZt:BN:F:Hb:nPpqg:G:fTX:d:D:L:Y:W:A:Kw:oi:")) != -1) {
 	switch (c) {
 	case 'X':
 	    profile = optarg;
 	    break;
 
+	case 'Y':
+	    metrics_profile = optarg;
+	    break;
+
+	case 'W': {
+	    char *end;
+	    long sz = strtol(optarg, &end, 10);
+	    switch (*end) {
+	    case 'k': case 'K': sz *= 1024;      end++; break;
+	    case 'm': case 'M': sz *= 1024*1024; end++; break;
+	    }
+	    if (*end || sz <= 0 || sz > INT_MAX/4) {
+		fprintf(stderr, "Invalid trial sample size '%s'\n", optarg);
+		return 1;
+	    }
+	    trial_sample = sz;
+	    break;
+	}
+
+	case 'w': {
+	    char *end;
+	    long sz = strtol(optarg, &end, 10);
+	    switch (*end) {
+	    case 'k': case 'K': sz *= 1024;      end++; break;
+	    case 'm': case 'M': sz *= 1024*1024; end++; break;
+	    }
+	    if (*end || sz <= 0 || sz > INT_MAX/2) {
+		fprintf(stderr, "Invalid write buffer size '%s'\n", optarg);
+		return 1;
+	    }
+	    write_bufsize = sz;
+	    break;
+	}
+
+	case 'o':
+	    write_direct = 1;
+	    break;
+
+	case 'K':
+	    use_mmap = 1;
+	    break;
+
+	case 'i':
+	    bam_index_fn = optarg;
+	    break;
+
+	case 'A': {
+	    // Containers by default, or bytes if given a size suffix
+	    char *end;
+	    long sz = strtol(optarg, &end, 10);
+	    long mult = 0;
+	    switch (*end) {
+	    case 'k': case 'K': mult = 1024;           end++; break;
+	    case 'm': case 'M': mult = 1024*1024;      end++; break;
+	    case 'g': case 'G': mult = 1024*1024*1024; end++; break;
+	    }
+	    if (*end || sz <= 0 || sz > INT_MAX/(mult ? mult : 1)) {
+		fprintf(stderr, "Invalid read-ahead depth '%s'\n", optarg);
+		return 1;
+	    }
+	    if (mult)
+		readahead_bytes = sz * mult;
+	    else
+		readahead = sz;
+	    break;
+	}
+
+	case 'L': {
+	    // Megabytes/sec by default, converted to kilobytes/sec
+	    char *end;
+	    double rate = strtod(optarg, &end);
+	    switch (*end) {
+	    case 'k': case 'K': rate /= 1000;  end++; break;
+	    case 'm': case 'M':                end++; break;
+	    case 'g': case 'G': rate *= 1000;  end++; break;
+	    }
+	    if (*end == 'b' || *end == 'B')
+		end++;
+	    if (*end || rate <= 0 || rate*1000 > INT_MAX) {
+		fprintf(stderr, "Invalid compression rate '%s'\n", optarg);
+		return 1;
+	    }
+	    target_rate = rate*1000 < 1 ? 1 : rate*1000;
+	    break;
+	}
+
 	case 'F':
 	    sam_fields = strtol(optarg, NULL, 0); // undocumented for testing
 	    break;
@@ -349,24 +458,11 @@ int main(int argc, char **argv) {
 	    break;
 
 	case 'R': {
-	    char *cp = strchr(optarg, ':');
-	    if (cp) {
-		*cp = 0;
-		switch (sscanf(cp+1, "%d-%d", &start, &end)) {
-		case 1:
-		    end = start;
-		    break;
-		case 2:
-		    break;
-		default:
-		    fprintf(stderr, "Malformed range format\n");
-		    return 1;
-		}
-	    } else {
-		start = INT_MIN;
-		end   = INT_MAX;
-	    }
-	    strncpy(ref_name, optarg, 1023);
+	    char **r = realloc(range_str, (nrange_str+1) * sizeof(*r));
+	    if (!r)
+		return 1;
+	    range_str = r;
+	    range_str[nrange_str++] = optarg;
 	    break;
 	}
 
@@ -517,6 +613,8 @@ int main(int argc, char **argv) {
     if (argc - optind > 0) {
 	if (*in_f == 0)
 	    sprintf(imode, "r%s%c", detect_format(argv[optind]), level);
+	if (use_mmap)
+	    strcat(imode, "m");
 	if (!(in = scram_open(argv[optind], imode))) {
 	    fprintf(stderr, "Failed to open file %s\n", argv[optind]);
 	    return 1;
@@ -566,6 +664,26 @@ int main(int argc, char **argv) {
 	if (scram_set_option(out, CRAM_OPT_PROFILE, profile))
 	    return 1;
 
+    if (target_rate)
+	if (scram_set_option(out, CRAM_OPT_TARGET_RATE, target_rate))
+	    return 1;
+
+    if (metrics_profile)
+	if (scram_set_option(out, CRAM_OPT_METRICS_PROFILE, metrics_profile))
+	    return 1;
+
+    if (trial_sample)
+	if (scram_set_option(out, CRAM_OPT_TRIAL_SAMPLE, trial_sample))
+	    return 1;
+
+    if (write_bufsize)
+	if (scram_set_option(out, CRAM_OPT_WRITE_THREAD, write_bufsize))
+	    return 1;
+
+    if (write_direct)
+	if (scram_set_option(out, CRAM_OPT_DIRECT_IO, write_direct))
+	    return 1;
+
     if (s_opt)
 	if (scram_set_option(out, CRAM_OPT_SEQS_PER_SLICE, s_opt))
 	    return 1;
@@ -665,6 +783,11 @@ int main(int argc, char **argv) {
 	    return 1;
     }
 
+    if (bam_index_fn) {
+	if (scram_set_option(out, CRAM_OPT_OUTPUT_INDEX, bam_index_fn))
+	    return 1;
+    }
+
     if (nthreads > 1) {
 	if (NULL == (p = t_pool_init(nthreads*2, nthreads)))
 	    return 1;
@@ -675,6 +798,14 @@ int main(int argc, char **argv) {
 	    return 1;
     }
 
+    if (readahead)
+	if (scram_set_option(in, CRAM_OPT_READAHEAD, readahead))
+	    return 1;
+
+    if (readahead_bytes)
+	if (scram_set_option(in, CRAM_OPT_READAHEAD_BYTES, readahead_bytes))
+	    return 1;
+
     if (ignore_md5) {
 	if (scram_set_option(in, CRAM_OPT_IGNORE_MD5, ignore_md5))
 	    return 1;
@@ -728,34 +859,32 @@ int main(int argc, char **argv) {
 	    free(arg_list);
 	}
 
-	if ((header || (omode[1] != 's' && omode[1] != '\0')) && scram_write_header(out) != 0)
+	if ((header || (omode[1] != 's' && omode[1] != 'z' && omode[1] != '\0')) && scram_write_header(out) != 0)
 	    return 1;
     }
 
 
-    /* Support for sub-range queries, currently implemented for CRAM only */
-    if (*ref_name != 0) {
-	cram_range r;
-	int refid;
+    /* Support for sub-range queries, for indexed CRAM and BAM */
+    if (nrange_str) {
+	cram_range *r;
+	int i;
 
-	if (in->is_bam) {
-	    fprintf(stderr, "Currently the -R option is only implemented for CRAM indices\n");
+	if (scram_index_load(in, argv[optind]) && in->is_bam)
 	    return 1;
-	}
-	    
-	cram_index_load(in->c, argv[optind]);
-
-	refid = sam_hdr_name2ref(in->c->header, ref_name);
 
-	if (refid == -1 && *ref_name != '*') {
-	    fprintf(stderr, "Unknown reference name '%s'\n", ref_name);
+	if (!(r = malloc(nrange_str * sizeof(*r))))
 	    return 1;
-	}
-	r.refid = refid;
-	r.start = start;
-	r.end = end;
-	if (scram_set_option(in, CRAM_OPT_RANGE, &r))
+	for (i = 0; i < nrange_str; i++)
+	    if (sam_hdr_parse_region(scram_get_header(in), range_str[i],
+				     &r[i].refid, &r[i].start, &r[i].end))
+		return 1;
+
+	if (nrange_str == 1
+	    ? scram_set_option(in, CRAM_OPT_RANGE, r)
+	    : scram_set_option(in, CRAM_OPT_RANGES, r, nrange_str))
 	    return 1;
+	free(r);
+	free(range_str);
     }
 
     /* Do the actual file format conversion */
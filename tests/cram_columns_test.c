@@ -0,0 +1,198 @@
+/*
+ * Checks every column from cram_get_slice_columns() against the same
+ * records from cram_get_bam_seq(), and that
+ * mixing the two on one file descriptor leaves later cram_get_bam_seq
+ * calls on their normal multi-threaded path.
+ *
+ * Usage: cram_columns_test file.cram ref.fa
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <ctype.h>
+
+#include <io_lib/scram.h>
+#include <io_lib/thread_pool.h>
+
+#define FIELDS (SAM_QNAME | SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | \
+		SAM_CIGAR | SAM_RNEXT | SAM_PNEXT | SAM_TLEN | SAM_SEQ | \
+		SAM_QUAL | SAM_AUX | SAM_RGAUX)
+
+/* A private copy of each bam_seq_t */
+typedef bam_seq_t *rec_t;
+
+#define rec_end(b) ((char *)&(b)->ref + bam_blk_size(b))
+
+static cram_fd *open_cram(char *fn, char *ref) {
+    cram_fd *fd = cram_open(fn, "rb");
+    if (!fd) {
+	fprintf(stderr, "Cannot open %s\n", fn);
+	exit(1);
+    }
+    cram_load_reference(fd, ref);
+    cram_set_option(fd, CRAM_OPT_REQUIRED_FIELDS, FIELDS);
+    return fd;
+}
+
+static void check_rec(rec_t *r, bam_seq_t *b) {
+    bam_seq_t *a = *r;
+
+    assert(bam_ref(a)      == bam_ref(b));
+    assert(bam_pos(a)      == bam_pos(b));
+    assert(bam_flag(a)     == bam_flag(b));
+    assert(bam_map_qual(a) == bam_map_qual(b));
+    assert(bam_bin(a)      == bam_bin(b));
+    assert(bam_mate_ref(a) == bam_mate_ref(b));
+    assert(bam_mate_pos(a) == bam_mate_pos(b));
+    assert(bam_ins_size(a) == bam_ins_size(b));
+    assert(bam_seq_len(a)  == bam_seq_len(b));
+    assert(bam_name_len(a) == bam_name_len(b));
+    assert(bam_cigar_len(a) == bam_cigar_len(b));
+
+    /* Name, CIGAR, sequence, quality and aux */
+    assert(rec_end(a) - bam_name(a) == rec_end(b) - bam_name(b));
+    assert(memcmp(bam_name(a), bam_name(b), rec_end(b) - bam_name(b)) == 0);
+}
+
+/*
+ * Compares record i of cols, including its offsets into the shared
+ * buffers, with b.
+ */
+static void check_cols(cram_slice_columns *cols, int i, bam_seq_t *b,
+		       SAM_hdr *h) {
+    uint32_t *cigar = bam_cigar(b);
+    unsigned char *seq = (unsigned char *)bam_seq(b);
+    char *aux;
+    size_t aux_len;
+    int64_t end;
+    int j, rg_len;
+
+    assert(cols->ref_id[i]      == bam_ref(b));
+    assert(cols->flag[i]        == bam_flag(b));
+    assert(cols->pos[i]-1       == bam_pos(b));
+    assert(cols->mapq[i]        == bam_map_qual(b));
+    assert(cols->mate_ref_id[i] == bam_mate_ref(b));
+    assert(cols->mate_pos[i]-1  == bam_mate_pos(b));
+    assert(cols->tlen[i]        == bam_ins_size(b));
+
+    assert(cols->name_len[i] == bam_name_len(b)-1);
+    assert(memcmp(cols->names + cols->name_off[i], bam_name(b),
+		  cols->name_len[i]) == 0);
+
+    assert(cols->ncigar[i] == bam_cigar_len(b));
+    for (j = 0; j < cols->ncigar[i]; j++)
+	assert(cols->cigar[cols->cigar_off[i] + j] == cigar[j]);
+    if (!(bam_flag(b) & BAM_FUNMAP)) {
+	end = cols->pos[i]-1;
+	for (j = 0; j < bam_cigar_len(b); j++)
+	    if (BAM_CONSUME_REF(cigar[j] & BAM_CIGAR_MASK))
+		end += cigar[j] >> BAM_CIGAR_SHIFT;
+	assert(cols->end[i] == end);
+    }
+
+    assert(cols->seq_len[i] == bam_seq_len(b));
+    for (j = 0; j < cols->seq_len[i]; j++) {
+	int c = (seq[j/2] >> ((~j&1)<<2)) & 15;
+	assert(toupper((unsigned char)cols->seq[cols->seq_off[i] + j])
+	       == "=ACMGRSVTWYHKDBN"[c]);
+    }
+    assert(memcmp(cols->qual + cols->qual_off[i], bam_qual(b),
+		  cols->seq_len[i]) == 0);
+
+    /* bam_seq_t aux is the CRAM aux data plus RG:Z, if any */
+    aux = bam_aux(b);
+    aux_len = rec_end(b) - aux;
+    rg_len = cols->rg[i] == -1 ? 0 : h->rg[cols->rg[i]].name_len + 4;
+    assert(cols->aux_len[i] + rg_len == aux_len);
+    assert(memcmp(cols->aux + cols->aux_off[i], aux, cols->aux_len[i]) == 0);
+    if (rg_len) {
+	aux += cols->aux_len[i];
+	assert(memcmp(aux, "RGZ", 3) == 0);
+	assert(strcmp(aux+3, h->rg[cols->rg[i]].name) == 0);
+    }
+}
+
+int main(int argc, char **argv) {
+    cram_fd *fd;
+    bam_seq_t *b = NULL;
+    cram_slice_columns *cols;
+    t_pool *p;
+    rec_t *recs = NULL;
+    int nrecs = 0, arecs = 0, i, n, nslices, saw_bl = 0;
+
+    if (argc != 3) {
+	fprintf(stderr, "Usage: cram_columns_test file.cram ref.fa\n");
+	return 1;
+    }
+
+    /* Reference answer, single threaded */
+    fd = open_cram(argv[1], argv[2]);
+    while (cram_get_bam_seq(fd, &b) >= 0) {
+	if (nrecs == arecs) {
+	    arecs = arecs ? arecs*2 : 1024;
+	    recs = realloc(recs, arecs * sizeof(*recs));
+	    assert(recs);
+	}
+	recs[nrecs] = malloc(b->alloc);
+	assert(recs[nrecs]);
+	memcpy(recs[nrecs], b, b->alloc);
+	nrecs++;
+    }
+    assert(cram_eof(fd) == 1);
+    cram_close(fd);
+
+    /* Every slice in columnar form */
+    fd = open_cram(argv[1], argv[2]);
+    n = nslices = 0;
+    while ((cols = cram_get_slice_columns(fd))) {
+	assert(cols->nrec > 0 && n + cols->nrec <= nrecs);
+	for (i = 0; i < cols->nrec; i++)
+	    check_cols(cols, i, recs[n++], fd->header);
+	nslices++;
+	cram_free_slice_columns(cols);
+    }
+    assert(n == nrecs);
+    assert(cram_eof(fd) == 1);
+    cram_close(fd);
+
+    /* One slice in columnar form, then the rest as bam_seq_t */
+    if (nslices > 1) {
+	p = t_pool_init(4, 2);
+	assert(p);
+	fd = open_cram(argv[1], argv[2]);
+	cram_set_option(fd, CRAM_OPT_THREAD_POOL, p);
+
+	cols = cram_get_slice_columns(fd);
+	assert(cols);
+	assert(cols->nrec > 0 && cols->nrec < nrecs);
+	assert(fd->no_bam_seq == 0);
+	for (i = 0; i < cols->nrec; i++)
+	    check_cols(cols, i, recs[i], fd->header);
+	n = cols->nrec;
+	cram_free_slice_columns(cols);
+
+	while (cram_get_bam_seq(fd, &b) >= 0) {
+	    assert(n < nrecs);
+	    check_rec(&recs[n++], b);
+	    if (fd->ctr && fd->ctr->slice && fd->ctr->slice->bl)
+		saw_bl = 1;
+	}
+	assert(n == nrecs);
+
+	/* Slices queued after the columnar call are converted by the pool */
+	assert(saw_bl);
+
+	cram_close(fd);
+	t_pool_destroy(p, 0);
+    }
+
+    for (i = 0; i < nrecs; i++)
+	free(recs[i]);
+    free(recs);
+    free(b);
+
+    printf("%d records in %d slices OK\n", nrecs, nslices);
+    return 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * Checks the HUFFMAN decoder against a known multi-symbol code.  The
+ * code has lengths from 1 to 12 bits, so decoding covers both the
+ * lookup table (up to HUFF_LUT_BITS) and the bit-by-bit fallback for
+ * longer codes and for the last few bytes of a block.
+ *
+ * Usage: cram_huffman_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <io_lib/scram.h>
+#include <io_lib/cram_codecs.h>
+
+/* Lengths 1..11, 12, 12 give a complete prefix code of 13 symbols */
+#define NCODES 13
+static const int sym[NCODES] = {
+    65, 3, 120, 7, 0, 99, 42, 17, 1, 90, 64, 100, 2
+};
+static const int len[NCODES] = {
+    1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 12
+};
+
+#define NSYM 5000
+
+typedef struct {
+    unsigned char *data;
+    size_t byte;
+    int bit;
+} bit_writer;
+
+static void put_bits(bit_writer *w, int code, int nbits) {
+    while (nbits--) {
+	if (code & (1 << nbits))
+	    w->data[w->byte] |= 1 << w->bit;
+	if (--w->bit < 0)
+	    w->bit = 7, w->byte++;
+    }
+}
+
+/*
+ * Canonical codes as per the CRAM spec: ordered by length and then by
+ * symbol, incrementing and shifting left as the length grows.
+ */
+static void canonical_codes(int *code) {
+    int order[NCODES], i, j, val = -1, last_len = 0;
+
+    for (i = 0; i < NCODES; i++)
+	order[i] = i;
+    for (i = 1; i < NCODES; i++) {
+	for (j = i; j > 0; j--) {
+	    int a = order[j-1], b = order[j];
+	    if (len[a] < len[b] || (len[a] == len[b] && sym[a] < sym[b]))
+		break;
+	    order[j-1] = b, order[j] = a;
+	}
+    }
+
+    for (i = 0; i < NCODES; i++) {
+	int k = order[i];
+	val++;
+	while (len[k] > last_len)
+	    val <<= 1, last_len++;
+	code[k] = val;
+    }
+}
+
+/* ITF8 parameters: ncodes, symbols, ncodes, lengths; all values < 128 */
+static int huffman_params(char *buf) {
+    int i, n = 0;
+
+    buf[n++] = NCODES;
+    for (i = 0; i < NCODES; i++)
+	buf[n++] = sym[i];
+    buf[n++] = NCODES;
+    for (i = 0; i < NCODES; i++)
+	buf[n++] = len[i];
+
+    return n;
+}
+
+static void check_decode(enum cram_external_type option) {
+    cram_block_compression_hdr hdr;
+    varint_vec vv;
+    cram_codec *c;
+    cram_block *in;
+    bit_writer w;
+    char params[64];
+    int code[NCODES], *idx, *ival, nparam, i, n, r, nlong = 0;
+    unsigned char *cval;
+
+    memset(&hdr, 0, sizeof(hdr));
+    cram_init_varint(&vv, 3);
+    canonical_codes(&code[0]);
+
+    nparam = huffman_params(params);
+    c = cram_decoder_init(&hdr, E_HUFFMAN, params, nparam, option, 3, &vv);
+    assert(c);
+    assert(c->huffman.lut);
+
+    /* Pseudo-random symbols, weighted towards the short codes */
+    idx = malloc(NSYM * sizeof(*idx));
+    w.data = calloc(NSYM * 2 + 1, 1);
+    assert(idx && w.data);
+    w.byte = 0, w.bit = 7;
+    srand(15551);
+    for (i = 0; i < NSYM; i++) {
+	int k = 0;
+	while (k < NCODES-1 && (rand() & 1))
+	    k++;
+	if (k == NCODES-1 && (rand() & 1))
+	    k = NCODES-2; // one of the two 12 bit codes
+	if (i % 97 == 0)
+	    k = NCODES-3 + (i/97) % 3; // ensure some long codes
+	idx[i] = k;
+	if (len[k] > HUFF_LUT_BITS)
+	    nlong++;
+	put_bits(&w, code[k], len[k]);
+    }
+    assert(nlong > 0);
+
+    in = cram_new_block(CORE, 0);
+    assert(in);
+    BLOCK_APPEND(in, w.data, w.byte + (w.bit != 7));
+    in->uncomp_size = in->byte;
+    in->byte = 0, in->bit = 7;
+
+    /* Decode in two calls, to carry bit state across them */
+    if (option == E_INT) {
+	ival = malloc(NSYM * sizeof(*ival));
+	assert(ival);
+	n = NSYM/3;
+	r = c->decode(NULL, c, in, (char *)ival, &n);
+	assert(r == 0);
+	n = NSYM - NSYM/3;
+	r = c->decode(NULL, c, in, (char *)(ival + NSYM/3), &n);
+	assert(r == 0);
+	for (i = 0; i < NSYM; i++)
+	    assert(ival[i] == sym[idx[i]]);
+	free(ival);
+    } else {
+	cval = malloc(NSYM);
+	assert(cval);
+	n = NSYM/3;
+	r = c->decode(NULL, c, in, (char *)cval, &n);
+	assert(r == 0);
+	n = NSYM - NSYM/3;
+	r = c->decode(NULL, c, in, (char *)cval + NSYM/3, &n);
+	assert(r == 0);
+	for (i = 0; i < NSYM; i++)
+	    assert(cval[i] == sym[idx[i]]);
+	free(cval);
+    }
+
+    /* Exactly the encoded bits were consumed */
+    assert(in->byte == w.byte && in->bit == w.bit);
+
+    printf("%s: %d symbols, %d longer than the table, OK\n",
+	   option == E_INT ? "int" : "byte", NSYM, nlong);
+
+    cram_free_block(in);
+    c->free(c);
+    free(idx);
+    free(w.data);
+}
+
+int main(void) {
+    check_decode(E_INT);
+    check_decode(E_BYTE);
+    return 0;
+}
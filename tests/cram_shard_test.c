@@ -0,0 +1,156 @@
+/*
+ * Checks that the shards from cram_index_shards() cover the whole file,
+ * with cram_shard_open() handles together returning every record exactly
+ * once and in file order.
+ *
+ * Usage: cram_shard_test file.cram ref.fa
+ *
+ * file.cram must already be indexed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <io_lib/scram.h>
+#include <io_lib/thread_pool.h>
+
+#define FIELDS (SAM_QNAME | SAM_FLAG | SAM_RNAME | SAM_POS)
+
+typedef struct {
+    int ref, flag;
+    int64_t pos;
+    char *name;
+} rec_t;
+
+static cram_fd *open_cram(char *fn, char *ref) {
+    cram_fd *fd = cram_open(fn, "rb");
+    if (!fd) {
+	fprintf(stderr, "Cannot open %s\n", fn);
+	exit(1);
+    }
+    cram_load_reference(fd, ref);
+    cram_set_option(fd, CRAM_OPT_REQUIRED_FIELDS, FIELDS);
+    return fd;
+}
+
+static void check_rec(rec_t *r, bam_seq_t *b) {
+    assert(r->ref  == bam_ref(b));
+    assert(r->flag == bam_flag(b));
+    assert(r->pos  == bam_pos(b));
+    assert(strcmp(r->name, bam_name(b)) == 0);
+}
+
+/*
+ * Iterates over n shards of fn, all open at once on a shared pool, and
+ * checks them against the nrecs records in recs.
+ *
+ * Returns the number of shards used.
+ */
+static int check_shards(char *fn, char *ref, t_pool *p, int n,
+			rec_t *recs, int nrecs) {
+    cram_fd *fd, **s;
+    cram_shard *sh;
+    bam_seq_t *b = NULL;
+    int nsh, i, r, k = 0, shared_ref;
+
+    fd = open_cram(fn, ref);
+    if (p)
+	cram_set_option(fd, CRAM_OPT_THREAD_POOL, p);
+    if (cram_index_load(fd, fn) != 0) {
+	fprintf(stderr, "Cannot load index for %s\n", fn);
+	exit(1);
+    }
+
+    nsh = cram_index_shards(fd, n, &sh);
+    assert(nsh >= 1 && nsh <= n);
+
+    // Contiguous, ending at EOF
+    for (i = 0; i < nsh-1; i++)
+	assert(sh[i].end == sh[i+1].start);
+    assert(sh[nsh-1].end == -1);
+
+    s = calloc(nsh, sizeof(*s));
+    assert(s);
+    shared_ref = fd->shared_ref;
+    for (i = 0; i < nsh; i++) {
+	s[i] = cram_shard_open(fd, fn, &sh[i]);
+	assert(s[i]);
+    }
+
+    for (i = 0; i < nsh; i++) {
+	int first = k;
+	while (cram_get_bam_seq(s[i], &b) >= 0) {
+	    assert(k < nrecs);
+	    check_rec(&recs[k++], b);
+	}
+	assert(cram_eof(s[i]));
+	assert(k > first);
+    }
+    assert(k == nrecs);
+
+    // Opening shards leaves the parent's settings alone
+    assert(fd->shared_ref == shared_ref);
+
+    for (i = nsh-1; i >= 0; i--) {
+	r = cram_close(s[i]);
+	assert(r == 0);
+    }
+    r = cram_close(fd);
+    assert(r == 0);
+
+    free(s);
+    free(sh);
+    free(b);
+
+    return nsh;
+}
+
+int main(int argc, char **argv) {
+    cram_fd *fd;
+    bam_seq_t *b = NULL;
+    t_pool *p;
+    rec_t *recs = NULL;
+    int nrecs = 0, arecs = 0, i, n;
+
+    if (argc != 3) {
+	fprintf(stderr, "Usage: cram_shard_test file.cram ref.fa\n");
+	return 1;
+    }
+
+    /* Reference answer, single threaded */
+    fd = open_cram(argv[1], argv[2]);
+    while (cram_get_bam_seq(fd, &b) >= 0) {
+	if (nrecs == arecs) {
+	    arecs = arecs ? arecs*2 : 1024;
+	    recs = realloc(recs, arecs * sizeof(*recs));
+	    assert(recs);
+	}
+	recs[nrecs].ref  = bam_ref(b);
+	recs[nrecs].flag = bam_flag(b);
+	recs[nrecs].pos  = bam_pos(b);
+	recs[nrecs].name = strdup(bam_name(b));
+	nrecs++;
+    }
+    assert(cram_eof(fd) == 1);
+    cram_close(fd);
+    free(b);
+
+    /* One shard, a few, and more than there are containers */
+    p = t_pool_init(4, 2);
+    assert(p);
+    n = check_shards(argv[1], argv[2], NULL, 1, recs, nrecs);
+    assert(n == 1);
+    n = check_shards(argv[1], argv[2], p, 3, recs, nrecs);
+    assert(n > 1);
+    n = check_shards(argv[1], argv[2], p, 100000, recs, nrecs);
+    t_pool_destroy(p, 0);
+
+    for (i = 0; i < nrecs; i++)
+	free(recs[i].name);
+    free(recs);
+
+    printf("%d records in %d shards OK\n", nrecs, n);
+    return 0;
+}